@@ -0,0 +1,107 @@
+#ifndef ALU_TABLES_H
+#define ALU_TABLES_H
+
+#include "types.h"
+
+#include <array>
+#include <cstddef>
+
+// The CPU's 8-bit arithmetic precomputed for every operand combination. Each entry is laid
+// out like the AF register pair, the result in the high byte and Z, N, H and C in the high
+// nibble of the low one, so an instruction is a single load merged into AF. The entry
+// functions below are the reference the tables are generated from at compile time.
+
+static constexpr byte ALU_Z_FLAG = 0x80;
+static constexpr byte ALU_N_FLAG = 0x40;
+static constexpr byte ALU_H_FLAG = 0x20;
+static constexpr byte ALU_C_FLAG = 0x10;
+
+constexpr word makeAluEntry(const int result, const int flags)
+{
+	return static_cast<word>(((result & 0xFF) << 8) | ((result & 0xFF) == 0 ? ALU_Z_FLAG : 0) | flags);
+}
+
+// ADD and ADC, ADD being ADC with a clear carry
+constexpr word computeAddEntry(const int a, const int n, const int carry)
+{
+	const int flags =
+		((a & 0x0F) + (n & 0x0F) + carry > 0x0F ? ALU_H_FLAG : 0) |
+		(a + n + carry > 0xFF ? ALU_C_FLAG : 0);
+	return makeAluEntry(a + n + carry, flags);
+}
+
+// SUB, SBC and CP, which is SUB without storing the result
+constexpr word computeSubEntry(const int a, const int n, const int carry)
+{
+	const int result = a - n - carry;
+	const int flags = ALU_N_FLAG |
+		(((result & 0xFF) ^ n ^ a) & 0x10 ? ALU_H_FLAG : 0) |
+		(result < 0 ? ALU_C_FLAG : 0);
+	return makeAluEntry(result, flags);
+}
+
+// INC and DEC leave C alone, their entries never have it set
+constexpr word computeIncEntry(const int value)
+{
+	return makeAluEntry(value + 1, (value & 0x0F) == 0x0F ? ALU_H_FLAG : 0);
+}
+
+constexpr word computeDecEntry(const int value)
+{
+	return makeAluEntry(value - 1, ALU_N_FLAG | ((value & 0x0F) == 0x00 ? ALU_H_FLAG : 0));
+}
+
+// DAA keeps N and only ever sets C, both come in through flags
+constexpr word computeDaaEntry(const int a, const int flags)
+{
+	int result = a;
+	int carry = flags & ALU_C_FLAG;
+
+	if (!(flags & ALU_N_FLAG))
+	{
+		if ((flags & ALU_H_FLAG) || (result & 0x0F) > 9) result += 0x06;
+		if ((flags & ALU_C_FLAG) || result > 0x9F) result += 0x60;
+	}
+	else
+	{
+		if (flags & ALU_H_FLAG) result = (result - 0x06) & 0xFF;
+		if (flags & ALU_C_FLAG) result -= 0x60;
+	}
+
+	if (result & 0x100) carry = ALU_C_FLAG;
+	return makeAluEntry(result, (flags & ALU_N_FLAG) | carry);
+}
+
+// Table indices; the carry and flags come straight from the F register
+constexpr std::size_t getAluIndex(const byte a, const byte n, const byte f)
+{
+	return (static_cast<std::size_t>(f & ALU_C_FLAG) << 12) | (a << 8) | n;
+}
+
+constexpr std::size_t getDaaIndex(const byte a, const byte f)
+{
+	return (static_cast<std::size_t>(f & (ALU_N_FLAG | ALU_H_FLAG | ALU_C_FLAG)) << 4) | a;
+}
+
+template<std::size_t Size, typename Generator>
+constexpr std::array<word, Size> generateAluTable(const Generator generator)
+{
+	std::array<word, Size> table{};
+	for (std::size_t i = 0; i < Size; ++i) table[i] = generator(i);
+	return table;
+}
+
+static constexpr std::array<word, 0x20000> ALU_ADD_TABLE = generateAluTable<0x20000>([](const std::size_t i) { return computeAddEntry((i >> 8) & 0xFF, i & 0xFF, static_cast<int>(i >> 16)); });
+static constexpr std::array<word, 0x20000> ALU_SUB_TABLE = generateAluTable<0x20000>([](const std::size_t i) { return computeSubEntry((i >> 8) & 0xFF, i & 0xFF, static_cast<int>(i >> 16)); });
+static constexpr std::array<word, 0x100> ALU_INC_TABLE = generateAluTable<0x100>([](const std::size_t i) { return computeIncEntry(static_cast<int>(i)); });
+static constexpr std::array<word, 0x100> ALU_DEC_TABLE = generateAluTable<0x100>([](const std::size_t i) { return computeDecEntry(static_cast<int>(i)); });
+static constexpr std::array<word, 0x800> ALU_DAA_TABLE = generateAluTable<0x800>([](const std::size_t i) { return computeDaaEntry(i & 0xFF, static_cast<int>((i >> 4) & 0x70)); });
+
+static_assert(ALU_ADD_TABLE[getAluIndex(0x3A, 0xC6, 0x00)] == 0x00B0, "ADD 0x3A + 0xC6 must give 0x00 with Z, H and C");
+static_assert(ALU_ADD_TABLE[getAluIndex(0xE1, 0x1E, ALU_C_FLAG)] == 0x00B0, "ADC 0xE1 + 0x1E + 1 must give 0x00 with Z, H and C");
+static_assert(ALU_SUB_TABLE[getAluIndex(0x3E, 0x0F, 0x00)] == 0x2F60, "SUB 0x3E - 0x0F must give 0x2F with N and H");
+static_assert(ALU_SUB_TABLE[getAluIndex(0x3B, 0x4F, ALU_C_FLAG)] == 0xEB70, "SBC 0x3B - 0x4F - 1 must give 0xEB with N, H and C");
+static_assert(ALU_INC_TABLE[0xFF] == 0x00A0 && ALU_DEC_TABLE[0x10] == 0x0F60, "INC and DEC must set H on a nibble borrow or carry");
+static_assert(ALU_DAA_TABLE[getDaaIndex(0x9A, 0x00)] == 0x0090 && ALU_DAA_TABLE[getDaaIndex(0x45, ALU_N_FLAG | ALU_H_FLAG)] == 0x3F40, "DAA must adjust after both addition and subtraction");
+
+#endif /* ALU_TABLES_H */
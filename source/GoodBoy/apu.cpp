@@ -1,5 +1,6 @@
-#include <SDL.h>
 #include <cassert>
+#include <cmath>
+#include <cstring>
 
 #include "apu.h"
 
@@ -42,46 +43,16 @@
 #define OutputChannel3ToSO2 ISBITSET(m_OutputTerminal, 6)
 #define OutputChannel4ToSO2 ISBITSET(m_OutputTerminal, 7)
 
-#define AudioSampleRate 48000
-#define AudioOutChannelCount 2
-#define FrameSizeBytes 8              // 32 bit samples * 2 channels
-#define AudioDeviceBufferSize 2048    // 2 KB
-#define InternalAudioBufferSize 32768 // 32 KB
+#define AudioSampleRate AudioSink::SAMPLE_RATE
 
-#define CyclesPerSecond 4213440 // CyclesPerFrame * 60Hz refresh
+#define CyclesPerSecond 4194304 // DMG clock rate
+#define SampleFlushCycles 8192  // Flush synthesized samples to the sink at 512Hz, the DMG frame sequencer rate
 
 #define Pi 3.141592653589793
 #define TwoPi 6.283185307179586
 
-void AudioDeviceCallbackStatic(void* pUserdata, Uint8* pStream, int length)
-{
-    reinterpret_cast<APU*>(pUserdata)->AudioDeviceCallback(
-        pStream,
-        length);
-}
-
 APU::APU() :
-    m_Channel1Sweep(0x00),
-    m_Channel1SoundLength(0x00),
-    m_Channel1VolumeEnvelope(0x00),
-    m_Channel1FrequencyLo(0x00),
-    m_Channel1FrequencyHi(0x00),
-    m_Channel2SoundLength(0x00),
-    m_Channel2VolumeEnvelope(0x00),
-    m_Channel2FrequencyLo(0x00),
-    m_Channel2FrequencyHi(0x00),
-    m_Channel3SoundOnOff(0x00),
-    m_Channel3SoundLength(0x00),
-    m_Channel3SelectOutputLevel(0x00),
-    m_Channel3FrequencyLo(0x00),
-    m_Channel3FrequencyHi(0x00),
-    m_Channel4SoundLength(0x00),
-    m_Channel4VolumeEnvelope(0x00),
-    m_Channel4PolynomialCounter(0x00),
-    m_Channel4Counter(0x00),
-    m_ChannelControlOnOffVolume(0x00),
-    m_OutputTerminal(0x00),
-    m_SoundOnOff(0x00),
+    APURegisterState(),
     m_Channel1SoundGenerator(
         CHANNEL_1,
         &m_SoundOnOff,
@@ -118,37 +89,55 @@ APU::APU() :
         &m_Channel4PolynomialCounter,
         &m_Channel4Counter
     ),
-    m_AudioDevice(0),
-    m_AudioFrameRemainder(0.0),
-    m_OutputBuffer(InternalAudioBufferSize, FrameSizeBytes),
-    m_Initialized(false),
+    m_Scheduler(nullptr),
+    m_AudioSink(nullptr),
     m_SoundDisabled(false)
 {
     memset(m_WavePatternRAM, 0x00, ARRAYSIZE(m_WavePatternRAM));
-
-    if (SDL_Init(SDL_INIT_AUDIO))
-    {
-        assert(false);
-    }
-    else
-    {
-        LoadAudioDevice(AudioDeviceCallbackStatic);
-    }
 }
 
 APU::~APU()
 {
-    if (m_Initialized)
+}
+
+void APU::setAudioSink(AudioSink* audioSink)
+{
+    // Whatever is owed up to now belongs to the previous sink
+    sync();
+    m_AudioSink = audioSink;
+    scheduleNextEvent();
+}
+
+void APU::sync()
+{
+    const uint64_t currentCycle = m_Scheduler->getCurrentCycle();
+    if (currentCycle == m_LastSyncCycle)
     {
-        SDL_PauseAudioDevice(m_AudioDevice, 1);
-        SDL_CloseAudioDevice(m_AudioDevice);
+        return;
     }
 
-    SDL_Quit();
+    const unsigned int cycles = static_cast<unsigned int>(currentCycle - m_LastSyncCycle);
+    m_LastSyncCycle = currentCycle;
+
+    update(cycles);
+    scheduleNextEvent();
+}
+
+void APU::scheduleNextEvent()
+{
+    const uint64_t cyclesUntilNextEvent = m_AudioSink ? SampleFlushCycles : Scheduler::MAX_SYNC_INTERVAL_CYCLES;
+    m_Scheduler->schedule(Scheduler::EventType::APU, m_LastSyncCycle + cyclesUntilNextEvent);
 }
 
 void APU::update(unsigned int cycles)
 {
+    // Sample synthesis only feeds the output, none of it is observable by the guest,
+    // so headless runs with no sink attached skip it entirely
+    if (m_AudioSink == nullptr || m_SoundDisabled)
+    {
+        return;
+    }
+
     // Calculate the number of audio frames to generate for the elapsed CPU cycle count
     double sample_count = m_AudioFrameRemainder + (((double)AudioSampleRate / (double)CyclesPerSecond) * (double)cycles);
     double int_part = 0.0;
@@ -190,25 +179,14 @@ void APU::update(unsigned int cycles)
         so1 *= ((float)OutputLevelSO1 / 28);
         so2 *= ((float)OutputLevelSO2 / 28);
 
-        float f_frame[2] = { so1, so2 };
-        m_OutputBuffer.Put((Uint8*)f_frame);
-    }
-}
-
-void APU::AudioDeviceCallback(Uint8* pStream, int length)
-{
-    SDL_memset(pStream, 0x00, length);
-
-    if (!ISBITSET(m_SoundOnOff, 7))
-        return;
-
-    for (int index = 0; index < length; index += FrameSizeBytes)
-    {
-        Uint8* frame = m_OutputBuffer.Get();
-        for (int i = 0; i < FrameSizeBytes; i++)
+        // All sound circuits are stopped while the master switch is off
+        if (!ISBITSET(m_SoundOnOff, 7))
         {
-            pStream[index + i] = frame[i];
+            so1 = 0.0f;
+            so2 = 0.0f;
         }
+
+        m_AudioSink->onAudioFrame(so1, so2);
     }
 }
 
@@ -275,6 +253,9 @@ byte APU::readByte(const word address)
 
 bool APU::writeByte(const word address, const byte val)
 {
+    // Samples up to now are synthesized with the old register values
+    sync();
+
     if (m_SoundDisabled)
     {
         return true;
@@ -387,18 +368,6 @@ bool APU::writeByte(const word address, const byte val)
 void APU::setSoundDisabled(const bool soundDisabled)
 {
     m_SoundDisabled = soundDisabled;
-    if (m_SoundDisabled)
-    {
-        if (m_Initialized)
-        {
-            SDL_PauseAudioDevice(m_AudioDevice, 1);
-            SDL_CloseAudioDevice(m_AudioDevice);
-        }
-    }
-    else
-    {
-        LoadAudioDevice(AudioDeviceCallbackStatic);
-    }
 }
 
 bool APU::isSoundDisabled() const
@@ -406,27 +375,37 @@ bool APU::isSoundDisabled() const
     return m_SoundDisabled;
 }
 
-void APU::LoadAudioDevice(SDL_AudioCallback callback)
+void APU::saveState(APUState& state) const
 {
-    SDL_AudioSpec want, have;
-
-    SDL_memset(&want, 0, sizeof(want));
-    want.freq = AudioSampleRate;
-    want.format = AUDIO_F32;
-    want.channels = AudioOutChannelCount;
-    want.samples = AudioDeviceBufferSize; // Must be a power of 2
-    want.callback = callback;
-    want.userdata = this;
+    state.m_Registers = *this;
+    m_Channel1SoundGenerator.SaveState(state.m_Channel1);
+    m_Channel2SoundGenerator.SaveState(state.m_Channel2);
+    m_Channel3SoundGenerator.SaveState(state.m_Channel3);
+    m_Channel4SoundGenerator.SaveState(state.m_Channel4);
+    m_Channel1SoundGenerator.SaveState(state.m_Channel1SquareWave);
+    m_Channel2SoundGenerator.SaveState(state.m_Channel2SquareWave);
+    m_Channel3SoundGenerator.SaveState(state.m_Channel3Waveform);
+    m_Channel4SoundGenerator.SaveState(state.m_Channel4Noise);
+}
 
-    m_AudioDevice = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
-    if (m_AudioDevice == 0)
-    {
-        assert(false);
-        return;
-    }
+void APU::loadState(const APUState& state)
+{
+    static_cast<APURegisterState&>(*this) = state.m_Registers;
+    m_Channel1SoundGenerator.LoadState(state.m_Channel1);
+    m_Channel2SoundGenerator.LoadState(state.m_Channel2);
+    m_Channel3SoundGenerator.LoadState(state.m_Channel3);
+    m_Channel4SoundGenerator.LoadState(state.m_Channel4);
+    m_Channel1SoundGenerator.LoadState(state.m_Channel1SquareWave);
+    m_Channel2SoundGenerator.LoadState(state.m_Channel2SquareWave);
+    m_Channel3SoundGenerator.LoadState(state.m_Channel3Waveform);
+    m_Channel4SoundGenerator.LoadState(state.m_Channel4Noise);
+}
 
-    SDL_PauseAudioDevice(m_AudioDevice, 0);
-    m_Initialized = true;
+void APU::copyStateFrom(const APU& other)
+{
+    APUState state;
+    other.saveState(state);
+    loadState(state);
 }
 
 APU::SoundGenerator::SoundGenerator(
@@ -503,12 +482,8 @@ float APU::SoundGenerator::NextSample()
             }
         }
 
-        // Clamp adjusted frequency between 0 and 2047
-        if (adjusted_frequency < 0)
-        {
-            adjusted_frequency = 0;
-        }
-        else if (adjusted_frequency > 2047)
+        // Clamp adjusted frequency to 2047 (unsigned, so it can't go below 0)
+        if (adjusted_frequency > 2047)
         {
             adjusted_frequency = 2047;
         }
@@ -591,7 +566,6 @@ APU::SquareWaveGenerator::SquareWaveGenerator(
     m_FrequencyLoRegister(frequencyLoRegister),
     m_FrequencyHiRegister(frequencyHiRegister)
 {
-    memset(m_Coefficients, 0, ARRAYSIZE(m_Coefficients));
 }
 
 void APU::SquareWaveGenerator::TriggerSweepRegisterUpdate()
@@ -957,64 +931,3 @@ void APU::WaveformGenerator::UpdateFrequency(unsigned int frequencyRegValue)
     // is 65536/(2048-x) Hz
     m_FrequencyHz = 65536.0 / (double)(2048 - frequencyRegValue);
 }
-
-APU::Buffer::Buffer(size_t element_count, size_t element_size)
-{
-    m_ElementCount = element_count + 1;
-    m_ElementSize = element_size;
-    m_BufferSize = m_ElementCount * m_ElementSize;
-    m_Bytes = new Uint8[m_BufferSize * sizeof(Uint8)];
-    m_DefaultBytes = new Uint8[m_ElementSize * sizeof(Uint8)];
-    memset(m_DefaultBytes, 0, m_ElementSize);
-    Reset();
-}
-
-APU::Buffer::~Buffer()
-{
-    delete m_Bytes;
-    delete m_DefaultBytes;
-}
-
-void APU::Buffer::Reset()
-{
-    m_ReadIndex = 0;
-    m_WriteIndex = 0;
-    memset(m_Bytes, 0, m_BufferSize * sizeof(Uint8));
-}
-
-void APU::Buffer::Put(Uint8* element)
-{
-    memcpy(&m_Bytes[m_WriteIndex], element, m_ElementSize);
-    AdvanceWriteIndex();
-    if (m_WriteIndex == m_ReadIndex)
-    {
-        AdvanceReadIndex();
-    }
-}
-
-Uint8* APU::Buffer::Get()
-{
-    Uint8* data;
-    if (m_WriteIndex == m_ReadIndex)
-    {
-        data = m_DefaultBytes;
-    }
-    else
-    {
-        data = &m_Bytes[m_ReadIndex];
-        AdvanceReadIndex();
-    }
-    return data;
-}
-
-void APU::Buffer::AdvanceReadIndex()
-{
-    mutex.lock();
-    m_ReadIndex = (m_ReadIndex + m_ElementSize) % m_BufferSize;
-    mutex.unlock();
-}
-
-void APU::Buffer::AdvanceWriteIndex()
-{
-    m_WriteIndex = (m_WriteIndex + m_ElementSize) % m_BufferSize;
-}
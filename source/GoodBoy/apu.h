@@ -1,19 +1,116 @@
 #ifndef APU_H
 #define APU_H
 
-#include <SDL.h>
+#include "scheduler.h"
+#include "sinks.h"
 #include "types.h"
-#include <mutex>
+
+// Mutable sound generator state, split from the generators' register wiring so that the
+// whole APU can be snapshotted as a handful of trivially copyable blocks
+struct SoundGeneratorState
+{
+    bool m_Enabled = true;
+    double m_FrequencyHz = 1.0;
+    double m_Phase = 0.0;
+    bool m_CounterModeEnabled = false;
+    double m_SoundLengthSeconds = 0.0;
+    bool m_SweepModeEnabled = false;
+    double m_SweepDirection = 0.0;
+    int m_SweepShiftFrequencyExponent = 0;
+    double m_SweepStepLengthSeconds = 0.0;
+    bool m_EnvelopeModeEnabled = false;
+    double m_EnvelopeDirection = 0.0;
+    double m_EnvelopeStartVolume = 1.0;
+    double m_EnvelopeStepLengthSeconds = 0.0;
+    double m_SoundLengthTimerSeconds = 0.0;
+    bool m_SoundLengthExpired = false;
+    unsigned int m_FrequencyRegisterData = 0;
+};
+
+struct SquareWaveGeneratorState
+{
+    // Maximum number of harmonics used to generate the square wave
+    static const int MaxHarmonicsCount = 52;
+
+    double m_DutyCycle = 0.5;
+    int m_HarmonicsCount = 0;
+    double m_Coefficients[MaxHarmonicsCount] = {};
+};
+
+struct NoiseGeneratorState
+{
+    float m_Signal = 0.5;
+    double m_PreviousSamplePhase = 0.0;
+
+    unsigned int m_shiftRegisterMSB = 14;
+    unsigned int m_shiftRegister = 0xFF;
+};
+
+struct WaveformGeneratorState
+{
+    byte m_VolumeShift = 0;
+};
+
+// Audio registers plus the synthesis clock
+struct APURegisterState
+{
+    byte m_Channel1Sweep = 0x00;
+    byte m_Channel1SoundLength = 0x00;
+    byte m_Channel1VolumeEnvelope = 0x00;
+    byte m_Channel1FrequencyLo = 0x00;
+    byte m_Channel1FrequencyHi = 0x00;
+
+    byte m_Channel2SoundLength = 0x00;
+    byte m_Channel2VolumeEnvelope = 0x00;
+    byte m_Channel2FrequencyLo = 0x00;
+    byte m_Channel2FrequencyHi = 0x00;
+
+    byte m_Channel3SoundOnOff = 0x00;
+    byte m_Channel3SoundLength = 0x00;
+    byte m_Channel3SelectOutputLevel = 0x00;
+    byte m_Channel3FrequencyLo = 0x00;
+    byte m_Channel3FrequencyHi = 0x00;
+    byte m_WavePatternRAM[0x0F + 1] = {};
+
+    byte m_Channel4SoundLength = 0x00;
+    byte m_Channel4VolumeEnvelope = 0x00;
+    byte m_Channel4PolynomialCounter = 0x00;
+    byte m_Channel4Counter = 0x00;
+
+    byte m_ChannelControlOnOffVolume = 0x00;
+    byte m_OutputTerminal = 0x00;
+
+    byte m_SoundOnOff = 0x00;
+
+    uint64_t m_LastSyncCycle = 0;
+    double m_AudioFrameRemainder = 0.0;
+};
+
+struct APUState
+{
+    APURegisterState m_Registers;
+    SoundGeneratorState m_Channel1;
+    SoundGeneratorState m_Channel2;
+    SoundGeneratorState m_Channel3;
+    SoundGeneratorState m_Channel4;
+    SquareWaveGeneratorState m_Channel1SquareWave;
+    SquareWaveGeneratorState m_Channel2SquareWave;
+    WaveformGeneratorState m_Channel3Waveform;
+    NoiseGeneratorState m_Channel4Noise;
+};
 
 // APU code taken from https://github.com/Dooskington/GameLad/pull/111
-class APU
+class APU : private APURegisterState
 {
 public:
     APU();
     ~APU();
 
-    void update(unsigned int cycles);
-    void AudioDeviceCallback(Uint8* pStream, int length);
+    void setScheduler(Scheduler* scheduler) { m_Scheduler = scheduler; scheduleNextEvent(); }
+    void setAudioSink(AudioSink* audioSink);
+
+    // Synthesizes the samples owed to the sink up to the scheduler's current cycle
+    void sync();
 
     // IMemoryUnit
     byte readByte(const word address);
@@ -21,9 +118,14 @@ public:
     
     void setSoundDisabled(const bool soundDisabled);
     bool isSoundDisabled() const;
+
+    void saveState(APUState& state) const;
+    void loadState(const APUState& state);
+    void copyStateFrom(const APU& other);
     
 private:
-    void LoadAudioDevice(SDL_AudioCallback callback);
+    void update(unsigned int cycles);
+    void scheduleNextEvent();
 
     typedef enum
     {
@@ -33,33 +135,8 @@ private:
         CHANNEL_4
     } APUChannel;
 
-    // Byte ring buffer for streaming audio data
-    class Buffer
-    {
-    public:
-        Buffer(size_t element_count, size_t element_size);
-        ~Buffer();
-
-        void Reset();
-        void Put(Uint8* element);
-        Uint8* Get();
-
-    private:
-        size_t m_ElementCount;
-        size_t m_ElementSize;
-        size_t m_BufferSize;
-        Uint8* m_Bytes;
-        Uint8* m_DefaultBytes;
-        size_t m_ReadIndex;
-        size_t m_WriteIndex;
-        std::mutex mutex;
-
-        void AdvanceReadIndex();
-        void AdvanceWriteIndex();
-    };
-
     // Base class for sound channel sample generators
-    class SoundGenerator
+    class SoundGenerator : protected SoundGeneratorState
     {
     public:
         SoundGenerator(
@@ -69,27 +146,13 @@ private:
         virtual ~SoundGenerator() = default;
         float NextSample();
 
+        void SaveState(SoundGeneratorState& state) const { state = *this; }
+        void LoadState(const SoundGeneratorState& state) { static_cast<SoundGeneratorState&>(*this) = state; }
+
     protected:
         const APUChannel m_Channel;
         const byte* m_SoundOnOffRegister;
 
-        bool m_Enabled = true;
-        double m_FrequencyHz = 1.0;
-        double m_Phase = 0.0;
-        bool m_CounterModeEnabled = false;
-        double m_SoundLengthSeconds;
-        bool m_SweepModeEnabled = false;
-        double m_SweepDirection;
-        int m_SweepShiftFrequencyExponent;
-        double m_SweepStepLengthSeconds;
-        bool m_EnvelopeModeEnabled = false;
-        double m_EnvelopeDirection;
-        double m_EnvelopeStartVolume = 1.0;
-        double m_EnvelopeStepLengthSeconds;
-        double m_SoundLengthTimerSeconds = 0.0;
-        bool m_SoundLengthExpired = false;
-        unsigned int m_FrequencyRegisterData = 0;
-
         virtual float NextWaveformSample() = 0;
         virtual void UpdateFrequency(unsigned int freqencyRegValue) = 0;
 
@@ -98,7 +161,7 @@ private:
         void ResetSoundOnOffFlag();
     };
 
-    class SquareWaveGenerator : public SoundGenerator
+    class SquareWaveGenerator : public SoundGenerator, private SquareWaveGeneratorState
     {
     public:
         SquareWaveGenerator(
@@ -118,27 +181,25 @@ private:
         void TriggerFrequencyLoRegisterUpdate();
         void TriggerFrequencyHiRegisterUpdate();
 
-    private:
-        // Maximum number of harmonics used to generate the square wave
-        static const int MaxHarmonicsCount = 52;
+        void SaveState(SquareWaveGeneratorState& state) const { state = *this; }
+        void LoadState(const SquareWaveGeneratorState& state) { static_cast<SquareWaveGeneratorState&>(*this) = state; }
+        using SoundGenerator::SaveState;
+        using SoundGenerator::LoadState;
 
+    private:
         const byte* m_SweepRegister;
         const byte* m_SoundLengthRegister;
         const byte* m_VolumeEnvelopeRegister;
         const byte* m_FrequencyLoRegister;
         const byte* m_FrequencyHiRegister;
 
-        double m_DutyCycle = 0.5;
-        int m_HarmonicsCount = 0;
-        double m_Coefficients[MaxHarmonicsCount];
-
         float NextWaveformSample() override;
         void UpdateFrequency(unsigned int freqencyRegValue) override;
 
         void RegenerateCoefficients();
     };
 
-    class NoiseGenerator : public SoundGenerator
+    class NoiseGenerator : public SoundGenerator, private NoiseGeneratorState
     {
     public:
         NoiseGenerator(
@@ -156,23 +217,22 @@ private:
         void TriggerPolynomialCounterRegisterUpdate();
         void TriggerCounterRegisterUpdate();
 
+        void SaveState(NoiseGeneratorState& state) const { state = *this; }
+        void LoadState(const NoiseGeneratorState& state) { static_cast<NoiseGeneratorState&>(*this) = state; }
+        using SoundGenerator::SaveState;
+        using SoundGenerator::LoadState;
+
     private:
         const byte* m_SoundLengthRegister;
         const byte* m_VolumeEnvelopeRegister;
         const byte* m_PolynomialCounterRegister;
         const byte* m_CounterRegister;
 
-        float m_Signal = 0.5;
-        double m_PreviousSamplePhase = 0.0;
-
-        unsigned int m_shiftRegisterMSB = 14;
-        unsigned int m_shiftRegister = 0xFF;
-
         float NextWaveformSample() override;
         void UpdateFrequency(unsigned int freqencyRegValue) override;
     };
 
-    class WaveformGenerator : public SoundGenerator
+    class WaveformGenerator : public SoundGenerator, private WaveformGeneratorState
     {
     public:
         WaveformGenerator(
@@ -193,6 +253,11 @@ private:
         void TriggerFrequencyLoRegisterUpdate();
         void TriggerFrequencyHiRegisterUpdate();
 
+        void SaveState(WaveformGeneratorState& state) const { state = *this; }
+        void LoadState(const WaveformGeneratorState& state) { static_cast<WaveformGeneratorState&>(*this) = state; }
+        using SoundGenerator::SaveState;
+        using SoundGenerator::LoadState;
+
     private:
         const byte* m_ChannelSoundOnOffRegister;
         const byte* m_SoundLengthRegister;
@@ -201,42 +266,11 @@ private:
         const byte* m_FrequencyHiRegister;
         const byte* m_WaveBuffer;
 
-        byte m_VolumeShift = 0;
-
         float NextWaveformSample() override;
         void UpdateFrequency(unsigned int freqencyRegValue) override;
     };
 
 private:
-    // Audio Registers
-    byte m_Channel1Sweep;
-    byte m_Channel1SoundLength;
-    byte m_Channel1VolumeEnvelope;
-    byte m_Channel1FrequencyLo;
-    byte m_Channel1FrequencyHi;
-
-    byte m_Channel2SoundLength;
-    byte m_Channel2VolumeEnvelope;
-    byte m_Channel2FrequencyLo;
-    byte m_Channel2FrequencyHi;
-
-    byte m_Channel3SoundOnOff;
-    byte m_Channel3SoundLength;
-    byte m_Channel3SelectOutputLevel;
-    byte m_Channel3FrequencyLo;
-    byte m_Channel3FrequencyHi;
-    byte m_WavePatternRAM[0x0F + 1];
-
-    byte m_Channel4SoundLength;
-    byte m_Channel4VolumeEnvelope;
-    byte m_Channel4PolynomialCounter;
-    byte m_Channel4Counter;
-
-    byte m_ChannelControlOnOffVolume;
-    byte m_OutputTerminal;
-
-    byte m_SoundOnOff;
-
     // Synthesis
     SquareWaveGenerator m_Channel1SoundGenerator;
     SquareWaveGenerator m_Channel2SoundGenerator;
@@ -244,10 +278,8 @@ private:
     NoiseGenerator m_Channel4SoundGenerator;
 
     // Output
-    SDL_AudioDeviceID m_AudioDevice;
-    double m_AudioFrameRemainder;
-    Buffer m_OutputBuffer;
-    bool m_Initialized;
+    Scheduler* m_Scheduler;
+    AudioSink* m_AudioSink;
     bool m_SoundDisabled;
 };
 
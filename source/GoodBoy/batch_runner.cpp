@@ -0,0 +1,65 @@
+#include "batch_runner.h"
+
+#include <algorithm>
+#include <cassert>
+
+BatchRunner::BatchRunner(const unsigned int threadCount, const bool pinThreadsToCores)
+	: pool_(threadCount, pinThreadsToCores)
+{
+}
+
+std::size_t BatchRunner::addInstance(std::unique_ptr<System> system, const unsigned int frameBudget, CompletionCallback completionCallback, const int pinnedCore)
+{
+	assert(system != nullptr);
+	instances_.push_back({ std::move(system), frameBudget, 0, std::move(completionCallback), pinnedCore });
+	return instances_.size() - 1;
+}
+
+void BatchRunner::setFrameBudget(const std::size_t instanceIndex, const unsigned int frameBudget)
+{
+	instances_[instanceIndex].frameBudget = frameBudget;
+}
+
+void BatchRunner::run()
+{
+	// instances_ is not resized while the pool is running, so workers can index it freely
+	for (std::size_t i = 0; i < instances_.size(); ++i)
+	{
+		instances_[i].framesRemaining = instances_[i].frameBudget;
+		submitSlice(i, instances_[i].pinnedCore);
+	}
+
+	pool_.waitIdle();
+}
+
+void BatchRunner::submitSlice(const std::size_t instanceIndex, const int workerIndex)
+{
+	const bool stealable = instances_[instanceIndex].pinnedCore == ANY_CORE;
+	pool_.submit([this, instanceIndex](const unsigned int currentWorkerIndex)
+	{
+		runSlice(instanceIndex, currentWorkerIndex);
+	}, workerIndex, stealable);
+}
+
+void BatchRunner::runSlice(const std::size_t instanceIndex, const unsigned int workerIndex)
+{
+	Instance& instance = instances_[instanceIndex];
+
+	const unsigned int sliceFrames = std::min(instance.framesRemaining, FRAMES_PER_SLICE);
+	for (unsigned int i = 0; i < sliceFrames; ++i)
+	{
+		instance.system->runFrame();
+	}
+	instance.framesRemaining -= sliceFrames;
+
+	if (instance.framesRemaining > 0)
+	{
+		// Requeue on the current worker so the instance stays cache-warm unless
+		// another worker runs dry and steals it
+		submitSlice(instanceIndex, static_cast<int>(workerIndex));
+	}
+	else if (instance.completionCallback)
+	{
+		instance.completionCallback(instanceIndex, *instance.system);
+	}
+}
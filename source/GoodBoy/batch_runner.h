@@ -0,0 +1,62 @@
+#ifndef BATCH_RUNNER_H
+#define BATCH_RUNNER_H
+
+#include "system.h"
+#include "work_stealing_pool.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Runs many independent System instances side by side, e.g. for unattended regression
+// sessions. Each instance is stepped in short slices of frames on a work-stealing pool,
+// so instances with long budgets do not leave other cores idle once short ones finish.
+// Systems share nothing, so no two workers ever touch the same instance at once.
+class BatchRunner final
+{
+public:
+	// Called on the worker thread that ran the instance's last frame
+	using CompletionCallback = std::function<void(const std::size_t instanceIndex, System& system)>;
+
+	static constexpr int ANY_CORE = WorkStealingPool::ANY_WORKER;
+
+	// Frames an instance runs before it is requeued and other instances get a turn
+	static constexpr unsigned int FRAMES_PER_SLICE = 8;
+
+public:
+	// A thread count of 0 uses one thread per hardware thread. With pinThreadsToCores
+	// each worker thread is bound to its own core.
+	explicit BatchRunner(const unsigned int threadCount = 0, const bool pinThreadsToCores = false);
+
+	// Takes ownership of a system that will run frameBudget frames per call to run().
+	// A pinnedCore other than ANY_CORE keeps the instance on that worker thread (and
+	// therefore that core when the threads are pinned) instead of letting it migrate.
+	std::size_t addInstance(std::unique_ptr<System> system, const unsigned int frameBudget, CompletionCallback completionCallback = nullptr, const int pinnedCore = ANY_CORE);
+
+	std::size_t getInstanceCount() const { return instances_.size(); }
+	System& getInstance(const std::size_t instanceIndex) { return *instances_[instanceIndex].system; }
+	void setFrameBudget(const std::size_t instanceIndex, const unsigned int frameBudget);
+
+	// Runs every instance through its frame budget and blocks until all have completed
+	void run();
+
+private:
+	struct Instance
+	{
+		std::unique_ptr<System> system;
+		unsigned int frameBudget;
+		unsigned int framesRemaining;
+		CompletionCallback completionCallback;
+		int pinnedCore;
+	};
+
+private:
+	void submitSlice(const std::size_t instanceIndex, const int workerIndex);
+	void runSlice(const std::size_t instanceIndex, const unsigned int workerIndex);
+
+private:
+	std::vector<Instance> instances_;
+	WorkStealingPool pool_;
+};
+
+#endif /* BATCH_RUNNER_H */
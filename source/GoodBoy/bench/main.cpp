@@ -0,0 +1,332 @@
+#include "input_movie.h"
+#include "sinks.h"
+#include "system.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Headless throughput benchmark. Runs a ROM uncapped for a fixed number of frames, with
+// an optional input movie driving the joypad, and prints the results as one JSON object
+// on stdout so runs can be compared across builds and hosts.
+//
+//   goodboy_bench [--frames=N] [--warmup=N] [--movie=PATH] [--no-output] [--cached|--jit]
+//                 [--profile=PATH] [--profile-folded=PATH] [--watch=TYPES:START[-END]]... ROM
+//
+// Video and audio are produced into discarding sinks unless --no-output is given, in
+// which case the core skips frame upload and audio synthesis entirely. --cached runs the
+// CPU's cached interpreter instead of the plain one, --jit its JIT.
+//
+// In builds configured with GOODBOY_GUEST_PROFILER, --profile writes a GuestProfiler
+// report of the timed frames and --profile-folded their call stacks for flamegraph.pl.
+// Profiling slows the run down, so its timings are not comparable to unprofiled ones.
+//
+// --watch watches the hex address range for reads, writes or execution, TYPES being any
+// of r, w and x, e.g. --watch=w:8000-9FFF for VRAM writes. Every hit from the first
+// warmup frame on is printed to stderr with its frame and PC.
+
+static constexpr int DEFAULT_FRAME_COUNT = 3600;
+static constexpr int DEFAULT_WARMUP_FRAME_COUNT = 60;
+
+static bool parseIntArgument(const char* argument, const char* name, int& value)
+{
+	const std::size_t nameLength = strlen(name);
+	if (strncmp(argument, name, nameLength) != 0)
+	{
+		return false;
+	}
+
+	value = atoi(argument + nameLength);
+	return true;
+}
+
+static void printJsonString(const char* key, const std::string& value)
+{
+	printf("  \"%s\": \"", key);
+	for (const char c : value)
+	{
+		if (c == '"' || c == '\\')
+		{
+			printf("\\%c", c);
+		}
+		else if (static_cast<unsigned char>(c) < 0x20 || static_cast<unsigned char>(c) >= 0x80)
+		{
+			// Cartridge titles are raw header bytes, so anything outside ASCII is escaped
+			printf("\\u%04x", static_cast<unsigned char>(c));
+		}
+		else
+		{
+			putchar(c);
+		}
+	}
+	printf("\",\n");
+}
+
+static const char* getExecutionModeName(const CPU::ExecutionMode executionMode)
+{
+	switch (executionMode)
+	{
+		case CPU::ExecutionMode::CACHED_INTERPRETER: return "cached_interpreter";
+		case CPU::ExecutionMode::JIT: return "jit";
+		default: return "interpreter";
+	}
+}
+
+struct Watch
+{
+	byte types;
+	word startAddress;
+	word endAddress;
+};
+
+// TYPES:START[-END], see above
+static bool parseWatch(const char* spec, Watch& watch)
+{
+	watch = Watch{ 0, 0, 0 };
+	for (; *spec != ':'; ++spec)
+	{
+		switch (*spec)
+		{
+			case 'r': watch.types |= WatchpointHit::READ; break;
+			case 'w': watch.types |= WatchpointHit::WRITE; break;
+			case 'x': watch.types |= WatchpointHit::EXECUTE; break;
+			default: return false;
+		}
+	}
+
+	char* end = nullptr;
+	const unsigned long startAddress = strtoul(spec + 1, &end, 16);
+	const unsigned long endAddress = *end == '-' ? strtoul(end + 1, &end, 16) : startAddress;
+	if (watch.types == 0 || end == spec + 1 || *end != '\0' || startAddress > endAddress || endAddress > 0xFFFF)
+	{
+		return false;
+	}
+
+	watch.startAddress = static_cast<word>(startAddress);
+	watch.endAddress = static_cast<word>(endAddress);
+	return true;
+}
+
+class PrintingWatchpointSink final : public WatchpointSink
+{
+public:
+	void onWatchpointHit(const WatchpointHit& hit) override
+	{
+		const char* type = hit.type == WatchpointHit::READ ? "read" : hit.type == WatchpointHit::WRITE ? "write" : "execute";
+		fprintf(stderr, "watchpoint: frame %d %s %04X = %02X pc %04X\n", frame, type, hit.address, hit.value, hit.pc);
+		hitCount++;
+	}
+
+	int frame = 0;
+	uint64_t hitCount = 0;
+};
+
+#ifdef GOODBOY_GUEST_PROFILER
+template<typename Writer>
+static bool writeProfile(const char* path, const Writer writer)
+{
+	if (path == nullptr)
+	{
+		return true;
+	}
+
+	FILE* file = fopen(path, "w");
+	if (file == nullptr)
+	{
+		fprintf(stderr, "Could not write profile %s\n", path);
+		return false;
+	}
+
+	writer(file);
+	fclose(file);
+	return true;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	int frameCount = DEFAULT_FRAME_COUNT;
+	int warmupFrameCount = DEFAULT_WARMUP_FRAME_COUNT;
+	const char* moviePath = nullptr;
+	const char* profilePath = nullptr;
+	const char* foldedProfilePath = nullptr;
+	const char* romPath = nullptr;
+	std::vector<Watch> watches;
+	bool produceOutput = true;
+	CPU::ExecutionMode executionMode = CPU::ExecutionMode::INTERPRETER;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (parseIntArgument(argv[i], "--frames=", frameCount) || parseIntArgument(argv[i], "--warmup=", warmupFrameCount))
+		{
+			continue;
+		}
+		else if (strncmp(argv[i], "--movie=", strlen("--movie=")) == 0)
+		{
+			moviePath = argv[i] + strlen("--movie=");
+		}
+		else if (strncmp(argv[i], "--profile=", strlen("--profile=")) == 0)
+		{
+			profilePath = argv[i] + strlen("--profile=");
+		}
+		else if (strncmp(argv[i], "--profile-folded=", strlen("--profile-folded=")) == 0)
+		{
+			foldedProfilePath = argv[i] + strlen("--profile-folded=");
+		}
+		else if (strncmp(argv[i], "--watch=", strlen("--watch=")) == 0)
+		{
+			Watch watch;
+			if (!parseWatch(argv[i] + strlen("--watch="), watch))
+			{
+				fprintf(stderr, "Invalid watchpoint %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+			watches.push_back(watch);
+		}
+		else if (strcmp(argv[i], "--no-output") == 0)
+		{
+			produceOutput = false;
+		}
+		else if (strcmp(argv[i], "--cached") == 0)
+		{
+			executionMode = CPU::ExecutionMode::CACHED_INTERPRETER;
+		}
+		else if (strcmp(argv[i], "--jit") == 0)
+		{
+			executionMode = CPU::ExecutionMode::JIT;
+		}
+		else
+		{
+			romPath = argv[i];
+		}
+	}
+
+	if (romPath == nullptr || frameCount <= 0 || warmupFrameCount < 0)
+	{
+		fprintf(stderr, "usage: %s [--frames=N] [--warmup=N] [--movie=PATH] [--no-output] [--cached|--jit] [--profile=PATH] [--profile-folded=PATH] [--watch=TYPES:START[-END]]... ROM\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+#ifndef GOODBOY_GUEST_PROFILER
+	if (profilePath != nullptr || foldedProfilePath != nullptr)
+	{
+		fprintf(stderr, "Profiling needs a build configured with GOODBOY_GUEST_PROFILER\n");
+		return EXIT_FAILURE;
+	}
+#endif
+
+	FILE* romFile = fopen(romPath, "rb");
+	if (romFile == nullptr)
+	{
+		fprintf(stderr, "Could not open ROM %s\n", romPath);
+		return EXIT_FAILURE;
+	}
+	fclose(romFile);
+
+	System system;
+	const std::string cartridgeName = system.loadCartridge(romPath);
+	system.setExecutionMode(executionMode);
+
+	NullVideoSink videoSink;
+	NullAudioSink audioSink;
+	system.setVideoSink(produceOutput ? &videoSink : nullptr);
+	system.setAudioSink(produceOutput ? &audioSink : nullptr);
+
+	PrintingWatchpointSink watchpointSink;
+	for (const Watch& watch : watches)
+	{
+		system.addWatchpoint(watch.types, watch.startAddress, watch.endAddress);
+	}
+	system.setWatchpointSink(watches.empty() ? nullptr : &watchpointSink);
+
+	InputMoviePlayer moviePlayer;
+	if (moviePath != nullptr && (!moviePlayer.open(moviePath) || !moviePlayer.seek(system, 0)))
+	{
+		fprintf(stderr, "Could not replay input movie %s against %s\n", moviePath, romPath);
+		return EXIT_FAILURE;
+	}
+
+	// Once the movie runs out the buttons stay released
+	const auto runFrame = [&]()
+	{
+		if (!moviePlayer.playFrame(system))
+		{
+			system.setInputState(0, 0);
+			system.runFrame();
+		}
+		watchpointSink.frame++;
+	};
+
+	for (int i = 0; i < warmupFrameCount; ++i)
+	{
+		runFrame();
+	}
+
+#ifdef GOODBOY_GUEST_PROFILER
+	GuestProfiler profiler;
+	const bool profiling = profilePath != nullptr || foldedProfilePath != nullptr;
+	system.setGuestProfiler(profiling ? &profiler : nullptr);
+#endif
+
+	const uint64_t startInstructionCount = system.getExecutedInstructionCount();
+	system.setSubsystemTimingEnabled(true);
+
+	const auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < frameCount; ++i)
+	{
+		runFrame();
+	}
+	const auto end = std::chrono::steady_clock::now();
+
+	system.setSubsystemTimingEnabled(false);
+
+#ifdef GOODBOY_GUEST_PROFILER
+	system.setGuestProfiler(nullptr);
+	const bool wroteProfile =
+		writeProfile(profilePath, [&profiler](FILE* file) { profiler.writeReport(file); }) &&
+		writeProfile(foldedProfilePath, [&profiler](FILE* file) { profiler.writeFoldedStacks(file); });
+	if (!wroteProfile)
+	{
+		return EXIT_FAILURE;
+	}
+#endif
+
+	const double seconds = std::chrono::duration<double>(end - start).count();
+	const uint64_t instructionCount = system.getExecutedInstructionCount() - startInstructionCount;
+	const SubsystemTimes& subsystemTimes = system.getSubsystemTimes();
+	const double displaySeconds = std::chrono::duration<double>(subsystemTimes.display).count();
+	const double timerSeconds = std::chrono::duration<double>(subsystemTimes.timer).count();
+	const double apuSeconds = std::chrono::duration<double>(subsystemTimes.apu).count();
+	const double framesPerSecond = frameCount / seconds;
+	const double realTimeFramesPerSecond = static_cast<double>(System::CPU_CLOCK_CYCLES_PER_SECOND) / System::CPU_CLOCK_CYCLES_PER_FRAME;
+
+	printf("{\n");
+	printJsonString("rom", romPath);
+	printJsonString("cartridge", cartridgeName);
+	printJsonString("movie", moviePath != nullptr ? moviePath : "");
+	printf("  \"output\": %s,\n", produceOutput ? "true" : "false");
+	printf("  \"execution_mode\": \"%s\",\n", getExecutionModeName(system.getExecutionMode()));
+	printf("  \"warmup_frames\": %d,\n", warmupFrameCount);
+	printf("  \"frames\": %d,\n", frameCount);
+	printf("  \"seconds\": %.6f,\n", seconds);
+	printf("  \"frames_per_second\": %.2f,\n", framesPerSecond);
+	printf("  \"speed_vs_real_time\": %.2f,\n", framesPerSecond / realTimeFramesPerSecond);
+	printf("  \"instructions\": %llu,\n", static_cast<unsigned long long>(instructionCount));
+	printf("  \"instructions_per_second\": %.0f,\n", instructionCount / seconds);
+	printf("  \"mips\": %.3f,\n", instructionCount / seconds / 1e6);
+	printf("  \"watchpoint_hits\": %llu,\n", static_cast<unsigned long long>(watchpointSink.hitCount));
+	printf("  \"subsystem_seconds\": {\n");
+	// Everything outside the scheduled component syncs: instruction execution, memory
+	// access, interrupt dispatch and syncs forced by register accesses
+	printf("    \"cpu\": %.6f,\n", seconds - displaySeconds - timerSeconds - apuSeconds);
+	printf("    \"display\": %.6f,\n", displaySeconds);
+	printf("    \"timer\": %.6f,\n", timerSeconds);
+	printf("    \"apu\": %.6f\n", apuSeconds);
+	printf("  }\n");
+	printf("}\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+#include "block_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+static constexpr std::size_t ADDRESS_SPACE_SIZE = 0x10000;
+
+BlockCache::BlockCache()
+	: recentBlocks_(ADDRESS_SPACE_SIZE, nullptr)
+	, ramCodeMap_(ADDRESS_SPACE_SIZE, 0)
+	, currentBlock_(nullptr)
+	, nextInstructionIndex_(0)
+	, nextInstructionAddress_(0)
+{
+}
+
+BlockCache::Block* BlockCache::enterBlock(const word address, const int bank)
+{
+	Block* block = recentBlocks_[address];
+	if (block == nullptr || block->bank != bank)
+	{
+		const auto it = blocks_.find(getBlockKey(address, bank));
+		if (it == blocks_.end())
+		{
+			currentBlock_ = nullptr;
+			return nullptr;
+		}
+
+		block = it->second.get();
+		recentBlocks_[address] = block;
+	}
+
+	setCurrentBlock(block);
+	return block;
+}
+
+BlockCache::Block& BlockCache::insertBlock(Block block, const bool isRamBlock)
+{
+	assert(!block.instructions.empty());
+
+	const uint32_t key = getBlockKey(block.startAddress, block.bank);
+	assert(blocks_.find(key) == blocks_.end());
+
+	auto& insertedBlock = blocks_[key];
+	insertedBlock = std::make_unique<Block>(std::move(block));
+
+	if (isRamBlock)
+	{
+		std::fill(ramCodeMap_.begin() + insertedBlock->startAddress, ramCodeMap_.begin() + insertedBlock->endAddress, 1);
+		ramBlockKeys_.push_back(key);
+	}
+
+	recentBlocks_[insertedBlock->startAddress] = insertedBlock.get();
+	setCurrentBlock(insertedBlock.get());
+	return *insertedBlock;
+}
+
+void BlockCache::resumeCurrentBlock(const std::size_t instructionIndex, const word address)
+{
+	assert(currentBlock_ != nullptr);
+	if (instructionIndex >= currentBlock_->instructions.size())
+	{
+		currentBlock_ = nullptr;
+		return;
+	}
+
+	nextInstructionIndex_ = instructionIndex;
+	nextInstructionAddress_ = address;
+}
+
+bool BlockCache::containsRamCode(const word first, const word last) const
+{
+	return std::any_of(ramCodeMap_.begin() + first, ramCodeMap_.begin() + last + 1, [](const byte isCode) { return isCode != 0; });
+}
+
+void BlockCache::invalidateRamBlocks()
+{
+	// RAM code is rare and short-lived enough that dropping all of it beats tracking
+	// which blocks overlap the written byte
+	for (const uint32_t key : ramBlockKeys_)
+	{
+		const auto it = blocks_.find(key);
+		assert(it != blocks_.end());
+
+		const Block* block = it->second.get();
+		std::fill(ramCodeMap_.begin() + block->startAddress, ramCodeMap_.begin() + block->endAddress, 0);
+		if (recentBlocks_[block->startAddress] == block)
+		{
+			recentBlocks_[block->startAddress] = nullptr;
+		}
+		blocks_.erase(it);
+	}
+
+	ramBlockKeys_.clear();
+	currentBlock_ = nullptr;
+}
+
+void BlockCache::clearCompiledCode()
+{
+	for (auto& entry : blocks_)
+	{
+		entry.second->entryCount = 0;
+		entry.second->compiledEntryPoints.clear();
+	}
+}
+
+void BlockCache::clear()
+{
+	blocks_.clear();
+	ramBlockKeys_.clear();
+	std::fill(recentBlocks_.begin(), recentBlocks_.end(), nullptr);
+	std::fill(ramCodeMap_.begin(), ramCodeMap_.end(), 0);
+	currentBlock_ = nullptr;
+}
+
+void BlockCache::setCurrentBlock(Block* block)
+{
+	currentBlock_ = block;
+	nextInstructionIndex_ = 0;
+	nextInstructionAddress_ = block->startAddress;
+}
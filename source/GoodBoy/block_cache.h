@@ -0,0 +1,167 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include "types.h"
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class CPU;
+
+// Pre-decoded guest code for the CPU's cached interpreter and JIT. A block is a straight run of
+// instructions starting at an address in a given bank, decoded once into handler
+// pointers and immediates, so executing it never goes back through Memory to fetch
+// opcode and operand bytes. Blocks are looked up by address and bank whenever control
+// flow leaves the current one and followed instruction by instruction otherwise.
+//
+// ROM blocks stay valid for the lifetime of the cartridge. Blocks in work RAM and HRAM
+// are dropped as soon as any byte they were decoded from is written.
+class BlockCache final
+{
+public:
+	using InstructionHandler = unsigned int (*)(CPU& cpu);
+
+	struct DecodedInstruction
+	{
+		InstructionHandler handler;
+		word immediate; // the second opcode byte for CB-prefixed instructions
+		byte length;
+		byte opcode;
+	};
+
+	// A polling loop a block begins with: instructions that change nothing but A and F and
+	// only read memory, ending in a branch back to the block's start. The CPU skips its
+	// iterations once one of them changed nothing, see CPU::isInIdleLoop.
+	struct IdleLoop
+	{
+		unsigned int clockCycles; // per iteration, 0 when the block doesn't begin with one
+		byte instructionCount;
+		byte branchClockCycles;
+		byte addressRegisters;    // which of BC, DE, HL and C it reads memory through, see CPU::canSkipIdleLoop
+	};
+
+	// A block copy or fill loop a block begins with, e.g. LD A,(HL+) / LD (DE),A / INC DE /
+	// DEC BC / LD A,B / OR C / JR NZ or LD (HL+),A / DEC B / JR NZ: every iteration writes
+	// a byte read through one register pair, or a value fixed for the whole loop, through
+	// another, steps both by one and decrements a counter, branching back to the block's
+	// start until that reaches zero. The CPU runs its iterations in bulk, see CPU::runBulkLoop.
+	struct BulkLoop
+	{
+		static constexpr byte NO_PAIR              = 0xFF;
+		static constexpr byte OPERAND_IMMEDIATE    = 0xFF;
+		static constexpr byte OPERAND_READ         = 0xFE; // the byte the copy read
+		static constexpr byte OPERAND_COUNTER_TEST = 0xFD; // the halves of the counter ORed
+
+		unsigned int clockCycles;  // per iteration, 0 when the block doesn't begin with one
+		byte instructionCount;
+		byte branchClockCycles;
+		byte destinationPair;      // register pair index (BC 0, DE 2, HL 4) written through
+		sbyte destinationOffset;   // how far it moved in the iteration before the write
+		sbyte destinationStep;     // and in a whole iteration, 1 or -1
+		byte sourcePair;           // likewise for the read of a copy, NO_PAIR for fills
+		sbyte sourceOffset;
+		sbyte sourceStep;
+		byte fillOperand;          // B to L or A as in opcode register fields, or OPERAND_IMMEDIATE
+		byte fillValue;
+		byte exitOperand;          // what A holds after an iteration, as fillOperand or one of the above
+		byte exitValue;
+		byte counterRegister;      // register index of the counter, or of the pair for 16-bit ones
+		bool isWordCounter;
+	};
+
+	struct Block
+	{
+		word startAddress;
+		word endAddress; // one past the last byte of the last instruction
+		int bank;
+		std::vector<DecodedInstruction> instructions;
+
+		// JIT only: how often the block was entered and, once it got hot enough to be
+		// compiled, the host code entry point of each instruction (nullptr for the ones
+		// left to the interpreter)
+		unsigned int entryCount;
+		std::vector<const byte*> compiledEntryPoints;
+
+		IdleLoop idleLoop;
+		BulkLoop bulkLoop;
+	};
+
+	static constexpr std::size_t MAX_BLOCK_INSTRUCTION_COUNT = 64;
+
+public:
+	BlockCache();
+
+	BlockCache(const BlockCache&) = delete;
+	BlockCache& operator=(const BlockCache&) = delete;
+
+	// The next instruction of the block being executed if it continues at address,
+	// nullptr when the block must be looked up again
+	inline const DecodedInstruction* nextInstruction(const word address)
+	{
+		if (currentBlock_ == nullptr || address != nextInstructionAddress_ || nextInstructionIndex_ == currentBlock_->instructions.size())
+		{
+			return nullptr;
+		}
+
+		const DecodedInstruction& instruction = currentBlock_->instructions[nextInstructionIndex_++];
+		nextInstructionAddress_ += instruction.length;
+		return &instruction;
+	}
+
+	// The current block and the index of its next instruction if execution continues at
+	// address, nullptr where nextInstruction would return nullptr
+	inline Block* getCurrentBlock(const word address, std::size_t& instructionIndex) const
+	{
+		if (currentBlock_ == nullptr || address != nextInstructionAddress_ || nextInstructionIndex_ == currentBlock_->instructions.size())
+		{
+			return nullptr;
+		}
+
+		instructionIndex = nextInstructionIndex_;
+		return currentBlock_;
+	}
+
+	// Continues the current block at the given instruction after compiled code ran part of
+	// it, an index past its end leaves the block
+	void resumeCurrentBlock(const std::size_t instructionIndex, const word address);
+
+	// Makes the block at address and bank the current one, nullptr if it isn't cached
+	Block* enterBlock(const word address, const int bank);
+	Block& insertBlock(Block block, const bool isRamBlock);
+
+	// The current block may be decoded from a bank that is no longer mapped
+	void onBankSwitch() { currentBlock_ = nullptr; }
+
+	inline void onRamWrite(const word address)
+	{
+		if (ramCodeMap_[address] != 0)
+		{
+			invalidateRamBlocks();
+		}
+	}
+
+	// Whether any byte from first to last was decoded into a cached block
+	bool containsRamCode(const word first, const word last) const;
+
+	void invalidateRamBlocks();
+	void clearCompiledCode();
+	void clear();
+
+private:
+	static uint32_t getBlockKey(const word address, const int bank) { return static_cast<uint32_t>(bank) << 16 | address; }
+
+	void setCurrentBlock(Block* block);
+
+private:
+	std::unordered_map<uint32_t, std::unique_ptr<Block>> blocks_;
+	std::vector<uint32_t> ramBlockKeys_;
+	std::vector<Block*> recentBlocks_; // by start address, the last block entered there in any bank
+	std::vector<byte> ramCodeMap_;     // by address, non-zero where a RAM block was decoded from
+	Block* currentBlock_;
+	std::size_t nextInstructionIndex_;
+	word nextInstructionAddress_;
+};
+
+#endif /* BLOCK_CACHE_H */
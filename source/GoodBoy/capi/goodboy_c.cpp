@@ -0,0 +1,207 @@
+#include "goodboy_c.h"
+
+#include "sinks.h"
+#include "system.h"
+
+#include <cstring>
+#include <memory>
+#include <new>
+
+static_assert(GB_FRAMEBUFFER_SIZE == VideoSink::SCREEN_WIDTH * VideoSink::SCREEN_HEIGHT * VideoSink::BYTES_PER_PIXEL, "Framebuffer size mismatch");
+static_assert(GB_BUTTON_START == System::ACTION_BUTTON_START_MASK && GB_BUTTON_DOWN == System::DIRECTION_BUTTON_DOWN_MASK, "Button mask mismatch");
+
+// Smallest image with a complete header and both fixed ROM banks
+static constexpr std::size_t MIN_ROM_SIZE = 0x8000;
+
+namespace
+{
+	class FramebufferSink final : public VideoSink
+	{
+	public:
+		FramebufferSink() : pixels_() {}
+
+		void onVBlank(const byte* pixels) override { memcpy(pixels_, pixels, sizeof(pixels_)); }
+
+		const byte* getPixels() const { return pixels_; }
+
+	private:
+		byte pixels_[GB_FRAMEBUFFER_SIZE];
+	};
+
+	// Prefixes every save state so a blob from another ROM or build is rejected
+	struct StateHeader
+	{
+		uint64_t romHash;
+		uint64_t stateSize;
+	};
+}
+
+struct gb_instance
+{
+	std::unique_ptr<System> system;
+	std::unique_ptr<MachineState> scratchState;
+	FramebufferSink framebufferSink;
+	bool renderEnabled = true;
+};
+
+uint32_t gb_abi_version(void)
+{
+	return GB_ABI_VERSION;
+}
+
+gb_instance* gb_create(void)
+{
+	return new (std::nothrow) gb_instance();
+}
+
+void gb_destroy(gb_instance* gb)
+{
+	delete gb;
+}
+
+int gb_load_rom_from_memory(gb_instance* gb, const uint8_t* rom, size_t rom_size)
+{
+	if (gb == nullptr || rom == nullptr || rom_size < MIN_ROM_SIZE)
+	{
+		return GB_ERROR_INVALID_ARGUMENT;
+	}
+
+	gb->system = std::make_unique<System>();
+	if (gb->scratchState == nullptr)
+	{
+		gb->scratchState = std::make_unique<MachineState>();
+	}
+	gb->system->loadCartridgeFromMemory(rom, rom_size);
+	gb->system->setVideoSink(gb->renderEnabled ? &gb->framebufferSink : nullptr);
+	gb->system->setAudioSink(nullptr);
+	return GB_OK;
+}
+
+int gb_set_input(gb_instance* gb, uint8_t action_buttons, uint8_t direction_buttons)
+{
+	if (gb == nullptr)
+	{
+		return GB_ERROR_INVALID_ARGUMENT;
+	}
+	if (gb->system == nullptr)
+	{
+		return GB_ERROR_NO_ROM;
+	}
+
+	gb->system->setInputState(action_buttons & 0x0F, direction_buttons & 0x0F);
+	return GB_OK;
+}
+
+int gb_step_frames(gb_instance* gb, uint32_t frame_count)
+{
+	if (gb == nullptr)
+	{
+		return GB_ERROR_INVALID_ARGUMENT;
+	}
+	if (gb->system == nullptr)
+	{
+		return GB_ERROR_NO_ROM;
+	}
+
+	for (uint32_t i = 0; i < frame_count; ++i)
+	{
+		gb->system->runFrame();
+	}
+	return GB_OK;
+}
+
+int gb_set_render_enabled(gb_instance* gb, int enabled)
+{
+	if (gb == nullptr)
+	{
+		return GB_ERROR_INVALID_ARGUMENT;
+	}
+
+	gb->renderEnabled = enabled != 0;
+	if (gb->system != nullptr)
+	{
+		gb->system->setVideoSink(gb->renderEnabled ? &gb->framebufferSink : nullptr);
+	}
+	return GB_OK;
+}
+
+const uint8_t* gb_get_framebuffer(const gb_instance* gb)
+{
+	return gb != nullptr ? gb->framebufferSink.getPixels() : nullptr;
+}
+
+const uint8_t* gb_get_ram(const gb_instance* gb, size_t* ram_size)
+{
+	if (gb == nullptr || gb->system == nullptr)
+	{
+		if (ram_size != nullptr)
+		{
+			*ram_size = 0;
+		}
+		return nullptr;
+	}
+
+	if (ram_size != nullptr)
+	{
+		*ram_size = gb->system->getWorkRamSize();
+	}
+	return gb->system->getWorkRam();
+}
+
+size_t gb_get_state_size(void)
+{
+	return sizeof(StateHeader) + sizeof(MachineState);
+}
+
+int gb_save_state(const gb_instance* gb, void* buffer, size_t buffer_size)
+{
+	if (gb == nullptr || buffer == nullptr)
+	{
+		return GB_ERROR_INVALID_ARGUMENT;
+	}
+	if (gb->system == nullptr)
+	{
+		return GB_ERROR_NO_ROM;
+	}
+	if (buffer_size < gb_get_state_size())
+	{
+		return GB_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	// The caller's buffer has no alignment guarantee, so go through a scratch state
+	gb->system->snapshot(*gb->scratchState);
+
+	const StateHeader header = { gb->system->getRomHash(), sizeof(MachineState) };
+	byte* out = static_cast<byte*>(buffer);
+	memcpy(out, &header, sizeof(header));
+	memcpy(out + sizeof(header), gb->scratchState.get(), sizeof(MachineState));
+	return GB_OK;
+}
+
+int gb_load_state(gb_instance* gb, const void* buffer, size_t buffer_size)
+{
+	if (gb == nullptr || buffer == nullptr)
+	{
+		return GB_ERROR_INVALID_ARGUMENT;
+	}
+	if (gb->system == nullptr)
+	{
+		return GB_ERROR_NO_ROM;
+	}
+	if (buffer_size < gb_get_state_size())
+	{
+		return GB_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	const byte* in = static_cast<const byte*>(buffer);
+	StateHeader header;
+	memcpy(&header, in, sizeof(header));
+	if (header.romHash != gb->system->getRomHash() || header.stateSize != sizeof(MachineState))
+	{
+		return GB_ERROR_STATE_MISMATCH;
+	}
+
+	memcpy(gb->scratchState.get(), in + sizeof(header), sizeof(MachineState));
+	gb->system->restore(*gb->scratchState);
+	return GB_OK;
+}
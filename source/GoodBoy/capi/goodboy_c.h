@@ -0,0 +1,95 @@
+#ifndef GOODBOY_C_H
+#define GOODBOY_C_H
+
+/*
+ * Flat C interface to the emulation core, for use from other languages through FFI.
+ * Each gb_instance is an independent machine; separate instances may be driven from
+ * separate threads, a single instance from one thread at a time. Nothing here calls
+ * back into the caller, and a whole batch of frames runs inside one gb_step_frames call.
+ *
+ * Functions returning int return GB_OK or one of the negative GB_ERROR_* codes.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+	#if defined(GOODBOY_C_API_EXPORTS)
+		#define GB_API __declspec(dllexport)
+	#else
+		#define GB_API __declspec(dllimport)
+	#endif
+#else
+	#define GB_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped whenever a signature or the meaning of a constant changes */
+#define GB_ABI_VERSION 1
+
+#define GB_OK                      0
+#define GB_ERROR_INVALID_ARGUMENT -1
+#define GB_ERROR_NO_ROM           -2
+#define GB_ERROR_BUFFER_TOO_SMALL -3
+#define GB_ERROR_STATE_MISMATCH   -4
+
+/* gb_set_input action_buttons bits */
+#define GB_BUTTON_A      0x01
+#define GB_BUTTON_B      0x02
+#define GB_BUTTON_SELECT 0x04
+#define GB_BUTTON_START  0x08
+
+/* gb_set_input direction_buttons bits */
+#define GB_BUTTON_RIGHT  0x01
+#define GB_BUTTON_LEFT   0x02
+#define GB_BUTTON_UP     0x04
+#define GB_BUTTON_DOWN   0x08
+
+#define GB_SCREEN_WIDTH      160
+#define GB_SCREEN_HEIGHT     144
+#define GB_BYTES_PER_PIXEL   4
+#define GB_FRAMEBUFFER_SIZE  (GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT * GB_BYTES_PER_PIXEL)
+
+typedef struct gb_instance gb_instance;
+
+GB_API uint32_t gb_abi_version(void);
+
+/* Returns NULL if the instance could not be allocated */
+GB_API gb_instance* gb_create(void);
+GB_API void gb_destroy(gb_instance* gb);
+
+/* Powers on a fresh machine with a copy of the given ROM image. Any previous machine
+ * state is discarded. Battery-backed RAM starts blank and is never written to disk. */
+GB_API int gb_load_rom_from_memory(gb_instance* gb, const uint8_t* rom, size_t rom_size);
+
+/* Held buttons, applied from the next frame on until changed */
+GB_API int gb_set_input(gb_instance* gb, uint8_t action_buttons, uint8_t direction_buttons);
+
+GB_API int gb_step_frames(gb_instance* gb, uint32_t frame_count);
+
+/* Rendering is on by default. With it off the core skips building the frame on VBlank
+ * and gb_get_framebuffer keeps returning the last frame rendered. */
+GB_API int gb_set_render_enabled(gb_instance* gb, int enabled);
+
+/* The last completed frame, GB_FRAMEBUFFER_SIZE bytes of RGBA8888 (ABGR byte order),
+ * row-major. The pointer stays valid for the lifetime of the instance. */
+GB_API const uint8_t* gb_get_framebuffer(const gb_instance* gb);
+
+/* Work RAM: 8KB at 0xC000 on DMG, all eight 4KB banks on CGB. The pointer stays valid
+ * until the next gb_load_rom_from_memory. Returns NULL if no ROM is loaded. */
+GB_API const uint8_t* gb_get_ram(const gb_instance* gb, size_t* ram_size);
+
+/* Save states are opaque blobs of gb_get_state_size() bytes. They can only be loaded
+ * into an instance running the same ROM, with a library of the same build. */
+GB_API size_t gb_get_state_size(void);
+GB_API int gb_save_state(const gb_instance* gb, void* buffer, size_t buffer_size);
+GB_API int gb_load_state(gb_instance* gb, const void* buffer, size_t buffer_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GOODBOY_C_H */
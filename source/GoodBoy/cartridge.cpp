@@ -4,6 +4,7 @@
 #include "logging.h"
 
 #include <cassert>
+#include <cstring>
 #include <stdio.h>
 
 static constexpr word CARTRIDGE_TITLE_LENGTH  = 0x10;
@@ -27,18 +28,18 @@ static const word CARTRIDGE_RAM_SIZES[] =
 };
 
 Cartridge::Cartridge()
-	: cartridgeRom_(nullptr)
+	: CartridgeState()
+	, cartridgeRomImage_()
+	, cartridgeRom_(nullptr)
+	, cartridgeExternalRam_(nullptr)
 	, cartridgeName_()
+	, romHash_(0)
 	, cartridgeType_(CartridgeType::UNSUPPORTED)
 	, cartridgeROMSizeInKB_(0)
 	, cartridgeExternalRAMSizeInKB_(0)
-	, romBankNumberRegister_(0x1)
-	, ramBankNumberRegister_(0x0)
-	, secondaryBankNumberRegister_(0x0)
-	, bankingMode_(0x0)
 	, cgbType_(CgbType::DMG)
-	, externalRamEnabled_(false)
 {
+	romBankNumberRegister_ = 0x1;
 }
 
 Cartridge::~Cartridge()
@@ -58,11 +59,105 @@ std::string Cartridge::loadCartridge(const char* filepath)
 	return cartridgeName_ + " " + CARTRIDGE_TYPE_NAMES[static_cast<int>(cartridgeType_)];
 }
 
+std::string Cartridge::loadCartridgeFromMemory(const byte* romData, const std::size_t romSize)
+{
+	setCartridgeRom(std::make_shared<std::vector<byte>>(romData, romData + romSize));
+	saveFileName_.clear();
+	setCartridgeAttributes();
+	setCartridgeExternalRam();
+
+	return cartridgeName_ + " " + CARTRIDGE_TYPE_NAMES[static_cast<int>(cartridgeType_)];
+}
+
 void Cartridge::unloadCartridge()
 {
 	flushExternalRamToFile();
-	delete cartridgeRom_;
-	delete cartridgeExternalRam_;
+	cartridgeRomImage_.reset();
+	cartridgeRom_ = nullptr;
+	delete[] cartridgeExternalRam_;
+	cartridgeExternalRam_ = nullptr;
+}
+
+void Cartridge::shareCartridge(const Cartridge& other)
+{
+	unloadCartridge();
+
+	cartridgeRomImage_ = other.cartridgeRomImage_;
+	cartridgeRom_ = other.cartridgeRom_;
+	cartridgeName_ = other.cartridgeName_;
+	saveFileName_.clear();
+	romHash_ = other.romHash_;
+	cartridgeType_ = other.cartridgeType_;
+	cartridgeROMSizeInKB_ = other.cartridgeROMSizeInKB_;
+	cartridgeExternalRAMSizeInKB_ = other.cartridgeExternalRAMSizeInKB_;
+	cgbType_ = other.cgbType_;
+
+	cartridgeExternalRam_ = new byte[cartridgeExternalRAMSizeInKB_ * 1024];
+}
+
+void Cartridge::saveState(CartridgeState& state, byte* externalRam) const
+{
+	state = *this;
+	if (cartridgeExternalRAMSizeInKB_ > 0)
+	{
+		memcpy(externalRam, cartridgeExternalRam_, cartridgeExternalRAMSizeInKB_ * 1024);
+	}
+}
+
+void Cartridge::loadState(const CartridgeState& state, const byte* externalRam)
+{
+	static_cast<CartridgeState&>(*this) = state;
+	if (cartridgeExternalRAMSizeInKB_ > 0)
+	{
+		memcpy(cartridgeExternalRam_, externalRam, cartridgeExternalRAMSizeInKB_ * 1024);
+	}
+}
+
+int Cartridge::getRomBankNumber() const
+{
+	switch (cartridgeType_)
+	{
+		case CartridgeType::MBC1:
+		case CartridgeType::MBC1_RAM:
+		case CartridgeType::MBC1_RAM_BATTERY:
+			return bankingMode_ == 0 ? (romBankNumberRegister_ | (ramBankNumberRegister_ << 4)) : romBankNumberRegister_;
+
+		case CartridgeType::MBC3_RAM_BATTERY:
+		case CartridgeType::MBC3_TIMER_RAM_BATTERY:
+			return romBankNumberRegister_;
+
+		case CartridgeType::MBC5_RAM_BATTERY:
+		case CartridgeType::MBC5_RUMBLE_RAM_BATTERY:
+			return secondaryBankNumberRegister_ == 0x1 ? (0x100 | romBankNumberRegister_) : romBankNumberRegister_;
+
+		default: return 1;
+	}
+}
+
+const byte* Cartridge::getRomBank(const word address) const
+{
+	switch (cartridgeType_)
+	{
+		case CartridgeType::ROM_ONLY:
+		case CartridgeType::MBC1:
+		case CartridgeType::MBC1_RAM:
+		case CartridgeType::MBC1_RAM_BATTERY:
+		case CartridgeType::MBC3_RAM_BATTERY:
+		case CartridgeType::MBC3_TIMER_RAM_BATTERY:
+		case CartridgeType::MBC5_RAM_BATTERY:
+		case CartridgeType::MBC5_RUMBLE_RAM_BATTERY:
+			break;
+
+		default: return nullptr;
+	}
+
+	if (cartridgeRomImage_ == nullptr)
+	{
+		return nullptr;
+	}
+
+	const std::size_t bankOffset = address <= 0x3FFF ? 0 : static_cast<std::size_t>(getRomBankNumber()) * 0x4000;
+	return bankOffset + 0x4000 <= cartridgeRomImage_->size() ? cartridgeRom_ + bankOffset : nullptr;
 }
 
 byte Cartridge::readByteAt(const word address) const
@@ -343,9 +438,24 @@ void Cartridge::readCartridgeRom(const char* filepath)
 	fseek(file, 0, SEEK_SET);
 
 	// copy cartridge over
-	cartridgeRom_ = new byte[size];
-	fread(cartridgeRom_, sizeof(byte), size, file);
+	auto romImage = std::make_shared<std::vector<byte>>(size);
+	fread(romImage->data(), sizeof(byte), size, file);
 	fclose(file);
+
+	setCartridgeRom(std::move(romImage));
+}
+
+void Cartridge::setCartridgeRom(std::shared_ptr<std::vector<byte>> romImage)
+{
+	// FNV-1a, identifies the ROM that save states were taken with
+	romHash_ = 0xCBF29CE484222325;
+	for (const byte b : *romImage)
+	{
+		romHash_ = (romHash_ ^ b) * 0x100000001B3;
+	}
+
+	cartridgeRom_ = romImage->data();
+	cartridgeRomImage_ = std::move(romImage);
 }
 
 void Cartridge::setSaveFilename(const char* filepath)
@@ -394,7 +504,7 @@ void Cartridge::setCartridgeExternalRam()
 {
 	cartridgeExternalRam_ = new byte[cartridgeExternalRAMSizeInKB_ * 1024];
 	memset(cartridgeExternalRam_, 0xFF, cartridgeExternalRAMSizeInKB_ * 1024);
-	FILE* eRamFile = fopen(saveFileName_.c_str(), "rb");
+	FILE* eRamFile = saveFileName_.empty() ? nullptr : fopen(saveFileName_.c_str(), "rb");
 	if (eRamFile != nullptr)
 	{
 		// get file size
@@ -416,7 +526,7 @@ void Cartridge::flushExternalRamToFile()
 	case CartridgeType::MBC5_RAM_BATTERY:
 	case CartridgeType::MBC5_RUMBLE_RAM_BATTERY:
 	{
-		if (cartridgeExternalRAMSizeInKB_ > 0 && !externalRamEnabled_)
+		if (cartridgeExternalRAMSizeInKB_ > 0 && !externalRamEnabled_ && !saveFileName_.empty())
 		{
 			FILE* file = fopen(saveFileName_.c_str(), "wb");
 			fwrite(cartridgeExternalRam_, sizeof(byte), cartridgeExternalRAMSizeInKB_ * 1024, file);
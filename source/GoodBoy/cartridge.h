@@ -3,9 +3,22 @@
 
 #include "types.h"
 
+#include <memory>
 #include <string>
+#include <vector>
 
-class Cartridge final
+// Guest-visible banking state, kept as one trivially copyable block for snapshots. The
+// external RAM is sized per cartridge and is saved alongside it.
+struct CartridgeState
+{
+	byte romBankNumberRegister_;
+	byte ramBankNumberRegister_;
+	byte secondaryBankNumberRegister_;
+	byte bankingMode_;
+	bool externalRamEnabled_;
+};
+
+class Cartridge final : private CartridgeState
 {
 public:
 	enum class CartridgeType
@@ -30,39 +43,65 @@ public:
 		CGB_ONLY
 	};
 
+	// Largest external RAM of any supported cartridge (MBC5)
+	static constexpr int MAX_EXTERNAL_RAM_SIZE = 128 * 1024;
+
 public:
 	Cartridge();
 	~Cartridge();
 
+	Cartridge(const Cartridge&) = delete;
+	Cartridge& operator=(const Cartridge&) = delete;
+
 	std::string loadCartridge(const char* filepath);
+	// Copies the ROM image out of the caller's buffer. There is no battery save file.
+	std::string loadCartridgeFromMemory(const byte* romData, const std::size_t romSize);
 	void unloadCartridge();
 
+	// Loads the same cartridge as other, sharing its immutable ROM image. External RAM is
+	// allocated but left for the caller to fill, and the copy never writes the battery
+	// save file.
+	void shareCartridge(const Cartridge& other);
+
 	CgbType getCgbType() const { return cgbType_; }
+	uint64_t getRomHash() const { return romHash_; }
+	int getExternalRamSize() const { return cartridgeExternalRAMSizeInKB_ * 1024; }
+
+	// The ROM bank readByteAt currently maps at 0x4000-0x7FFF
+	int getRomBankNumber() const;
+
+	// The 16KB readByteAt maps at 0x0000-0x3FFF or 0x4000-0x7FFF, whichever holds address,
+	// for reading in bulk. nullptr if they don't all come from the ROM image.
+	const byte* getRomBank(const word address) const;
 
 	byte readByteAt(const word address) const;
 	void writeByteAt(const word address, const byte b);
 
+	// externalRam must hold at least MAX_EXTERNAL_RAM_SIZE bytes; only the loaded
+	// cartridge's external RAM size is copied
+	void saveState(CartridgeState& state, byte* externalRam) const;
+	void loadState(const CartridgeState& state, const byte* externalRam);
+	void copyStateFrom(const Cartridge& other) { other.saveState(*this, cartridgeExternalRam_); }
+
 private:
 	void readCartridgeRom(const char* filepath);
+	void setCartridgeRom(std::shared_ptr<std::vector<byte>> romImage);
 	void setSaveFilename(const char* filepath);
 	void setCartridgeAttributes();
 	void setCartridgeExternalRam();
 	void flushExternalRamToFile();
 
 private:
-	byte* cartridgeRom_;
+	std::shared_ptr<const std::vector<byte>> cartridgeRomImage_;
+	const byte* cartridgeRom_; // cartridgeRomImage_'s bytes
 	byte* cartridgeExternalRam_;
 	std::string cartridgeName_;
 	std::string saveFileName_;	
+	uint64_t romHash_;
 	CartridgeType cartridgeType_;
 	int cartridgeROMSizeInKB_;
 	int cartridgeExternalRAMSizeInKB_;
-	byte romBankNumberRegister_;
-	byte ramBankNumberRegister_;
-	byte secondaryBankNumberRegister_;
-	byte bankingMode_;
 	CgbType cgbType_;
-	bool externalRamEnabled_;
 };
 
 #endif
\ No newline at end of file
@@ -1,15 +1,21 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "cpu.h"
+#include "alu_tables.h"
 #include "display.h"
+#include "guest_profiler.h"
+#include "interrupt_controller.h"
 #include "logging.h"
 
 #include <cassert>
+#include <cstddef>
+#include <cstring>
 #include <iomanip>
+#include <iterator>
 #include <sstream>
 #include <stdio.h>
 
-static byte coreInstructionClockCycles[256] = 
+static constexpr byte coreInstructionClockCycles[256] = 
 {   /*          0x0 0x1 0x2 0x3 0x4 0x5 0x6 0x7 0x8 0x9 0xA 0xB 0xC 0xD 0xE 0xF */
 	/* 0x00 */  4,  12, 8,  8,  4,  4,  8,  4,  20, 8,  8,  8,  4,  4,  8,  4,
 	/* 0x10 */  0,  12, 8,  8,  4,  4,  8,  4,  12, 8,  8,  8,  4,  4,  8,  4,
@@ -29,7 +35,7 @@ static byte coreInstructionClockCycles[256] =
 	/* 0xF0 */  12, 12, 8,  4,  0,  16, 8,  16, 12, 8,  16, 4,  0,  0,  8,  16
 };
 
-static byte cbInstructionClockCycles[256] =
+static constexpr byte cbInstructionClockCycles[256] =
 {   /*          0x0 0x1 0x2 0x3 0x4 0x5 0x6 0x7 0x8 0x9 0xA 0xB 0xC 0xD 0xE 0xF */
 	/* 0x00 */  8,  8,  8,  8,  8,  8,  16, 8,  8,  8,  8,  8,  8,  8,  16, 8,
 	/* 0x10 */  8,  8,  8,  8,  8,  8,  16, 8,  8,  8,  8,  8,  8,  8,  16, 8,
@@ -50,6 +56,361 @@ static byte cbInstructionClockCycles[256] =
 
 };
 
+// Instruction sizes including the opcode. STOP is one byte, it never reads its operand.
+static constexpr byte instructionLengths[256] =
+{   /*          0x0 0x1 0x2 0x3 0x4 0x5 0x6 0x7 0x8 0x9 0xA 0xB 0xC 0xD 0xE 0xF */
+	/* 0x00 */  1,  3,  1,  1,  1,  1,  2,  1,  3,  1,  1,  1,  1,  1,  2,  1,
+	/* 0x10 */  1,  3,  1,  1,  1,  1,  2,  1,  2,  1,  1,  1,  1,  1,  2,  1,
+	/* 0x20 */  2,  3,  1,  1,  1,  1,  2,  1,  2,  1,  1,  1,  1,  1,  2,  1,
+	/* 0x30 */  2,  3,  1,  1,  1,  1,  2,  1,  2,  1,  1,  1,  1,  1,  2,  1,
+	/* 0x40 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	/* 0x50 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	/* 0x60 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	/* 0x70 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	/* 0x80 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	/* 0x90 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	/* 0xA0 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	/* 0xB0 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	/* 0xC0 */  1,  1,  3,  3,  3,  1,  2,  1,  1,  1,  3,  2,  3,  3,  2,  1,
+	/* 0xD0 */  1,  1,  3,  1,  3,  1,  2,  1,  1,  1,  3,  1,  3,  1,  2,  1,
+	/* 0xE0 */  2,  1,  1,  1,  1,  1,  2,  1,  2,  1,  3,  1,  1,  1,  2,  1,
+	/* 0xF0 */  2,  1,  1,  1,  1,  1,  2,  1,  2,  1,  3,  1,  1,  1,  2,  1
+};
+
+// Unconditional jumps, calls, returns and restarts, halting and undefined opcodes
+static constexpr bool endsBlock(const byte opcode)
+{
+	switch (opcode)
+	{
+		case 0x10: case 0x18: case 0x76: case 0xC3: case 0xC9: case 0xCD: case 0xD9: case 0xE9:
+		case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+			return true;
+		default:
+			return (opcode & 0xC7) == 0xC7;
+	}
+}
+
+static constexpr byte IDLE_LOOP_READS_BC     = 0x1;
+static constexpr byte IDLE_LOOP_READS_DE     = 0x2;
+static constexpr byte IDLE_LOOP_READS_HL     = 0x4;
+static constexpr byte IDLE_LOOP_READS_FF00_C = 0x8;
+
+// Memory that only the CPU writes or that components only change when they catch up at
+// one of their scheduler events, so a polling loop reading it sees the same value until then
+static bool isIdleLoopReadStable(const word address)
+{
+	return address <= Memory::ROM_BANK_1_N_END_ADDRESS ||
+		(address >= Memory::WRAM_0_START_ADDRESS && address <= Memory::WRAM_1_END_ADDRESS) ||
+		(address >= Memory::HRAM_START_ADDRESS && address <= Memory::HRAM_END_ADDRESS) ||
+		(address >= Memory::LCD_START_ADDRESS && address <= Memory::LCD_END_ADDRESS) ||
+		address == Memory::IF_ADDRESS || address == Memory::IE_ADDRESS;
+}
+
+// For the instructions a polling loop may consist of, the IDLE_LOOP_READS_* registers they
+// read memory through. -1 for any that writes memory or a register other than A and F.
+static int getIdleLoopReadRegisters(const BlockCache::DecodedInstruction& instruction)
+{
+	const byte opcode = instruction.opcode;
+	if (opcode == 0xCB)
+	{
+		const byte cbOpcode = static_cast<byte>(instruction.immediate);
+		if ((cbOpcode & 0xC0) != 0x40)
+		{
+			return -1;
+		}
+		return (cbOpcode & 0x07) == 0x06 ? IDLE_LOOP_READS_HL : 0;          // BIT b,r
+	}
+
+	if (opcode >= 0x78 && opcode <= 0xBF)
+	{
+		return (opcode & 0x07) == 0x06 ? IDLE_LOOP_READS_HL : 0;            // LD A,r and ALU A,r
+	}
+
+	switch (opcode)
+	{
+		case 0x00: case 0x07: case 0x0F: case 0x17: case 0x1F: case 0x27: case 0x2F: case 0x37: case 0x3F: case 0x3E:
+		case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+			return 0;
+		case 0x0A: return IDLE_LOOP_READS_BC;                                // LD A,(BC)
+		case 0x1A: return IDLE_LOOP_READS_DE;                                // LD A,(DE)
+		case 0xF2: return IDLE_LOOP_READS_FF00_C;                            // LD A,(C)
+		case 0xF0: return isIdleLoopReadStable(0xFF00 + (instruction.immediate & 0xFF)) ? 0 : -1; // LDH A,(n)
+		case 0xFA: return isIdleLoopReadStable(instruction.immediate) ? 0 : -1;                  // LD A,(nn)
+		default: return -1;
+	}
+}
+
+// The polling loop the block begins with, if any. The first branch must be the one back to
+// the start, so every iteration takes the same path and cycles.
+static BlockCache::IdleLoop findIdleLoop(const BlockCache::Block& block)
+{
+	BlockCache::IdleLoop loop = {};
+	unsigned int clockCycles = 0;
+	word address = block.startAddress;
+	for (std::size_t i = 0; i < block.instructions.size(); ++i)
+	{
+		const BlockCache::DecodedInstruction& instruction = block.instructions[i];
+		address += instruction.length;
+
+		word target;
+		switch (instruction.opcode)
+		{
+			case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+				target = address + static_cast<sbyte>(instruction.immediate & 0xFF);  // JR n and JR cc,n
+				break;
+			case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+				target = instruction.immediate;                                        // JP nn and JP cc,nn
+				break;
+			default:
+			{
+				const int readRegisters = getIdleLoopReadRegisters(instruction);
+				if (readRegisters < 0)
+				{
+					return {};
+				}
+				loop.addressRegisters |= readRegisters;
+				clockCycles += instruction.opcode == 0xCB ? cbInstructionClockCycles[instruction.immediate] : coreInstructionClockCycles[instruction.opcode];
+				continue;
+			}
+		}
+
+		if (target != block.startAddress)
+		{
+			return {};
+		}
+
+		// The branch tables hold the cycles of a taken branch
+		loop.branchClockCycles = coreInstructionClockCycles[instruction.opcode];
+		loop.clockCycles = clockCycles + loop.branchClockCycles;
+		loop.instructionCount = static_cast<byte>(i + 1);
+		return loop;
+	}
+
+	return {};
+}
+
+// What A holds during a copy or fill loop iteration, see findBulkLoop. Copies of B to L
+// are their register fields, immediates BULK_LOOP_A_IMMEDIATE | the value.
+static constexpr int BULK_LOOP_A_ON_ENTRY     = -1;
+static constexpr int BULK_LOOP_A_IMMEDIATE    = 0x100;
+static constexpr int BULK_LOOP_A_READ         = 0x200;
+static constexpr int BULK_LOOP_A_COUNTER_TEST = 0x300;
+
+static constexpr byte OPERAND_FIELD_A = 7;
+
+// The copy or fill loop the block begins with, if any. Its instructions may only move
+// bytes through A, step the pointers and count down, where the counter is either a
+// register decremented by DEC r or a pair decremented by DEC rr and tested by LD A,r /
+// OR r on its halves. As with polling loops the first branch must be the one back to the
+// start, here a JR NZ or JP NZ taken until the count reaches zero.
+static BlockCache::BulkLoop findBulkLoop(const BlockCache::Block& block)
+{
+	BlockCache::BulkLoop loop = {};
+	int pairSteps[3] = {};          // how far BC, DE and HL moved so far in the iteration
+	int pairChanges[3] = {};        // and in how many instructions
+	int decrementedRegister = -1;   // the one DEC r allowed, of B to L
+	int readPair = -1;
+	int writePair = -1;
+	int writtenValue = BULK_LOOP_A_ON_ENTRY;
+	int a = BULK_LOOP_A_ON_ENTRY;
+	int aCopyPairChanges = 0;       // of the pair A copied a half of, when it did
+	bool isACopyDecremented = false; // whether that half had been decremented by then
+	bool isAChanged = false;
+	int counter = -1;               // the last flags are those of DEC r on this register
+	int counterPair = -1;           // or of testing this pair for zero
+	unsigned int clockCycles = 0;
+	word address = block.startAddress;
+	for (std::size_t i = 0; i < block.instructions.size(); ++i)
+	{
+		const BlockCache::DecodedInstruction& instruction = block.instructions[i];
+		const byte opcode = instruction.opcode;
+		address += instruction.length;
+
+		switch (opcode)
+		{
+			case 0x0A: case 0x1A: case 0x2A: case 0x3A: case 0x7E:   // LD A,(BC), LD A,(DE), LD A,(HL+), LD A,(HL-) and LD A,(HL)
+			case 0x02: case 0x12: case 0x22: case 0x32: case 0x77:   // LD (BC),A, LD (DE),A, LD (HL+),A, LD (HL-),A and LD (HL),A
+			{
+				const int pair = opcode == 0x7E || opcode == 0x77 ? 2 : std::min(opcode >> 4, 2);
+				const bool isRead = opcode == 0x7E || (opcode & 0x0F) == 0x0A;
+				int& accessPair = isRead ? readPair : writePair;
+				if (accessPair >= 0)
+				{
+					return {};
+				}
+
+				accessPair = pair;
+				if (isRead)
+				{
+					loop.sourceOffset = static_cast<sbyte>(pairSteps[pair]);
+					a = BULK_LOOP_A_READ;
+					isAChanged = true;
+				}
+				else
+				{
+					loop.destinationOffset = static_cast<sbyte>(pairSteps[pair]);
+					writtenValue = a;
+				}
+
+				if (opcode == 0x2A || opcode == 0x22 || opcode == 0x3A || opcode == 0x32)
+				{
+					pairSteps[2] += opcode <= 0x2A ? 1 : -1;
+					pairChanges[2]++;
+				}
+				break;
+			}
+			case 0x03: case 0x13: case 0x23:                         // INC rr
+			case 0x0B: case 0x1B: case 0x2B:                         // DEC rr
+				pairSteps[opcode >> 4] += (opcode & 0x08) ? -1 : 1;
+				pairChanges[opcode >> 4]++;
+				break;
+			case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: // DEC r
+				if (decrementedRegister >= 0)
+				{
+					return {};
+				}
+				decrementedRegister = opcode >> 3;
+				counter = decrementedRegister;
+				counterPair = -1;
+				break;
+			case 0x78: case 0x79: case 0x7A: case 0x7B: case 0x7C: case 0x7D: // LD A,r
+				a = opcode & 0x07;
+				aCopyPairChanges = pairChanges[a >> 1];
+				isACopyDecremented = a == decrementedRegister;
+				isAChanged = true;
+				break;
+			case 0x7F:                                               // LD A,A
+				break;
+			case 0x3E:                                               // LD A,n
+				a = BULK_LOOP_A_IMMEDIATE | (instruction.immediate & 0xFF);
+				isAChanged = true;
+				break;
+			case 0xAF:                                               // XOR A
+				a = BULK_LOOP_A_IMMEDIATE;
+				isAChanged = true;
+				counter = -1;
+				counterPair = -1;
+				break;
+			case 0xB0: case 0xB1: case 0xB2: case 0xB3: case 0xB4: case 0xB5: // OR r
+			{
+				// Only as the zero test of a pair A holds the other half of, copied after
+				// the pair was decremented
+				const int operand = opcode & 0x07;
+				if (a < 0 || a > 5 || (a >> 1) != (operand >> 1) || a == operand || pairChanges[a >> 1] != 1 || aCopyPairChanges != 1)
+				{
+					return {};
+				}
+				counter = -1;
+				counterPair = a >> 1;
+				a = BULK_LOOP_A_COUNTER_TEST;
+				break;
+			}
+			case 0x20: case 0xC2:                                    // JR NZ,n and JP NZ,nn
+				break;
+			default:
+				return {};
+		}
+
+		if (opcode != 0x20 && opcode != 0xC2)
+		{
+			clockCycles += coreInstructionClockCycles[opcode];
+			continue;
+		}
+
+		const word target = opcode == 0x20 ? static_cast<word>(address + static_cast<sbyte>(instruction.immediate & 0xFF)) : instruction.immediate;
+		if (target != block.startAddress || writePair < 0 || readPair == writePair)
+		{
+			return {};
+		}
+
+		// Both pointers step by one per iteration and nothing else changes but the counter
+		for (int pair = 0; pair < 3; ++pair)
+		{
+			const bool isPointer = pair == readPair || pair == writePair;
+			if (isPointer ? pairSteps[pair] != 1 && pairSteps[pair] != -1 : pair != counterPair && pairChanges[pair] != 0)
+			{
+				return {};
+			}
+		}
+
+		if (counterPair >= 0 ? counterPair == readPair || counterPair == writePair || pairChanges[counterPair] != 1 || pairSteps[counterPair] != -1 || decrementedRegister >= 0 :
+			counter < 0 || (counter >> 1) == readPair || (counter >> 1) == writePair || pairChanges[counter >> 1] != 0)
+		{
+			return {};
+		}
+
+		// A copy writes what it read, a fill the same value every iteration
+		if (readPair >= 0)
+		{
+			if (writtenValue != BULK_LOOP_A_READ)
+			{
+				return {};
+			}
+			loop.sourcePair = static_cast<byte>(readPair * 2);
+			loop.sourceStep = static_cast<sbyte>(pairSteps[readPair]);
+		}
+		else if (writtenValue == BULK_LOOP_A_ON_ENTRY && !isAChanged)
+		{
+			loop.sourcePair = BlockCache::BulkLoop::NO_PAIR;
+			loop.fillOperand = OPERAND_FIELD_A;
+		}
+		else if (writtenValue >= 0 && writtenValue <= 5 && pairChanges[writtenValue >> 1] == 0 && writtenValue != decrementedRegister)
+		{
+			loop.sourcePair = BlockCache::BulkLoop::NO_PAIR;
+			loop.fillOperand = static_cast<byte>(writtenValue);
+		}
+		else if ((writtenValue & ~0xFF) == BULK_LOOP_A_IMMEDIATE)
+		{
+			loop.sourcePair = BlockCache::BulkLoop::NO_PAIR;
+			loop.fillOperand = BlockCache::BulkLoop::OPERAND_IMMEDIATE;
+			loop.fillValue = static_cast<byte>(writtenValue);
+		}
+		else
+		{
+			return {};
+		}
+
+		// What A is left with, which for a copy of B to L has to be their value at the end
+		if (a == BULK_LOOP_A_ON_ENTRY)
+		{
+			loop.exitOperand = OPERAND_FIELD_A;
+		}
+		else if (a == BULK_LOOP_A_READ)
+		{
+			loop.exitOperand = BlockCache::BulkLoop::OPERAND_READ;
+		}
+		else if (a == BULK_LOOP_A_COUNTER_TEST)
+		{
+			loop.exitOperand = BlockCache::BulkLoop::OPERAND_COUNTER_TEST;
+		}
+		else if ((a & ~0xFF) == BULK_LOOP_A_IMMEDIATE)
+		{
+			loop.exitOperand = BlockCache::BulkLoop::OPERAND_IMMEDIATE;
+			loop.exitValue = static_cast<byte>(a);
+		}
+		else if (pairChanges[a >> 1] == aCopyPairChanges && (a != decrementedRegister || isACopyDecremented))
+		{
+			loop.exitOperand = static_cast<byte>(a);
+		}
+		else
+		{
+			return {};
+		}
+
+		// The branch tables hold the cycles of a taken branch
+		loop.clockCycles = clockCycles + coreInstructionClockCycles[opcode];
+		loop.instructionCount = static_cast<byte>(i + 1);
+		loop.branchClockCycles = static_cast<byte>(coreInstructionClockCycles[opcode]);
+		loop.destinationPair = static_cast<byte>(writePair * 2);
+		loop.destinationStep = static_cast<sbyte>(pairSteps[writePair]);
+		loop.counterRegister = static_cast<byte>(counterPair >= 0 ? counterPair * 2 : counter);
+		loop.isWordCounter = counterPair >= 0;
+		return loop;
+	}
+
+	return {};
+}
+
 #define SET_Z_FLAG() registersAF_ |= 0x80
 #define SET_N_FLAG() registersAF_ |= 0x40
 #define SET_H_FLAG() registersAF_ |= 0x20
@@ -79,1737 +440,1643 @@ static constexpr word JOYPAD_INTERRUPT_HANDLER_ADDRESS   = 0x60;
 
 static constexpr byte ISR_EXECUTION_CLOCK_CYCLES = 0;
 
-CPU::CPU(Memory& mem, Display& display)
-	: mem_(mem)
+CPU::CPU(Memory& mem, Display& display, InterruptController& interruptController)
+	: CPUState()
+	, mem_(mem)
 	, display_(display)
-	, registersAF_(0)
-	, registersPC_(0)
-	, isHalted_(false)
+	, interruptController_(interruptController)
+	, blockCache_(nullptr)
+	, jit_(nullptr)
+	, enterCompiledCode_(nullptr)
+	, exitCompiledCode_(nullptr)
+	, compiledBlocksStart_(nullptr)
+	, executionMode_(ExecutionMode::INTERPRETER)
+	, predecodedImmediate_(0)
+	, lastInstructionClockCycles_(0)
+	, executedInstructionCount_(0)
+	, idleLoop_()
+	, idleLoopAddress_(0)
+	, idleLoopAF_(0)
+	, idleLoopInstructionCount_(NO_IDLE_LOOP)
+	, bulkLoopAddress_(0)
+	, bulkLoopInstructionCount_(NO_BULK_LOOP)
+#ifdef GOODBOY_GUEST_PROFILER
+	, guestProfiler_(nullptr)
+#endif
 	, shouldDumpState_(false)
-	, ime_(false)
-	, eiTriggered_(false)
 {
-	memset(generalPurposeRegisters_, 0, sizeof(generalPurposeRegisters_));	
 }
 
 unsigned int CPU::executeNextInstruction()
 {
 	if (isHalted_ || display_.cgbHdmaTransferInProgress())
 	{
-		return coreInstructionClockCycles[0];
+#ifdef GOODBOY_GUEST_PROFILER
+		if (guestProfiler_ != nullptr) guestProfiler_->recordHaltedCycles(HALTED_STEP_CLOCK_CYCLES);
+#endif
+		return HALTED_STEP_CLOCK_CYCLES;
 	}
 
-	currentInstructionOperands_.clear();
-	byte opcode = readByteAtPC();
-	unsigned int clockCycles = coreInstructionClockCycles[opcode];
-	
-	switch (opcode)
-	{
-		// noop
-		case 0x00: break;
-
-		// stop
-		case 0x10: isHalted_ = true; break;
-
-		// 8-bit Loads
-		case 0x06: setRegByte(REG_B_INDEX, readByteAtPC()); break;		
-		case 0x0E: setRegByte(REG_C_INDEX, readByteAtPC()); break;
-		case 0x16: setRegByte(REG_D_INDEX, readByteAtPC()); break;
-		case 0x1E: setRegByte(REG_E_INDEX, readByteAtPC()); break;
-		case 0x26: setRegByte(REG_H_INDEX, readByteAtPC()); break;
-		case 0x2E: setRegByte(REG_L_INDEX, readByteAtPC()); break;
-		case 0x7F: setRegAByte(getRegAByte()); break;
-		case 0x78: setRegAByte(getRegByte(REG_B_INDEX)); break;
-		case 0x79: setRegAByte(getRegByte(REG_C_INDEX)); break;
-		case 0x7A: setRegAByte(getRegByte(REG_D_INDEX)); break;
-		case 0x7B: setRegAByte(getRegByte(REG_E_INDEX)); break;
-		case 0x7C: setRegAByte(getRegByte(REG_H_INDEX)); break;
-		case 0x7D: setRegAByte(getRegByte(REG_L_INDEX)); break;
-		case 0x0A: setRegAByte(mem_.readByteAt(getRegWord(REG_BC_INDEX))); break;
-		case 0x1A: setRegAByte(mem_.readByteAt(getRegWord(REG_DE_INDEX))); break;
-		case 0x7E: setRegAByte(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-		case 0xFA: setRegAByte(mem_.readByteAt(readWordAtPc())); break;
-		case 0x3E: setRegAByte(readByteAtPC()); break;
-		case 0xF2: setRegAByte(mem_.readByteAt(0xFF00 + getRegByte(REG_C_INDEX))); break;
-		case 0xE2: mem_.writeByteAt(0xFF00 + getRegByte(REG_C_INDEX), getRegAByte()); break;
-		case 0x47: setRegByte(REG_B_INDEX, getRegAByte()); break;
-		case 0x4F: setRegByte(REG_C_INDEX, getRegAByte()); break;
-		case 0x57: setRegByte(REG_D_INDEX, getRegAByte()); break;
-		case 0x5F: setRegByte(REG_E_INDEX, getRegAByte()); break;
-		case 0x67: setRegByte(REG_H_INDEX, getRegAByte()); break;
-		case 0x6F: setRegByte(REG_L_INDEX, getRegAByte()); break;
-		case 0x02: mem_.writeByteAt(getRegWord(REG_BC_INDEX), getRegAByte()); break;
-		case 0x12: mem_.writeByteAt(getRegWord(REG_DE_INDEX), getRegAByte()); break;
-		case 0x77: mem_.writeByteAt(getRegWord(REG_HL_INDEX), getRegAByte()); break;
-		case 0xEA: mem_.writeByteAt(readWordAtPc(), getRegAByte()); break;
-		case 0xE0: mem_.writeByteAt(0xFF00 + readByteAtPC(), getRegAByte()); break;
-		case 0xF0: setRegAByte(mem_.readByteAt(0xFF00 + readByteAtPC())); break;
-		
-		case 0x40: setRegByte(REG_B_INDEX, getRegByte(REG_B_INDEX)); break;
-		case 0x41: setRegByte(REG_B_INDEX, getRegByte(REG_C_INDEX)); break;
-		case 0x42: setRegByte(REG_B_INDEX, getRegByte(REG_D_INDEX)); break;
-		case 0x43: setRegByte(REG_B_INDEX, getRegByte(REG_E_INDEX)); break;
-		case 0x44: setRegByte(REG_B_INDEX, getRegByte(REG_H_INDEX)); break;
-		case 0x45: setRegByte(REG_B_INDEX, getRegByte(REG_L_INDEX)); break;
-		case 0x46: setRegByte(REG_B_INDEX, mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-
-		case 0x48: setRegByte(REG_C_INDEX, getRegByte(REG_B_INDEX)); break;
-		case 0x49: setRegByte(REG_C_INDEX, getRegByte(REG_C_INDEX)); break;
-		case 0x4A: setRegByte(REG_C_INDEX, getRegByte(REG_D_INDEX)); break;
-		case 0x4B: setRegByte(REG_C_INDEX, getRegByte(REG_E_INDEX)); break;
-		case 0x4C: setRegByte(REG_C_INDEX, getRegByte(REG_H_INDEX)); break;
-		case 0x4D: setRegByte(REG_C_INDEX, getRegByte(REG_L_INDEX)); break;
-		case 0x4E: setRegByte(REG_C_INDEX, mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-
-		case 0x50: setRegByte(REG_D_INDEX, getRegByte(REG_B_INDEX)); break;
-		case 0x51: setRegByte(REG_D_INDEX, getRegByte(REG_C_INDEX)); break;
-		case 0x52: setRegByte(REG_D_INDEX, getRegByte(REG_D_INDEX)); break;
-		case 0x53: setRegByte(REG_D_INDEX, getRegByte(REG_E_INDEX)); break;
-		case 0x54: setRegByte(REG_D_INDEX, getRegByte(REG_H_INDEX)); break;
-		case 0x55: setRegByte(REG_D_INDEX, getRegByte(REG_L_INDEX)); break;
-		case 0x56: setRegByte(REG_D_INDEX, mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-
-		case 0x58: setRegByte(REG_E_INDEX, getRegByte(REG_B_INDEX)); break;
-		case 0x59: setRegByte(REG_E_INDEX, getRegByte(REG_C_INDEX)); break;
-		case 0x5A: setRegByte(REG_E_INDEX, getRegByte(REG_D_INDEX)); break;
-		case 0x5B: setRegByte(REG_E_INDEX, getRegByte(REG_E_INDEX)); break;
-		case 0x5C: setRegByte(REG_E_INDEX, getRegByte(REG_H_INDEX)); break;
-		case 0x5D: setRegByte(REG_E_INDEX, getRegByte(REG_L_INDEX)); break;
-		case 0x5E: setRegByte(REG_E_INDEX, mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-
-		case 0x60: setRegByte(REG_H_INDEX, getRegByte(REG_B_INDEX)); break;
-		case 0x61: setRegByte(REG_H_INDEX, getRegByte(REG_C_INDEX)); break;
-		case 0x62: setRegByte(REG_H_INDEX, getRegByte(REG_D_INDEX)); break;
-		case 0x63: setRegByte(REG_H_INDEX, getRegByte(REG_E_INDEX)); break;
-		case 0x64: setRegByte(REG_H_INDEX, getRegByte(REG_H_INDEX)); break;
-		case 0x65: setRegByte(REG_H_INDEX, getRegByte(REG_L_INDEX)); break;
-		case 0x66: setRegByte(REG_H_INDEX, mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-
-		case 0x68: setRegByte(REG_L_INDEX, getRegByte(REG_B_INDEX)); break;
-		case 0x69: setRegByte(REG_L_INDEX, getRegByte(REG_C_INDEX)); break;
-		case 0x6A: setRegByte(REG_L_INDEX, getRegByte(REG_D_INDEX)); break;
-		case 0x6B: setRegByte(REG_L_INDEX, getRegByte(REG_E_INDEX)); break;
-		case 0x6C: setRegByte(REG_L_INDEX, getRegByte(REG_H_INDEX)); break;
-		case 0x6D: setRegByte(REG_L_INDEX, getRegByte(REG_L_INDEX)); break;
-		case 0x6E: setRegByte(REG_L_INDEX, mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-
-		case 0x70: mem_.writeByteAt(getRegWord(REG_HL_INDEX), getRegByte(REG_B_INDEX)); break;
-		case 0x71: mem_.writeByteAt(getRegWord(REG_HL_INDEX), getRegByte(REG_C_INDEX)); break;
-		case 0x72: mem_.writeByteAt(getRegWord(REG_HL_INDEX), getRegByte(REG_D_INDEX)); break;
-		case 0x73: mem_.writeByteAt(getRegWord(REG_HL_INDEX), getRegByte(REG_E_INDEX)); break;
-		case 0x74: mem_.writeByteAt(getRegWord(REG_HL_INDEX), getRegByte(REG_H_INDEX)); break;
-		case 0x75: mem_.writeByteAt(getRegWord(REG_HL_INDEX), getRegByte(REG_L_INDEX)); break;
-		case 0x36: mem_.writeByteAt(getRegWord(REG_HL_INDEX), readByteAtPC()); break;
-
-		case 0x22: ldihla(); break;
-		case 0x2A: ldiahl(); break;
-		case 0x32: lddhla(); break;
-		case 0x3A: lddahl(); break;
-
-		// 16-bit Loads
-		case 0x01:
-		case 0x11:
-		case 0x21:
-		case 0x31: setRegWord((opcode >> 4) * sizeof(word), readWordAtPc()); break;
-
-		// LD SP,HL
-		case 0xF9: setRegWord(REG_SP_INDEX, getRegWord(REG_HL_INDEX)); break;
-
-		// LD nn, SP
-		case 0x08: mem_.writeWordAt(readWordAtPc(), getRegWord(REG_SP_INDEX)); break;
-
-		// XOR A n
-		case 0xAF: xoran((registersAF_ & 0xFF00) >> 8); break;
-		case 0xA8: xoran(getRegByte(REG_B_INDEX)); break;
-		case 0xA9: xoran(getRegByte(REG_C_INDEX)); break;
-		case 0xAA: xoran(getRegByte(REG_D_INDEX)); break;
-		case 0xAB: xoran(getRegByte(REG_E_INDEX)); break;
-		case 0xAC: xoran(getRegByte(REG_H_INDEX)); break;
-		case 0xAD: xoran(getRegByte(REG_L_INDEX)); break;
-		case 0xAE: xoran(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-		case 0xEE: xoran(readByteAtPC()); break;
-
-		// OR A n
-		case 0xB7: oran((registersAF_ & 0xFF00) >> 8); break;
-		case 0xB0: oran(getRegByte(REG_B_INDEX)); break;
-		case 0xB1: oran(getRegByte(REG_C_INDEX)); break;
-		case 0xB2: oran(getRegByte(REG_D_INDEX)); break;
-		case 0xB3: oran(getRegByte(REG_E_INDEX)); break;
-		case 0xB4: oran(getRegByte(REG_H_INDEX)); break;
-		case 0xB5: oran(getRegByte(REG_L_INDEX)); break;
-		case 0xB6: oran(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-		case 0xF6: oran(readByteAtPC()); break;
-
-		// AND A n
-		case 0xA7: andan((registersAF_ & 0xFF00) >> 8); break;
-		case 0xA0: andan(getRegByte(REG_B_INDEX)); break;
-		case 0xA1: andan(getRegByte(REG_C_INDEX)); break;
-		case 0xA2: andan(getRegByte(REG_D_INDEX)); break;
-		case 0xA3: andan(getRegByte(REG_E_INDEX)); break;
-		case 0xA4: andan(getRegByte(REG_H_INDEX)); break;
-		case 0xA5: andan(getRegByte(REG_L_INDEX)); break;
-		case 0xA6: andan(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-		case 0xE6: andan(readByteAtPC()); break;
-
-		// JR cc,n
-		case 0x20: 
-		{
-			jrccn(!IS_Z_FLAG_SET(), readSByteAtPC());
-			if (IS_Z_FLAG_SET()) clockCycles -= 4;
-		} break;
-		case 0x28: 
-		{
-			jrccn(IS_Z_FLAG_SET(), readSByteAtPC());
-			if (!IS_Z_FLAG_SET()) clockCycles -= 4;
-		} break;
-		case 0x30:
-		{
-			jrccn(!IS_C_FLAG_SET(), readSByteAtPC());
-			if (IS_C_FLAG_SET()) clockCycles -= 4;
-		} break;
-		case 0x38: 
-		{
-			jrccn(IS_C_FLAG_SET(), readSByteAtPC());
-			if (!IS_C_FLAG_SET()) clockCycles -= 4;
-		} break;
-		
-		// RET CC
-		case 0xC0: 
-		{
-			if (!IS_Z_FLAG_SET()) ret();
-			if (IS_Z_FLAG_SET()) clockCycles -= 12;
-		} break;
-		case 0xC8:
-		{
-			if (IS_Z_FLAG_SET()) ret();
-			if (!IS_Z_FLAG_SET()) clockCycles -= 12;
-		} break;
-		case 0xD0:
-		{
-			if (!IS_C_FLAG_SET()) ret();
-			if (IS_C_FLAG_SET()) clockCycles -= 12;
-		} break;
-		case 0xD8:
-		{
-			if (IS_C_FLAG_SET()) ret();
-			if (!IS_C_FLAG_SET()) clockCycles -= 12;
-		} break;
-			
-		// INC n
-		case 0x3C: inca(); break;
-		case 0x04: incn(REG_B_INDEX); break;
-		case 0x0C: incn(REG_C_INDEX); break;
-		case 0x14: incn(REG_D_INDEX); break;
-		case 0x1C: incn(REG_E_INDEX); break;
-		case 0x24: incn(REG_H_INDEX); break;
-		case 0x2C: incn(REG_L_INDEX); break;
-		case 0x34: inchl(); break;
-
-		// DEC n
-		case 0x3D: deca(); break;
-		case 0x05: decn(REG_B_INDEX); break;
-		case 0x0D: decn(REG_C_INDEX); break;
-		case 0x15: decn(REG_D_INDEX); break;
-		case 0x1D: decn(REG_E_INDEX); break;
-		case 0x25: decn(REG_H_INDEX); break;
-		case 0x2D: decn(REG_L_INDEX); break;
-		case 0x35: dechl(); break;
-
-		// CP A
-		case 0xBF: cpa(getRegAByte()); break;
-		case 0xB8: cpa(getRegByte(REG_B_INDEX)); break;
-		case 0xB9: cpa(getRegByte(REG_C_INDEX)); break;
-		case 0xBA: cpa(getRegByte(REG_D_INDEX)); break;
-		case 0xBB: cpa(getRegByte(REG_E_INDEX)); break;
-		case 0xBC: cpa(getRegByte(REG_H_INDEX)); break;
-		case 0xBD: cpa(getRegByte(REG_L_INDEX)); break;
-		case 0xBE: cpa(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-		case 0xFE: cpa(readByteAtPC()); break;
-
-		// ADD A n
-		case 0x87: addan(getRegAByte()); break;
-		case 0x80: addan(getRegByte(REG_B_INDEX)); break;
-		case 0x81: addan(getRegByte(REG_C_INDEX)); break;
-		case 0x82: addan(getRegByte(REG_D_INDEX)); break;
-		case 0x83: addan(getRegByte(REG_E_INDEX)); break;
-		case 0x84: addan(getRegByte(REG_H_INDEX)); break;
-		case 0x85: addan(getRegByte(REG_L_INDEX)); break;
-		case 0x86: addan(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-		case 0xC6: addan(readByteAtPC()); break;
-
-		// SUB A n
-		case 0x97: suban(getRegAByte()); break;
-		case 0x90: suban(getRegByte(REG_B_INDEX)); break;
-		case 0x91: suban(getRegByte(REG_C_INDEX)); break;
-		case 0x92: suban(getRegByte(REG_D_INDEX)); break;
-		case 0x93: suban(getRegByte(REG_E_INDEX)); break;
-		case 0x94: suban(getRegByte(REG_H_INDEX)); break;
-		case 0x95: suban(getRegByte(REG_L_INDEX)); break;
-		case 0x96: suban(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-		case 0xD6: suban(readByteAtPC()); break;
-
-		// ADD HL, n
-		case 0x09:
-		case 0x19:
-		case 0x29:
-		case 0x39: addhln(getRegWord(((opcode & 0xF0) >> 4) * sizeof(word))); break;
-
-		// INC nn
-		case 0x03: setRegWord(REG_BC_INDEX, getRegWord(REG_BC_INDEX) + 1); break;
-		case 0x13: setRegWord(REG_DE_INDEX, getRegWord(REG_DE_INDEX) + 1); break;
-		case 0x23: setRegWord(REG_HL_INDEX, getRegWord(REG_HL_INDEX) + 1); break;
-		case 0x33: setRegWord(REG_SP_INDEX, getRegWord(REG_SP_INDEX) + 1); break;
-
-		// dec nn
-		case 0x0B:
-		case 0x1B:
-		case 0x2B:
-		case 0x3B:
-		{
-			byte regIndex = ((opcode & 0xF0) >> 4) * 2;
-			word regWord = getRegWord(regIndex);
-			setRegWord(regIndex, regWord - 1);
-		} break;
-
-		// SCF
-		case 0x37:
-		{
-			RESET_H_FLAG();
-			RESET_N_FLAG();
-			SET_C_FLAG();
-		} break;
-
-		// CCF
-		case 0x3F: 
-		{
-			RESET_H_FLAG();
-			RESET_N_FLAG();
-			if (IS_C_FLAG_SET())
-				RESET_C_FLAG();
-			else 
-				SET_C_FLAG();
-		} break;
-
-
-		// ADD SP, n
-		case 0xE8: addspn();  break;
-
-		// LDHL SP, n
-		case 0xF8: ldhlspn(); break;
+	return blockCache_ != nullptr ? executeCachedInstruction() : executeInterpretedInstruction();
+}
 
-		// RLA  (Z cleared)
-		case 0x07: rlca(); break;
+unsigned int CPU::executeInterpretedInstruction()
+{
+#ifdef GOODBOY_GUEST_PROFILER
+	const word pc = registersPC_;
+	const int bank = guestProfiler_ != nullptr ? mem_.getCodeBank(pc) : Memory::UNCACHEABLE_CODE_BANK;
+#endif
 
-		// RLCA (Z cleared)
-		case 0x17: rla(); RESET_Z_FLAG();  break;
+	executedInstructionCount_++;
+	const byte opcode = mem_.fetchOpcodeAt(registersPC_++);
+	const unsigned int clockCycles = OPCODE_HANDLERS[opcode](*this);
 
-		// RRCA (Z cleared)
-		case 0x0F: rrca(); break;
+#ifdef GOODBOY_GUEST_PROFILER
+	// The CB handler fetched its second byte itself, none can have written it
+	if (guestProfiler_ != nullptr)
+		guestProfiler_->recordInstruction(bank, pc, opcode, opcode == 0xCB ? mem_.readByteAt(pc + 1) : 0, clockCycles, registersPC_);
+#endif
 
-		//  RRA (Z cleared)
-		case 0x1F: rra(); RESET_Z_FLAG(); break;
+	if (shouldDumpState_)
+		printState();
+	return clockCycles;
+}
 
-		// DAA
-		case 0x27: daa(); break;
+unsigned int CPU::executeCachedInstruction()
+{
+	const BlockCache::DecodedInstruction* instruction = blockCache_->nextInstruction(registersPC_);
+	if (instruction == nullptr)
+	{
+		if (enterBlock() == nullptr)
+		{
+			return executeInterpretedInstruction();
+		}
+		instruction = blockCache_->nextInstruction(registersPC_);
+	}
 
-		// CPL 
-		case 0x2F: cpl(); break;
+	// The instruction's own writes may invalidate its block, so nothing is read from it
+	// once the handler runs
+	const BlockCache::InstructionHandler handler = instruction->handler;
+#ifdef GOODBOY_GUEST_PROFILER
+	const word pc = registersPC_;
+	const int bank = guestProfiler_ != nullptr ? mem_.getCodeBank(pc) : Memory::UNCACHEABLE_CODE_BANK;
+	const byte opcode = instruction->opcode;
+	const byte cbOpcode = static_cast<byte>(instruction->immediate);
+#endif
+	predecodedImmediate_ = instruction->immediate;
+	registersPC_ += instruction->length;
+
+	executedInstructionCount_++;
+	const unsigned int clockCycles = handler(*this);
+
+#ifdef GOODBOY_GUEST_PROFILER
+	if (guestProfiler_ != nullptr)
+		guestProfiler_->recordInstruction(bank, pc, opcode, cbOpcode, clockCycles, registersPC_);
+#endif
 
-		// DI
-		case 0xF3: eiTriggered_ = false; ime_ = false;  break;
+	if (shouldDumpState_)
+		printState();
+	return clockCycles;
+}
 
-		// EI
-		case 0xFB: eiTriggered_ = true; break;
+BlockCache::Block* CPU::enterBlock()
+{
+	const int bank = mem_.getCodeBank(registersPC_);
+	if (bank == Memory::UNCACHEABLE_CODE_BANK)
+	{
+		return nullptr;
+	}
 
-		// CALL nn
-		case 0xCD:
+	BlockCache::Block* block = blockCache_->enterBlock(registersPC_, bank);
+	if (block == nullptr)
+	{
+		BlockCache::Block decodedBlock = decodeBlock(registersPC_, bank);
+		if (decodedBlock.instructions.empty())
 		{
-			word newAddress = readWordAtPc();
-			callnn(newAddress);
-		} break;
+			return nullptr;
+		}
+		block = &blockCache_->insertBlock(std::move(decodedBlock), registersPC_ >= Memory::WRAM_0_START_ADDRESS);
+	}
 
-		// CALL cc, nn
-		case 0xC4: 
-		{
-			word newAddress = readWordAtPc(); 
-			if (!IS_Z_FLAG_SET()) callnn(newAddress); 
-			else clockCycles -= 12;
-		} break;
-		case 0xCC: 
-		{
-			word newAddress = readWordAtPc();
-			if (IS_Z_FLAG_SET()) callnn(newAddress); 
-			else clockCycles -= 12;
-		} break;
-		case 0xD4: 
-		{
-			word newAddress = readWordAtPc();
-			if (!IS_C_FLAG_SET()) callnn(newAddress); 
-			else clockCycles -= 12;
-		} break;
-		case 0xDC: 
-		{
-			word newAddress = readWordAtPc();
-			if (IS_C_FLAG_SET()) callnn(newAddress); 
-			else clockCycles -= 12;
-		} break;
-
-		// PUSH nn
-		case 0xF5: pushaf(); break;
-		case 0xC5: pushnn(REG_BC_INDEX); break;
-		case 0xD5: pushnn(REG_DE_INDEX); break;
-		case 0xE5: pushnn(REG_HL_INDEX); break;
-		
-		// POP nn
-		case 0xF1: popaf(); break;
-		case 0xC1: popnn(REG_BC_INDEX); break;
-		case 0xD1: popnn(REG_DE_INDEX); break;
-		case 0xE1: popnn(REG_HL_INDEX); break;
-
-		// RET
-		case 0xC9: ret(); break;
-		
-		// RETI
-		case 0xD9: ret(); eiTriggered_ = true; break;
+	if (block->idleLoop.clockCycles != 0)
+	{
+		idleLoop_ = block->idleLoop;
+		idleLoopAddress_ = registersPC_;
+		idleLoopAF_ = registersAF_;
+		idleLoopInstructionCount_ = executedInstructionCount_ + block->idleLoop.instructionCount;
+	}
+	else if (block->bulkLoop.clockCycles != 0)
+	{
+		bulkLoopAddress_ = registersPC_;
+		bulkLoopInstructionCount_ = executedInstructionCount_ + block->bulkLoop.instructionCount;
+	}
 
-		// JR N
-		case 0x18: registersPC_ += readSByteAtPC(); break;
-		
-		// JP nn
-		case 0xC3: registersPC_ = readWordAtPc(); break;
+	return block;
+}
 
-		// JP (hl)
-		case 0xE9: registersPC_ = getRegWord(REG_HL_INDEX); break;
+BlockCache::Block CPU::decodeBlock(const word startAddress, const int bank) const
+{
+	BlockCache::Block block = { startAddress, startAddress, bank, {}, 0, {}, {}, {} };
+	const word regionEnd = Memory::getCodeRegionEnd(startAddress);
 
-		// JP cc, nn
-		case 0xC2: 
-		{
-			jpccn(!IS_Z_FLAG_SET(), readWordAtPc());
-			if (IS_Z_FLAG_SET()) clockCycles -= 4;
-		} break;
-		case 0xCA:
-		{
-			jpccn(IS_Z_FLAG_SET(), readWordAtPc());
-			if (!IS_Z_FLAG_SET()) clockCycles -= 4;
-		} break;
-		case 0xD2:
+	// Conditional branches don't end a block, the taken path just leaves it early
+	word address = startAddress;
+	while (block.instructions.size() < BlockCache::MAX_BLOCK_INSTRUCTION_COUNT)
+	{
+		// Instructions on pages with execute watchpoints are left to the interpreter's fetches
+		if (mem_.isExecuteWatched(address))
 		{
-			jpccn(!IS_C_FLAG_SET(), readWordAtPc());
-			if (IS_C_FLAG_SET()) clockCycles -= 4;
-		} break;
-		case 0xDA: 
+			break;
+		}
+
+		const byte opcode = mem_.readByteAt(address);
+		const byte length = instructionLengths[opcode];
+		if (address + length - 1 > regionEnd)
 		{
-			jpccn(IS_C_FLAG_SET(), readWordAtPc());
-			if (!IS_C_FLAG_SET()) clockCycles -= 4;
-		} break;
+			break;
+		}
 
-		// RST n
-		case 0xC7: callnn(0x00);  break;
-		case 0xCF: callnn(0x08);  break;
-		case 0xD7: callnn(0x10);  break;
-		case 0xDF: callnn(0x18);  break;
-		case 0xE7: callnn(0x20);  break;
-		case 0xEF: callnn(0x28);  break;
-		case 0xF7: callnn(0x30);  break;
-		case 0xFF: callnn(0x38);  break;
-
-		// ADC A n
-		case 0x8F: adcan(getRegAByte()); break;
-		case 0x88: 
-		case 0x89: 
-		case 0x8A: 
-		case 0x8B: 
-		case 0x8C: 
-		case 0x8D: adcan(getRegByte((opcode & 0x0F) - 0x08)); break;
-		case 0x8E: adcan(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;
-		case 0xCE: adcan(readByteAtPC()); break;
-
-		// SBC A n
-		case 0x9F: sbcan(getRegAByte()); break;
-		case 0x98:
-		case 0x99:
-		case 0x9A:
-		case 0x9B:
-		case 0x9C:
-		case 0x9D: sbcan(getRegByte((opcode & 0x0F) - 0x08)); break;
-		case 0x9E: sbcan(mem_.readByteAt(getRegWord(REG_HL_INDEX))); break;		
-		case 0xDE: sbcan(readByteAtPC()); break;
-
-		// HALT
-		case 0x76: isHalted_ = true; break;
-
-		// CB
-		case 0xCB:
+		BlockCache::DecodedInstruction instruction = { PREDECODED_OPCODE_HANDLERS[opcode], 0, length, opcode };
+		if (opcode == 0xCB)
 		{
-			byte cbOpcode = readByteAtPC();
-			clockCycles = cbInstructionClockCycles[cbOpcode];
+			instruction.immediate = mem_.readByteAt(address + 1);
+			instruction.handler = CB_OPCODE_HANDLERS[instruction.immediate];
+		}
+		else if (length == 2)
+			instruction.immediate = mem_.readByteAt(address + 1);
+		else if (length == 3)
+			instruction.immediate = mem_.readWordAt(address + 1);
 
-			switch (cbOpcode)
-			{
-				// RLC n
-				case 0x07: cbrlca(); break;
-				case 0x00:
-				case 0x01:
-				case 0x02:
-				case 0x03:
-				case 0x04:
-				case 0x05: cbrlcn(cbOpcode & 0x0F); break;
-				case 0x06: cbrlchl(); break;
-
-				// RRC n
-				case 0x0F: cbrrca(); break;
-				case 0x08: 
-				case 0x09:
-				case 0x0A:
-				case 0x0B:
-				case 0x0C:
-				case 0x0D: cbrrcn((cbOpcode & 0x0F) - 0x08); break;
-				case 0x0E: cbrrchl(); break;
-
-				// RL n
-				case 0x17: rla(); break;
-				case 0x10:
-				case 0x11:
-				case 0x12:
-				case 0x13:
-				case 0x14:
-				case 0x15: rln(cbOpcode & 0x0F); break;
-				case 0x16: rlhl(); break;
-
-				// RR n
-				case 0x1F: rra(); break;
-				case 0x18:
-				case 0x19:
-				case 0x1A:
-				case 0x1B:
-				case 0x1C:
-				case 0x1D: rrn((cbOpcode & 0x0F) - 0x08); break;
-				case 0x1E: rrhl(); break;
-				
-				// SL n
-				case 0x27: sla(); break;
-				case 0x20: 
-				case 0x21: 
-				case 0x22: 
-				case 0x23: 
-				case 0x24: 
-				case 0x25: sln(cbOpcode & 0x0F); break;
-				case 0x26: slhl(); break;
-				
-				// SR n
-				case 0x2F: sra(); break;
-				case 0x28:
-				case 0x29:
-				case 0x2A:
-				case 0x2B:
-				case 0x2C:
-				case 0x2D: srn((cbOpcode & 0x0F) - 0x08); break;
-				case 0x2E: srhl(); break;
-
-				// SRL n
-				case 0x3F: srla(); break;
-				case 0x38:
-				case 0x39:
-				case 0x3A:
-				case 0x3B:
-				case 0x3C:
-				case 0x3D: srln((cbOpcode & 0x0F) - 0x8); break;
-				case 0x3E: srlhl(); break;
-
-				// SWAP n
-				case 0x37: swapa(); break;
-				case 0x30: case 0x31: case 0x32: case 0x33: case 0x34: case 0x35: swapn(cbOpcode & 0x0F); break;
-				case 0x36: swaphl(); break;
-
-				// BIT b,r
-				case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47: case 0x48: case 0x49: case 0x4A: case 0x4B: case 0x4C: case 0x4D: case 0x4E: case 0x4F:
-				case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57: case 0x58: case 0x59: case 0x5A: case 0x5B: case 0x5C: case 0x5D: case 0x5E: case 0x5F:
-				case 0x60: case 0x61: case 0x62: case 0x63: case 0x64: case 0x65: case 0x66: case 0x67: case 0x68: case 0x69: case 0x6A: case 0x6B: case 0x6C: case 0x6D: case 0x6E: case 0x6F:
-				case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77: case 0x78: case 0x79: case 0x7A: case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F:
-				{
-					byte bit = (cbOpcode >> 3) & 0x07;
-					byte reg = cbOpcode % 0x8;
-
-					if (reg == 0x6)
-						testBit(bit, mem_.readByteAt(getRegWord(REG_HL_INDEX)));
-					else if (reg == 0x7)
-						testBit(bit, getRegAByte());
-					else
-						testBit(bit, getRegByte(reg));
-				} break;
-
-				
-				// RES b,r
-				case 0x80: case 0x81: case 0x82: case 0x83: case 0x84: case 0x85: case 0x86: case 0x87: case 0x88: case 0x89: case 0x8A: case 0x8B: case 0x8C: case 0x8D: case 0x8E: case 0x8F:
-				case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97: case 0x98: case 0x99: case 0x9A: case 0x9B: case 0x9C: case 0x9D: case 0x9E: case 0x9F:
-				case 0xA0: case 0xA1: case 0xA2: case 0xA3: case 0xA4: case 0xA5: case 0xA6: case 0xA7: case 0xA8: case 0xA9: case 0xAA: case 0xAB: case 0xAC: case 0xAD: case 0xAE: case 0xAF:
-				case 0xB0: case 0xB1: case 0xB2: case 0xB3: case 0xB4: case 0xB5: case 0xB6: case 0xB7: case 0xB8: case 0xB9: case 0xBA: case 0xBB: case 0xBC: case 0xBD: case 0xBE: case 0xBF:
-				{
-					byte bit = (cbOpcode >> 3) & 0x07;
-					byte reg = cbOpcode % 0x8;
-
-					if (reg == 0x6)
-					{
-						byte val = mem_.readByteAt(getRegWord(REG_HL_INDEX));
-						resetBit(bit, val);
-						mem_.writeByteAt(getRegWord(REG_HL_INDEX), val);
-					}
-					else if (reg == 0x7)
-					{
-						byte val = getRegAByte();
-						resetBit(bit, val);
-						setRegAByte(val);
-					}
-					else
-					{
-						byte val = getRegByte(reg);
-						resetBit(bit, val);
-						setRegByte(reg, val);
-					}
-				} break;
-
-				// SET b,r
-				case 0xC0: case 0xC1: case 0xC2: case 0xC3: case 0xC4: case 0xC5: case 0xC6: case 0xC7: case 0xC8: case 0xC9: case 0xCA: case 0xCB: case 0xCC: case 0xCD: case 0xCE: case 0xCF:
-				case 0xD0: case 0xD1: case 0xD2: case 0xD3: case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8: case 0xD9: case 0xDA: case 0xDB: case 0xDC: case 0xDD: case 0xDE: case 0xDF:
-				case 0xE0: case 0xE1: case 0xE2: case 0xE3: case 0xE4: case 0xE5: case 0xE6: case 0xE7: case 0xE8: case 0xE9: case 0xEA: case 0xEB: case 0xEC: case 0xED: case 0xEE: case 0xEF:
-				case 0xF0: case 0xF1: case 0xF2: case 0xF3: case 0xF4: case 0xF5: case 0xF6: case 0xF7: case 0xF8: case 0xF9: case 0xFA: case 0xFB: case 0xFC: case 0xFD: case 0xFE: case 0xFF:
-				{
-					byte bit = (cbOpcode >> 3) & 0x07;					
-					byte reg = cbOpcode % 0x8;
-
-					if (reg == 0x6)
-					{
-						byte val = mem_.readByteAt(getRegWord(REG_HL_INDEX));
-						setBit(bit, val);
-						mem_.writeByteAt(getRegWord(REG_HL_INDEX), val);
-					}
-					else if (reg == 0x7)
-					{
-						byte val = getRegAByte();
-						setBit(bit, val);
-						setRegAByte(val);
-					}
-					else
-					{
-						byte val = getRegByte(reg);
-						setBit(bit, val);
-						setRegByte(reg, val);
-					}
-				} break;
-
-				default:
-					std::stringstream unhandledOpcode;
-					unhandledOpcode << "Unhandled opcode: " << getHexByte(opcode) << " " << getHexByte(cbOpcode) << "\n";
-					log(LogType::ERROR, unhandledOpcode.str().c_str());
-			}
-		} break;
+		block.instructions.push_back(instruction);
+		address += length;
+		block.endAddress = address;
 
-		default:
-			std::stringstream unhandledOpcode; 
-			unhandledOpcode << "Unhandled opcode: " << getHexByte(opcode) << "\n";
-			log(LogType::ERROR, unhandledOpcode.str().c_str());
+		if (endsBlock(opcode) || address > regionEnd)
+		{
+			break;
+		}
 	}
 
-	if (shouldDumpState_)
-		printState();
-	return clockCycles;
+	block.idleLoop = findIdleLoop(block);
+	block.bulkLoop = findBulkLoop(block);
+	return block;
 }
 
-void CPU::addhln(const word w)
+void CPU::setExecutionMode(ExecutionMode mode)
 {
-	word hlW = getRegWord(REG_HL_INDEX);
-	word bot12hl = hlW & 0xFFF;
-	word bot12w  = w & 0xFFF;
-
-	unsigned int halfCarryTest = bot12hl + bot12w;
-	if (halfCarryTest > 0xFFF)
-		SET_H_FLAG();
-	else
-		RESET_H_FLAG();
+	if (mode == ExecutionMode::JIT && !initializeJit())
+	{
+		log(LogType::WARNING, "The JIT is not available on this host, using the cached interpreter instead");
+		mode = ExecutionMode::CACHED_INTERPRETER;
+	}
 
-	unsigned int fullCarryTest = hlW + w;
-	if (fullCarryTest > 0xFFFF)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
+	if (mode != ExecutionMode::INTERPRETER && blockCache_ == nullptr)
+	{
+		blockCache_ = std::make_unique<BlockCache>();
+	}
+	else if (mode == ExecutionMode::INTERPRETER)
+	{
+		blockCache_.reset();
+	}
 
-	RESET_N_FLAG();
+	if (mode != ExecutionMode::JIT && jit_ != nullptr)
+	{
+		// Blocks outlive the JIT in the cached interpreter, their entry points don't
+		if (blockCache_ != nullptr)
+		{
+			blockCache_->clearCompiledCode();
+		}
+		jit_.reset();
+	}
 
-	setRegWord(REG_HL_INDEX,fullCarryTest & 0xFFFF);
+	executionMode_ = mode;
+	mem_.setBlockCache(blockCache_.get());
 }
 
-void CPU::testBit(const byte bit, const byte val)
+void CPU::invalidateCachedRamCode()
 {
-	if (((val >> bit) & 0x1) != 0x1) 
-		SET_Z_FLAG();
-	else                 
-		RESET_Z_FLAG();
-	
-	RESET_N_FLAG();
-	SET_H_FLAG();
+	idleLoopInstructionCount_ = NO_IDLE_LOOP;
+	bulkLoopInstructionCount_ = NO_BULK_LOOP;
+	if (blockCache_ != nullptr)
+	{
+		blockCache_->invalidateRamBlocks();
+	}
 }
 
-void CPU::setBit(const byte bit, byte& val)
+void CPU::clearCachedCode()
 {
-	val |= (1 << bit);
-}
+	idleLoopInstructionCount_ = NO_IDLE_LOOP;
+	bulkLoopInstructionCount_ = NO_BULK_LOOP;
+	if (blockCache_ != nullptr)
+	{
+		blockCache_->clear();
+	}
 
-void CPU::resetBit(const byte bit, byte& val)
-{
-	val &= (~(1 << bit));
+	if (jit_ != nullptr)
+	{
+		jit_->rewind(compiledBlocksStart_);
+	}
 }
 
-void CPU::jrccn(const byte cond, const sbyte offset)
+// Compiled code keeps the CPU in RBX, the cycle limit in R12D, the cycles and instructions
+// run so far in R13D and R14D and the CompiledRun being filled in in R15. All of them are
+// callee-saved, so calls into opcode handlers leave them alone.
+using Register = X64Emitter::Register;
+using AluOperation = X64Emitter::AluOperation;
+using Condition = X64Emitter::Condition;
+
+static constexpr Register JIT_CPU_REGISTER          = Register::RBX;
+static constexpr Register JIT_CYCLE_LIMIT_REGISTER  = Register::R12;
+static constexpr Register JIT_CYCLES_REGISTER       = Register::R13;
+static constexpr Register JIT_INSTRUCTIONS_REGISTER = Register::R14;
+static constexpr Register JIT_RUN_REGISTER          = Register::R15;
+
+static constexpr Register JIT_SAVED_REGISTERS[] = { JIT_CPU_REGISTER, JIT_CYCLE_LIMIT_REGISTER, JIT_CYCLES_REGISTER, JIT_INSTRUCTIONS_REGISTER, JIT_RUN_REGISTER };
+
+#if defined(_WIN32)
+static constexpr Register JIT_ARGUMENT_REGISTERS[] = { Register::RCX, Register::RDX, Register::R8, Register::R9 };
+static constexpr byte JIT_SHADOW_SPACE_SIZE = 32;
+#else
+static constexpr Register JIT_ARGUMENT_REGISTERS[] = { Register::RDI, Register::RSI, Register::RDX, Register::RCX };
+static constexpr byte JIT_SHADOW_SPACE_SIZE = 0;
+#endif
+
+static constexpr std::size_t JIT_CODE_CAPACITY = 4 * 1024 * 1024;
+static constexpr std::size_t MAX_COMPILED_BLOCK_SIZE = 32 * 1024;
+
+// The x86 operations setting Z, H and C exactly like the SM83 ones, in opcode order. H
+// is the x86 auxiliary carry. The logical ones leave it undefined and get their flags
+// computed separately.
+static constexpr AluOperation X64_ALU_OPERATIONS[8] =
 {
-	if (cond) registersPC_ += offset;
-}
+	AluOperation::ADD, AluOperation::ADC, AluOperation::SUB, AluOperation::SBB,
+	AluOperation::AND, AluOperation::XOR, AluOperation::OR, AluOperation::CMP
+};
 
-void CPU::jpccn(const byte cond, const word address)
+struct CompiledRun
 {
-	if (cond) registersPC_ = address;
-}
+	uint32_t clockCycles;
+	uint32_t lastInstructionClockCycles;
+	uint32_t instructionCount;
+	uint32_t nextInstructionIndex; // in the block the run started in, past its end once it left
+};
 
-void CPU::xoran(const byte n)
+// Translates a block into x86-64 code with an entry point per compilable instruction: the
+// ones that touch nothing but CPU registers. Those run natively or, where the flags are
+// awkward, through their opcode handler. Guest registers stay in the CPU object, so each
+// instruction loads and stores what it uses and handlers always see a consistent state.
+//
+// After every instruction the cycles are checked against the limit. Execution leaves
+// through an exit stub, which stores the PC and where to resume, once the limit is
+// reached, control leaves the block or the next instruction isn't compiled. The latter
+// covers every memory access (which may sync components and raise interrupts) and every
+// instruction changing IME or halting, so compiled code never runs past an I/O access or
+// a point where an interrupt could be taken.
+class BlockCompiler final
 {
-	byte val = getRegAByte();
-	byte res = val ^ n;
-	
-	RESET_Z_FLAG();
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-	RESET_C_FLAG();
+public:
+	BlockCompiler(X64Emitter& emitter, const CPU& cpu, const BlockCache::Block& block, const byte* exitCode);
 
-	if (res == 0) SET_Z_FLAG();
-	setRegAByte(res);
-}
+	std::vector<const byte*> compile();
 
-void CPU::oran(const byte n)
-{
-	byte val = getRegAByte();
-	byte res = val | n;
+private:
+	static constexpr uint32_t LEFT_BLOCK = UINT32_MAX;
 
-	RESET_Z_FLAG();
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-	RESET_C_FLAG();
-
-	if (res == 0) SET_Z_FLAG();
-	setRegAByte(res);
-}
-
-void CPU::andan(const byte n)
-{
-	byte val = getRegAByte();
-	byte res = val & n;
+	struct PendingJump
+	{
+		X64Emitter::Fixup fixup;
+		std::size_t instructionIndex;
+	};
 
-	RESET_Z_FLAG();
-	RESET_N_FLAG();
-	SET_H_FLAG();
-	RESET_C_FLAG();
+	struct PendingExit
+	{
+		X64Emitter::Fixup fixup;
+		word address;
+		uint32_t instructionIndex;
+		uint32_t lastInstructionClockCycles;
+	};
+
+	static bool isCompilable(const BlockCache::DecodedInstruction& instruction);
+
+	void emitInstruction(const BlockCache::DecodedInstruction& instruction);
+	void emitContinuation(const word address, const unsigned int clockCycles, const bool fallsThrough);
+	void emitConditionalBranch(const byte condition, const word address, const unsigned int clockCycles);
+	void emitAluOperation(const byte operation, const byte operand, const byte immediate);
+	void emitIncDec(const byte operand, const bool decrement);
+	void emitCollectFlags(const bool withCarry);
+	void emitMergeFlags(const byte keptFlags, const byte setFlags);
+	void emitHandlerCall(const BlockCache::InstructionHandler handler);
+
+	std::size_t findInstruction(const word address) const;
+	int32_t getOperandDisplacement(const byte operand) const;
+
+private:
+	X64Emitter& emitter_;
+	const BlockCache::Block& block_;
+	const byte* exitCode_;
+	std::vector<word> addresses_; // of every instruction and the block's end
+	std::vector<bool> compilable_;
+	std::vector<PendingJump> jumps_;
+	std::vector<PendingExit> exits_;
+	std::size_t currentIndex_;
+	int32_t registerADisplacement_;
+	int32_t registerFDisplacement_;
+	int32_t registersDisplacement_;
+	int32_t registerPCDisplacement_;
+};
 
-	if (res == 0) SET_Z_FLAG();
-	setRegAByte(res);
+BlockCompiler::BlockCompiler(X64Emitter& emitter, const CPU& cpu, const BlockCache::Block& block, const byte* exitCode)
+	: emitter_(emitter)
+	, block_(block)
+	, exitCode_(exitCode)
+	, currentIndex_(0)
+{
+	// Guest registers are addressed relative to the CPU. AF is a host word, so on the
+	// little-endian x86 F is its first byte and A its second.
+	const auto stateDisplacement = static_cast<int32_t>(reinterpret_cast<const byte*>(&static_cast<const CPUState&>(cpu)) - reinterpret_cast<const byte*>(&cpu));
+	registerADisplacement_ = stateDisplacement + offsetof(CPUState, registersAF_) + 1;
+	registerFDisplacement_ = stateDisplacement + offsetof(CPUState, registersAF_);
+	registersDisplacement_ = stateDisplacement + offsetof(CPUState, generalPurposeRegisters_);
+	registerPCDisplacement_ = stateDisplacement + offsetof(CPUState, registersPC_);
+
+	word address = block.startAddress;
+	for (const auto& instruction : block.instructions)
+	{
+		addresses_.push_back(address);
+		compilable_.push_back(isCompilable(instruction));
+		address += instruction.length;
+	}
+	addresses_.push_back(address);
 }
 
-void CPU::incn(const byte regIndex)
+std::vector<const byte*> BlockCompiler::compile()
 {
-	byte regVal = getRegByte(regIndex);
-	bool isBit3SetBefore = (regVal & 0x08) == 0x08;
-	regVal++;
-	bool isBit3SetAfter = (regVal & 0x08) == 0x08;
+	const byte* start = emitter_.getCursor();
 
-	if (regVal == 0x0)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-	
-	RESET_N_FLAG();
+	std::vector<const byte*> entryPoints(block_.instructions.size(), nullptr);
+	for (currentIndex_ = 0; currentIndex_ < block_.instructions.size(); ++currentIndex_)
+	{
+		if (compilable_[currentIndex_])
+		{
+			entryPoints[currentIndex_] = emitter_.getCursor();
+			emitInstruction(block_.instructions[currentIndex_]);
+		}
+	}
 
-	if (isBit3SetBefore && !isBit3SetAfter)
-		SET_H_FLAG();
-	else
-		RESET_H_FLAG();
+	for (const auto& jump : jumps_)
+	{
+		emitter_.bind(jump.fixup, entryPoints[jump.instructionIndex]);
+	}
+
+	for (const auto& exit : exits_)
+	{
+		emitter_.bind(exit.fixup, emitter_.getCursor());
+		emitter_.storeWordImmediate(JIT_CPU_REGISTER, registerPCDisplacement_, exit.address);
+		emitter_.storeDwordImmediate(JIT_RUN_REGISTER, offsetof(CompiledRun, nextInstructionIndex), exit.instructionIndex);
+		emitter_.storeDwordImmediate(JIT_RUN_REGISTER, offsetof(CompiledRun, lastInstructionClockCycles), exit.lastInstructionClockCycles);
+		emitter_.jmp(exitCode_);
+	}
 
-	setRegByte(regIndex, regVal);
+	assert(static_cast<std::size_t>(emitter_.getCursor() - start) <= MAX_COMPILED_BLOCK_SIZE);
+	(void)start;
+	return entryPoints;
 }
 
-void CPU::decn(const byte regIndex)
+bool BlockCompiler::isCompilable(const BlockCache::DecodedInstruction& instruction)
 {
-	byte val = getRegByte(regIndex);
-	byte calc = (val -1);
-
-	SET_N_FLAG();
-	
-	if (calc == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+	const byte opcode = instruction.opcode;
+	const byte x = opcode >> 6;
+	const byte y = (opcode >> 3) & 0x07;
+	const byte z = opcode & 0x07;
 
-	if (((calc ^ 0x01 ^ val) & 0x10) == 0x10)
-		SET_H_FLAG();
-	else
-		RESET_H_FLAG();
+	if (opcode == 0xCB)
+	{
+		return (instruction.immediate & 0x07) != CPU::OPERAND_HL_INDIRECT;
+	}
 
-	setRegByte(regIndex, calc);
+	switch (x)
+	{
+		case 0:
+			switch (z)
+			{
+				case 0: return y == 0 || y >= 3;                      // NOP, JR n, JR cc,n
+				case 2: return false;                                 // loads and stores through BC, DE and HL
+				case 4: case 5: case 6: return y != CPU::OPERAND_HL_INDIRECT;
+				default: return true;
+			}
+		case 1: return y != CPU::OPERAND_HL_INDIRECT && z != CPU::OPERAND_HL_INDIRECT;
+		case 2: return z != CPU::OPERAND_HL_INDIRECT;
+		default:
+			// ALU A,n, JP nn, JP cc,nn and LD SP,HL
+			return z == 6 || opcode == 0xC3 || (z == 2 && y < 4) || opcode == 0xF9;
+	}
 }
 
-void CPU::cpa(const byte val)
+void BlockCompiler::emitInstruction(const BlockCache::DecodedInstruction& instruction)
 {
-	byte aVal = getRegAByte();
-	byte calc = (aVal - val);
-
-	SET_N_FLAG();
+	const byte opcode = instruction.opcode;
+	const byte x = opcode >> 6;
+	const byte y = (opcode >> 3) & 0x07;
+	const byte z = opcode & 0x07;
+	const byte p = y >> 1;
+	const byte q = y & 0x01;
+	const word nextAddress = addresses_[currentIndex_ + 1];
+	const int32_t wordRegisterDisplacement = registersDisplacement_ + p * sizeof(word);
 
-	if (calc == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+	if (opcode == 0xCB)
+	{
+		emitHandlerCall(instruction.handler);
+		emitContinuation(nextAddress, cbInstructionClockCycles[instruction.immediate], true);
+		return;
+	}
 
-	if ((aVal & 0x0F) < (val & 0x0F))
-		SET_H_FLAG();
+	const unsigned int clockCycles = coreInstructionClockCycles[opcode];
+	if (x == 0)
+	{
+		if (z == 0 && y == 3)
+		{
+			// JR n
+			emitContinuation(nextAddress + static_cast<sbyte>(instruction.immediate), clockCycles, false);
+			return;
+		}
+		else if (z == 0 && y >= 4)
+		{
+			// JR cc,n
+			emitConditionalBranch(y - 4, nextAddress + static_cast<sbyte>(instruction.immediate), clockCycles);
+			return;
+		}
+		else if (z == 1 && q == 0)
+		{
+			// LD nn,n: registers are stored high byte first
+			emitter_.storeWordImmediate(JIT_CPU_REGISTER, wordRegisterDisplacement, static_cast<word>(instruction.immediate << 8 | instruction.immediate >> 8));
+		}
+		else if (z == 3)
+		{
+			// INC nn / DEC nn
+			emitter_.movzxWord(Register::RAX, JIT_CPU_REGISTER, wordRegisterDisplacement);
+			emitter_.rolWord(Register::RAX, 8);
+			if (q == 0)
+				emitter_.incWord(Register::RAX);
+			else
+				emitter_.decWord(Register::RAX);
+			emitter_.rolWord(Register::RAX, 8);
+			emitter_.storeWord(JIT_CPU_REGISTER, wordRegisterDisplacement, Register::RAX);
+		}
+		else if (z == 4 || z == 5)
+		{
+			emitIncDec(y, z == 5);
+		}
+		else if (z == 6)
+		{
+			// LD r,n
+			emitter_.storeByteImmediate(JIT_CPU_REGISTER, getOperandDisplacement(y), static_cast<byte>(instruction.immediate));
+		}
+		else if (z != 0)
+		{
+			// ADD HL,n, the rotations on A, DAA, CPL, SCF and CCF
+			emitHandlerCall(instruction.handler);
+		}
+	}
+	else if (x == 1)
+	{
+		// LD r1,r2
+		emitter_.movzxByte(Register::RAX, JIT_CPU_REGISTER, getOperandDisplacement(z));
+		emitter_.storeByte(JIT_CPU_REGISTER, getOperandDisplacement(y), Register::RAX);
+	}
+	else if (x == 2)
+	{
+		emitAluOperation(y, z, 0);
+	}
+	else if (z == 6)
+	{
+		emitAluOperation(y, CPU::OPERAND_HL_INDIRECT, static_cast<byte>(instruction.immediate));
+	}
+	else if (opcode == 0xF9)
+	{
+		// LD SP,HL
+		emitter_.movzxWord(Register::RAX, JIT_CPU_REGISTER, registersDisplacement_ + CPU::REG_HL_INDEX);
+		emitter_.storeWord(JIT_CPU_REGISTER, registersDisplacement_ + CPU::REG_SP_INDEX, Register::RAX);
+	}
+	else if (opcode == 0xC3)
+	{
+		// JP nn
+		emitContinuation(instruction.immediate, clockCycles, false);
+		return;
+	}
 	else
-		RESET_H_FLAG();
+	{
+		// JP cc,nn
+		emitConditionalBranch(y, instruction.immediate, clockCycles);
+		return;
+	}
 
-	if (aVal < val)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
+	emitContinuation(nextAddress, clockCycles, true);
 }
 
-void CPU::rln(const byte regIndex)
+void BlockCompiler::emitContinuation(const word address, const unsigned int clockCycles, const bool fallsThrough)
 {
-	byte val = getRegByte(regIndex);
-	
-	bool oldCFlag = IS_C_FLAG_SET();
-
-	if (val >> 7 == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
-	
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val <<= 1;
+	emitter_.aluDwordImmediate(AluOperation::ADD, JIT_CYCLES_REGISTER, clockCycles);
+	emitter_.incDword(JIT_INSTRUCTIONS_REGISTER);
 
-	if (oldCFlag) val |= 0x1;
-
-	if (val == 0x0) SET_Z_FLAG();
-	else RESET_Z_FLAG();
+	const std::size_t targetIndex = findInstruction(address);
+	if (targetIndex < block_.instructions.size() && compilable_[targetIndex])
+	{
+		emitter_.aluDword(AluOperation::CMP, JIT_CYCLES_REGISTER, JIT_CYCLE_LIMIT_REGISTER);
+		if (fallsThrough)
+		{
+			// The next instruction's code follows right after this one's
+			assert(targetIndex == currentIndex_ + 1);
+			exits_.push_back({ emitter_.jcc(Condition::AE), address, static_cast<uint32_t>(targetIndex), clockCycles });
+			return;
+		}
+		jumps_.push_back({ emitter_.jcc(Condition::B), targetIndex });
+	}
 
-	setRegByte(regIndex, val);
+	const uint32_t resumeIndex = targetIndex <= block_.instructions.size() ? static_cast<uint32_t>(targetIndex) : LEFT_BLOCK;
+	exits_.push_back({ emitter_.jmp(), address, resumeIndex, clockCycles });
 }
 
-void CPU::rrn(const byte regIndex)
+void BlockCompiler::emitConditionalBranch(const byte condition, const word address, const unsigned int clockCycles)
 {
-	byte val = getRegByte(regIndex);
-
-	bool oldCFlag = IS_C_FLAG_SET();
-
-	if ((val & 0x01) == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val >>= 1;
+	// NZ and NC hold when the flag is clear, which is when TEST sets ZF
+	emitter_.testByteImmediate(JIT_CPU_REGISTER, registerFDisplacement_, condition == CPU::CONDITION_NZ || condition == CPU::CONDITION_Z ? 0x80 : 0x10);
+	const X64Emitter::Fixup notTaken = emitter_.jcc(condition == CPU::CONDITION_NZ || condition == CPU::CONDITION_NC ? Condition::NE : Condition::E);
 
-	if (oldCFlag) val |= 0x80;
+	emitContinuation(address, clockCycles, false);
 
-	if (val == 0x0) SET_Z_FLAG();
-	else RESET_Z_FLAG();
-
-	setRegByte(regIndex, val);
+	emitter_.bind(notTaken, emitter_.getCursor());
+	emitContinuation(addresses_[currentIndex_ + 1], clockCycles - 4, true);
 }
 
-void CPU::sln(const byte regIndex)
+// operand is a register field, or OPERAND_HL_INDIRECT standing in for the immediate
+void BlockCompiler::emitAluOperation(const byte operation, const byte operand, const byte immediate)
 {
-	byte val = getRegByte(regIndex);
-
-	if ((val >> 7) == 0x1)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val <<= 1;
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	setRegByte(regIndex, val);
-}
+	const AluOperation aluOperation = X64_ALU_OPERATIONS[operation];
 
+	emitter_.movzxByte(Register::RAX, JIT_CPU_REGISTER, registerADisplacement_);
+	if (operand != CPU::OPERAND_HL_INDIRECT)
+	{
+		emitter_.movzxByte(Register::RCX, JIT_CPU_REGISTER, getOperandDisplacement(operand));
+	}
 
-void CPU::srn(const byte regIndex)
-{
-	byte val = getRegByte(regIndex);
+	if (aluOperation == AluOperation::ADC || aluOperation == AluOperation::SBB)
+	{
+		// The guest carry into the host one
+		emitter_.movzxByte(Register::RDX, JIT_CPU_REGISTER, registerFDisplacement_);
+		emitter_.btDword(Register::RDX, 4);
+	}
 
-	if ((val & 0x1) == 0x1)
-		SET_C_FLAG();
+	if (operand != CPU::OPERAND_HL_INDIRECT)
+		emitter_.aluByte(aluOperation, Register::RAX, Register::RCX);
 	else
-		RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
+		emitter_.aluByteImmediate(aluOperation, Register::RAX, immediate);
 
-	val = (val >> 1) | ( val & 0x80);
-	if (val == 0x00)
-		SET_Z_FLAG();
+	if (aluOperation == AluOperation::AND || aluOperation == AluOperation::XOR || aluOperation == AluOperation::OR)
+	{
+		// Only Z depends on the result: EDX = result == 0 ? 0x80 : 0
+		emitter_.aluByteImmediate(AluOperation::CMP, Register::RAX, 1);
+		emitter_.aluDword(AluOperation::SBB, Register::RDX, Register::RDX);
+		emitter_.aluDwordImmediate(AluOperation::AND, Register::RDX, 0x80);
+		emitMergeFlags(0x0F, aluOperation == AluOperation::AND ? 0x20 : 0x00);
+	}
 	else
-		RESET_Z_FLAG();
+	{
+		const bool subtracts = aluOperation == AluOperation::SUB || aluOperation == AluOperation::SBB || aluOperation == AluOperation::CMP;
+		emitCollectFlags(true);
+		emitMergeFlags(0x0F, subtracts ? 0x40 : 0x00);
+	}
 
-	setRegByte(regIndex, val);
+	if (aluOperation != AluOperation::CMP)
+	{
+		emitter_.storeByte(JIT_CPU_REGISTER, registerADisplacement_, Register::RAX);
+	}
 }
 
-void CPU::srln(const byte regIndex)
+void BlockCompiler::emitIncDec(const byte operand, const bool decrement)
 {
-	byte val = getRegByte(regIndex);
-
-	if ((val & 0x1) == 0x1)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val >>= 1;
-	if (val == 0x00)
-		SET_Z_FLAG();
+	const int32_t displacement = getOperandDisplacement(operand);
+	emitter_.movzxByte(Register::RAX, JIT_CPU_REGISTER, displacement);
+	if (decrement)
+		emitter_.decByte(Register::RAX);
 	else
-		RESET_Z_FLAG();
+		emitter_.incByte(Register::RAX);
 
-	setRegByte(regIndex, val);
+	// C is left as it was
+	emitCollectFlags(false);
+	emitMergeFlags(0x1F, decrement ? 0x40 : 0x00);
+	emitter_.storeByte(JIT_CPU_REGISTER, displacement, Register::RAX);
 }
 
-void CPU::addspn()
+// Moves ZF, AF and (withCarry) CF into EDX as Z, H and C. Clobbers ECX.
+void BlockCompiler::emitCollectFlags(const bool withCarry)
 {
-	word spVal = getRegWord(REG_SP_INDEX);
-	sbyte val = readSByteAtPC();
-	word result = (spVal + val);
-
-	RESET_Z_FLAG();
-	RESET_N_FLAG();
-
-	if ((result & 0xF) < (spVal & 0xF)) SET_H_FLAG();
-	else RESET_H_FLAG();
-
-	if ((result & 0xFF) < (spVal & 0xFF)) SET_C_FLAG();
-	else RESET_C_FLAG();
+	emitter_.pushFlags();
+	emitter_.pop(Register::RDX);
+	if (withCarry)
+	{
+		emitter_.movDword(Register::RCX, Register::RDX);
+		emitter_.aluDwordImmediate(AluOperation::AND, Register::RCX, 0x01);
+		emitter_.shlDword(Register::RCX, 4);
+	}
 
-	setRegWord(REG_SP_INDEX, result);
+	// ZF is bit 6 and AF bit 4, one below Z and H
+	emitter_.aluDwordImmediate(AluOperation::AND, Register::RDX, 0x50);
+	emitter_.aluDword(AluOperation::ADD, Register::RDX, Register::RDX);
+	if (withCarry)
+	{
+		emitter_.aluDword(AluOperation::OR, Register::RDX, Register::RCX);
+	}
 }
 
-void CPU::ldhlspn()
+// F = (F & keptFlags) | EDX | setFlags. Clobbers ECX.
+void BlockCompiler::emitMergeFlags(const byte keptFlags, const byte setFlags)
 {
-	word spVal = getRegWord(REG_SP_INDEX);
-	sbyte val = readSByteAtPC();
-	word result = spVal + val;
-	word check = spVal ^ val ^ ((spVal + val) & 0xFFFF);
-
-	if ((check & 0x100) == 0x100) SET_C_FLAG();
-	else RESET_C_FLAG();
-
-	if ((check & 0x10) == 0x10) SET_H_FLAG();
-	else RESET_H_FLAG();
-		
-	RESET_Z_FLAG();
-	RESET_N_FLAG();
+	emitter_.movzxByte(Register::RCX, JIT_CPU_REGISTER, registerFDisplacement_);
+	emitter_.aluDwordImmediate(AluOperation::AND, Register::RCX, keptFlags);
+	emitter_.aluDword(AluOperation::OR, Register::RCX, Register::RDX);
+	if (setFlags != 0)
+	{
+		emitter_.aluDwordImmediate(AluOperation::OR, Register::RCX, setFlags);
+	}
+	emitter_.storeByte(JIT_CPU_REGISTER, registerFDisplacement_, Register::RCX);
+}
 
+void BlockCompiler::emitHandlerCall(const BlockCache::InstructionHandler handler)
+{
+	// Its cycle count is known already, the return value is ignored
+	emitter_.movQword(JIT_ARGUMENT_REGISTERS[0], JIT_CPU_REGISTER);
+	emitter_.movQwordImmediate(Register::RAX, reinterpret_cast<uint64_t>(handler));
+	emitter_.call(Register::RAX);
+}
 
-	setRegWord(REG_HL_INDEX, result);
+// The index of the instruction at address, the instruction count for the block's end and
+// an index past that if address is neither
+std::size_t BlockCompiler::findInstruction(const word address) const
+{
+	for (std::size_t i = 0; i < addresses_.size(); ++i)
+	{
+		if (addresses_[i] == address)
+		{
+			return i;
+		}
+	}
+	return addresses_.size();
 }
 
-void CPU::rla()
+int32_t BlockCompiler::getOperandDisplacement(const byte operand) const
 {
-	byte val = getRegAByte();
+	assert(operand != CPU::OPERAND_HL_INDIRECT);
+	return operand == CPU::OPERAND_A ? registerADisplacement_ : registersDisplacement_ + operand;
+}
 
-	bool oldCFlag = IS_C_FLAG_SET();
+bool CPU::initializeJit()
+{
+	if (jit_ != nullptr)
+	{
+		return true;
+	}
 
-	if (val >> 7 == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
+	if (!X64Emitter::HOST_SUPPORTED)
+	{
+		return false;
+	}
 
-	RESET_N_FLAG();
-	RESET_H_FLAG();
+	auto jit = std::make_unique<X64Emitter>(JIT_CODE_CAPACITY);
+	if (!jit->isAvailable())
+	{
+		return false;
+	}
 
-	val <<= 1;
+	jit->beginWrite();
 
-	if (oldCFlag) val |= 0x1;
+	// Five pushes on top of the return address leave the stack 16-byte aligned for calls
+	const byte* entry = jit->getCursor();
+	for (const Register reg : JIT_SAVED_REGISTERS)
+	{
+		jit->push(reg);
+	}
+	if (JIT_SHADOW_SPACE_SIZE != 0)
+	{
+		jit->subQwordImmediate(Register::RSP, JIT_SHADOW_SPACE_SIZE);
+	}
+	jit->movQword(JIT_CPU_REGISTER, JIT_ARGUMENT_REGISTERS[0]);
+	jit->movDword(JIT_CYCLE_LIMIT_REGISTER, JIT_ARGUMENT_REGISTERS[1]);
+	jit->movQword(JIT_RUN_REGISTER, JIT_ARGUMENT_REGISTERS[2]);
+	jit->aluDword(AluOperation::XOR, JIT_CYCLES_REGISTER, JIT_CYCLES_REGISTER);
+	jit->aluDword(AluOperation::XOR, JIT_INSTRUCTIONS_REGISTER, JIT_INSTRUCTIONS_REGISTER);
+	jit->jmp(JIT_ARGUMENT_REGISTERS[3]);
+
+	exitCompiledCode_ = jit->getCursor();
+	jit->storeDword(JIT_RUN_REGISTER, offsetof(CompiledRun, clockCycles), JIT_CYCLES_REGISTER);
+	jit->storeDword(JIT_RUN_REGISTER, offsetof(CompiledRun, instructionCount), JIT_INSTRUCTIONS_REGISTER);
+	if (JIT_SHADOW_SPACE_SIZE != 0)
+	{
+		jit->addQwordImmediate(Register::RSP, JIT_SHADOW_SPACE_SIZE);
+	}
+	for (auto it = std::rbegin(JIT_SAVED_REGISTERS); it != std::rend(JIT_SAVED_REGISTERS); ++it)
+	{
+		jit->pop(*it);
+	}
+	jit->ret();
 
-	if (val == 0x0) SET_Z_FLAG();
-	else RESET_Z_FLAG();
+	compiledBlocksStart_ = jit->getCursor();
+	jit->endWrite();
 
-	setRegAByte(val);
+	enterCompiledCode_ = reinterpret_cast<CompiledCodeEntry>(const_cast<byte*>(entry));
+	jit_ = std::move(jit);
+	return true;
 }
 
-void CPU::rlca()
+void CPU::compileBlock(BlockCache::Block& block)
 {
-	byte val = getRegAByte();
-
-	if (val >> 7 == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
+	jit_->beginWrite();
 
-	RESET_Z_FLAG();
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val <<= 1;
+	// Starting over is simpler than tracking which code is still reachable, hot blocks
+	// just get compiled again
+	if (jit_->getRemainingCapacity() < MAX_COMPILED_BLOCK_SIZE)
+	{
+		blockCache_->clearCompiledCode();
+		jit_->rewind(compiledBlocksStart_);
+	}
 
-	if (IS_C_FLAG_SET()) val |= 0x1;
+	BlockCompiler compiler(*jit_, *this, block, exitCompiledCode_);
+	block.compiledEntryPoints = compiler.compile();
 
-	setRegAByte(val);
+	jit_->endWrite();
 }
 
-void CPU::rra()
+// The System checks for interrupts after every step, compiled code and halt skipping run
+// several steps without. That is only the same while none could be taken in between: IME
+// isn't about to be set by an EI or RETI and no enabled interrupt is pending already.
+bool CPU::canDeferInterruptCheck() const
 {
-	byte val = getRegAByte();
-
-	bool oldCFlag = IS_C_FLAG_SET();
-
-	if ((val & 0x01) == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
+	if (!ime_)
+	{
+		return !eiTriggered_;
+	}
 
-	RESET_N_FLAG();
-	RESET_H_FLAG();
+	return interruptController_.getPendingInterrupts() == 0;
+}
 
-	val >>= 1;
+bool CPU::canSkipIdleLoop() const
+{
+	// Skipped iterations would miss reads a watchpoint is waiting for
+	if (!canDeferInterruptCheck() || display_.cgbHdmaTransferInProgress() || mem_.hasReadWatchpoints())
+	{
+		return false;
+	}
 
-	if (oldCFlag) val |= 0x80;
+	// The loop doesn't change the registers it reads through, but they may point anywhere
+	const byte readRegisters = idleLoop_.addressRegisters;
+	return (!(readRegisters & IDLE_LOOP_READS_BC) || isIdleLoopReadStable(getRegWord(REG_BC_INDEX))) &&
+		(!(readRegisters & IDLE_LOOP_READS_DE) || isIdleLoopReadStable(getRegWord(REG_DE_INDEX))) &&
+		(!(readRegisters & IDLE_LOOP_READS_HL) || isIdleLoopReadStable(getRegWord(REG_HL_INDEX))) &&
+		(!(readRegisters & IDLE_LOOP_READS_FF00_C) || isIdleLoopReadStable(0xFF00 + getRegByte(REG_C_INDEX)));
+}
 
-	if (val == 0x0) SET_Z_FLAG();
-	else RESET_Z_FLAG();
+unsigned int CPU::skipIdleLoop(const unsigned int cycleLimit)
+{
+	// The last iteration that fits still runs as usual, so the components the loop reads
+	// are synced when they would have been and the lazy state stays the same as well
+	const unsigned int iterations = cycleLimit / idleLoop_.clockCycles - 1;
+	executedInstructionCount_ += static_cast<uint64_t>(iterations) * idleLoop_.instructionCount;
+	idleLoopInstructionCount_ = executedInstructionCount_;
+	lastInstructionClockCycles_ = idleLoop_.branchClockCycles;
 
-	setRegAByte(val);
+#ifdef GOODBOY_GUEST_PROFILER
+	if (guestProfiler_ != nullptr)
+		guestProfiler_->recordSkippedIdleLoop(static_cast<uint64_t>(iterations) * idleLoop_.instructionCount, iterations * idleLoop_.clockCycles);
+#endif
+	return iterations * idleLoop_.clockCycles;
 }
 
-void CPU::rrca()
+unsigned int CPU::runBulkLoop(const unsigned int cycleLimit)
 {
-	byte val = getRegAByte();
-
-	if ((val & 0x01) == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
+	// As for polling loops, every iteration is a step an interrupt could be taken after
+	if (!canDeferInterruptCheck() || display_.cgbHdmaTransferInProgress())
+	{
+		return 0;
+	}
 
-	RESET_Z_FLAG();
-	RESET_N_FLAG();
-	RESET_H_FLAG();
+	// The loop's code may have been written since it was entered
+	const BlockCache::Block* block = blockCache_->enterBlock(registersPC_, mem_.getCodeBank(registersPC_));
+	if (block == nullptr || block->bulkLoop.clockCycles == 0)
+	{
+		return 0;
+	}
 
-	val >>= 1;
+	// The counter reaching zero ends the loop, so its value is the number of iterations
+	// left, this one included, with 0 for all 256 or 65536. As with polling loops one more
+	// iteration than the last run here has to fit and runs as usual, so the components the
+	// loop accesses are synced when they would have been.
+	const BlockCache::BulkLoop loop = block->bulkLoop;
+	const unsigned int counterValue = loop.isWordCounter ? getRegWord(loop.counterRegister) : getRegByte(loop.counterRegister);
+	const unsigned int iterationsLeft = counterValue != 0 ? counterValue : (loop.isWordCounter ? 0x10000 : 0x100);
+	unsigned int iterations = std::min(iterationsLeft, cycleLimit / loop.clockCycles);
+	if (iterations <= MIN_BULK_LOOP_ITERATIONS)
+	{
+		return 0;
+	}
+	iterations--;
 
-	if (IS_C_FLAG_SET()) val |= 0x80;
-
-	setRegAByte(val);
-}
-
-
-
-void CPU::rlhl()
-{
-	word hlAddress = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(hlAddress);
-
-	bool oldCFlag = IS_C_FLAG_SET();
-
-	if ((val >> 7) == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val <<= 1;
-
-	if (oldCFlag) val |= 0x1;
-
-	if (val == 0x0) SET_Z_FLAG();
-	else RESET_Z_FLAG();
-
-	mem_.writeByteAt(hlAddress, val);
-}
-
-void CPU::rrhl()
-{
-	word hlAddress = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(hlAddress);
-
-	bool oldCFlag = IS_C_FLAG_SET();
-
-	if ((val & 0x01) == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val >>= 1;
-
-	if (oldCFlag) val |= 0x80;
-
-	if (val == 0x0) SET_Z_FLAG();
-	else RESET_Z_FLAG();
-
-	mem_.writeByteAt(hlAddress, val);
-}
-
-void CPU::sla()
-{
-	byte val = getRegAByte();
-
-	if ((val >> 7) == 0x1)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val <<= 1;
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	setRegAByte(val);
-}
-
-void CPU::sra()
-{
-	byte val = getRegAByte();
-
-	if ((val & 0x1) == 0x1)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val = (val >> 1) | (val & 0x80);
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	setRegAByte(val);
-}
-
-void CPU::slhl()
-{
-	word hlAddress = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(hlAddress);
-
-	if ((val >> 7) == 0x1)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
+	const word destination = static_cast<word>(getRegWord(loop.destinationPair) + loop.destinationOffset);
+	const word source = loop.sourcePair != BlockCache::BulkLoop::NO_PAIR ? static_cast<word>(getRegWord(loop.sourcePair) + loop.sourceOffset) : 0;
+	iterations = mem_.getBulkAccessCount(destination, loop.destinationStep, iterations, true);
+	if (loop.sourcePair != BlockCache::BulkLoop::NO_PAIR)
+	{
+		iterations = mem_.getBulkAccessCount(source, loop.sourceStep, iterations, false);
+	}
+	if (iterations < MIN_BULK_LOOP_ITERATIONS)
+	{
+		return 0;
+	}
 
-	val <<= 1;
-	if (val == 0x00)
-		SET_Z_FLAG();
+	byte value = loop.fillOperand == OPERAND_A ? getRegAByte() : loop.fillOperand == BlockCache::BulkLoop::OPERAND_IMMEDIATE ? loop.fillValue : getRegByte(loop.fillOperand);
+	if (loop.sourcePair != BlockCache::BulkLoop::NO_PAIR)
+	{
+		value = mem_.copyBytes(destination, loop.destinationStep, source, loop.sourceStep, iterations);
+		setRegWord(loop.sourcePair, static_cast<word>(getRegWord(loop.sourcePair) + loop.sourceStep * static_cast<int>(iterations)));
+	}
 	else
-		RESET_Z_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	mem_.writeByteAt(hlAddress, val);
-}
-
-void CPU::srhl()
-{
-	word hlAddress = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(hlAddress);
+	{
+		mem_.fillBytes(destination, loop.destinationStep, value, iterations);
+	}
+	setRegWord(loop.destinationPair, static_cast<word>(getRegWord(loop.destinationPair) + loop.destinationStep * static_cast<int>(iterations)));
 
-	if ((val & 0x1) == 0x1)
-		SET_C_FLAG();
+	// The counter stays above zero, so the flags are those of a DEC r or OR r that left it
+	// there: only H and the carry DEC r keeps may be set
+	const unsigned int counterLeft = counterValue - iterations;
+	if (loop.isWordCounter)
+	{
+		setRegWord(loop.counterRegister, static_cast<word>(counterLeft));
+		registersAF_ &= 0xFF00;
+	}
 	else
-		RESET_C_FLAG();
+	{
+		setRegByte(loop.counterRegister, static_cast<byte>(counterLeft));
+		registersAF_ = (registersAF_ & 0xFF10) | 0x40 | ((counterLeft & 0x0F) == 0x0F ? 0x20 : 0x00);
+	}
 
-	RESET_N_FLAG();
-	RESET_H_FLAG();
+	switch (loop.exitOperand)
+	{
+		case OPERAND_A:
+			break;
+		case BlockCache::BulkLoop::OPERAND_READ:
+			setRegAByte(value);
+			break;
+		case BlockCache::BulkLoop::OPERAND_COUNTER_TEST:
+			setRegAByte(static_cast<byte>((counterLeft >> 8) | counterLeft));
+			break;
+		case BlockCache::BulkLoop::OPERAND_IMMEDIATE:
+			setRegAByte(loop.exitValue);
+			break;
+		default:
+			setRegAByte(getRegByte(loop.exitOperand));
+			break;
+	}
 
-	val = (val >> 1) | (val & 0x80);
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+	executedInstructionCount_ += static_cast<uint64_t>(iterations) * loop.instructionCount;
+	lastInstructionClockCycles_ = loop.branchClockCycles;
 
-	mem_.writeByteAt(hlAddress, val);
+#ifdef GOODBOY_GUEST_PROFILER
+	if (guestProfiler_ != nullptr)
+		guestProfiler_->recordBulkLoop(static_cast<uint64_t>(iterations) * loop.instructionCount, iterations * loop.clockCycles);
+#endif
+	return iterations * loop.clockCycles;
 }
 
-void CPU::srla()
+unsigned int CPU::executeCompiledInstructions(const unsigned int cycleLimit)
 {
-	byte val = getRegAByte();
-
-	if ((val & 0x1) == 0x1)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val >>= 1;
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+	if (isHalted_ || display_.cgbHdmaTransferInProgress())
+	{
+#ifdef GOODBOY_GUEST_PROFILER
+		if (guestProfiler_ != nullptr) guestProfiler_->recordHaltedCycles(HALTED_STEP_CLOCK_CYCLES);
+#endif
+		lastInstructionClockCycles_ = HALTED_STEP_CLOCK_CYCLES;
+		return lastInstructionClockCycles_;
+	}
 
-	setRegAByte(val);
-}
+	std::size_t instructionIndex = 0;
+	BlockCache::Block* block = blockCache_->getCurrentBlock(registersPC_, instructionIndex);
+	if (block == nullptr)
+	{
+		block = enterBlock();
+		// Polling, copy and fill loops are left to the cached interpreter, which enters
+		// them through enterBlock every iteration for it to notice when they can be skipped
+		// or run in bulk
+		if (block != nullptr && block->idleLoop.clockCycles == 0 && block->bulkLoop.clockCycles == 0 && block->compiledEntryPoints.empty() && ++block->entryCount == JIT_COMPILE_THRESHOLD)
+		{
+			compileBlock(*block);
+		}
+	}
 
-void CPU::srlhl()
-{
-	word hlAddress = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(hlAddress);
+	const byte* entryPoint = block != nullptr && !block->compiledEntryPoints.empty() ? block->compiledEntryPoints[instructionIndex] : nullptr;
+	if (entryPoint == nullptr || !canDeferInterruptCheck())
+	{
+		lastInstructionClockCycles_ = executeCachedInstruction();
+		return lastInstructionClockCycles_;
+	}
 
-	if ((val & 0x1) == 0x1)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
+#ifdef GOODBOY_GUEST_PROFILER
+	const word pc = registersPC_;
+	const int bank = block->bank;
+#endif
 
-	RESET_N_FLAG();
-	RESET_H_FLAG();
+	CompiledRun run;
+	enterCompiledCode_(this, cycleLimit, &run, entryPoint);
 
-	val >>= 1;
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+#ifdef GOODBOY_GUEST_PROFILER
+	if (guestProfiler_ != nullptr)
+		guestProfiler_->recordCompiledRun(bank, pc, run.instructionCount, run.clockCycles);
+#endif
 
-	mem_.writeByteAt(hlAddress, val);
+	executedInstructionCount_ += run.instructionCount;
+	blockCache_->resumeCurrentBlock(run.nextInstructionIndex, registersPC_);
+	lastInstructionClockCycles_ = run.lastInstructionClockCycles;
+	return run.clockCycles;
 }
 
-void CPU::pushnn(const byte regIndex)
+template<byte Opcode, bool Predecoded>
+unsigned int CPU::dispatchOpcode(CPU& cpu)
 {
-	word spAddress = getRegWord(REG_SP_INDEX);
-	setRegWord(REG_SP_INDEX, spAddress - 2);
-	mem_.writeWordAt(spAddress - 2, getRegWord(regIndex));
+	return cpu.executeOpcode<Opcode, Predecoded>();
 }
 
-void CPU::popnn(const byte regIndex)
+template<byte CbOpcode>
+unsigned int CPU::dispatchCbOpcode(CPU& cpu)
 {
-	word spAddress = getRegWord(REG_SP_INDEX);
-	setRegWord(regIndex, mem_.readWordAt(spAddress));
-	setRegWord(REG_SP_INDEX, spAddress + 2);
+	return cpu.executeCbOpcode<CbOpcode>();
 }
 
-void CPU::addan(const byte val)
+template<byte Operand>
+byte CPU::readOperand()
 {
-	byte aVal = getRegAByte();
-	byte calc = aVal + val;
-
-	RESET_N_FLAG();
-	if (calc == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	if (((calc ^ aVal ^ val) & 0x10) == 0x10)
-		SET_H_FLAG();
+	if constexpr (Operand == OPERAND_HL_INDIRECT)
+		return mem_.readByteAt(getRegWord(REG_HL_INDEX));
+	else if constexpr (Operand == OPERAND_A)
+		return getRegAByte();
 	else
-		RESET_H_FLAG();
-
-	if (calc < aVal)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
-
-	setRegAByte(static_cast<byte>(calc));
+		return getRegByte(Operand);
 }
 
-void CPU::suban(const byte val)
+template<byte Operand>
+void CPU::writeOperand(const byte val)
 {
-	byte aVal = getRegAByte();
-	byte calc = (aVal - val);
-
-	SET_N_FLAG();
-
-	if (calc == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	if ((aVal & 0x0F) < (val & 0x0F))
-		SET_H_FLAG();
-	else
-		RESET_H_FLAG();
-
-	if ((aVal & 0xFF) < (val & 0xFF))
-		SET_C_FLAG();
+	if constexpr (Operand == OPERAND_HL_INDIRECT)
+		mem_.writeByteAt(getRegWord(REG_HL_INDEX), val);
+	else if constexpr (Operand == OPERAND_A)
+		setRegAByte(val);
 	else
-		RESET_C_FLAG();
-
-	setRegAByte(calc);
+		setRegByte(Operand, val);
 }
 
-void CPU::adcan(const byte val)
+template<byte Condition>
+bool CPU::isConditionMet() const
 {
-	byte regAVal = getRegAByte();
-	byte c = IS_C_FLAG_SET() ? 0x01 : 0x00;
-
-	RESET_N_FLAG();
-
-	if (((int)(regAVal & 0x0F) + (int)(val & 0x0F) + (int)c) > 0x0F)
-		SET_H_FLAG();
+	if constexpr (Condition == CONDITION_NZ)
+		return !IS_Z_FLAG_SET();
+	else if constexpr (Condition == CONDITION_Z)
+		return IS_Z_FLAG_SET();
+	else if constexpr (Condition == CONDITION_NC)
+		return !IS_C_FLAG_SET();
 	else
-		RESET_H_FLAG();
-
-	if (((int)(regAVal & 0xFF) + (int)(val & 0xFF) + (int)c) > 0xFF)
-		SET_C_FLAG();
+		return IS_C_FLAG_SET();
+}
+
+template<byte Operation>
+void CPU::aluOperation(const byte val)
+{
+	if constexpr (Operation == 0)
+		addan(val);
+	else if constexpr (Operation == 1)
+		adcan(val);
+	else if constexpr (Operation == 2)
+		suban(val);
+	else if constexpr (Operation == 3)
+		sbcan(val);
+	else if constexpr (Operation == 4)
+		andan(val);
+	else if constexpr (Operation == 5)
+		xoran(val);
+	else if constexpr (Operation == 6)
+		oran(val);
 	else
-		RESET_C_FLAG();
-
-	byte res = regAVal + val + c;
-	setRegAByte(res);
-	if (res == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-}
-
-void CPU::sbcan(const byte val)
-{
-	int un = (int)val & 0xFF;
-	int tmpA = (int)getRegAByte() & 0xFF;
-	int ua = tmpA;
-
-	ua -= un;
-
-	if (IS_C_FLAG_SET()) ua -= 1;
-
-	SET_N_FLAG();
-	if (ua < 0)
-		SET_C_FLAG();
-	else
-		RESET_C_FLAG();
-
-	ua &= 0xFF;
-
-	if (ua == 0)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	if (((ua ^ un ^ tmpA) & 0x10) == 0x10)
-		SET_H_FLAG();
-	else
-		RESET_H_FLAG();
-
-	setRegAByte(static_cast<byte>(ua));
-}
-
-void CPU::swapa()
-{
-	byte val = getRegAByte();
-	byte res = ((val & 0x0F) << 4) | ((val & 0xF0) >> 4);
-
-	if (res == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-	RESET_C_FLAG();
-
-	setRegAByte(res);
-}
-
-void CPU::swapn(const byte regIndex)
-{
-	byte val = getRegByte(regIndex);
-	byte res = ((val & 0x0F) << 4) | ((val & 0xF0) >> 4);
-
-	if (res == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-	RESET_C_FLAG();
-
-	setRegByte(regIndex, res);
-}
-
-void CPU::swaphl()
-{
-	word hlAddress = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(hlAddress);
-	byte res = ((val & 0x0F) << 4) | ((val & 0xF0) >> 4);
-
-	if (res == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	RESET_N_FLAG();
-	RESET_H_FLAG();
-	RESET_C_FLAG();
-
-	mem_.writeByteAt(hlAddress, res);
-}
-
-void CPU::pushaf()
-{
-	word spAddress = getRegWord(REG_SP_INDEX);
-	setRegWord(REG_SP_INDEX, spAddress - 2);
-	mem_.writeWordAt(spAddress - 2, getRegAByte() << 8 | getRegFByte());
-}
-
-void CPU::popaf()
-{
-	word spAddress = getRegWord(REG_SP_INDEX);
-	word val = mem_.readWordAt(spAddress);
-	registersAF_ = (val & 0xFFF0);
-	setRegWord(REG_SP_INDEX, spAddress + 2);
+		cpa(val);
 }
 
-void CPU::inca()
+// Opcodes are decoded from their xxyyyzzz fields (yyy split further into ppq): x selects
+// the block, y and z the register, condition or operation within it. Every field is a
+// template constant, so each instantiation compiles down to just its own instruction.
+template<byte Opcode, bool Predecoded>
+unsigned int CPU::executeOpcode()
 {
-	byte regVal = getRegAByte();
-	bool isBit3SetBefore = (regVal & 0x08) == 0x08;
-	regVal++;
-	bool isBit3SetAfter = (regVal & 0x08) == 0x08;
+	constexpr byte x = Opcode >> 6;
+	constexpr byte y = (Opcode >> 3) & 0x07;
+	constexpr byte z = Opcode & 0x07;
+	constexpr byte p = y >> 1;
+	constexpr byte q = y & 0x01;
+	constexpr unsigned int clockCycles = coreInstructionClockCycles[Opcode];
 
-	if (regVal == 0x0)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	RESET_N_FLAG();
+	if constexpr (x == 0)
+	{
+		if constexpr (z == 0)
+		{
+			if constexpr (y == 0)
+			{
+				// NOP
+			}
+			else if constexpr (y == 1)
+			{
+				// LD (nn),SP
+				mem_.writeWordAt(fetchWord<Predecoded>(), getRegWord(REG_SP_INDEX));
+			}
+			else if constexpr (y == 2)
+			{
+				// STOP
+				isHalted_ = true;
+			}
+			else if constexpr (y == 3)
+			{
+				// JR n
+				const sbyte offset = fetchSByte<Predecoded>();
+				registersPC_ += offset;
+			}
+			else
+			{
+				// JR cc,n
+				const sbyte offset = fetchSByte<Predecoded>();
+				if (!isConditionMet<y - 4>())
+					return clockCycles - 4;
+				registersPC_ += offset;
+			}
+		}
+		else if constexpr (z == 1)
+		{
+			if constexpr (q == 0)
+				setRegWord(p * sizeof(word), fetchWord<Predecoded>());   // LD nn,n
+			else
+				addhln(getRegWord(p * sizeof(word)));           // ADD HL,n
+		}
+		else if constexpr (z == 2)
+		{
+			// LD (BC),A / LD (DE),A / LDI (HL),A / LDD (HL),A and their loading counterparts
+			const word address = getRegWord(p < 2 ? p * sizeof(word) : REG_HL_INDEX);
+			if constexpr (q == 0)
+				mem_.writeByteAt(address, getRegAByte());
+			else
+				setRegAByte(mem_.readByteAt(address));
 
-	if (isBit3SetBefore && !isBit3SetAfter)
-		SET_H_FLAG();
+			if constexpr (p == 2)
+				setRegWord(REG_HL_INDEX, address + 1);
+			else if constexpr (p == 3)
+				setRegWord(REG_HL_INDEX, address - 1);
+		}
+		else if constexpr (z == 3)
+		{
+			// INC nn / DEC nn
+			constexpr byte regIndex = p * sizeof(word);
+			if constexpr (q == 0)
+				setRegWord(regIndex, getRegWord(regIndex) + 1);
+			else
+				setRegWord(regIndex, getRegWord(regIndex) - 1);
+		}
+		else if constexpr (z == 4)
+		{
+			incn<y>();
+		}
+		else if constexpr (z == 5)
+		{
+			decn<y>();
+		}
+		else if constexpr (z == 6)
+		{
+			// LD r,n
+			writeOperand<y>(fetchByte<Predecoded>());
+		}
+		else if constexpr (y < 4)
+		{
+			// RLCA, RRCA, RLA, RRA: the CB rotations on A with Z cleared
+			rotateShift<y, OPERAND_A>();
+			RESET_Z_FLAG();
+		}
+		else if constexpr (y == 4)
+		{
+			daa();
+		}
+		else if constexpr (y == 5)
+		{
+			cpl();
+		}
+		else if constexpr (y == 6)
+		{
+			// SCF
+			RESET_H_FLAG();
+			RESET_N_FLAG();
+			SET_C_FLAG();
+		}
+		else
+		{
+			// CCF
+			RESET_H_FLAG();
+			RESET_N_FLAG();
+			if (IS_C_FLAG_SET())
+				RESET_C_FLAG();
+			else
+				SET_C_FLAG();
+		}
+	}
+	else if constexpr (x == 1)
+	{
+		if constexpr (Opcode == 0x76)
+			isHalted_ = true;                    // HALT
+		else
+			writeOperand<y>(readOperand<z>());   // LD r1,r2
+	}
+	else if constexpr (x == 2)
+	{
+		aluOperation<y>(readOperand<z>());
+	}
+	else if constexpr (z == 0)
+	{
+		if constexpr (y < 4)
+		{
+			// RET cc
+			if (!isConditionMet<y>())
+				return clockCycles - 12;
+			ret();
+		}
+		else if constexpr (y == 4)
+		{
+			// LDH (n),A
+			mem_.writeByteAt(0xFF00 + fetchByte<Predecoded>(), getRegAByte());
+		}
+		else if constexpr (y == 5)
+		{
+			addspn(fetchSByte<Predecoded>());
+		}
+		else if constexpr (y == 6)
+		{
+			// LDH A,(n)
+			setRegAByte(mem_.readByteAt(0xFF00 + fetchByte<Predecoded>()));
+		}
+		else
+		{
+			ldhlspn(fetchSByte<Predecoded>());
+		}
+	}
+	else if constexpr (z == 1)
+	{
+		if constexpr (Opcode == 0xF1)
+			popaf();
+		else if constexpr (q == 0)
+			popnn(p * sizeof(word));
+		else if constexpr (p == 0)
+			ret();
+		else if constexpr (p == 1)
+		{
+			// RETI
+			ret();
+			eiTriggered_ = true;
+		}
+		else if constexpr (p == 2)
+			registersPC_ = getRegWord(REG_HL_INDEX);               // JP (HL)
+		else
+			setRegWord(REG_SP_INDEX, getRegWord(REG_HL_INDEX));    // LD SP,HL
+	}
+	else if constexpr (z == 2)
+	{
+		if constexpr (y < 4)
+		{
+			// JP cc,nn
+			const word address = fetchWord<Predecoded>();
+			if (!isConditionMet<y>())
+				return clockCycles - 4;
+			registersPC_ = address;
+		}
+		else if constexpr (y == 4)
+			mem_.writeByteAt(0xFF00 + getRegByte(REG_C_INDEX), getRegAByte());   // LD (C),A
+		else if constexpr (y == 5)
+			mem_.writeByteAt(fetchWord<Predecoded>(), getRegAByte());                     // LD (nn),A
+		else if constexpr (y == 6)
+			setRegAByte(mem_.readByteAt(0xFF00 + getRegByte(REG_C_INDEX)));      // LD A,(C)
+		else
+			setRegAByte(mem_.readByteAt(fetchWord<Predecoded>()));                        // LD A,(nn)
+	}
+	else if constexpr (z == 3 && y == 0)
+	{
+		// JP nn
+		registersPC_ = fetchWord<Predecoded>();
+	}
+	else if constexpr (z == 3 && y == 1)
+	{
+		return CB_OPCODE_HANDLERS[fetchByte<Predecoded>()](*this);
+	}
+	else if constexpr (Opcode == 0xF3)
+	{
+		// DI
+		eiTriggered_ = false;
+		ime_ = false;
+	}
+	else if constexpr (Opcode == 0xFB)
+	{
+		// EI
+		eiTriggered_ = true;
+	}
+	else if constexpr (z == 4 && y < 4)
+	{
+		// CALL cc,nn
+		const word address = fetchWord<Predecoded>();
+		if (!isConditionMet<y>())
+			return clockCycles - 12;
+		callnn(address);
+	}
+	else if constexpr (z == 5 && q == 0)
+	{
+		if constexpr (Opcode == 0xF5)
+			pushaf();
+		else
+			pushnn(p * sizeof(word));
+	}
+	else if constexpr (Opcode == 0xCD)
+	{
+		// CALL nn
+		callnn(fetchWord<Predecoded>());
+	}
+	else if constexpr (z == 6)
+	{
+		aluOperation<y>(fetchByte<Predecoded>());
+	}
+	else if constexpr (z == 7)
+	{
+		// RST n
+		callnn(y * 0x08);
+	}
 	else
-		RESET_H_FLAG();
+	{
+		logUnhandledOpcode(Opcode);
+	}
 
-	setRegAByte(regVal);
+	return clockCycles;
 }
 
-void CPU::deca()
+template<byte CbOpcode>
+unsigned int CPU::executeCbOpcode()
 {
-	byte val = getRegAByte();
-	byte calc = (val - 1);
+	constexpr byte x = CbOpcode >> 6;
+	constexpr byte y = (CbOpcode >> 3) & 0x07;
+	constexpr byte z = CbOpcode & 0x07;
 
-	SET_N_FLAG();
-
-	if (calc == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	if (((calc ^ 0x01 ^ val) & 0x10) == 0x10)
-		SET_H_FLAG();
+	if constexpr (x == 0)
+		rotateShift<y, z>();
+	else if constexpr (x == 1)
+		testBit<y, z>();
+	else if constexpr (x == 2)
+		writeOperand<z>(readOperand<z>() & ~(1 << y));   // RES b,r
 	else
-		RESET_H_FLAG();
+		writeOperand<z>(readOperand<z>() | (1 << y));    // SET b,r
 
-	setRegAByte(calc);
+	return cbInstructionClockCycles[CbOpcode];
 }
 
-void CPU::inchl()
+template<byte Operand>
+void CPU::incn()
 {
-	word adr = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(adr);
-
-	bool isBit3SetBefore = (val & 0x08) == 0x08;
-	val++;
-	bool isBit3SetAfter = (val & 0x08) == 0x08;
-
-	if (val == 0x0)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	RESET_N_FLAG();
-
-	if (isBit3SetBefore && !isBit3SetAfter)
-		SET_H_FLAG();
-	else
-		RESET_H_FLAG();
-
-	mem_.writeByteAt(adr, val);
+	const word entry = ALU_INC_TABLE[readOperand<Operand>()];
+	registersAF_ = (registersAF_ & 0xFF1F) | (entry & 0x00E0);
+	writeOperand<Operand>(entry >> 8);
 }
 
-void CPU::dechl()
+template<byte Operand>
+void CPU::decn()
 {
-	word hlAddress = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(hlAddress);
-	byte calc = (val - 1);
-
-	SET_N_FLAG();
-
-	if (calc == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	if (((calc ^ 0x01 ^ val) & 0x10) == 0x10)
-		SET_H_FLAG();
-	else
-		RESET_H_FLAG();
-
-	mem_.writeByteAt(hlAddress, calc);
+	const word entry = ALU_DEC_TABLE[readOperand<Operand>()];
+	registersAF_ = (registersAF_ & 0xFF1F) | (entry & 0x00E0);
+	writeOperand<Operand>(entry >> 8);
 }
 
-void CPU::daa()
+// RLC, RRC, RL, RR, SLA, SRA, SWAP and SRL in CB opcode order
+template<byte Operation, byte Operand>
+void CPU::rotateShift()
 {
-	int aVal = getRegAByte();
+	const byte val = readOperand<Operand>();
+	byte res;
+	bool carry;
 
-	if (!IS_N_FLAG_SET())
+	if constexpr (Operation == 0)
 	{
-		if (IS_H_FLAG_SET() || (aVal & 0xF) > 9)
-		{
-			aVal += 0x06;
-		}
-
-		if (IS_C_FLAG_SET() || (aVal > 0x9F))
-		{
-			aVal += 0x60;
-		}
+		carry = (val >> 7) == 0x1;
+		res = (val << 1) | (val >> 7);
+	}
+	else if constexpr (Operation == 1)
+	{
+		carry = (val & 0x01) == 0x1;
+		res = (val >> 1) | (val << 7);
+	}
+	else if constexpr (Operation == 2)
+	{
+		carry = (val >> 7) == 0x1;
+		res = (val << 1) | (IS_C_FLAG_SET() ? 0x01 : 0x00);
+	}
+	else if constexpr (Operation == 3)
+	{
+		carry = (val & 0x01) == 0x1;
+		res = (val >> 1) | (IS_C_FLAG_SET() ? 0x80 : 0x00);
+	}
+	else if constexpr (Operation == 4)
+	{
+		carry = (val >> 7) == 0x1;
+		res = val << 1;
+	}
+	else if constexpr (Operation == 5)
+	{
+		carry = (val & 0x01) == 0x1;
+		res = (val >> 1) | (val & 0x80);
+	}
+	else if constexpr (Operation == 6)
+	{
+		carry = false;
+		res = ((val & 0x0F) << 4) | ((val & 0xF0) >> 4);
 	}
 	else
 	{
-		if (IS_H_FLAG_SET())
-		{
-			aVal = (aVal - 0x06) & 0xFF;
-		}
-
-		if (IS_C_FLAG_SET())
-		{
-			aVal -= 0x60;
-		}
+		carry = (val & 0x01) == 0x1;
+		res = val >> 1;
 	}
 
-	if ((aVal & 0x100) == 0x100)
+	if (carry)
 		SET_C_FLAG();
+	else
+		RESET_C_FLAG();
 
+	RESET_N_FLAG();
 	RESET_H_FLAG();
 
-	aVal &= 0xFF;
+	if (res == 0x00)
+		SET_Z_FLAG();
+	else
+		RESET_Z_FLAG();
 
-	(aVal == 0x00) ? SET_Z_FLAG() : RESET_Z_FLAG();
-	setRegAByte(static_cast<byte>(aVal));
+	writeOperand<Operand>(res);
 }
 
-void CPU::cpl()
+template<byte Bit, byte Operand>
+void CPU::testBit()
 {
-	setRegAByte(getRegAByte() ^ 0xFF);
-	SET_N_FLAG();
+	if (((readOperand<Operand>() >> Bit) & 0x1) != 0x1) 
+		SET_Z_FLAG();
+	else                 
+		RESET_Z_FLAG();
+	
+	RESET_N_FLAG();
 	SET_H_FLAG();
 }
 
-void CPU::ldihla()
+template<bool Predecoded, std::size_t... Opcodes>
+constexpr std::array<CPU::OpcodeHandler, 256> CPU::makeOpcodeHandlers(std::index_sequence<Opcodes...>)
 {
-	word hlValue = getRegWord(REG_HL_INDEX);
-	mem_.writeByteAt(hlValue, getRegAByte());
-	setRegWord(REG_HL_INDEX, hlValue + 1);
+	return {{ &CPU::dispatchOpcode<static_cast<byte>(Opcodes), Predecoded>... }};
 }
 
-void CPU::ldiahl()
+template<std::size_t... Opcodes>
+constexpr std::array<CPU::OpcodeHandler, 256> CPU::makeCbOpcodeHandlers(std::index_sequence<Opcodes...>)
 {
-	word hlValue = getRegWord(REG_HL_INDEX);
-	setRegAByte(mem_.readByteAt(hlValue));
-	setRegWord(REG_HL_INDEX, hlValue + 1);
+	return {{ &CPU::dispatchCbOpcode<static_cast<byte>(Opcodes)>... }};
 }
 
-void CPU::lddhla()
+const std::array<CPU::OpcodeHandler, 256> CPU::OPCODE_HANDLERS = CPU::makeOpcodeHandlers<false>(std::make_index_sequence<256>());
+const std::array<CPU::OpcodeHandler, 256> CPU::PREDECODED_OPCODE_HANDLERS = CPU::makeOpcodeHandlers<true>(std::make_index_sequence<256>());
+const std::array<CPU::OpcodeHandler, 256> CPU::CB_OPCODE_HANDLERS = CPU::makeCbOpcodeHandlers(std::make_index_sequence<256>());
+
+void CPU::logUnhandledOpcode(const byte opcode) const
 {
-	word hlValue = getRegWord(REG_HL_INDEX);
-	mem_.writeByteAt(hlValue, getRegAByte());
-	setRegWord(REG_HL_INDEX, hlValue - 1);
+	std::stringstream unhandledOpcode;
+	unhandledOpcode << "Unhandled opcode: " << getHexByte(opcode) << "\n";
+	log(LogType::ERROR, unhandledOpcode.str().c_str());
 }
 
-void CPU::lddahl()
+void CPU::addhln(const word w)
 {
-	word hlValue = getRegWord(REG_HL_INDEX);
-	setRegAByte(mem_.readByteAt(hlValue));
-	setRegWord(REG_HL_INDEX, hlValue - 1);
-}
+	word hlW = getRegWord(REG_HL_INDEX);
+	word bot12hl = hlW & 0xFFF;
+	word bot12w  = w & 0xFFF;
+
+	unsigned int halfCarryTest = bot12hl + bot12w;
+	if (halfCarryTest > 0xFFF)
+		SET_H_FLAG();
+	else
+		RESET_H_FLAG();
 
+	unsigned int fullCarryTest = hlW + w;
+	if (fullCarryTest > 0xFFFF)
+		SET_C_FLAG();
+	else
+		RESET_C_FLAG();
 
-void CPU::ret()
-{
-	word spAddress = getRegWord(REG_SP_INDEX);
-	registersPC_ = mem_.readWordAt(spAddress);
-	setRegWord(REG_SP_INDEX, spAddress + 2);
-}
+	RESET_N_FLAG();
 
-void CPU::callnn(word address)
-{
-	word spAddress = getRegWord(REG_SP_INDEX);
-	setRegWord(REG_SP_INDEX, spAddress - 2);
-	mem_.writeWordAt(spAddress - 2, registersPC_);
-	registersPC_ = address;
+	setRegWord(REG_HL_INDEX,fullCarryTest & 0xFFFF);
 }
 
-void CPU::cbrlca()
+void CPU::xoran(const byte n)
 {
 	byte val = getRegAByte();
-
-	if (val >> 7 == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
-
+	byte res = val ^ n;
+	
+	RESET_Z_FLAG();
 	RESET_N_FLAG();
 	RESET_H_FLAG();
+	RESET_C_FLAG();
 
-	val <<= 1;
-	if (IS_C_FLAG_SET()) val |= 0x1;
-
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
-
-	setRegAByte(val);
+	if (res == 0) SET_Z_FLAG();
+	setRegAByte(res);
 }
 
-void CPU::cbrrca()
+void CPU::oran(const byte n)
 {
 	byte val = getRegAByte();
+	byte res = val | n;
 
-	if ((val & 0x01) == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
-
+	RESET_Z_FLAG();
 	RESET_N_FLAG();
 	RESET_H_FLAG();
+	RESET_C_FLAG();
 
-	val >>= 1;
-	if (IS_C_FLAG_SET()) val |= 0x80;
+	if (res == 0) SET_Z_FLAG();
+	setRegAByte(res);
+}
 
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+void CPU::andan(const byte n)
+{
+	byte val = getRegAByte();
+	byte res = val & n;
+
+	RESET_Z_FLAG();
+	RESET_N_FLAG();
+	SET_H_FLAG();
+	RESET_C_FLAG();
 
-	setRegAByte(val);
+	if (res == 0) SET_Z_FLAG();
+	setRegAByte(res);
 }
 
-void CPU::cbrlcn(const byte regIndex)
+void CPU::cpa(const byte val)
 {
-	byte val = getRegByte(regIndex);
+	registersAF_ = (registersAF_ & 0xFF0F) | (ALU_SUB_TABLE[getAluIndex(getRegAByte(), val, 0)] & 0x00F0);
+}
 
-	if (val >> 7 == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
+void CPU::addspn(const sbyte val)
+{
+	word spVal = getRegWord(REG_SP_INDEX);
+	word result = (spVal + val);
 
+	RESET_Z_FLAG();
 	RESET_N_FLAG();
-	RESET_H_FLAG();
 
-	val <<= 1;
-	if (IS_C_FLAG_SET()) val |= 0x1;
+	if ((result & 0xF) < (spVal & 0xF)) SET_H_FLAG();
+	else RESET_H_FLAG();
 
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+	if ((result & 0xFF) < (spVal & 0xFF)) SET_C_FLAG();
+	else RESET_C_FLAG();
 
-	setRegByte(regIndex, val);
+	setRegWord(REG_SP_INDEX, result);
 }
 
-void CPU::cbrrcn(const byte regIndex)
+void CPU::ldhlspn(const sbyte val)
 {
-	byte val = getRegByte(regIndex);
+	word spVal = getRegWord(REG_SP_INDEX);
+	word result = spVal + val;
+	word check = spVal ^ val ^ ((spVal + val) & 0xFFFF);
 
-	if ((val & 0x01) == 0x1) SET_C_FLAG();
+	if ((check & 0x100) == 0x100) SET_C_FLAG();
 	else RESET_C_FLAG();
 
+	if ((check & 0x10) == 0x10) SET_H_FLAG();
+	else RESET_H_FLAG();
+		
+	RESET_Z_FLAG();
 	RESET_N_FLAG();
-	RESET_H_FLAG();
-
-	val >>= 1;
-	if (IS_C_FLAG_SET()) val |= 0x80;
 
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
 
-	setRegByte(regIndex, val);
+	setRegWord(REG_HL_INDEX, result);
 }
 
-void CPU::cbrlchl()
+void CPU::pushnn(const byte regIndex)
 {
-	word address = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(address);
+	word spAddress = getRegWord(REG_SP_INDEX);
+	setRegWord(REG_SP_INDEX, spAddress - 2);
+	mem_.writeWordAt(spAddress - 2, getRegWord(regIndex));
+}
 
-	if ((val >> 7) == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
+void CPU::popnn(const byte regIndex)
+{
+	word spAddress = getRegWord(REG_SP_INDEX);
+	setRegWord(regIndex, mem_.readWordAt(spAddress));
+	setRegWord(REG_SP_INDEX, spAddress + 2);
+}
 
-	RESET_N_FLAG();
-	RESET_H_FLAG();
+void CPU::addan(const byte val)
+{
+	registersAF_ = ALU_ADD_TABLE[getAluIndex(getRegAByte(), val, 0)] | (registersAF_ & 0x000F);
+}
 
-	val <<= 1;
-	if (IS_C_FLAG_SET()) val |= 0x1;
+void CPU::suban(const byte val)
+{
+	registersAF_ = ALU_SUB_TABLE[getAluIndex(getRegAByte(), val, 0)] | (registersAF_ & 0x000F);
+}
 
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+void CPU::adcan(const byte val)
+{
+	registersAF_ = ALU_ADD_TABLE[getAluIndex(getRegAByte(), val, getRegFByte())] | (registersAF_ & 0x000F);
+}
 
-	mem_.writeByteAt(address, val);
+void CPU::sbcan(const byte val)
+{
+	registersAF_ = ALU_SUB_TABLE[getAluIndex(getRegAByte(), val, getRegFByte())] | (registersAF_ & 0x000F);
 }
 
-void CPU::cbrrchl()
+void CPU::pushaf()
 {
-	word address = getRegWord(REG_HL_INDEX);
-	byte val = mem_.readByteAt(address);
+	word spAddress = getRegWord(REG_SP_INDEX);
+	setRegWord(REG_SP_INDEX, spAddress - 2);
+	mem_.writeWordAt(spAddress - 2, getRegAByte() << 8 | getRegFByte());
+}
 
-	if ((val & 0x01) == 0x1) SET_C_FLAG();
-	else RESET_C_FLAG();
+void CPU::popaf()
+{
+	word spAddress = getRegWord(REG_SP_INDEX);
+	word val = mem_.readWordAt(spAddress);
+	registersAF_ = (val & 0xFFF0);
+	setRegWord(REG_SP_INDEX, spAddress + 2);
+}
 
-	RESET_N_FLAG();
-	RESET_H_FLAG();
+void CPU::daa()
+{
+	registersAF_ = ALU_DAA_TABLE[getDaaIndex(getRegAByte(), getRegFByte())] | (registersAF_ & 0x000F);
+}
 
-	val >>= 1;
-	if (IS_C_FLAG_SET()) val |= 0x80;
+void CPU::cpl()
+{
+	setRegAByte(getRegAByte() ^ 0xFF);
+	SET_N_FLAG();
+	SET_H_FLAG();
+}
 
-	if (val == 0x00)
-		SET_Z_FLAG();
-	else
-		RESET_Z_FLAG();
+void CPU::ret()
+{
+	word spAddress = getRegWord(REG_SP_INDEX);
+	registersPC_ = mem_.readWordAt(spAddress);
+	setRegWord(REG_SP_INDEX, spAddress + 2);
+}
 
-	mem_.writeByteAt(address, val);
+void CPU::callnn(word address)
+{
+	word spAddress = getRegWord(REG_SP_INDEX);
+	setRegWord(REG_SP_INDEX, spAddress - 2);
+	mem_.writeWordAt(spAddress - 2, registersPC_);
+	registersPC_ = address;
 }
 
 unsigned int CPU::handleInterrupts()
 {
 	if (ime_)
 	{
-		byte interruptFlagRegister = mem_.readByteAt(Memory::IF_ADDRESS);
-		byte interruptEnabledRegister = mem_.readByteAt(Memory::IE_ADDRESS);
-		byte maskedIFIE = (interruptFlagRegister & 0x1F) & (interruptEnabledRegister & 0x1F); // we only care about the 5 bottom bits
+		const byte maskedIFIE = interruptController_.getPendingInterrupts();
 		if (maskedIFIE != 0x00)
 		{
+			const byte interruptFlagRegister = interruptController_.readByteAt(Memory::IF_ADDRESS);
 			isHalted_ = false;
 
 			word spAddress = getRegWord(REG_SP_INDEX);
 			setRegWord(REG_SP_INDEX, spAddress - 2); // Dec SP
 			mem_.writeWordAt(spAddress - 2, registersPC_);    // Push PC to stack
 			ime_ = false;                                       // Prevent cascading interrupts 
+#ifdef GOODBOY_GUEST_PROFILER
+			if (guestProfiler_ != nullptr) guestProfiler_->recordInterrupt();
+#endif
 
 			if ((maskedIFIE >> VBLANK_INTERRUPT_BIT) == 0x1)
 			{
-				mem_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & VBLANK_INTERRUPT_NEGATED_MASK); // disable VBlank bit on IF
+				interruptController_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & VBLANK_INTERRUPT_NEGATED_MASK); // disable VBlank bit on IF
 				registersPC_ = VBLANK_INTERRUPT_HANDLER_ADDRESS;
 			}
 			else if ((maskedIFIE >> LCD_STAT_INTERRUPT_BIT) == 0x1)
 			{
-				mem_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & LCD_STAT_INTERRUPT_NEGATED_MASK);
+				interruptController_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & LCD_STAT_INTERRUPT_NEGATED_MASK);
 				registersPC_ = LCD_STAT_INTERRUPT_HANDLER_ADDRESS;
 			}
 			else if ((maskedIFIE >> TIMER_INTERRUPT_BIT) == 0x1)
 			{
-				mem_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & TIMER_INTERRUPT_NEGATED_MASK);
+				interruptController_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & TIMER_INTERRUPT_NEGATED_MASK);
 				registersPC_ = TIMER_INTERRUPT_HANDLER_ADDRESS;
 			}
 			else if ((maskedIFIE >> SERIAL_INTERRUPT_BIT) == 0x1)
 			{
-				mem_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & SERIAL_INTERRUPT_NEGATED_MASK);
+				interruptController_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & SERIAL_INTERRUPT_NEGATED_MASK);
 				registersPC_ = SERIAL_INTERRUPT_HANDLER_ADDRESS;
 			}
 			else
 			{
-				mem_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & JOYPAD_INTERRUPT_NEGATED_MASK);
+				interruptController_.writeByteAt(Memory::IF_ADDRESS, interruptFlagRegister & JOYPAD_INTERRUPT_NEGATED_MASK);
 				registersPC_ = JOYPAD_INTERRUPT_HANDLER_ADDRESS;
 			}
 		}
@@ -1830,22 +2097,14 @@ unsigned int CPU::handleInterrupts()
 
 void CPU::triggerInterrupt(const byte interruptBit)
 {
-	byte ifRegister = mem_.readByteAt(Memory::IF_ADDRESS);
-	mem_.writeByteAt(Memory::IF_ADDRESS, ifRegister | (0x1 << interruptBit));
+	interruptController_.requestInterrupt(interruptBit);
 	isHalted_ = false;
 }
 
 void CPU::printState() const
 {
 	std::stringstream state;
-	state << "\n=============== state post:";
-	
-	for (const byte b: currentInstructionOperands_)
-	{
-		state << getHexByte(b) << " ";
-	}
-
-	state << " =============\n";
+	state << "\n=============== state post =============\n";
 	const auto sizeofHeader = state.str().size();
 	state << "af: " << getHexWord(registersAF_) << "\n";
 	state << "bc: " << getHexWord(getRegWord(REG_BC_INDEX)) << "\n";
@@ -1856,4 +2115,4 @@ void CPU::printState() const
 	for (unsigned int i = 0U; i < sizeofHeader - 2; ++i) state << "=";
 	state << "\n";
 	log(LogType::INFO, state.str().c_str());
-}
\ No newline at end of file
+}
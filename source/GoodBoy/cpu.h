@@ -1,14 +1,34 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include "block_cache.h"
 #include "memory.h"
 #include "types.h"
+#include "x64_emitter.h"
 
-#include <vector>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <utility>
 
 class Memory;
 class Display;
-class CPU final
+class GuestProfiler;
+class InterruptController;
+struct CompiledRun;
+
+// Guest-visible CPU state, kept as one trivially copyable block for snapshots
+struct CPUState
+{
+	word registersAF_;
+	byte generalPurposeRegisters_[sizeof(word) * 4];  // BC, DE, HL, SP
+	word registersPC_;
+	bool isHalted_;
+	bool ime_;
+	bool eiTriggered_; // ei is delayed by one instruction so we can't allow interrupts for the entire system's step
+};
+
+class CPU final : private CPUState
 {
 public:
 	static constexpr byte VBLANK_INTERRUPT_BIT   = 0;
@@ -17,14 +37,85 @@ public:
 	static constexpr byte SERIAL_INTERRUPT_BIT   = 3;
 	static constexpr byte JOYPAD_INTERRUPT_BIT   = 4;
 
+	// A halted CPU (or one stalled by an HDMA transfer) idles in steps of one NOP
+	static constexpr unsigned int HALTED_STEP_CLOCK_CYCLES = 4;
+
+	enum class ExecutionMode
+	{
+		INTERPRETER,        // fetches and decodes every instruction through Memory
+		CACHED_INTERPRETER, // runs pre-decoded blocks of ROM, work RAM and HRAM code, see BlockCache
+		JIT                 // the cached interpreter plus x86-64 code for hot blocks, see executeCompiledInstructions
+	};
+
+	// Blocks are compiled once entered this many times
+	static constexpr unsigned int JIT_COMPILE_THRESHOLD = 8;
+
 public:
-	CPU(Memory& mem, Display& display);
+	CPU(Memory& mem, Display& display, InterruptController& interruptController);
 	
 	unsigned int executeNextInstruction();
 	unsigned int handleInterrupts();
+
+	// Halted with neither an interrupt pending for dispatch nor an EI about to take effect,
+	// so only a component raising an interrupt can end it and every step until then is the
+	// same HALTED_STEP_CLOCK_CYCLES of nothing
+	bool isHaltedUntilInterrupt() const { return isHalted_ && canDeferInterruptCheck(); }
+
+	// Cached interpreter and JIT only: back at the start of a polling loop (see
+	// BlockCache::IdleLoop) after an iteration that changed no register and saw no
+	// scheduler event. Until the next event every further iteration reads the same values
+	// and does the same, so skipIdleLoop can jump over them.
+	bool isInIdleLoop() const { return executedInstructionCount_ == idleLoopInstructionCount_ && registersPC_ == idleLoopAddress_ && registersAF_ == idleLoopAF_ && canSkipIdleLoop(); }
+
+	// Skips all but one of the whole iterations that fit in cycleLimit, at least two, and
+	// returns their cycles, the branch closing the last one counting as its last instruction
+	unsigned int skipIdleLoop(const unsigned int cycleLimit);
+	unsigned int getIdleLoopClockCycles() const { return idleLoop_.clockCycles; }
+
+	// Whatever a polling loop reads may change once components caught up at an event
+	void onSchedulerEvent() { idleLoopInstructionCount_ = NO_IDLE_LOOP; }
+
+	// Cached interpreter and JIT only: back at the start of a block copy or fill loop (see
+	// BlockCache::BulkLoop) after one of its iterations
+	bool isAtBulkLoop() const { return executedInstructionCount_ == bulkLoopInstructionCount_ && registersPC_ == bulkLoopAddress_; }
+
+	// Runs the iterations that fit in cycleLimit at once through Memory's bulk accesses,
+	// but one and never the loop's last, and returns their cycles, the branch closing the
+	// last of them counting as its last instruction. The registers end up as the guest
+	// would leave them. 0 if too few could, leaving them to the usual step.
+	unsigned int runBulkLoop(const unsigned int cycleLimit);
+
+	// JIT only: runs at least one instruction and, through compiled code, keeps going as
+	// long as the instructions neither access memory nor can see an interrupt being taken,
+	// until their cycles reach cycleLimit. The result is indistinguishable from one step
+	// per instruction as long as the caller stops there, i.e. cycleLimit is no later than
+	// the next scheduler event.
+	unsigned int executeCompiledInstructions(const unsigned int cycleLimit);
+	unsigned int getLastInstructionClockCycles() const { return lastInstructionClockCycles_; }
 	
 	void triggerInterrupt(const byte interruptBit);
 
+	// The JIT falls back to the cached interpreter on hosts it can't generate code for
+	void setExecutionMode(ExecutionMode mode);
+	ExecutionMode getExecutionMode() const { return executionMode_; }
+
+	// Memory contents replaced behind the CPU's back (state loads) or a new cartridge
+	void invalidateCachedRamCode();
+	void clearCachedCode();
+
+#ifdef GOODBOY_GUEST_PROFILER
+	// Told about every instruction, compiled run and interrupt dispatch while set
+	void setGuestProfiler(GuestProfiler* guestProfiler) { guestProfiler_ = guestProfiler; }
+#endif
+
+	// Host-side count of instructions executed (halted steps excluded), not part of the state
+	uint64_t getExecutedInstructionCount() const { return executedInstructionCount_; }
+
+	const CPUState& getState() const { return *this; }
+	void saveState(CPUState& state) const { state = *this; }
+	void loadState(const CPUState& state) { static_cast<CPUState&>(*this) = state; }
+	void copyStateFrom(const CPU& other) { other.saveState(*this); }
+
 private:
 	inline void setRegAByte(const byte val) { registersAF_ = (val << 8) | (registersAF_ & 0x00FF);  }
 	inline void setRegByte(const byte regIndex, const byte val) { generalPurposeRegisters_[regIndex] = val; }
@@ -35,87 +126,74 @@ private:
 	inline byte getRegByte(const byte regIndex) const { return generalPurposeRegisters_[regIndex]; }
 	inline word getRegWord(const byte regIndex) const { return generalPurposeRegisters_[regIndex] << 8 | generalPurposeRegisters_[regIndex + 1]; }
 
-	inline byte readByteAtPC() 
-	{
-		byte b = mem_.readByteAt(registersPC_++);
-		currentInstructionOperands_.emplace_back(b);
-		return b; 
-	}
-	inline sbyte readSByteAtPC()
-	{
-		sbyte b = mem_.readSByteAt(registersPC_++);
-		currentInstructionOperands_.emplace_back(b);
-		return b;
-	}
+	inline byte readByteAtPC() { return mem_.readByteAt(registersPC_++); }
+	inline sbyte readSByteAtPC() { return mem_.readSByteAt(registersPC_++); }
 	inline word readWordAtPc()
 	{
 		word w = mem_.readWordAt(registersPC_);
 		registersPC_ += 2;
-		currentInstructionOperands_.emplace_back(w & 0xFF);
-		currentInstructionOperands_.emplace_back(w >> 8);
 		return w;
 	}
 
+	// Predecoded handlers take their immediate from predecodedImmediate_, with the PC
+	// already moved past the instruction
+	template<bool Predecoded> inline byte fetchByte() { if constexpr (Predecoded) return static_cast<byte>(predecodedImmediate_); else return readByteAtPC(); }
+	template<bool Predecoded> inline sbyte fetchSByte() { if constexpr (Predecoded) return static_cast<sbyte>(predecodedImmediate_); else return readSByteAtPC(); }
+	template<bool Predecoded> inline word fetchWord() { if constexpr (Predecoded) return predecodedImmediate_; else return readWordAtPc(); }
+
+	unsigned int executeInterpretedInstruction();
+	unsigned int executeCachedInstruction();
+	BlockCache::Block* enterBlock();
+	BlockCache::Block decodeBlock(const word startAddress, const int bank) const;
+
+	bool initializeJit();
+	bool canDeferInterruptCheck() const;
+	bool canSkipIdleLoop() const;
+	void compileBlock(BlockCache::Block& block);
+
+	friend class BlockCompiler;
+
+	// One handler per opcode, each an instantiation of executeOpcode/executeCbOpcode
+	using OpcodeHandler = BlockCache::InstructionHandler;
+
+	template<byte Opcode, bool Predecoded> static unsigned int dispatchOpcode(CPU& cpu);
+	template<byte CbOpcode> static unsigned int dispatchCbOpcode(CPU& cpu);
+	template<bool Predecoded, std::size_t... Opcodes> static constexpr std::array<OpcodeHandler, 256> makeOpcodeHandlers(std::index_sequence<Opcodes...>);
+	template<std::size_t... Opcodes> static constexpr std::array<OpcodeHandler, 256> makeCbOpcodeHandlers(std::index_sequence<Opcodes...>);
+
+	template<byte Opcode, bool Predecoded> unsigned int executeOpcode();
+	template<byte CbOpcode> unsigned int executeCbOpcode();
+
+	// Operand is a 3-bit register field from the opcode: B, C, D, E, H, L, (HL) or A
+	template<byte Operand> byte readOperand();
+	template<byte Operand> void writeOperand(const byte val);
+	template<byte Condition> bool isConditionMet() const;
+	template<byte Operation> void aluOperation(const byte val);
+	template<byte Operation, byte Operand> void rotateShift();
+	template<byte Operand> void incn();
+	template<byte Operand> void decn();
+	template<byte Bit, byte Operand> void testBit();
+
 	void addhln(const word w);
-	void testBit(const byte bit, const byte val);
-	void setBit(const byte bit, byte& val);
-	void resetBit(const byte bit, byte& val);
-	void jrccn(const byte cond, const sbyte offset);
-	void jpccn(const byte cond, const word address);
 	void xoran(const byte n);
 	void oran(const byte n);
 	void andan(const byte n);
-	void incn(const byte regIndex);
-	void decn(const byte regIndex);
 	void cpa(const byte val);
-	void rln(const byte regIndex);
-	void rrn(const byte regIndex);
-	void sln(const byte regIndex);
-	void srn(const byte regIndex);
-	void srln(const byte regIndex);
-	void addspn();
-	void ldhlspn();
-	void rla();
-	void rra();
-	void rlca();
-	void rrca();
-	void rlhl();
-	void rrhl();
-	void sla();
-	void sra();
-	void slhl();
-	void srhl();
-	void srla();
-	void srlhl();
+	void addspn(const sbyte val);
+	void ldhlspn(const sbyte val);
 	void pushnn(const byte regIndex);
 	void popnn(const byte regIndex);
 	void addan(const byte val);
 	void suban(const byte val);
 	void adcan(const byte val);
 	void sbcan(const byte val);
-	void swapa();
-	void swapn(const byte regIndex);
-	void swaphl();
 	void pushaf();
 	void popaf();
-	void inca();
-	void deca();
-	void inchl();
-	void dechl();
 	void daa();
 	void cpl();
-	void ldihla();
-	void ldiahl();
-	void lddhla();
-	void lddahl();
 	void ret();
 	void callnn(word address);
-	void cbrlca();
-	void cbrrca();
-	void cbrlcn(const byte regIndex);
-	void cbrrcn(const byte regIndex);
-	void cbrlchl();
-	void cbrrchl();
+	void logUnhandledOpcode(const byte opcode) const;
 	void printState() const;
 private:
 	static constexpr byte REG_B_INDEX = 0;
@@ -132,16 +210,55 @@ private:
 	static constexpr byte REG_HL_INDEX = 4;
 	static constexpr byte REG_SP_INDEX = 6;
 
+	static constexpr byte OPERAND_HL_INDIRECT = 6;
+	static constexpr byte OPERAND_A           = 7;
+
+	static constexpr byte CONDITION_NZ = 0;
+	static constexpr byte CONDITION_Z  = 1;
+	static constexpr byte CONDITION_NC = 2;
+	static constexpr byte CONDITION_C  = 3;
+
+	static constexpr uint64_t NO_IDLE_LOOP = UINT64_MAX;
+	static constexpr uint64_t NO_BULK_LOOP = UINT64_MAX;
+
+	// Fewer iterations are left to run one by one
+	static constexpr unsigned int MIN_BULK_LOOP_ITERATIONS = 4;
+
+	static const std::array<OpcodeHandler, 256> OPCODE_HANDLERS;
+	static const std::array<OpcodeHandler, 256> PREDECODED_OPCODE_HANDLERS;
+	static const std::array<OpcodeHandler, 256> CB_OPCODE_HANDLERS;
+
+	// Shared entry and exit of all compiled code: saves the host registers, jumps to the
+	// entry point and on the way out fills in the CompiledRun
+	using CompiledCodeEntry = void (*)(CPU* cpu, unsigned int cycleLimit, CompiledRun* run, const byte* entryPoint);
+
 	Memory& mem_;
 	Display& display_;
-	word registersAF_;
-	byte generalPurposeRegisters_[sizeof(word) * 4];  // BC, DE, HL, SP
-	std::vector<byte> currentInstructionOperands_;
-	word registersPC_;
-	bool isHalted_;
+	InterruptController& interruptController_;
+	std::unique_ptr<BlockCache> blockCache_; // only in the cached interpreter and the JIT
+	std::unique_ptr<X64Emitter> jit_;        // only in the JIT
+	CompiledCodeEntry enterCompiledCode_;
+	const byte* exitCompiledCode_;
+	const byte* compiledBlocksStart_;
+	ExecutionMode executionMode_;
+	word predecodedImmediate_;
+	unsigned int lastInstructionClockCycles_;
+	uint64_t executedInstructionCount_;
+
+	// The polling loop entered last and the instruction count and AF that would show one
+	// iteration later that it changed nothing
+	BlockCache::IdleLoop idleLoop_;
+	word idleLoopAddress_;
+	word idleLoopAF_;
+	uint64_t idleLoopInstructionCount_;
+
+	// The copy or fill loop entered last and the instruction count back at its start
+	word bulkLoopAddress_;
+	uint64_t bulkLoopInstructionCount_;
+#ifdef GOODBOY_GUEST_PROFILER
+	GuestProfiler* guestProfiler_;
+#endif
 	bool shouldDumpState_;
-	bool ime_;
-	bool eiTriggered_; // ei is delayed by one instruction so we can't allow interrupts for the entire system's step
 };
 
 #endif
\ No newline at end of file
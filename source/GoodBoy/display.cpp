@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 
 #define GET_DISPLAY_MODE() (lcdStatus_ & 0x03)
 #define SET_DISPLAY_MODE(mode) lcdStatus_ = (lcdStatus_ & 0xFC) | mode
@@ -217,38 +218,49 @@ static const byte GAMEBOY_NATIVE_COLORS[4][4] =
 };
 
 Display::Display()
-	: mainMemoryBlock_(nullptr)
-	, clock_(VBLANK_DOTS)
-	, totalFrameClock_(0)
-	, dmaClockCyclesRemaining_(0)
-	, cgbHdmaClockCyclesRemaining_(0)
-	, dmaSourceAddressStart_(0)
-	, cgbHdmaSourceAddress_(0)
-	, cgbHdmaDestinationAddress_(0)
-	, cgbHdmaTransferLength_(0)
-	, lcdStatus_(0)
-	, lcdControl_(0)
-	, scy_(0), scx_(0)
-	, ly_(0)
-	, winLy_(0)
-	, lyc_(0)
-	, bgPalette_(0)
-	, obj0Palette_(0)
-	, obj1Palette_(0)
-	, winx_(0), winy_(0)
-	, cgbVramBank_(0xFE)
-	, cgbBackgroundPaletteIndex_(0)
-    , cgbOBJPaletteIndex_(0)
-    , cgbHdmaTrigger_(0)
-	, cgbHdmaTransferMode_(0)
+	: DisplayState()
+	, cpu_(nullptr)
+	, memory_(nullptr)
+	, mainMemoryBlock_(nullptr)
+	, videoSink_(nullptr)
+	, scheduler_(nullptr)
 	, cgbType_(Cartridge::CgbType::DMG)
 	, respectIllegalReadsWrites_(true)
 {
+	clock_ = VBLANK_DOTS;
+	cgbVramBank_ = 0xFE;
 	memset(finalSDLPixels_, 0xFF, sizeof(finalSDLPixels_));
 	memset(cgbVram_, 0xFF, sizeof(cgbVram_));
 	SET_DISPLAY_MODE(DISPLAY_MODE_VBLANK);
 }
 
+void Display::sync()
+{
+	const auto currentCycle = scheduler_->getCurrentCycle();
+	if (currentCycle == lastSyncCycle_)
+	{
+		return;
+	}
+
+	// Mark as synced before updating, since DMA completion reads back through Memory
+	const auto previousSyncCycle = lastSyncCycle_;
+	lastSyncCycle_ = currentCycle;
+
+	// The cycles of the last CPU step are applied on their own. A finishing HDMA drops
+	// the PPU time of the step it completes in, so lumping that step together with
+	// earlier ones would drop too much.
+	const auto stepStartCycle = std::max(previousSyncCycle, scheduler_->getStepStartCycle());
+	if (stepStartCycle > previousSyncCycle)
+	{
+		update(static_cast<unsigned int>(stepStartCycle - previousSyncCycle));
+	}
+	if (currentCycle > stepStartCycle)
+	{
+		update(static_cast<unsigned int>(currentCycle - stepStartCycle));
+	}
+	scheduleNextEvent();
+}
+
 void Display::update(const unsigned int spentCpuCycles)
 {
 	if (dmaClockCyclesRemaining_ > 0)
@@ -262,6 +274,7 @@ void Display::update(const unsigned int spentCpuCycles)
 			{
 				mainMemoryBlock_[Memory::OAM_START_ADDRESS + i] = memory_->readByteAt(dmaSourceAddressStart_ + i);
 			}
+			memory_->onDmaTransferChanged();
 		}
 		return;
 	}
@@ -341,7 +354,10 @@ void Display::update(const unsigned int spentCpuCycles)
 
 				compareLYtoLYC();
 
-				cb_(finalSDLPixels_);
+				if (videoSink_)
+				{
+					videoSink_->onVBlank(finalSDLPixels_);
+				}
 				
 				memset(bgAndWindowColorIndices, 0, sizeof(bgAndWindowColorIndices));
 				memset(cgbBgTopLevelPriorityPixels, false, sizeof(cgbBgTopLevelPriorityPixels));
@@ -406,8 +422,41 @@ void Display::update(const unsigned int spentCpuCycles)
 	}
 }
 
-byte Display::readByteAt(const word address) const
+void Display::scheduleNextEvent()
+{
+	int cyclesUntilNextEvent = static_cast<int>(Scheduler::MAX_SYNC_INTERVAL_CYCLES);
+
+	if (dmaClockCyclesRemaining_ > 0)
+	{
+		// The PPU (and HDMA) is held while an OAM DMA is in progress
+		cyclesUntilNextEvent = std::min(cyclesUntilNextEvent, dmaClockCyclesRemaining_);
+	}
+	else
+	{
+		if (cgbHdmaClockCyclesRemaining_ > 0)
+		{
+			cyclesUntilNextEvent = std::min(cyclesUntilNextEvent, cgbHdmaClockCyclesRemaining_);
+		}
+
+		if (IS_BIT_SET(7, lcdControl_))
+		{
+			switch (GET_DISPLAY_MODE())
+			{
+				case DISPLAY_MODE_HBLANK: cyclesUntilNextEvent = std::min(cyclesUntilNextEvent, HBLANK_DOTS - clock_); break;
+				case DISPLAY_MODE_VBLANK: cyclesUntilNextEvent = std::min(cyclesUntilNextEvent, SCANLINE_DOTS - clock_); break;
+				case DISPLAY_MODE_SEARCHING_OAM: cyclesUntilNextEvent = std::min(cyclesUntilNextEvent, SEARCHING_OAM_DOTS - clock_); break;
+				case DISPLAY_MODE_TRANSFERRING_TO_LCD: cyclesUntilNextEvent = std::min(cyclesUntilNextEvent, TRANSFERRING_TO_LCD_DOTS - clock_); break;
+			}
+		}
+	}
+
+	scheduler_->schedule(Scheduler::EventType::PPU, lastSyncCycle_ + std::max(cyclesUntilNextEvent, 0));
+}
+
+byte Display::readByteAt(const word address)
 {
+	sync();
+
 	if (address >= Memory::VRAM_START_ADDRESS && address <= Memory::VRAM_END_ADDRESS)
 	{
 		if (GET_DISPLAY_MODE() == DISPLAY_MODE_TRANSFERRING_TO_LCD)
@@ -460,8 +509,25 @@ byte Display::readByteAt(const word address) const
 	return 0xFF;
 }
 
+byte* Display::getCpuAccessibleVram()
+{
+	sync();
+
+	if (GET_DISPLAY_MODE() == DISPLAY_MODE_TRANSFERRING_TO_LCD && respectIllegalReadsWrites_)
+	{
+		return nullptr;
+	}
+
+	if (cgbType_ == Cartridge::CgbType::DMG)
+		return &mainMemoryBlock_[Memory::VRAM_START_ADDRESS];
+	else
+		return &cgbVram_[(cgbVramBank_ & 0x1) * 0x2000];
+}
+
 void Display::writeByteAt(const word address, const byte b)
 {
+	sync();
+
 	if (address >= Memory::VRAM_START_ADDRESS && address <= Memory::VRAM_END_ADDRESS)
 	{
 		if (GET_DISPLAY_MODE() == DISPLAY_MODE_TRANSFERRING_TO_LCD)
@@ -561,12 +627,16 @@ void Display::writeByteAt(const word address, const byte b)
 		} break;
 		default: log(LogType::WARNING, "Display::writeByteAt Unknown write %s at %s", getHexByte(b).c_str(), getHexWord(address).c_str());
 	}
+
+	// Register writes can start a DMA or move the PPU to a different mode
+	scheduleNextEvent();
 }
 
 void Display::performDMATransfer(const byte b)
 {
 	dmaClockCyclesRemaining_ = DMA_CLOCK_CYCLES;
 	dmaSourceAddressStart_ = b << 8;
+	memory_->onDmaTransferChanged();
 }
 
 void Display::performCgbHDMATransfer(const byte b)
@@ -877,8 +947,9 @@ void Display::renderOBJsScanline()
 		static_cast<byte>((obj1Palette_ & 0xC0) >> 6)
 	};
 
-	for (word objAddress : selectedOBJAddressesForCurrentScanline_)
+	for (int objIndex = 0; objIndex < selectedOBJCountForCurrentScanline_; ++objIndex)
 	{
+		word objAddress   = selectedOBJAddressesForCurrentScanline_[objIndex];
 		byte objYPos      = mainMemoryBlock_[objAddress + 0] - 16;
 		byte objXPos      = mainMemoryBlock_[objAddress + 1] - 8;
 		byte objTileIndex = mainMemoryBlock_[objAddress + 2];
@@ -1005,7 +1076,7 @@ void Display::renderOBJsScanline()
 
 void Display::searchOBJSInCurrentScanline()
 {
-	selectedOBJAddressesForCurrentScanline_.clear();
+	selectedOBJCountForCurrentScanline_ = 0;
 
 	bool xlSprites = IS_BIT_SET(2, lcdControl_);
 
@@ -1017,19 +1088,19 @@ void Display::searchOBJSInCurrentScanline()
 		if (xlSprites) // 8x16 case
 		{
 			if (ly_ >= objYPos && ly_ < objYPos + 16) 
-				selectedOBJAddressesForCurrentScanline_.insert(selectedOBJAddressesForCurrentScanline_.begin(), i);
+				prependOBJToCurrentScanline(i);
 		}
 		else // 8x8 case
 		{
 			if (ly_ >= objYPos && ly_ < objYPos + 8) 
-				selectedOBJAddressesForCurrentScanline_.insert(selectedOBJAddressesForCurrentScanline_.begin(), i);
+				prependOBJToCurrentScanline(i);
 		}
 
-		if (selectedOBJAddressesForCurrentScanline_.size() == 10) break;
+		if (selectedOBJCountForCurrentScanline_ == MAX_OBJS_PER_SCANLINE) break;
 	}
 	
 	// Bubble sort for x priority
-	int count = static_cast<int>(selectedOBJAddressesForCurrentScanline_.size());
+	int count = selectedOBJCountForCurrentScanline_;
 	for (int i = 0; i < count - 1; ++i)
 	{
 		for (int j = 0; j < count - i - 1; ++j)
@@ -1047,6 +1118,16 @@ void Display::searchOBJSInCurrentScanline()
 	}
 }
 
+void Display::prependOBJToCurrentScanline(const word objAddress)
+{
+	for (int i = selectedOBJCountForCurrentScanline_; i > 0; --i)
+	{
+		selectedOBJAddressesForCurrentScanline_[i] = selectedOBJAddressesForCurrentScanline_[i - 1];
+	}
+	selectedOBJAddressesForCurrentScanline_[0] = objAddress;
+	selectedOBJCountForCurrentScanline_++;
+}
+
 void Display::compareLYtoLYC()
 {
 	if (ly_ == lyc_)
@@ -3,33 +3,82 @@
 
 #include "types.h"
 #include "cartridge.h"
-
-#include <functional>
-#include <vector>
+#include "scheduler.h"
+#include "sinks.h"
 
 class CPU;
 class Memory;
-class Display final
+
+// Guest-visible PPU state, kept as one trivially copyable block for snapshots. The frame
+// being composed is output only and is not part of it.
+struct DisplayState
+{
+	static constexpr int MAX_OBJS_PER_SCANLINE = 10;
+
+	byte cgbVram_[0x4000];
+	byte cgbBackgroundPaletteRam_[0x40];
+	byte cgbOBJPaletteRam_[0x40];
+	word selectedOBJAddressesForCurrentScanline_[MAX_OBJS_PER_SCANLINE];
+	uint64_t lastSyncCycle_;
+	int clock_;
+	int totalFrameClock_;
+	int dmaClockCyclesRemaining_;
+	int cgbHdmaClockCyclesRemaining_;
+	word dmaSourceAddressStart_;
+	word cgbHdmaSourceAddress_;
+	word cgbHdmaDestinationAddress_;
+	word cgbHdmaTransferLength_;
+	word cgbHdmaHblankTransferCurrentIndex_;
+	byte selectedOBJCountForCurrentScanline_;
+	byte lcdStatus_;
+	byte lcdControl_;
+	byte scy_, scx_;
+	byte ly_;
+	byte winLy_;
+	byte lyc_;
+	byte bgPalette_;
+	byte obj0Palette_;
+	byte obj1Palette_;
+	byte winx_, winy_;
+	byte cgbVramBank_;
+	byte cgbBackgroundPaletteIndex_;
+	byte cgbOBJPaletteIndex_;
+	byte cgbHdmaTrigger_;
+	byte cgbHdmaTransferMode_;
+};
+
+class Display final : private DisplayState
 {
 public:
 	Display();
 
-	using VBlankCallback = std::function<void(byte*)>;
-	void setVBlankCallback(VBlankCallback cb) { cb_ = cb; }
+	void setVideoSink(VideoSink* videoSink) { videoSink_ = videoSink; }
 	void setMainMemoryBlock(byte* mem) { mainMemoryBlock_ = mem; }
 	void setCPU(CPU* cpu) { cpu_ = cpu; }
 	void setMemory(Memory* mem) { memory_ = mem; }
+	void setScheduler(Scheduler* scheduler) { scheduler_ = scheduler; scheduleNextEvent(); }
 	void setCartridgeCgbType(Cartridge::CgbType cgbType) { cgbType_ = cgbType; }
 
-	void update(const unsigned int spentCpuCycles);
+	// Catches the PPU and any DMA transfer up to the scheduler's current cycle
+	void sync();
 
-	byte readByteAt(const word address) const;
+	byte readByteAt(const word address);
 	void writeByteAt(const word address, const byte b);
 	bool dmaTransferInProgress() const { return dmaClockCyclesRemaining_ > 0; }
 	bool cgbHdmaTransferInProgress() const { return cgbHdmaClockCyclesRemaining_ > 0; }
 	bool respectsIllegalReadWrites() const { return respectIllegalReadsWrites_;  }
+
+	// The VRAM bank the CPU sees at 0x8000-0x9FFF, for Memory's bulk accesses. nullptr while
+	// the PPU keeps the CPU out of it.
+	byte* getCpuAccessibleVram();
+
+	void saveState(DisplayState& state) const { state = *this; }
+	void loadState(const DisplayState& state) { static_cast<DisplayState&>(*this) = state; }
+	void copyStateFrom(const Display& other) { other.saveState(*this); }
 	
 private:
+	void update(const unsigned int spentCpuCycles);
+	void scheduleNextEvent();
 	void performDMATransfer(const byte b);
 	void performCgbHDMATransfer(const byte b);
 	void renderScanline();
@@ -37,45 +86,19 @@ private:
 	void renderWindowScanline();
 	void renderOBJsScanline();
 	void searchOBJSInCurrentScanline();
+	void prependOBJToCurrentScanline(const word objAddress);
 	void compareLYtoLYC();
 
 private:
-	byte cgbVram_[0x4000];
-	byte cgbBackgroundPaletteRam_[0x40];
-	byte cgbOBJPaletteRam_[0x40];
 	byte finalSDLPixels_[160 * 144 * 4];
 	byte bgAndWindowColorIndices[160 * 144];
 	bool cgbBgTopLevelPriorityPixels[160 * 144];
 	byte spriteColorIndices[160 * 144];
-	std::vector<word> selectedOBJAddressesForCurrentScanline_;
 	CPU* cpu_;
 	Memory* memory_;
 	byte* mainMemoryBlock_;
-	VBlankCallback cb_;
-	int clock_;
-	int totalFrameClock_;
-	int dmaClockCyclesRemaining_;
-	int cgbHdmaClockCyclesRemaining_;
-	word dmaSourceAddressStart_;
-	word cgbHdmaSourceAddress_;
-	word cgbHdmaDestinationAddress_;	
-	word cgbHdmaTransferLength_;
-	word cgbHdmaHblankTransferCurrentIndex_;
-	byte lcdStatus_;
-	byte lcdControl_;
-	byte scy_, scx_;
-	byte ly_;
-	byte winLy_;
-	byte lyc_;
-	byte bgPalette_;
-	byte obj0Palette_;
-	byte obj1Palette_;
-	byte winx_, winy_;
-	byte cgbVramBank_;
-	byte cgbBackgroundPaletteIndex_;
-	byte cgbOBJPaletteIndex_;
-	byte cgbHdmaTrigger_;
-	byte cgbHdmaTransferMode_;
+	VideoSink* videoSink_;
+	Scheduler* scheduler_;
 	Cartridge::CgbType cgbType_;
 	bool respectIllegalReadsWrites_;
 };
@@ -0,0 +1,43 @@
+#include "frame_pacer.h"
+
+FramePacer::FramePacer(const double framesPerSecond)
+    : ticksPerFrame_(static_cast<Uint64>(SDL_GetPerformanceFrequency() / framesPerSecond))
+    , nextFrameTicks_(SDL_GetPerformanceCounter() + ticksPerFrame_)
+{
+}
+
+bool FramePacer::isFrameDue() const
+{
+    return SDL_GetPerformanceCounter() >= nextFrameTicks_;
+}
+
+void FramePacer::waitForNextFrame()
+{
+    const Uint64 ticksPerSecond = SDL_GetPerformanceFrequency();
+    const Uint64 spinMarginTicks = static_cast<Uint64>(ticksPerSecond * SPIN_MARGIN_SECONDS);
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now + spinMarginTicks < nextFrameTicks_)
+    {
+        const Uint64 sleepTicks = nextFrameTicks_ - now - spinMarginTicks;
+        SDL_Delay(static_cast<Uint32>(sleepTicks * 1000 / ticksPerSecond));
+    }
+
+    while (SDL_GetPerformanceCounter() < nextFrameTicks_)
+    {
+    }
+
+    advanceFrame();
+}
+
+void FramePacer::advanceFrame()
+{
+    nextFrameTicks_ += ticksPerFrame_;
+
+    // After a stall (window drag, breakpoint) resynchronise instead of racing to catch up
+    const Uint64 now = SDL_GetPerformanceCounter();
+    if (now > nextFrameTicks_ + ticksPerFrame_)
+    {
+        nextFrameTicks_ = now + ticksPerFrame_;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <SDL.h>
+
+// Paces the host loop to a fixed frame rate. Most of the wait is spent asleep in
+// SDL_Delay and only the last couple of milliseconds, where the OS scheduler is too
+// coarse to rely on, are spun, so an idle window no longer pins a host core.
+// Deadlines advance by whole frame periods so rounding never accumulates into drift.
+class FramePacer final
+{
+public:
+    explicit FramePacer(const double framesPerSecond);
+
+    // True once the deadline for the current frame has passed
+    bool isFrameDue() const;
+
+    // Blocks until the current frame's deadline, then moves on to the next frame
+    void waitForNextFrame();
+
+    // Moves on to the next frame without waiting, for callers that poll isFrameDue()
+    void advanceFrame();
+
+private:
+    // Below this margin the rest of the wait is spun rather than slept
+    static constexpr double SPIN_MARGIN_SECONDS = 0.002;
+
+    Uint64 ticksPerFrame_;
+    Uint64 nextFrameTicks_;
+};
+
+#endif
@@ -1,8 +1,14 @@
 #include <SDL.h>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
-#include <memory.h>
 
+#include "frame_pacer.h"
 #include "logging.h"
+#include "rewind_buffer.h"
+#include "run_ahead.h"
+#include "sdl_audio_sink.h"
+#include "sdl_video_sink.h"
 #include "system.h" 
 #include "types.h"
 
@@ -41,38 +47,15 @@ struct SDLTextureDeleter
     }
 };
 
-void render(byte* pixels, SDL_Renderer* pRenderer, SDL_Texture* pTexture)
+// Edge detection for the toggle keys
+struct HotkeyState
 {
-    // Clear window
-    SDL_SetRenderDrawColor(pRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-    SDL_RenderClear(pRenderer);
-
-    byte* pPixels = nullptr;
-    int pitch = 0;
-    SDL_LockTexture(pTexture, nullptr, (void**)&pPixels, &pitch);
-
-    // Render Game
-    memcpy(pPixels, pixels, 160 * 144 * 4);
-
-    SDL_UnlockTexture(pTexture);
-
-    SDL_RenderCopy(pRenderer, pTexture, nullptr, nullptr);
-
-    // Update window
-    SDL_RenderPresent(pRenderer);
-}
-
-// TODO: refactor this
-std::unique_ptr<SDL_Renderer, SDLRendererDeleter> spRenderer;
-std::unique_ptr<SDL_Texture, SDLTextureDeleter> spTexture;
-
-// The emulator will call this whenever we hit VBlank
-void vBlankCallback(byte* pixels)
-{
-    render(pixels, spRenderer.get(), spTexture.get());
-}
+    bool soundButtonDownLastFrame = false;
+    bool turboButtonDownLastFrame = false;
+    bool turboEnabled = false;
+};
 
-void processInput(System& system)
+void processInput(System& system, HotkeyState& hotkeyState)
 {
     SDL_PumpEvents();
     const Uint8* keys = SDL_GetKeyboardState(NULL);
@@ -119,34 +102,57 @@ void processInput(System& system)
         actionButtons |= System::ACTION_BUTTON_SELECT_MASK;
     }
     
-    static bool soundButtonDownLastFrame = false;
-    
-    if (keys[SDL_SCANCODE_S] && !soundButtonDownLastFrame)
+    if (keys[SDL_SCANCODE_S] && !hotkeyState.soundButtonDownLastFrame)
     {
         system.toggleSoundDisabled();
     }
     
-    soundButtonDownLastFrame = keys[SDL_SCANCODE_S];
+    hotkeyState.soundButtonDownLastFrame = keys[SDL_SCANCODE_S];
+
+    if (keys[SDL_SCANCODE_T] && !hotkeyState.turboButtonDownLastFrame)
+    {
+        hotkeyState.turboEnabled = !hotkeyState.turboEnabled;
+    }
+
+    hotkeyState.turboButtonDownLastFrame = keys[SDL_SCANCODE_T];
     
     system.setInputState(actionButtons, directionButtons);
 }
 
-std::unique_ptr<System> initSystem(const char* romPath, SDL_Window* window)
+std::unique_ptr<System> initSystem(const char* romPath, SDL_Window* window, VideoSink* videoSink, AudioSink* audioSink)
 {
     auto system = std::make_unique<System>();
     auto cartridgeName = system->loadCartridge(romPath);
-    system->setVBlankCallback(vBlankCallback);
+    system->setVideoSink(videoSink);
+    system->setAudioSink(audioSink);
     SDL_SetWindowTitle(window, ("GoodBoy: " + cartridgeName).c_str());
     return system;
 }
 
+// Runs frames back to back for one host frame, presenting only the last one. A turbo
+// speed of 0 keeps going until the host frame is over, otherwise that many frames are run.
+void runTurboFrames(System& system, const FramePacer& framePacer, const int turboSpeed, VideoSink* videoSink, AudioSink* audioSink)
+{
+    system.setVideoSink(nullptr);
+    system.setAudioSink(nullptr);
 
-// 60 FPS or 16.67ms
-const double TimePerFrame = 1.0 / 60.0;
+    int framesRun = 0;
+    while (turboSpeed > 0 ? framesRun < turboSpeed - 1 : !framePacer.isFrameDue())
+    {
+        system.runFrame();
+        framesRun++;
+    }
+
+    system.setVideoSink(videoSink);
+    system.setAudioSink(audioSink);
+    system.runFrame();
+}
 
-// The number of CPU clock cycles per frame
-constexpr unsigned int CPU_CLOCK_CYCLES_PER_FRAME = 70224;
+// The DMG refreshes at 4194304 / 70224 ~= 59.73 Hz rather than 60
+const double FramesPerSecond = static_cast<double>(System::CPU_CLOCK_CYCLES_PER_SECOND) / System::CPU_CLOCK_CYCLES_PER_FRAME;
 
+// Roughly an hour of typical gameplay history
+const std::size_t RewindMemoryBudgetBytes = 64 * 1024 * 1024;
 
 int main(int argc, char** argv)
 {
@@ -154,8 +160,33 @@ int main(int argc, char** argv)
     int windowHeight = 144;
     int windowScale = 3;
     bool isRunning = true;
+    HotkeyState hotkeyState;
+
+    // Usage: GoodBoy [--turbo-speed=N] [--run-ahead=N] [rom]. Turbo (toggled with T) runs
+    // uncapped unless a speed multiplier is given. Run-ahead presents frames N frames in
+    // the future to cancel out that many frames of the game's own input lag.
+    int turboSpeed = 0;
+    int runAheadFrames = 0;
+    const char* romPath = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--turbo-speed=", strlen("--turbo-speed=")) == 0)
+        {
+            turboSpeed = atoi(argv[i] + strlen("--turbo-speed="));
+        }
+        else if (strncmp(argv[i], "--run-ahead=", strlen("--run-ahead=")) == 0)
+        {
+            runAheadFrames = atoi(argv[i] + strlen("--run-ahead="));
+        }
+        else
+        {
+            romPath = argv[i];
+        }
+    }
 
     std::unique_ptr<SDL_Window, SDLWindowDeleter> spWindow;
+    std::unique_ptr<SDL_Renderer, SDLRendererDeleter> spRenderer;
+    std::unique_ptr<SDL_Texture, SDLTextureDeleter> spTexture;
     SDL_Event event;
 
     // Initialize SDL
@@ -194,18 +225,22 @@ int main(int argc, char** argv)
     spTexture = std::unique_ptr<SDL_Texture, SDLTextureDeleter>(
         SDL_CreateTexture(spRenderer.get(), SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 160, 144));
 
-    unsigned int cpuClockCycles = 0;    
+    auto spVideoSink = std::make_unique<SDLVideoSink>(spRenderer.get(), spTexture.get());
+    auto spAudioSink = std::make_unique<SDLAudioSink>();
+
     std::unique_ptr<System> gameboySystem = nullptr;     
-    if (argc != 1)
+    RewindBuffer rewindBuffer(RewindMemoryBudgetBytes);
+    RunAhead runAhead(runAheadFrames > 0 ? static_cast<unsigned int>(runAheadFrames) : 0);
+    if (romPath != nullptr)
     {
-        gameboySystem = initSystem(argv[argc - 1], spWindow.get());
+        gameboySystem = initSystem(romPath, spWindow.get(), spVideoSink.get(), spAudioSink.get());
     }
     else
     {
         SDL_SetWindowTitle(spWindow.get(), "GoodBoy: Drag & Drop rom file");
     }
 
-    Uint64 frameStart = SDL_GetPerformanceCounter();
+    FramePacer framePacer(FramesPerSecond);
     while (isRunning)
     {
         // Poll for window input
@@ -218,7 +253,8 @@ int main(int argc, char** argv)
             if (event.type == SDL_DROPFILE)
             {
                 char* droppedRomPath = event.drop.file;       
-                gameboySystem = initSystem(droppedRomPath, spWindow.get());
+                gameboySystem = initSystem(droppedRomPath, spWindow.get(), spVideoSink.get(), spAudioSink.get());
+                rewindBuffer.clear();
                 SDL_free(droppedRomPath);
             } break;
         }
@@ -231,31 +267,34 @@ int main(int argc, char** argv)
 
         if (gameboySystem)
         {
-            processInput(*gameboySystem);
-            while (cpuClockCycles < CPU_CLOCK_CYCLES_PER_FRAME)
+            processInput(*gameboySystem, hotkeyState);
+
+            // Holding R plays history backwards: step back one state and emulate the
+            // frame that follows it so there is something to present
+            if (SDL_GetKeyboardState(NULL)[SDL_SCANCODE_R] && rewindBuffer.stepBack(*gameboySystem))
             {
-                cpuClockCycles += gameboySystem->emulateNextMachineStep();
+                gameboySystem->runFrame();
             }
-            cpuClockCycles -= CPU_CLOCK_CYCLES_PER_FRAME;
-        }
-
-        Uint64 frameEnd = SDL_GetPerformanceCounter();
-        // Loop until we use up the rest of our frame time
-        while (true)
-        {
-            frameEnd = SDL_GetPerformanceCounter();
-            double frameElapsedInSec = (double)(frameEnd - frameStart) / SDL_GetPerformanceFrequency();
-
-            // Break out once we use up our time per frame
-            if (frameElapsedInSec >= TimePerFrame)
+            else
             {
-                break;
+                if (hotkeyState.turboEnabled)
+                {
+                    runTurboFrames(*gameboySystem, framePacer, turboSpeed, spVideoSink.get(), spAudioSink.get());
+                }
+                else
+                {
+                    runAhead.runFrame(*gameboySystem, spVideoSink.get(), spAudioSink.get());
+                }
+                rewindBuffer.push(*gameboySystem);
             }
         }
 
-        frameStart = frameEnd;
+        framePacer.waitForNextFrame();
     }
 
+    gameboySystem.reset();
+    spAudioSink.reset();
+    spVideoSink.reset();
     spTexture.reset();
     spRenderer.reset();
     spWindow.reset();
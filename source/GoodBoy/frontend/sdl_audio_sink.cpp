@@ -0,0 +1,75 @@
+#include "sdl_audio_sink.h"
+#include "logging.h"
+
+#include <cstring>
+
+SDLAudioSink::SDLAudioSink()
+    : readIndex_(0)
+    , writeIndex_(0)
+    , audioDevice_(0)
+{
+    memset(ringBuffer_, 0, sizeof(ringBuffer_));
+
+    SDL_AudioSpec want, have;
+    SDL_memset(&want, 0, sizeof(want));
+    want.freq = SAMPLE_RATE;
+    want.format = AUDIO_F32;
+    want.channels = CHANNEL_COUNT;
+    want.samples = DEVICE_BUFFER_FRAMES;
+    want.callback = audioDeviceCallbackStatic;
+    want.userdata = this;
+
+    audioDevice_ = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
+    if (audioDevice_ == 0)
+    {
+        log(LogType::WARNING, "Audio device could not be opened! SDL error: '%s'", SDL_GetError());
+        return;
+    }
+
+    SDL_PauseAudioDevice(audioDevice_, 0);
+}
+
+SDLAudioSink::~SDLAudioSink()
+{
+    if (audioDevice_ != 0)
+    {
+        SDL_PauseAudioDevice(audioDevice_, 1);
+        SDL_CloseAudioDevice(audioDevice_);
+    }
+}
+
+void SDLAudioSink::onAudioFrame(const float left, const float right)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    ringBuffer_[writeIndex_ * CHANNEL_COUNT + 0] = left;
+    ringBuffer_[writeIndex_ * CHANNEL_COUNT + 1] = right;
+    writeIndex_ = (writeIndex_ + 1) % RING_BUFFER_FRAMES;
+
+    // Drop the oldest frame when the device falls behind
+    if (writeIndex_ == readIndex_)
+    {
+        readIndex_ = (readIndex_ + 1) % RING_BUFFER_FRAMES;
+    }
+}
+
+void SDLAudioSink::audioDeviceCallbackStatic(void* pUserdata, Uint8* pStream, int length)
+{
+    reinterpret_cast<SDLAudioSink*>(pUserdata)->audioDeviceCallback(pStream, length);
+}
+
+void SDLAudioSink::audioDeviceCallback(Uint8* pStream, int length)
+{
+    SDL_memset(pStream, 0x00, length);
+
+    float* pOut = reinterpret_cast<float*>(pStream);
+    const int frameCount = length / static_cast<int>(sizeof(float) * CHANNEL_COUNT);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < frameCount && readIndex_ != writeIndex_; ++i)
+    {
+        pOut[i * CHANNEL_COUNT + 0] = ringBuffer_[readIndex_ * CHANNEL_COUNT + 0];
+        pOut[i * CHANNEL_COUNT + 1] = ringBuffer_[readIndex_ * CHANNEL_COUNT + 1];
+        readIndex_ = (readIndex_ + 1) % RING_BUFFER_FRAMES;
+    }
+}
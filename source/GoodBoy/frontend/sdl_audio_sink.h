@@ -0,0 +1,36 @@
+#ifndef SDL_AUDIO_SINK_H
+#define SDL_AUDIO_SINK_H
+
+#include <SDL.h>
+#include <mutex>
+
+#include "sinks.h"
+
+// Streams the APU output to an SDL audio device. The emulation thread pushes
+// frames into a ring buffer that the SDL audio thread drains from its callback.
+class SDLAudioSink final : public AudioSink
+{
+public:
+    SDLAudioSink();
+    ~SDLAudioSink();
+
+    bool isOpen() const { return audioDevice_ != 0; }
+
+    void onAudioFrame(const float left, const float right) override;
+
+private:
+    static void audioDeviceCallbackStatic(void* pUserdata, Uint8* pStream, int length);
+    void audioDeviceCallback(Uint8* pStream, int length);
+
+private:
+    static constexpr int DEVICE_BUFFER_FRAMES = 2048;   // Must be a power of 2
+    static constexpr int RING_BUFFER_FRAMES = 4096;
+
+    float ringBuffer_[RING_BUFFER_FRAMES * CHANNEL_COUNT];
+    int readIndex_;
+    int writeIndex_;
+    std::mutex mutex_;
+    SDL_AudioDeviceID audioDevice_;
+};
+
+#endif
@@ -0,0 +1,30 @@
+#include "sdl_video_sink.h"
+
+#include <cstring>
+
+SDLVideoSink::SDLVideoSink(SDL_Renderer* pRenderer, SDL_Texture* pTexture)
+    : pRenderer_(pRenderer)
+    , pTexture_(pTexture)
+{
+}
+
+void SDLVideoSink::onVBlank(const byte* pixels)
+{
+    // Clear window
+    SDL_SetRenderDrawColor(pRenderer_, 0xFF, 0xFF, 0xFF, 0xFF);
+    SDL_RenderClear(pRenderer_);
+
+    byte* pPixels = nullptr;
+    int pitch = 0;
+    SDL_LockTexture(pTexture_, nullptr, (void**)&pPixels, &pitch);
+
+    // Render Game
+    memcpy(pPixels, pixels, SCREEN_WIDTH * SCREEN_HEIGHT * BYTES_PER_PIXEL);
+
+    SDL_UnlockTexture(pTexture_);
+
+    SDL_RenderCopy(pRenderer_, pTexture_, nullptr, nullptr);
+
+    // Update window
+    SDL_RenderPresent(pRenderer_);
+}
@@ -0,0 +1,21 @@
+#ifndef SDL_VIDEO_SINK_H
+#define SDL_VIDEO_SINK_H
+
+#include <SDL.h>
+
+#include "sinks.h"
+
+// Uploads every finished frame to a streaming texture and presents it
+class SDLVideoSink final : public VideoSink
+{
+public:
+    SDLVideoSink(SDL_Renderer* pRenderer, SDL_Texture* pTexture);
+
+    void onVBlank(const byte* pixels) override;
+
+private:
+    SDL_Renderer* pRenderer_;
+    SDL_Texture* pTexture_;
+};
+
+#endif
@@ -0,0 +1,272 @@
+#include "guest_profiler.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <string>
+
+static constexpr byte CB_PREFIX_OPCODE = 0xCB;
+
+static bool isCall(const byte opcode)
+{
+	return opcode == 0xCD || (opcode & 0xE7) == 0xC4; // CALL nn and CALL cc,nn
+}
+
+static bool isRst(const byte opcode)
+{
+	return (opcode & 0xC7) == 0xC7;
+}
+
+static bool isReturn(const byte opcode)
+{
+	return opcode == 0xC9 || opcode == 0xD9 || (opcode & 0xE7) == 0xC0; // RET, RETI and RET cc
+}
+
+static double getShare(const uint64_t part, const uint64_t total)
+{
+	return total != 0 ? 100.0 * part / total : 0.0;
+}
+
+GuestProfiler::GuestProfiler()
+{
+	reset();
+}
+
+void GuestProfiler::reset()
+{
+	std::fill(std::begin(opcodeCounters_), std::end(opcodeCounters_), Counters());
+	std::fill(std::begin(cbOpcodeCounters_), std::end(cbOpcodeCounters_), Counters());
+	pcCounters_.clear();
+	stackNodes_.assign(1, StackNode{ ROOT_FUNCTION, 0, 0, 0 });
+	stackNodeChildren_.clear();
+	currentStackNode_ = 0;
+	callsPastMaxDepth_ = 0;
+	pendingFunctionFlags_ = 0;
+	callPending_ = false;
+	instructionCount_ = 0;
+	clockCycles_ = 0;
+	compiledInstructionCount_ = 0;
+	compiledClockCycles_ = 0;
+	haltedClockCycles_ = 0;
+	skippedIdleLoopInstructionCount_ = 0;
+	skippedIdleLoopClockCycles_ = 0;
+	bulkLoopInstructionCount_ = 0;
+	bulkLoopClockCycles_ = 0;
+}
+
+void GuestProfiler::recordInstruction(const int bank, const word pc, const byte opcode, const byte cbOpcode, const unsigned int clockCycles, const word nextPC)
+{
+	const uint32_t location = getLocation(bank, pc);
+	if (callPending_)
+	{
+		enterFunction(location | pendingFunctionFlags_);
+	}
+
+	Counters& counters = opcode == CB_PREFIX_OPCODE ? cbOpcodeCounters_[cbOpcode] : opcodeCounters_[opcode];
+	counters.executions++;
+	counters.clockCycles += clockCycles;
+
+	PCCounters& pcCounters = pcCounters_[location];
+	pcCounters.executions++;
+	pcCounters.clockCycles += clockCycles;
+
+	instructionCount_++;
+	clockCycles_ += clockCycles;
+
+	// A call's own cycles belong to the caller and a return's to the callee
+	chargeCurrentStack(clockCycles);
+	if ((isCall(opcode) && nextPC != static_cast<word>(pc + 3)) || isRst(opcode))
+	{
+		callPending_ = true;
+		pendingFunctionFlags_ = 0;
+	}
+	else if (isReturn(opcode) && nextPC != static_cast<word>(pc + 1))
+	{
+		leaveFunction();
+	}
+}
+
+void GuestProfiler::recordCompiledRun(const int bank, const word pc, const uint64_t instructionCount, const unsigned int clockCycles)
+{
+	const uint32_t location = getLocation(bank, pc);
+	if (callPending_)
+	{
+		enterFunction(location | pendingFunctionFlags_);
+	}
+
+	// Compiled code neither calls nor returns, so the stack stays where it is
+	PCCounters& pcCounters = pcCounters_[location];
+	pcCounters.executions += instructionCount;
+	pcCounters.clockCycles += clockCycles;
+	pcCounters.compiledClockCycles += clockCycles;
+
+	instructionCount_ += instructionCount;
+	clockCycles_ += clockCycles;
+	compiledInstructionCount_ += instructionCount;
+	compiledClockCycles_ += clockCycles;
+	chargeCurrentStack(clockCycles);
+}
+
+void GuestProfiler::recordHaltedCycles(const unsigned int clockCycles)
+{
+	clockCycles_ += clockCycles;
+	haltedClockCycles_ += clockCycles;
+	chargeCurrentStack(clockCycles);
+}
+
+void GuestProfiler::recordSkippedIdleLoop(const uint64_t instructionCount, const unsigned int clockCycles)
+{
+	instructionCount_ += instructionCount;
+	clockCycles_ += clockCycles;
+	skippedIdleLoopInstructionCount_ += instructionCount;
+	skippedIdleLoopClockCycles_ += clockCycles;
+	chargeCurrentStack(clockCycles);
+}
+
+void GuestProfiler::recordBulkLoop(const uint64_t instructionCount, const unsigned int clockCycles)
+{
+	instructionCount_ += instructionCount;
+	clockCycles_ += clockCycles;
+	bulkLoopInstructionCount_ += instructionCount;
+	bulkLoopClockCycles_ += clockCycles;
+	chargeCurrentStack(clockCycles);
+}
+
+void GuestProfiler::recordInterrupt()
+{
+	// The handler's first instruction tells the bank, which for the vectors is always 0
+	callPending_ = true;
+	pendingFunctionFlags_ = INTERRUPT_FUNCTION_FLAG;
+}
+
+void GuestProfiler::enterFunction(const uint32_t function)
+{
+	callPending_ = false;
+	if (stackNodes_[currentStackNode_].depth == MAX_STACK_DEPTH)
+	{
+		callsPastMaxDepth_++;
+		return;
+	}
+
+	const uint64_t childKey = (static_cast<uint64_t>(currentStackNode_) << 32) | function;
+	const auto child = stackNodeChildren_.find(childKey);
+	if (child != stackNodeChildren_.end())
+	{
+		currentStackNode_ = child->second;
+		return;
+	}
+
+	const uint32_t childIndex = static_cast<uint32_t>(stackNodes_.size());
+	stackNodes_.push_back(StackNode{ function, currentStackNode_, stackNodes_[currentStackNode_].depth + 1, 0 });
+	stackNodeChildren_.emplace(childKey, childIndex);
+	currentStackNode_ = childIndex;
+}
+
+void GuestProfiler::leaveFunction()
+{
+	if (callsPastMaxDepth_ != 0)
+	{
+		callsPastMaxDepth_--;
+		return;
+	}
+
+	// Returning from the root means the stack was entered mid-call, e.g. by a profiler
+	// attached after the game started, and it stays there
+	currentStackNode_ = stackNodes_[currentStackNode_].parent;
+}
+
+void GuestProfiler::formatLocation(const uint32_t location, char (&text)[16])
+{
+	const uint32_t bankKey = (location & ~INTERRUPT_FUNCTION_FLAG) >> 16;
+	const char* prefix = location & INTERRUPT_FUNCTION_FLAG ? "int " : "";
+	if (bankKey == 0)
+	{
+		snprintf(text, sizeof(text), "%s--:%04X", prefix, location & 0xFFFF);
+	}
+	else
+	{
+		snprintf(text, sizeof(text), "%s%02X:%04X", prefix, bankKey - 1, location & 0xFFFF);
+	}
+}
+
+void GuestProfiler::writeReport(FILE* file, const std::size_t pcCount) const
+{
+	fprintf(file, "instructions          %" PRIu64 "\n", instructionCount_);
+	fprintf(file, "clock cycles          %" PRIu64 "\n", clockCycles_);
+	fprintf(file, "  compiled            %" PRIu64 " (%.2f%%) in %" PRIu64 " instructions\n", compiledClockCycles_, getShare(compiledClockCycles_, clockCycles_), compiledInstructionCount_);
+	fprintf(file, "  skipped idle loops  %" PRIu64 " (%.2f%%) in %" PRIu64 " instructions\n", skippedIdleLoopClockCycles_, getShare(skippedIdleLoopClockCycles_, clockCycles_), skippedIdleLoopInstructionCount_);
+	fprintf(file, "  bulk copies, fills  %" PRIu64 " (%.2f%%) in %" PRIu64 " instructions\n", bulkLoopClockCycles_, getShare(bulkLoopClockCycles_, clockCycles_), bulkLoopInstructionCount_);
+	fprintf(file, "  halted              %" PRIu64 " (%.2f%%)\n", haltedClockCycles_, getShare(haltedClockCycles_, clockCycles_));
+
+	// Compiled runs and skipped or bulk iterations have no per opcode counts, the shares
+	// are of the instructions stepped one by one
+	const uint64_t steppedClockCycles = clockCycles_ - compiledClockCycles_ - skippedIdleLoopClockCycles_ - bulkLoopClockCycles_ - haltedClockCycles_;
+	std::vector<int> opcodes;
+	for (int i = 0; i < 512; ++i)
+	{
+		const Counters& counters = i < 256 ? opcodeCounters_[i] : cbOpcodeCounters_[i - 256];
+		if (counters.executions != 0)
+		{
+			opcodes.push_back(i);
+		}
+	}
+	std::sort(opcodes.begin(), opcodes.end(), [this](const int a, const int b)
+	{
+		const Counters& countersA = a < 256 ? opcodeCounters_[a] : cbOpcodeCounters_[a - 256];
+		const Counters& countersB = b < 256 ? opcodeCounters_[b] : cbOpcodeCounters_[b - 256];
+		return countersA.clockCycles != countersB.clockCycles ? countersA.clockCycles > countersB.clockCycles : a < b;
+	});
+
+	fprintf(file, "\nopcode        executions        clock cycles   share\n");
+	for (const int opcode : opcodes)
+	{
+		const Counters& counters = opcode < 256 ? opcodeCounters_[opcode] : cbOpcodeCounters_[opcode - 256];
+		char name[8];
+		snprintf(name, sizeof(name), opcode < 256 ? "%02X" : "CB %02X", opcode & 0xFF);
+		fprintf(file, "%-6s  %16" PRIu64 "    %16" PRIu64 "  %5.2f%%\n", name, counters.executions, counters.clockCycles, getShare(counters.clockCycles, steppedClockCycles));
+	}
+
+	std::vector<std::pair<uint32_t, PCCounters>> pcs(pcCounters_.begin(), pcCounters_.end());
+	const std::size_t shownPCCount = std::min(pcCount, pcs.size());
+	std::partial_sort(pcs.begin(), pcs.begin() + shownPCCount, pcs.end(), [](const std::pair<uint32_t, PCCounters>& a, const std::pair<uint32_t, PCCounters>& b)
+	{
+		return a.second.clockCycles != b.second.clockCycles ? a.second.clockCycles > b.second.clockCycles : a.first < b.first;
+	});
+
+	fprintf(file, "\nbank:pc       executions        clock cycles       compiled   share\n");
+	for (std::size_t i = 0; i < shownPCCount; ++i)
+	{
+		char location[16];
+		formatLocation(pcs[i].first, location);
+		const PCCounters& counters = pcs[i].second;
+		fprintf(file, "%-8s  %14" PRIu64 "    %16" PRIu64 "  %13" PRIu64 "  %5.2f%%\n", location, counters.executions, counters.clockCycles, counters.compiledClockCycles, getShare(counters.clockCycles, clockCycles_));
+	}
+}
+
+void GuestProfiler::writeFoldedStacks(FILE* file) const
+{
+	std::vector<uint32_t> frames;
+	std::string line;
+	for (const StackNode& node : stackNodes_)
+	{
+		if (node.clockCycles == 0)
+		{
+			continue;
+		}
+
+		frames.clear();
+		for (const StackNode* frame = &node; frame->function != ROOT_FUNCTION; frame = &stackNodes_[frame->parent])
+		{
+			frames.push_back(frame->function);
+		}
+
+		line = "guest";
+		for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame)
+		{
+			char location[16];
+			formatLocation(*frame, location);
+			line += ';';
+			line += location;
+		}
+		fprintf(file, "%s %" PRIu64 "\n", line.c_str(), node.clockCycles);
+	}
+}
@@ -0,0 +1,105 @@
+#ifndef GUEST_PROFILER_H
+#define GUEST_PROFILER_H
+
+#include "types.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+// Where the guest spends its time: executions and cycles per opcode, CB-prefixed ones
+// apart, and per (bank, PC), plus cycles per call stack as followed through CALL, RST,
+// interrupt dispatch and RET/RETI. The CPU only reports to one in builds configured with
+// GOODBOY_GUEST_PROFILER, see System::setGuestProfiler; otherwise the hooks are compiled
+// out. Host-side and not part of the state.
+//
+// Compiled code runs are only seen as a whole, their cycles go to the PC they started at
+// and count as compiled there. Halted steps, skipped polling loop iterations and copy and
+// fill loop iterations run in bulk go to the call stack they happened in and are totalled
+// apart.
+class GuestProfiler final
+{
+public:
+	// Deeper calls are charged to the stack at this depth, as are guests that leave
+	// functions without returning
+	static constexpr std::size_t MAX_STACK_DEPTH = 64;
+
+	static constexpr std::size_t DEFAULT_REPORT_PC_COUNT = 64;
+
+public:
+	GuestProfiler();
+
+	void reset();
+
+	// bank is the CPU's code bank at pc, Memory::UNCACHEABLE_CODE_BANK outside ROM and
+	// work RAM. cbOpcode is only looked at for 0xCB, nextPC is the PC afterwards.
+	void recordInstruction(const int bank, const word pc, const byte opcode, const byte cbOpcode, const unsigned int clockCycles, const word nextPC);
+	void recordCompiledRun(const int bank, const word pc, const uint64_t instructionCount, const unsigned int clockCycles);
+	void recordHaltedCycles(const unsigned int clockCycles);
+	void recordSkippedIdleLoop(const uint64_t instructionCount, const unsigned int clockCycles);
+	void recordBulkLoop(const uint64_t instructionCount, const unsigned int clockCycles);
+	void recordInterrupt();
+
+	// Totals, the opcodes and the pcCount hottest PCs, all by cycles
+	void writeReport(FILE* file, const std::size_t pcCount = DEFAULT_REPORT_PC_COUNT) const;
+
+	// One "frame;frame;... cycles" line per call stack, as flamegraph.pl and compatible
+	// viewers read them. Frames are the bank:address the function was entered at.
+	void writeFoldedStacks(FILE* file) const;
+
+private:
+	struct Counters
+	{
+		uint64_t executions;
+		uint64_t clockCycles;
+	};
+
+	struct PCCounters
+	{
+		uint64_t executions;
+		uint64_t clockCycles;
+		uint64_t compiledClockCycles;
+	};
+
+	struct StackNode
+	{
+		uint32_t function;  // see getLocation, ROOT_FUNCTION for the root
+		uint32_t parent;
+		uint32_t depth;
+		uint64_t clockCycles;
+	};
+
+	static constexpr uint32_t ROOT_FUNCTION = UINT32_MAX;
+	static constexpr uint32_t INTERRUPT_FUNCTION_FLAG = 0x80000000;
+
+private:
+	static uint32_t getLocation(const int bank, const word pc) { return (static_cast<uint32_t>(bank + 1) << 16) | pc; }
+	static void formatLocation(const uint32_t location, char (&text)[16]);
+
+	void enterFunction(const uint32_t function);
+	void leaveFunction();
+	void chargeCurrentStack(const unsigned int clockCycles) { stackNodes_[currentStackNode_].clockCycles += clockCycles; }
+
+private:
+	Counters opcodeCounters_[256];
+	Counters cbOpcodeCounters_[256];
+	std::unordered_map<uint32_t, PCCounters> pcCounters_;
+	std::vector<StackNode> stackNodes_;
+	std::unordered_map<uint64_t, uint32_t> stackNodeChildren_; // parent << 32 | function
+	uint32_t currentStackNode_;
+	uint32_t callsPastMaxDepth_;
+	uint32_t pendingFunctionFlags_;
+	bool callPending_;          // the next instruction recorded is a function's first
+	uint64_t instructionCount_;
+	uint64_t clockCycles_;
+	uint64_t compiledInstructionCount_;
+	uint64_t compiledClockCycles_;
+	uint64_t haltedClockCycles_;
+	uint64_t skippedIdleLoopInstructionCount_;
+	uint64_t skippedIdleLoopClockCycles_;
+	uint64_t bulkLoopInstructionCount_;
+	uint64_t bulkLoopClockCycles_;
+};
+
+#endif /* GUEST_PROFILER_H */
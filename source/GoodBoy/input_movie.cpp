@@ -0,0 +1,230 @@
+#include "input_movie.h"
+#include "little_endian.h"
+#include "logging.h"
+#include "lz_compression.h"
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr char INPUT_MOVIE_MAGIC[8] = { 'G', 'B', 'M', 'O', 'V', 'I', 'E', '\0' };
+static constexpr std::size_t HEADER_SIZE = sizeof(INPUT_MOVIE_MAGIC) + 4 + 4 + 8 + 4 + 4 + 4 + 4;
+static constexpr std::size_t INDEX_ENTRY_SIZE = 4 + 4 + 8;
+
+static bool seekTo(FILE* file, const uint64_t offset)
+{
+#if defined(_WIN32)
+	return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+	return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+InputMovieRecorder::InputMovieRecorder(const uint32_t keyframeInterval)
+	: scratchState_(std::make_unique<MachineState>())
+	, romHash_(0)
+	, keyframeInterval_(std::max<uint32_t>(keyframeInterval, 1))
+{
+}
+
+void InputMovieRecorder::recordFrame(System& system, const byte actionButtons, const byte directionButtons)
+{
+	const uint32_t frame = getFrameCount();
+	if (frame == 0)
+	{
+		romHash_ = system.getRomHash();
+	}
+
+	if (frame % keyframeInterval_ == 0)
+	{
+		system.snapshot(*scratchState_);
+
+		Keyframe keyframe;
+		keyframe.frame = frame;
+		keyframe.compressedState.resize(lzCompressBound(sizeof(MachineState)));
+		const std::size_t compressedSize = lzCompress(reinterpret_cast<const byte*>(scratchState_.get()), sizeof(MachineState), keyframe.compressedState.data());
+		keyframe.compressedState.resize(compressedSize);
+		keyframes_.push_back(std::move(keyframe));
+	}
+
+	inputs_.push_back(static_cast<byte>((actionButtons & 0x0F) | ((directionButtons & 0x0F) << 4)));
+	system.setInputState(actionButtons, directionButtons);
+}
+
+bool InputMovieRecorder::save(const std::string& path) const
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		log(LogType::ERROR, "Could not create input movie %s", path.c_str());
+		return false;
+	}
+
+	std::vector<byte> compressedInputs(lzCompressBound(inputs_.size()));
+	compressedInputs.resize(lzCompress(inputs_.data(), inputs_.size(), compressedInputs.data()));
+
+	byte header[HEADER_SIZE];
+	memcpy(header, INPUT_MOVIE_MAGIC, sizeof(INPUT_MOVIE_MAGIC));
+	writeLE32(header + 8, INPUT_MOVIE_VERSION);
+	writeLE32(header + 12, static_cast<uint32_t>(sizeof(MachineState)));
+	writeLE64(header + 16, romHash_);
+	writeLE32(header + 24, getFrameCount());
+	writeLE32(header + 28, keyframeInterval_);
+	writeLE32(header + 32, static_cast<uint32_t>(keyframes_.size()));
+	writeLE32(header + 36, static_cast<uint32_t>(compressedInputs.size()));
+
+	std::vector<byte> index(keyframes_.size() * INDEX_ENTRY_SIZE);
+	uint64_t keyframeOffset = HEADER_SIZE + compressedInputs.size() + index.size();
+	for (std::size_t i = 0; i < keyframes_.size(); ++i)
+	{
+		byte* entry = index.data() + i * INDEX_ENTRY_SIZE;
+		writeLE32(entry, keyframes_[i].frame);
+		writeLE32(entry + 4, static_cast<uint32_t>(keyframes_[i].compressedState.size()));
+		writeLE64(entry + 8, keyframeOffset);
+		keyframeOffset += keyframes_[i].compressedState.size();
+	}
+
+	bool success = fwrite(header, sizeof(byte), sizeof(header), file) == sizeof(header);
+	success = success && fwrite(compressedInputs.data(), sizeof(byte), compressedInputs.size(), file) == compressedInputs.size();
+	success = success && fwrite(index.data(), sizeof(byte), index.size(), file) == index.size();
+	for (const auto& keyframe : keyframes_)
+	{
+		success = success && fwrite(keyframe.compressedState.data(), sizeof(byte), keyframe.compressedState.size(), file) == keyframe.compressedState.size();
+	}
+
+	success = fclose(file) == 0 && success;
+	if (!success)
+	{
+		log(LogType::ERROR, "Could not write input movie %s", path.c_str());
+	}
+	return success;
+}
+
+InputMoviePlayer::InputMoviePlayer()
+	: file_(nullptr)
+	, scratchState_(std::make_unique<MachineState>())
+	, romHash_(0)
+	, currentFrame_(0)
+{
+}
+
+InputMoviePlayer::~InputMoviePlayer()
+{
+	if (file_ != nullptr)
+	{
+		fclose(file_);
+	}
+}
+
+bool InputMoviePlayer::open(const std::string& path)
+{
+	if (file_ != nullptr)
+	{
+		fclose(file_);
+	}
+	inputs_.clear();
+	keyframeIndex_.clear();
+	currentFrame_ = 0;
+
+	file_ = fopen(path.c_str(), "rb");
+	if (file_ == nullptr)
+	{
+		log(LogType::ERROR, "Could not open input movie %s", path.c_str());
+		return false;
+	}
+
+	byte header[HEADER_SIZE];
+	if (fread(header, sizeof(byte), sizeof(header), file_) != sizeof(header) || memcmp(header, INPUT_MOVIE_MAGIC, sizeof(INPUT_MOVIE_MAGIC)) != 0)
+	{
+		log(LogType::ERROR, "%s is not an input movie", path.c_str());
+		return false;
+	}
+
+	const uint32_t version = readLE32(header + 8);
+	const uint32_t stateSize = readLE32(header + 12);
+	if (version != INPUT_MOVIE_VERSION || stateSize != sizeof(MachineState))
+	{
+		log(LogType::ERROR, "Input movie %s was recorded by an incompatible build", path.c_str());
+		return false;
+	}
+
+	romHash_ = readLE64(header + 16);
+	const uint32_t frameCount = readLE32(header + 24);
+	const uint32_t keyframeCount = readLE32(header + 32);
+	const uint32_t compressedInputsSize = readLE32(header + 36);
+
+	std::vector<byte> compressedInputs(compressedInputsSize);
+	std::vector<byte> index(keyframeCount * INDEX_ENTRY_SIZE);
+	inputs_.resize(frameCount);
+	if (fread(compressedInputs.data(), sizeof(byte), compressedInputs.size(), file_) != compressedInputs.size() ||
+		fread(index.data(), sizeof(byte), index.size(), file_) != index.size() ||
+		!lzDecompress(compressedInputs.data(), compressedInputs.size(), inputs_.data(), inputs_.size()))
+	{
+		log(LogType::ERROR, "Input movie %s is corrupt", path.c_str());
+		inputs_.clear();
+		return false;
+	}
+
+	for (uint32_t i = 0; i < keyframeCount; ++i)
+	{
+		const byte* entry = index.data() + i * INDEX_ENTRY_SIZE;
+		keyframeIndex_.push_back({ readLE32(entry), readLE32(entry + 4), readLE64(entry + 8) });
+	}
+
+	if (keyframeIndex_.empty() || keyframeIndex_.front().frame != 0)
+	{
+		log(LogType::ERROR, "Input movie %s has no starting keyframe", path.c_str());
+		inputs_.clear();
+		keyframeIndex_.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool InputMoviePlayer::seek(System& system, const uint32_t frame)
+{
+	if (keyframeIndex_.empty() || frame > getFrameCount())
+	{
+		return false;
+	}
+
+	if (system.getRomHash() != romHash_)
+	{
+		log(LogType::ERROR, "Input movie was recorded with a different ROM");
+		return false;
+	}
+
+	// Last keyframe at or before the target frame
+	const auto keyframe = std::upper_bound(keyframeIndex_.begin(), keyframeIndex_.end(), frame,
+		[](const uint32_t targetFrame, const KeyframeIndexEntry& entry) { return targetFrame < entry.frame; }) - 1;
+
+	std::vector<byte> compressedState(keyframe->compressedSize);
+	if (!seekTo(file_, keyframe->offset) ||
+		fread(compressedState.data(), sizeof(byte), compressedState.size(), file_) != compressedState.size() ||
+		!lzDecompress(compressedState.data(), compressedState.size(), reinterpret_cast<byte*>(scratchState_.get()), sizeof(MachineState)))
+	{
+		log(LogType::ERROR, "Input movie keyframe for frame %u is corrupt", keyframe->frame);
+		return false;
+	}
+
+	system.restore(*scratchState_);
+	currentFrame_ = keyframe->frame;
+	while (currentFrame_ < frame)
+	{
+		playFrame(system);
+	}
+	return true;
+}
+
+bool InputMoviePlayer::playFrame(System& system)
+{
+	if (isFinished())
+	{
+		return false;
+	}
+
+	const byte input = inputs_[currentFrame_++];
+	system.setInputState(input & 0x0F, input >> 4);
+	system.runFrame();
+	return true;
+}
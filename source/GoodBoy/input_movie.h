@@ -0,0 +1,100 @@
+#ifndef INPUT_MOVIE_H
+#define INPUT_MOVIE_H
+
+#include "system.h"
+#include "types.h"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Input movies are a per-frame log of the buttons passed to System::setInputState, one
+// byte per frame (action buttons in the low nibble, directions in the high nibble), plus
+// a keyframe snapshot of the whole machine every keyframeInterval frames. The keyframes
+// make any frame reachable by restoring the closest earlier keyframe and replaying fewer
+// than keyframeInterval frames of input.
+//
+// File layout (header fields little-endian):
+//   header:    "GBMOVIE\0", format version, MachineState size, ROM hash, frame count,
+//              keyframe interval, keyframe count, compressed input log size
+//   inputs:    LZ compressed input log
+//   index:     per keyframe its frame number, compressed size and file offset
+//   keyframes: LZ compressed MachineStates
+// Keyframes are raw MachineStates, so files only load into builds with the same layout.
+static constexpr uint32_t INPUT_MOVIE_VERSION = 1;
+
+class InputMovieRecorder final
+{
+public:
+	// Roughly ten seconds between keyframes
+	static constexpr uint32_t DEFAULT_KEYFRAME_INTERVAL = 600;
+
+public:
+	explicit InputMovieRecorder(const uint32_t keyframeInterval = DEFAULT_KEYFRAME_INTERVAL);
+
+	// Records the input for the frame the system is about to run and applies it. Call once
+	// per frame, right before System::runFrame.
+	void recordFrame(System& system, const byte actionButtons, const byte directionButtons);
+
+	uint32_t getFrameCount() const { return static_cast<uint32_t>(inputs_.size()); }
+
+	bool save(const std::string& path) const;
+
+private:
+	struct Keyframe
+	{
+		uint32_t frame;
+		std::vector<byte> compressedState;
+	};
+
+private:
+	std::unique_ptr<MachineState> scratchState_;
+	std::vector<byte> inputs_;
+	std::vector<Keyframe> keyframes_;
+	uint64_t romHash_;
+	uint32_t keyframeInterval_;
+};
+
+class InputMoviePlayer final
+{
+public:
+	InputMoviePlayer();
+	~InputMoviePlayer();
+
+	InputMoviePlayer(const InputMoviePlayer&) = delete;
+	InputMoviePlayer& operator=(const InputMoviePlayer&) = delete;
+
+	// Reads the header, input log and keyframe index. Keyframes are read on demand.
+	bool open(const std::string& path);
+
+	uint64_t getRomHash() const { return romHash_; }
+	uint32_t getFrameCount() const { return static_cast<uint32_t>(inputs_.size()); }
+	uint32_t getCurrentFrame() const { return currentFrame_; }
+	bool isFinished() const { return currentFrame_ >= inputs_.size(); }
+
+	// Brings the system to the start of the given frame by restoring the closest keyframe
+	// at or before it and replaying the input from there
+	bool seek(System& system, const uint32_t frame);
+
+	// Applies the current frame's input and runs it. Returns false past the last frame.
+	bool playFrame(System& system);
+
+private:
+	struct KeyframeIndexEntry
+	{
+		uint32_t frame;
+		uint32_t compressedSize;
+		uint64_t offset;
+	};
+
+private:
+	FILE* file_;
+	std::unique_ptr<MachineState> scratchState_;
+	std::vector<byte> inputs_;
+	std::vector<KeyframeIndexEntry> keyframeIndex_;
+	uint64_t romHash_;
+	uint32_t currentFrame_;
+};
+
+#endif /* INPUT_MOVIE_H */
@@ -0,0 +1,31 @@
+#include "interrupt_controller.h"
+#include "memory.h"
+
+InterruptController::InterruptController()
+	: InterruptControllerState()
+	, pendingInterrupts_(0)
+{
+	// Both registers power up like the rest of the unmapped I/O space
+	interruptFlagRegister_ = 0xFF;
+	interruptEnableRegister_ = 0xFF;
+	updatePendingInterrupts();
+}
+
+byte InterruptController::readByteAt(const word address) const
+{
+	return address == Memory::IF_ADDRESS ? interruptFlagRegister_ : interruptEnableRegister_;
+}
+
+void InterruptController::writeByteAt(const word address, const byte b)
+{
+	if (address == Memory::IF_ADDRESS)
+	{
+		interruptFlagRegister_ = b;
+	}
+	else
+	{
+		interruptEnableRegister_ = b;
+	}
+
+	updatePendingInterrupts();
+}
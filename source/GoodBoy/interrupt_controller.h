@@ -0,0 +1,40 @@
+#ifndef INTERRUPT_CONTROLLER_H
+#define INTERRUPT_CONTROLLER_H
+
+#include "types.h"
+
+// Guest-visible interrupt registers, kept as one trivially copyable block for snapshots
+struct InterruptControllerState
+{
+	byte interruptFlagRegister_;
+	byte interruptEnableRegister_;
+};
+
+// Owns IF and IE. The enabled and requested interrupts are kept as one mask that only
+// changes when either register does, so checking for one after every instruction is a
+// single test instead of two trips through Memory.
+class InterruptController final : private InterruptControllerState
+{
+public:
+	InterruptController();
+
+	byte readByteAt(const word address) const;
+	void writeByteAt(const word address, const byte b);
+
+	void requestInterrupt(const byte interruptBit) { interruptFlagRegister_ |= 0x1 << interruptBit; updatePendingInterrupts(); }
+
+	// IF & IE over the 5 interrupt bits
+	byte getPendingInterrupts() const { return pendingInterrupts_; }
+
+	void saveState(InterruptControllerState& state) const { state = *this; }
+	void loadState(const InterruptControllerState& state) { static_cast<InterruptControllerState&>(*this) = state; updatePendingInterrupts(); }
+	void copyStateFrom(const InterruptController& other) { other.saveState(*this); updatePendingInterrupts(); }
+
+private:
+	void updatePendingInterrupts() { pendingInterrupts_ = interruptFlagRegister_ & interruptEnableRegister_ & 0x1F; }
+
+private:
+	byte pendingInterrupts_;
+};
+
+#endif /* INTERRUPT_CONTROLLER_H */
@@ -10,12 +10,11 @@
 static constexpr byte JOYPAD_REGISTER_INITIAL_STATE = 0xCF; 
 
 Joypad::Joypad()
-	: mem_(nullptr)
-	, joypadRegister_(JOYPAD_REGISTER_INITIAL_STATE)
-	, lastActionButtonsState_(0)
-	, lastDirectionButtonsState_(0)
+	: JoypadState()
+	, cpu_(nullptr)
+	, mem_(nullptr)
 {
-
+	joypadRegister_ = JOYPAD_REGISTER_INITIAL_STATE;
 }
 
 void Joypad::setJoypadState(const byte actionButtons, const byte directionButtons)
@@ -4,7 +4,16 @@
 #include "types.h"
 
 class CPU;
-class Joypad final
+
+// Guest-visible joypad state, kept as one trivially copyable block for snapshots
+struct JoypadState
+{
+	byte joypadRegister_;
+	byte lastActionButtonsState_;
+	byte lastDirectionButtonsState_;
+};
+
+class Joypad final : private JoypadState
 {
 public:
 	Joypad();
@@ -15,12 +24,13 @@ public:
 	byte readByteAt(const word address) const;
 	void writeByteAt(const word address, const byte b);
 
+	void saveState(JoypadState& state) const { state = *this; }
+	void loadState(const JoypadState& state) { static_cast<JoypadState&>(*this) = state; }
+	void copyStateFrom(const Joypad& other) { other.saveState(*this); }
+
 private:
 	CPU* cpu_;
 	byte* mem_;
-	byte joypadRegister_;
-	byte lastActionButtonsState_;
-	byte lastDirectionButtonsState_;
 };
 
 
@@ -0,0 +1,32 @@
+#ifndef LITTLE_ENDIAN_H
+#define LITTLE_ENDIAN_H
+
+#include "types.h"
+
+// Fixed byte order helpers for the on-disk formats, independent of the host's endianness
+
+inline void writeLE32(byte* out, const uint32_t value)
+{
+	for (int i = 0; i < 4; ++i) out[i] = static_cast<byte>(value >> (i * 8));
+}
+
+inline void writeLE64(byte* out, const uint64_t value)
+{
+	for (int i = 0; i < 8; ++i) out[i] = static_cast<byte>(value >> (i * 8));
+}
+
+inline uint32_t readLE32(const byte* in)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < 4; ++i) value |= static_cast<uint32_t>(in[i]) << (i * 8);
+	return value;
+}
+
+inline uint64_t readLE64(const byte* in)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i) value |= static_cast<uint64_t>(in[i]) << (i * 8);
+	return value;
+}
+
+#endif /* LITTLE_ENDIAN_H */
@@ -0,0 +1,86 @@
+#include "lockstep_verifier.h"
+
+#include <cstdio>
+
+static std::string formatCPUState(const char* name, const CPUState& state, const uint64_t instructionCount)
+{
+	char text[160];
+	snprintf(text, sizeof(text), "%s: AF=%04X BC=%02X%02X DE=%02X%02X HL=%02X%02X SP=%02X%02X PC=%04X halted=%d ime=%d ei=%d instructions=%llu\n",
+		name, state.registersAF_,
+		state.generalPurposeRegisters_[0], state.generalPurposeRegisters_[1], state.generalPurposeRegisters_[2], state.generalPurposeRegisters_[3],
+		state.generalPurposeRegisters_[4], state.generalPurposeRegisters_[5], state.generalPurposeRegisters_[6], state.generalPurposeRegisters_[7],
+		state.registersPC_, state.isHalted_, state.ime_, state.eiTriggered_, static_cast<unsigned long long>(instructionCount));
+	return text;
+}
+
+static bool areCPUStatesEqual(const CPUState& a, const CPUState& b)
+{
+	for (std::size_t i = 0; i < sizeof(a.generalPurposeRegisters_); ++i)
+	{
+		if (a.generalPurposeRegisters_[i] != b.generalPurposeRegisters_[i])
+		{
+			return false;
+		}
+	}
+
+	return a.registersAF_ == b.registersAF_ && a.registersPC_ == b.registersPC_ &&
+		a.isHalted_ == b.isHalted_ && a.ime_ == b.ime_ && a.eiTriggered_ == b.eiTriggered_;
+}
+
+LockstepVerifier::LockstepVerifier(const System& system)
+	: jitSystem_(system.clone())
+	, referenceSystem_(system.clone())
+	, jitCycles_(0)
+	, referenceCycles_(0)
+{
+	jitSystem_->setExecutionMode(CPU::ExecutionMode::JIT);
+	referenceSystem_->setExecutionMode(CPU::ExecutionMode::INTERPRETER);
+}
+
+bool LockstepVerifier::runFrame(const byte actionButtons, const byte directionButtons)
+{
+	if (hasDiverged())
+	{
+		return false;
+	}
+
+	jitSystem_->setInputState(actionButtons, directionButtons);
+	referenceSystem_->setInputState(actionButtons, directionButtons);
+
+	const uint64_t frameEndCycle = jitCycles_ + System::CPU_CLOCK_CYCLES_PER_FRAME;
+	while (jitCycles_ < frameEndCycle)
+	{
+		jitCycles_ += jitSystem_->emulateNextMachineStep();
+		while (referenceCycles_ < jitCycles_)
+		{
+			referenceCycles_ += referenceSystem_->emulateNextMachineStep();
+		}
+
+		if (!compareCPUs())
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool LockstepVerifier::compareCPUs()
+{
+	// Both copies were forked with zeroed instruction counters
+	const CPUState& jitState = jitSystem_->getCPUState();
+	const CPUState& referenceState = referenceSystem_->getCPUState();
+	const uint64_t jitInstructionCount = jitSystem_->getExecutedInstructionCount();
+	const uint64_t referenceInstructionCount = referenceSystem_->getExecutedInstructionCount();
+	if (referenceCycles_ == jitCycles_ && jitInstructionCount == referenceInstructionCount && areCPUStatesEqual(jitState, referenceState))
+	{
+		return true;
+	}
+
+	char header[96];
+	snprintf(header, sizeof(header), "Diverged at JIT cycle %llu, interpreter cycle %llu\n", static_cast<unsigned long long>(jitCycles_), static_cast<unsigned long long>(referenceCycles_));
+	divergence_ = header;
+	divergence_ += formatCPUState("jit", jitState, jitInstructionCount);
+	divergence_ += formatCPUState("interpreter", referenceState, referenceInstructionCount);
+	return false;
+}
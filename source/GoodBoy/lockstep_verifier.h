@@ -0,0 +1,42 @@
+#ifndef LOCKSTEP_VERIFIER_H
+#define LOCKSTEP_VERIFIER_H
+
+#include "system.h"
+
+#include <memory>
+#include <string>
+
+// Differential test of the JIT against the interpreter. Forks a machine into one copy per
+// engine and runs them in lock-step: after every step of the JIT copy, which may cover
+// several instructions, the interpreter copy catches up to the same cycle and the CPU
+// registers and instruction counts of both are compared. This is for tracking down JIT
+// bugs, both copies run well below normal speed.
+class LockstepVerifier final
+{
+public:
+	explicit LockstepVerifier(const System& system);
+
+	// Runs both copies for one frame's worth of cycles with the given input and returns
+	// false once they diverged, after which they don't run any further
+	bool runFrame(const byte actionButtons, const byte directionButtons);
+
+	bool hasDiverged() const { return !divergence_.empty(); }
+
+	// The cycle and both register sets where the copies first disagreed, empty until then
+	const std::string& getDivergence() const { return divergence_; }
+
+	const System& getJitSystem() const { return *jitSystem_; }
+	const System& getReferenceSystem() const { return *referenceSystem_; }
+
+private:
+	bool compareCPUs();
+
+private:
+	std::unique_ptr<System> jitSystem_;
+	std::unique_ptr<System> referenceSystem_;
+	uint64_t jitCycles_;
+	uint64_t referenceCycles_;
+	std::string divergence_;
+};
+
+#endif /* LOCKSTEP_VERIFIER_H */
@@ -53,8 +53,8 @@ inline std::string getHexWord(const word w)
 
 #else
 inline void log(const LogType, const char*, ...) {}
-inline std::string getHexByte(const byte b) { return std::string(); }
-inline std::string getHexWord(const word w) { return std::string(); }
+inline std::string getHexByte(const byte) { return std::string(); }
+inline std::string getHexWord(const word) { return std::string(); }
 #endif /* not NDEBUG */
 
 #endif /* Logging_h */
@@ -0,0 +1,163 @@
+#include "lz_compression.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+static constexpr std::size_t MIN_MATCH_LENGTH = 4;
+static constexpr std::size_t MAX_MATCH_OFFSET = 0xFFFF;
+static constexpr int HASH_BITS = 12;
+static constexpr uint32_t NO_POSITION = 0xFFFFFFFF;
+
+static inline uint32_t read32(const byte* p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t hashSequence(const uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static byte* writeExtraLength(byte* out, std::size_t length)
+{
+	while (length >= 0xFF)
+	{
+		*out++ = 0xFF;
+		length -= 0xFF;
+	}
+	*out++ = static_cast<byte>(length);
+	return out;
+}
+
+static bool readExtraLength(const byte*& in, const byte* end, std::size_t& length)
+{
+	byte b;
+	do
+	{
+		if (in == end) return false;
+		b = *in++;
+		length += b;
+	} while (b == 0xFF);
+	return true;
+}
+
+static byte* writeLiterals(byte* out, byte& token, const byte* literals, const std::size_t literalCount)
+{
+	token |= static_cast<byte>(std::min<std::size_t>(literalCount, 15) << 4);
+	if (literalCount >= 15)
+	{
+		out = writeExtraLength(out, literalCount - 15);
+	}
+	memcpy(out, literals, literalCount);
+	return out + literalCount;
+}
+
+std::size_t lzCompressBound(const std::size_t sourceSize)
+{
+	return sourceSize + sourceSize / 0xFF + 16;
+}
+
+std::size_t lzCompress(const byte* source, const std::size_t sourceSize, byte* destination)
+{
+	uint32_t hashTable[1 << HASH_BITS];
+	std::fill(std::begin(hashTable), std::end(hashTable), NO_POSITION);
+
+	byte* out = destination;
+	std::size_t anchor = 0;
+	std::size_t position = 0;
+
+	while (sourceSize >= MIN_MATCH_LENGTH && position <= sourceSize - MIN_MATCH_LENGTH)
+	{
+		const uint32_t sequence = read32(source + position);
+		const uint32_t hash = hashSequence(sequence);
+		const uint32_t candidate = hashTable[hash];
+		hashTable[hash] = static_cast<uint32_t>(position);
+
+		if (candidate == NO_POSITION || position - candidate > MAX_MATCH_OFFSET || read32(source + candidate) != sequence)
+		{
+			position++;
+			continue;
+		}
+
+		std::size_t matchLength = MIN_MATCH_LENGTH;
+		while (position + matchLength < sourceSize && source[candidate + matchLength] == source[position + matchLength])
+		{
+			matchLength++;
+		}
+
+		byte* tokenPosition = out++;
+		byte token = 0;
+		out = writeLiterals(out, token, source + anchor, position - anchor);
+
+		const std::size_t offset = position - candidate;
+		*out++ = static_cast<byte>(offset & 0xFF);
+		*out++ = static_cast<byte>(offset >> 8);
+
+		const std::size_t extraMatchLength = matchLength - MIN_MATCH_LENGTH;
+		token |= static_cast<byte>(std::min<std::size_t>(extraMatchLength, 15));
+		if (extraMatchLength >= 15)
+		{
+			out = writeExtraLength(out, extraMatchLength - 15);
+		}
+		*tokenPosition = token;
+
+		position += matchLength;
+		anchor = position;
+	}
+
+	// Trailing literals, always present so the decoder knows where the stream ends
+	byte* tokenPosition = out++;
+	byte token = 0;
+	out = writeLiterals(out, token, source + anchor, sourceSize - anchor);
+	*tokenPosition = token;
+
+	return static_cast<std::size_t>(out - destination);
+}
+
+bool lzDecompress(const byte* source, const std::size_t sourceSize, byte* destination, const std::size_t destinationSize)
+{
+	const byte* in = source;
+	const byte* inEnd = source + sourceSize;
+	byte* out = destination;
+	byte* outEnd = destination + destinationSize;
+
+	while (in < inEnd)
+	{
+		const byte token = *in++;
+
+		std::size_t literalCount = token >> 4;
+		if (literalCount == 15 && !readExtraLength(in, inEnd, literalCount)) return false;
+		if (literalCount > static_cast<std::size_t>(inEnd - in) || literalCount > static_cast<std::size_t>(outEnd - out)) return false;
+		memcpy(out, in, literalCount);
+		in += literalCount;
+		out += literalCount;
+
+		if (in == inEnd)
+		{
+			break;
+		}
+
+		if (inEnd - in < 2) return false;
+		const std::size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		std::size_t matchLength = token & 0x0F;
+		if (matchLength == 15 && !readExtraLength(in, inEnd, matchLength)) return false;
+		matchLength += MIN_MATCH_LENGTH;
+
+		if (offset == 0 || offset > static_cast<std::size_t>(out - destination) || matchLength > static_cast<std::size_t>(outEnd - out)) return false;
+
+		// Byte by byte, since a match may overlap the bytes it is producing
+		const byte* match = out - offset;
+		for (std::size_t i = 0; i < matchLength; ++i)
+		{
+			out[i] = match[i];
+		}
+		out += matchLength;
+	}
+
+	return out == outEnd;
+}
@@ -0,0 +1,27 @@
+#ifndef LZ_COMPRESSION_H
+#define LZ_COMPRESSION_H
+
+#include "types.h"
+
+#include <cstddef>
+
+// Small byte-oriented LZ77 codec in the spirit of LZ4: greedy matching through a hash of
+// the next 4 bytes, no entropy coding. Machine state is mostly runs and repeated tiles, so
+// this gets most of the way to a real compressor at a fraction of the cost.
+//
+// Each sequence is a token (literal count in the high nibble, match length - 4 in the low
+// nibble, 15 meaning "more length bytes follow"), the literals, a 16-bit little-endian
+// match offset and any extra match length bytes. The final sequence carries literals only.
+
+// Worst-case compressed size for sourceSize bytes of input
+std::size_t lzCompressBound(const std::size_t sourceSize);
+
+// Compresses into destination, which must hold lzCompressBound(sourceSize) bytes, and
+// returns the compressed size
+std::size_t lzCompress(const byte* source, const std::size_t sourceSize, byte* destination);
+
+// Decompresses exactly destinationSize bytes. Returns false if the input is malformed or
+// does not decode to exactly that size.
+bool lzDecompress(const byte* source, const std::size_t sourceSize, byte* destination, const std::size_t destinationSize);
+
+#endif /* LZ_COMPRESSION_H */
@@ -1,14 +1,19 @@
 #include "apu.h"
+#include "block_cache.h"
 #include "cartridge.h"
+#include "cpu.h"
 #include "display.h"
+#include "interrupt_controller.h"
 #include "joypad.h"
 #include "logging.h"
 #include "memory.h"
 #include "timer.h"
 #include "types.h"
 
+#include <algorithm>
 #include <cassert>
-#include <memory.h>
+#include <cstdlib>
+#include <cstring>
 #include <stdio.h>
 
 
@@ -108,47 +113,297 @@ static const byte cgbBios[] =
 	0x1F, 0x00, 0xFF, 0x03, 0x40, 0x41, 0x42, 0x20, 0x21, 0x22, 0x80, 0x81, 0x82, 0x10, 0x11, 0x12, 0x12, 0xB0, 0x79, 0xB8, 0xAD, 0x16, 0x17, 0x07, 0xBA, 0x05, 0x7C, 0x13, 0x00, 0x00, 0x00, 0x00
 };
 
-Memory::Memory(Display& display, Cartridge& cartridge, Joypad& joypad, Timer& timer, APU& apu)
-	: apu_(apu)
+Memory::Memory(Display& display, Cartridge& cartridge, Joypad& joypad, Timer& timer, APU& apu, InterruptController& interruptController)
+	: MemoryState()
+	, apu_(apu)
+	, blockCache_(nullptr)
 	, display_(display)
 	, cartridge_(cartridge)
+	, interruptController_(interruptController)
 	, joypad_(joypad)
 	, timer_(timer)
-	, cgbWramBank_(0x1)
 	, cgbType_(Cartridge::CgbType::DMG)
+	, watchedTypes_(0)
+	, watchpointSink_(nullptr)
+	, cpu_(nullptr)
 {
+	std::fill(std::begin(watchedPages_), std::end(watchedPages_), 0);
 	memset(mem_, 0xFF, sizeof(mem_));
 	memset(cgbWram_, 0xFF, sizeof(cgbWram_));
+	cgbWramBank_ = 0x1;
 	inBios_ = true;
+	remapPages();
 }
 
-sbyte Memory::readSByteAt(const word address) const 
+void Memory::remapPages()
 {
-	return static_cast<sbyte>(readAt(address)); 
+	std::fill(std::begin(hostReadPages_), std::end(hostReadPages_), nullptr);
+	std::fill(std::begin(hostWritePages_), std::end(hostWritePages_), nullptr);
+	mapRomPages();
+	mapWorkRamPages();
+
+	// Echo RAM isn't mirrored, reads see what was left in mem_ and writes are asserted on
+	for (std::size_t page = ECHO_WRAM_START_ADDRESS >> PAGE_SHIFT; page <= ECHO_WRAM_END_ADDRESS >> PAGE_SHIFT; ++page)
+	{
+		hostReadPages_[page] = &mem_[page << PAGE_SHIFT];
+	}
+	applyPages(0, PAGE_COUNT - 1);
+}
+
+void Memory::mapRomPages()
+{
+	// The boot ROM covers the start of bank 0 until it is disabled, but for the cartridge
+	// header. The pages the two share are left to readMappedAt, as are banks the
+	// cartridge doesn't map straight from its ROM image.
+	const byte* bios = cgbType_ == Cartridge::CgbType::DMG ? dmgBios : cgbBios;
+	const std::size_t biosSize = cgbType_ == Cartridge::CgbType::DMG ? sizeof(dmgBios) : sizeof(cgbBios);
+	const byte* bank0 = cartridge_.getRomBank(ROM_BANK_0_START_ADDRESS);
+	const byte* bankN = cartridge_.getRomBank(ROM_BANK_1_N_START_ADDRESS);
+	for (std::size_t page = ROM_BANK_0_START_ADDRESS >> PAGE_SHIFT; page <= ROM_BANK_0_END_ADDRESS >> PAGE_SHIFT; ++page)
+	{
+		const std::size_t pageStart = page << PAGE_SHIFT;
+		const std::size_t pageEnd = pageStart + PAGE_OFFSET_MASK;
+		if (inBios_ && pageStart < biosSize)
+		{
+			const bool holdsHeader = pageStart <= CARTRIDGE_HEADER_END_ADDRESS && pageEnd >= CARTRIDGE_HEADER_START_ADDRESS;
+			hostReadPages_[page] = pageEnd < biosSize && !holdsHeader ? bios + pageStart : nullptr;
+		}
+		else
+		{
+			hostReadPages_[page] = bank0 != nullptr ? bank0 + pageStart : nullptr;
+		}
+	}
+
+	for (std::size_t page = ROM_BANK_1_N_START_ADDRESS >> PAGE_SHIFT; page <= ROM_BANK_1_N_END_ADDRESS >> PAGE_SHIFT; ++page)
+	{
+		hostReadPages_[page] = bankN != nullptr ? bankN + ((page << PAGE_SHIFT) - ROM_BANK_1_N_START_ADDRESS) : nullptr;
+	}
+	applyPages(ROM_BANK_0_START_ADDRESS >> PAGE_SHIFT, ROM_BANK_1_N_END_ADDRESS >> PAGE_SHIFT);
+}
+
+void Memory::mapWorkRamPages()
+{
+	// Writes during OAM DMA go through writeMappedAt, which only lets them at HRAM
+	const bool isDmaTransferInProgress = display_.dmaTransferInProgress();
+	for (std::size_t page = WRAM_0_START_ADDRESS >> PAGE_SHIFT; page <= WRAM_1_END_ADDRESS >> PAGE_SHIFT; ++page)
+	{
+		const word pageStart = static_cast<word>(page << PAGE_SHIFT);
+		byte* bytes = &mem_[pageStart];
+		if (cgbType_ != Cartridge::CgbType::DMG)
+		{
+			bytes = pageStart <= WRAM_0_END_ADDRESS ? &cgbWram_[pageStart - WRAM_0_START_ADDRESS] : &cgbWram_[(pageStart - WRAM_1_START_ADDRESS) + cgbWramBank_ * 0x1000];
+		}
+
+		hostReadPages_[page] = bytes;
+		hostWritePages_[page] = isDmaTransferInProgress ? nullptr : bytes;
+	}
+	applyPages(WRAM_0_START_ADDRESS >> PAGE_SHIFT, WRAM_1_END_ADDRESS >> PAGE_SHIFT);
+}
+
+void Memory::applyPages(const std::size_t firstPage, const std::size_t lastPage)
+{
+	// Execute watchpoints trap reads too, fetchUnpagedAt tells the two apart
+	for (std::size_t page = firstPage; page <= lastPage; ++page)
+	{
+		readPages_[page] = watchedPages_[page] & (WatchpointHit::READ | WatchpointHit::EXECUTE) ? nullptr : hostReadPages_[page];
+		writePages_[page] = watchedPages_[page] & WatchpointHit::WRITE ? nullptr : hostWritePages_[page];
+	}
+}
+
+void Memory::addWatchpoint(const byte types, const word startAddress, const word endAddress)
+{
+	assert(startAddress <= endAddress);
+	watchpoints_.push_back(Watchpoint{ types, startAddress, endAddress });
+	watchedTypes_ |= types;
+	for (std::size_t page = startAddress >> PAGE_SHIFT; page <= static_cast<std::size_t>(endAddress >> PAGE_SHIFT); ++page)
+	{
+		watchedPages_[page] |= types;
+	}
+	applyPages(0, PAGE_COUNT - 1);
+}
+
+void Memory::clearWatchpoints()
+{
+	watchpoints_.clear();
+	watchedTypes_ = 0;
+	std::fill(std::begin(watchedPages_), std::end(watchedPages_), 0);
+	applyPages(0, PAGE_COUNT - 1);
+}
+
+void Memory::reportWatchpointHit(const byte type, const word address, const byte value) const
+{
+	if (watchpointSink_ == nullptr)
+	{
+		return;
+	}
+
+	for (const Watchpoint& watchpoint : watchpoints_)
+	{
+		if ((watchpoint.types & type) && address >= watchpoint.startAddress && address <= watchpoint.endAddress)
+		{
+			const word pc = type == WatchpointHit::EXECUTE || cpu_ == nullptr ? address : cpu_->getState().registersPC_;
+			watchpointSink_->onWatchpointHit(WatchpointHit{ type, address, value, pc });
+			return;
+		}
+	}
+}
+
+byte Memory::readUnpagedAt(const word address) const
+{
+	const std::size_t page = address >> PAGE_SHIFT;
+	const byte b = hostReadPages_[page] != nullptr ? hostReadPages_[page][address & PAGE_OFFSET_MASK] : readMappedAt(address);
+	if (watchedPages_[page] & WatchpointHit::READ) reportWatchpointHit(WatchpointHit::READ, address, b);
+	return b;
+}
+
+byte Memory::fetchUnpagedAt(const word address) const
+{
+	const std::size_t page = address >> PAGE_SHIFT;
+	const byte opcode = hostReadPages_[page] != nullptr ? hostReadPages_[page][address & PAGE_OFFSET_MASK] : readMappedAt(address);
+	if (watchedPages_[page] & WatchpointHit::EXECUTE) reportWatchpointHit(WatchpointHit::EXECUTE, address, opcode);
+	return opcode;
+}
+
+void Memory::writeUnpagedAt(const word address, const byte b)
+{
+	const std::size_t page = address >> PAGE_SHIFT;
+	if (watchedPages_[page] & WatchpointHit::WRITE) reportWatchpointHit(WatchpointHit::WRITE, address, b);
+	if (hostWritePages_[page] == nullptr)
+	{
+		writeMappedAt(address, b);
+		return;
+	}
+
+	if (blockCache_ != nullptr) blockCache_->onRamWrite(address);
+	hostWritePages_[page][address & PAGE_OFFSET_MASK] = b;
 }
 
-word Memory::readWordAt(const word address) const 
+unsigned int Memory::getBulkAccessCount(const word address, const int step, const unsigned int count, const bool isWrite)
 {
-	return (readAt(address + 1) << 8 | readAt(address)); 
+	// Writes to anything but HRAM may be dropped, see writeAt
+	if (count == 0 || display_.dmaTransferInProgress())
+	{
+		return 0;
+	}
+
+	word regionStart = 0;
+	word regionEnd = 0;
+	const byte* region = isWrite ? getBulkRamRegion(address, regionStart, regionEnd) : getBulkReadRegion(address, regionStart, regionEnd);
+	if (region == nullptr)
+	{
+		return 0;
+	}
+
+	const unsigned int accessCount = std::min(count, step > 0 ? regionEnd - address + 1u : address - regionStart + 1u);
+	const word lastAddress = static_cast<word>(address + step * static_cast<int>(accessCount - 1));
+	if (isWrite && blockCache_ != nullptr && blockCache_->containsRamCode(std::min(address, lastAddress), std::max(address, lastAddress)))
+	{
+		return 0;
+	}
+
+	// Watched pages are left to the guest's own accesses, which trap
+	const byte watchedType = isWrite ? WatchpointHit::WRITE : WatchpointHit::READ;
+	if (watchedTypes_ & watchedType)
+	{
+		for (std::size_t page = std::min(address, lastAddress) >> PAGE_SHIFT; page <= static_cast<std::size_t>(std::max(address, lastAddress) >> PAGE_SHIFT); ++page)
+		{
+			if (watchedPages_[page] & watchedType)
+			{
+				return 0;
+			}
+		}
+	}
+
+	return accessCount;
 }
 
-byte Memory::readByteAt(const word address) const 
+byte Memory::copyBytes(const word destination, const int destinationStep, const word source, const int sourceStep, const unsigned int count)
 {
-	return readAt(address);
+	word destinationStart = 0, destinationEnd = 0, sourceStart = 0, sourceEnd = 0;
+	byte* destinationBytes = getBulkRamRegion(destination, destinationStart, destinationEnd) + (destination - destinationStart);
+	const byte* sourceBytes = getBulkReadRegion(source, sourceStart, sourceEnd) + (source - sourceStart);
+
+	// Only forward copies between separate ranges are plain memcpys. Anything else goes a
+	// byte at a time like the guest, which repeats bytes when the ranges overlap.
+	const bool overlaps = destinationStart == sourceStart && static_cast<unsigned int>(std::abs(destination - source)) < count;
+	if (destinationStep == 1 && sourceStep == 1 && !overlaps)
+	{
+		memcpy(destinationBytes, sourceBytes, count);
+	}
+	else
+	{
+		for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(count); ++i)
+		{
+			destinationBytes[i * destinationStep] = sourceBytes[i * sourceStep];
+		}
+	}
+
+	// Later writes could only have changed it to itself
+	return sourceBytes[static_cast<std::ptrdiff_t>(count - 1) * sourceStep];
 }
 
-void Memory::writeWordAt(const word address, const word w) 
+void Memory::fillBytes(const word destination, const int destinationStep, const byte value, const unsigned int count)
 {
-	writeAt(address, w & 0x00FF);
-	writeAt(address + 1, w >> 8);
+	word destinationStart = 0, destinationEnd = 0;
+	byte* destinationBytes = getBulkRamRegion(destination, destinationStart, destinationEnd) + (destination - destinationStart);
+	memset(destinationStep > 0 ? destinationBytes : destinationBytes - (count - 1), value, count);
 }
 
-void Memory::writeByteAt(const word address, const byte b) 
+const byte* Memory::getBulkReadRegion(const word address, word& regionStart, word& regionEnd)
 {
-	writeAt(address, b);
+	if (address <= ROM_BANK_0_END_ADDRESS)
+	{
+		regionStart = ROM_BANK_0_START_ADDRESS;
+		regionEnd = ROM_BANK_0_END_ADDRESS;
+		return inBios_ ? nullptr : cartridge_.getRomBank(address);
+	}
+	else if (address <= ROM_BANK_1_N_END_ADDRESS)
+	{
+		regionStart = ROM_BANK_1_N_START_ADDRESS;
+		regionEnd = ROM_BANK_1_N_END_ADDRESS;
+		return cartridge_.getRomBank(address);
+	}
+
+	return getBulkRamRegion(address, regionStart, regionEnd);
+}
+
+byte* Memory::getBulkRamRegion(const word address, word& regionStart, word& regionEnd)
+{
+	if (address >= VRAM_START_ADDRESS && address <= VRAM_END_ADDRESS)
+	{
+		regionStart = VRAM_START_ADDRESS;
+		regionEnd = VRAM_END_ADDRESS;
+		return display_.getCpuAccessibleVram();
+	}
+	else if (address >= WRAM_0_START_ADDRESS && address <= WRAM_1_END_ADDRESS && cgbType_ == Cartridge::CgbType::DMG)
+	{
+		regionStart = WRAM_0_START_ADDRESS;
+		regionEnd = WRAM_1_END_ADDRESS;
+		return &mem_[WRAM_0_START_ADDRESS];
+	}
+	else if (address >= WRAM_0_START_ADDRESS && address <= WRAM_0_END_ADDRESS)
+	{
+		regionStart = WRAM_0_START_ADDRESS;
+		regionEnd = WRAM_0_END_ADDRESS;
+		return cgbWram_;
+	}
+	else if (address >= WRAM_1_START_ADDRESS && address <= WRAM_1_END_ADDRESS)
+	{
+		regionStart = WRAM_1_START_ADDRESS;
+		regionEnd = WRAM_1_END_ADDRESS;
+		return &cgbWram_[cgbWramBank_ * 0x1000];
+	}
+	else if (address >= HRAM_START_ADDRESS && address <= HRAM_END_ADDRESS)
+	{
+		regionStart = HRAM_START_ADDRESS;
+		regionEnd = HRAM_END_ADDRESS;
+		return &mem_[HRAM_START_ADDRESS];
+	}
+
+	return nullptr;
 }
 
-byte Memory::readAt(const word address) const
+byte Memory::readMappedAt(const word address) const
 {
 	//assert(!(address >= ECHO_WRAM_START_ADDRESS && address <= ECHO_WRAM_END_ADDRESS)); // echo ram writing is prohibited
 	assert(!(address >= UNUSABLE_START_ADDRESS && address <= UNUSABLE_END_ADDRESS));   // unusable memory writing is prohibited
@@ -164,10 +419,6 @@ byte Memory::readAt(const word address) const
 
 	if (address >= VRAM_START_ADDRESS && address <= VRAM_END_ADDRESS)
 		return display_.readByteAt(address);
-	else if (address >= WRAM_0_START_ADDRESS && address <= WRAM_0_END_ADDRESS && cgbType_ != Cartridge::CgbType::DMG)
-		return cgbWram_[address - WRAM_0_START_ADDRESS];
-	else if (address >= WRAM_1_START_ADDRESS && address <= WRAM_1_END_ADDRESS && cgbType_ != Cartridge::CgbType::DMG)
-		return cgbWram_[(address - WRAM_1_START_ADDRESS) + cgbWramBank_ * 0x1000];
 	else if (address >= EXTERNAL_RAM_START_ADDRESS && address <= EXTERNAL_RAM_END_ADDRESS)
 		return cartridge_.readByteAt(address);
 	else if (address >= OAM_START_ADDRESS && address <= OAM_END_ADDRESS)
@@ -178,6 +429,8 @@ byte Memory::readAt(const word address) const
 	//log(LogType::INFO, ("Reading from " + getHexWord(address) + ": at SERIAL (" + getHexWord(SERIAL_TRANSFER_START_ADDRESS) + "-" + getHexWord(SERIAL_TRANSFER_END_ADDRESS) + ")").c_str());
 	else if (address >= TIMER_START_ADDRESS && address <= TIMER_END_ADDRESS)
 		return timer_.readByteAt(address);
+	else if (address == IF_ADDRESS || address == IE_ADDRESS)
+		return interruptController_.readByteAt(address);
 	else if (address >= SOUND_START_ADDRESS && address <= SOUND_END_ADDRESS)
 		return apu_.readByte(address);
 	else if (address >= LCD_START_ADDRESS && address <= LCD_END_ADDRESS)
@@ -198,7 +451,7 @@ byte Memory::readAt(const word address) const
 	return mem_[address];
 }
 
-void Memory::writeAt(const word address, const byte b)
+void Memory::writeMappedAt(const word address, const byte b)
 {
 	// On DMG, during this time (DMA), the CPU can access only HRAM(memory at $FF80 - $FFFE)
 	if (display_.dmaTransferInProgress())
@@ -221,6 +474,8 @@ void Memory::writeAt(const word address, const byte b)
 	if (address <= ROM_BANK_1_N_START_ADDRESS)
 	{
 		cartridge_.writeByteAt(address, b);
+		mapRomPages();
+		if (blockCache_ != nullptr) blockCache_->onBankSwitch();
 		return;
 	}
 	else if (address >= VRAM_START_ADDRESS && address <= VRAM_END_ADDRESS)
@@ -236,11 +491,13 @@ void Memory::writeAt(const word address, const byte b)
 	else if (address >= WRAM_0_START_ADDRESS && address <= WRAM_0_END_ADDRESS && cgbType_ != Cartridge::CgbType::DMG)
 	{
 		cgbWram_[address - WRAM_0_START_ADDRESS] = b;
+		if (blockCache_ != nullptr) blockCache_->onRamWrite(address);
 		return;
 	}
 	else if (address >= WRAM_1_START_ADDRESS && address <= WRAM_1_END_ADDRESS && cgbType_ != Cartridge::CgbType::DMG)
 	{
 		cgbWram_[(address - WRAM_1_START_ADDRESS) + cgbWramBank_ * 0x1000] = b;
+		if (blockCache_ != nullptr) blockCache_->onRamWrite(address);
 		return;
 	}
 	else if (address >= OAM_START_ADDRESS && address <= OAM_END_ADDRESS)
@@ -260,6 +517,11 @@ void Memory::writeAt(const word address, const byte b)
 		timer_.writeByteAt(address, b);
 		return;
 	}
+	else if (address == IF_ADDRESS || address == IE_ADDRESS)
+	{
+		interruptController_.writeByteAt(address, b);
+		return;
+	}
 	else if (address >= SOUND_START_ADDRESS && address <= SOUND_END_ADDRESS)
 	{
 		apu_.writeByte(address, b);
@@ -283,6 +545,7 @@ void Memory::writeAt(const word address, const byte b)
 		{
 			log(LogType::INFO, ("Writing: " + getHexByte(b) + " at " + getHexWord(address) + "  DISABLE_BOOT_ROM_ADDRESS (" + getHexWord(DISABLE_BOOT_ROM_ADDRESS) + ").").c_str());
 			inBios_ = !(b > 0x0);
+			mapRomPages();
 		}
 	}
 	else if (address >= VRAM_DMA_START_ADDRESS && address <= VRAM_DMA_END_ADDRESS)
@@ -300,8 +563,37 @@ void Memory::writeAt(const word address, const byte b)
 	else if (address == WRAM_BANK_SELECT_ADDRESS && cgbType_ != Cartridge::CgbType::DMG)
 	{
 		cgbWramBank_ = (b & 0x7) == 0x0 ? 0x1 : (b & 0x7);
+		mapWorkRamPages();
+		if (blockCache_ != nullptr) blockCache_->onBankSwitch();
 		return;
 	}
 
+	// DMG work RAM and HRAM end up here
+	if (blockCache_ != nullptr) blockCache_->onRamWrite(address);
 	mem_[address] = b;
+}
+
+int Memory::getCodeBank(const word address) const
+{
+	if (address <= ROM_BANK_0_END_ADDRESS)
+		return inBios_ ? UNCACHEABLE_CODE_BANK : 0;
+	else if (address <= ROM_BANK_1_N_END_ADDRESS)
+		return cartridge_.getRomBankNumber();
+	else if (address >= WRAM_0_START_ADDRESS && address <= WRAM_0_END_ADDRESS)
+		return 0;
+	else if (address >= WRAM_1_START_ADDRESS && address <= WRAM_1_END_ADDRESS)
+		return cgbType_ != Cartridge::CgbType::DMG ? cgbWramBank_ : 0;
+	else if (address >= HRAM_START_ADDRESS && address <= HRAM_END_ADDRESS)
+		return 0;
+
+	return UNCACHEABLE_CODE_BANK;
+}
+
+word Memory::getCodeRegionEnd(const word address)
+{
+	if (address <= ROM_BANK_0_END_ADDRESS) return ROM_BANK_0_END_ADDRESS;
+	if (address <= ROM_BANK_1_N_END_ADDRESS) return ROM_BANK_1_N_END_ADDRESS;
+	if (address <= WRAM_0_END_ADDRESS) return WRAM_0_END_ADDRESS;
+	if (address <= WRAM_1_END_ADDRESS) return WRAM_1_END_ADDRESS;
+	return HRAM_END_ADDRESS;
 }
\ No newline at end of file
@@ -2,13 +2,29 @@
 #define MEMORY_H
 
 #include "types.h"
+#include "block_cache.h"
 #include "cartridge.h"
+#include "sinks.h"
+
+#include <vector>
 
 class APU;
+class CPU;
 class Display;
+class InterruptController;
 class Joypad;
 class Timer;
-class Memory final
+
+// Guest-visible memory contents, kept as one trivially copyable block for snapshots
+struct MemoryState
+{
+	byte mem_[0x10000];
+	byte cgbWram_[0x8000];
+	byte cgbWramBank_;
+	bool inBios_;
+};
+
+class Memory final : private MemoryState
 {
 public:
 	static constexpr word ROM_BANK_0_START_ADDRESS   = 0x0000;
@@ -55,34 +71,149 @@ public:
 	static constexpr word WRAM_BANK_SELECT_ADDRESS       = 0xFF70; // CGB+
 	static constexpr word IE_ADDRESS                     = 0xFFFF;
 
+	static constexpr int UNCACHEABLE_CODE_BANK = -1;
+
 public:
 	friend class System;
-	Memory(Display&, Cartridge&, Joypad&, Timer&, APU&);
+	Memory(Display&, Cartridge&, Joypad&, Timer&, APU&, InterruptController&);
+
+	void setCartridgeCgbType(Cartridge::CgbType cgbType) { cgbType_ = cgbType; remapPages(); }
+
+	// Rebuilds the page tables from the banks, boot ROM and DMA state, which the System
+	// does once the components are all loaded from a state
+	void remapPages();
+
+	// Told by the Display when OAM DMA starts or ends, which locks the CPU out of all but HRAM
+	void onDmaTransferChanged() { mapWorkRamPages(); }
+
+	// Told about work RAM/HRAM writes and bank switches while the CPU caches decoded code
+	void setBlockCache(BlockCache* blockCache) { blockCache_ = blockCache; }
+
+	// Watchpoints trap the accesses of the given WatchpointHit types to startAddress through
+	// endAddress by taking the pages holding them off the page tables, so the rest of memory
+	// keeps its speed. Every hit goes to the sink along with the CPU's PC. Host-side and not
+	// part of the state.
+	void addWatchpoint(const byte types, const word startAddress, const word endAddress);
+	void clearWatchpoints();
+	void setWatchpointSink(WatchpointSink* watchpointSink) { watchpointSink_ = watchpointSink; }
+	void setCPU(const CPU* cpu) { cpu_ = cpu; }
+
+	bool hasReadWatchpoints() const { return (watchedTypes_ & WatchpointHit::READ) != 0; }
+	bool isExecuteWatched(const word address) const { return (watchedPages_[address >> PAGE_SHIFT] & WatchpointHit::EXECUTE) != 0; }
+
+	// The bank mapped at address for code in ROM, work RAM and HRAM, which is all the CPU
+	// caches, or UNCACHEABLE_CODE_BANK. A cached instruction must not cross getCodeRegionEnd.
+	int getCodeBank(const word address) const;
+	static word getCodeRegionEnd(const word address);
 
-	void setCartridgeCgbType(Cartridge::CgbType cgbType) { cgbType_ = cgbType; }
+	sbyte readSByteAt(const word address) const { return static_cast<sbyte>(readAt(address)); }
 
-	sbyte readSByteAt(const word address) const;
+	word readWordAt(const word address) const { return (readAt(address + 1) << 8 | readAt(address)); }
+	byte readByteAt(const word address) const { return readAt(address); }
 
-	word readWordAt(const word address) const;
-	byte readByteAt(const word address) const;
+	void writeWordAt(const word address, const word w) { writeAt(address, w & 0x00FF); writeAt(address + 1, w >> 8); }
+	void writeByteAt(const word address, const byte b) { writeAt(address, b); }
 
-	void writeWordAt(const word address, const word w);
-	void writeByteAt(const word address, const byte b);
+	// The interpreter's opcode fetches, the only reads execute watchpoints see
+	byte fetchOpcodeAt(const word address) const
+	{
+		const byte* page = readPages_[address >> PAGE_SHIFT];
+		return page != nullptr ? page[address & PAGE_OFFSET_MASK] : fetchUnpagedAt(address);
+	}
+
+	// Bulk accesses for the CPU's copy and fill loops, see BlockCache::BulkLoop. How many of
+	// count accesses from address on, stepping by step (1 or -1), stay in one region of plain
+	// memory: ROM past the boot ROM for reads, VRAM while the PPU lets the CPU at it, work
+	// RAM and HRAM, without cached code for writes. Outside OAM DMA and watched pages only.
+	unsigned int getBulkAccessCount(const word address, const int step, const unsigned int count, const bool isWrite);
+
+	// count accesses that getBulkAccessCount allowed, with the same result as the guest
+	// doing them byte by byte. copyBytes returns the last byte it read.
+	byte copyBytes(const word destination, const int destinationStep, const word source, const int sourceStep, const unsigned int count);
+	void fillBytes(const word destination, const int destinationStep, const byte value, const unsigned int count);
+
+	// Work RAM as laid out in the state: the 8KB at 0xC000 on DMG, all 8 banks on CGB
+	const byte* getWorkRam() const { return cgbType_ == Cartridge::CgbType::DMG ? &mem_[WRAM_0_START_ADDRESS] : cgbWram_; }
+	std::size_t getWorkRamSize() const { return cgbType_ == Cartridge::CgbType::DMG ? WRAM_1_END_ADDRESS - WRAM_0_START_ADDRESS + 1 : sizeof(cgbWram_); }
+
+	void saveState(MemoryState& state) const { state = *this; }
+	void loadState(const MemoryState& state) { static_cast<MemoryState&>(*this) = state; }
+	void copyStateFrom(const Memory& other) { other.saveState(*this); }
 
 private:
-	byte readAt(const word address) const;
-	void writeAt(const word address, const byte b);
+	static constexpr std::size_t PAGE_COUNT = 0x100;
+	static constexpr unsigned int PAGE_SHIFT = 8;
+	static constexpr word PAGE_OFFSET_MASK = 0xFF;
+
+	// Plain memory is read and written through its page's host bytes, everything else
+	// goes through the unpaged accesses
+	inline byte readAt(const word address) const
+	{
+		const byte* page = readPages_[address >> PAGE_SHIFT];
+		return page != nullptr ? page[address & PAGE_OFFSET_MASK] : readUnpagedAt(address);
+	}
+
+	inline void writeAt(const word address, const byte b)
+	{
+		byte* page = writePages_[address >> PAGE_SHIFT];
+		if (page == nullptr)
+		{
+			writeUnpagedAt(address, b);
+			return;
+		}
+
+		if (blockCache_ != nullptr) blockCache_->onRamWrite(address);
+		page[address & PAGE_OFFSET_MASK] = b;
+	}
+
+	// Watched pages, then the host pages watchpoints took off the tables, then
+	// readMappedAt and writeMappedAt for the rest
+	byte readUnpagedAt(const word address) const;
+	byte fetchUnpagedAt(const word address) const;
+	void writeUnpagedAt(const word address, const byte b);
+	byte readMappedAt(const word address) const;
+	void writeMappedAt(const word address, const byte b);
+
+	void mapRomPages();
+	void mapWorkRamPages();
+	void applyPages(const std::size_t firstPage, const std::size_t lastPage);
+	void reportWatchpointHit(const byte type, const word address, const byte value) const;
+
+	// The host bytes behind the bulk accessible region holding address, from regionStart
+	// to regionEnd
+	const byte* getBulkReadRegion(const word address, word& regionStart, word& regionEnd);
+	byte* getBulkRamRegion(const word address, word& regionStart, word& regionEnd);
 
-	byte mem_[0x10000];
-	byte cgbWram_[0x8000];
 	APU& apu_;
+	BlockCache* blockCache_;
 	Display& display_;
 	Cartridge& cartridge_;
+	InterruptController& interruptController_;
 	Joypad& joypad_;
 	Timer& timer_;
-	byte cgbWramBank_;
 	Cartridge::CgbType cgbType_;
-	bool inBios_;
+
+	// By address >> PAGE_SHIFT: ROM outside the boot ROM's and the header's pages, work
+	// RAM in the selected bank and the echo RAM reads see, and work RAM for writes while
+	// no OAM DMA is running. nullptr for the rest. The host pages are as mapped, the
+	// others what accesses use, without the pages watchpoints trap.
+	const byte* hostReadPages_[PAGE_COUNT];
+	byte* hostWritePages_[PAGE_COUNT];
+	const byte* readPages_[PAGE_COUNT];
+	byte* writePages_[PAGE_COUNT];
+
+	struct Watchpoint
+	{
+		byte types;
+		word startAddress;
+		word endAddress;
+	};
+
+	std::vector<Watchpoint> watchpoints_;
+	byte watchedPages_[PAGE_COUNT]; // the types watched anywhere in each page
+	byte watchedTypes_;             // the types watched anywhere
+	WatchpointSink* watchpointSink_;
+	const CPU* cpu_;
 };
 
 #endif /* MEMORY_H */
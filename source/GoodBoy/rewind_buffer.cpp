@@ -0,0 +1,154 @@
+#include "rewind_buffer.h"
+
+#include <cstring>
+
+static inline uint64_t read64(const byte* p)
+{
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static byte* writeVarint(byte* out, std::size_t value)
+{
+	while (value >= 0x80)
+	{
+		*out++ = static_cast<byte>(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = static_cast<byte>(value);
+	return out;
+}
+
+static const byte* readVarint(const byte* in, std::size_t& value)
+{
+	value = 0;
+	int shift = 0;
+	byte b;
+	do
+	{
+		b = *in++;
+		value |= static_cast<std::size_t>(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return in;
+}
+
+RewindBuffer::RewindBuffer(const std::size_t memoryBudgetBytes)
+	: newestState_(std::make_unique<MachineState>())
+	, scratchState_(std::make_unique<MachineState>())
+	, memoryBudgetBytes_(memoryBudgetBytes)
+	, deltaBytes_(0)
+	, hasNewestState_(false)
+{
+	// A zero run is at least a word long between two literal runs, so each pair of
+	// varints is amortised over at least 9 bytes of state
+	encodeBuffer_.resize(sizeof(MachineState) + (sizeof(MachineState) / 8 + 2) * 20);
+}
+
+void RewindBuffer::push(const System& system)
+{
+	if (!hasNewestState_)
+	{
+		system.snapshot(*newestState_);
+		hasNewestState_ = true;
+		return;
+	}
+
+	system.snapshot(*scratchState_);
+
+	const std::size_t deltaSize = encodeDelta(reinterpret_cast<const byte*>(scratchState_.get()), reinterpret_cast<const byte*>(newestState_.get()), sizeof(MachineState));
+	deltas_.emplace_back(encodeBuffer_.begin(), encodeBuffer_.begin() + deltaSize);
+	deltaBytes_ += deltaSize;
+	std::swap(newestState_, scratchState_);
+
+	// Dropping the oldest delta just makes the oldest state unreachable, the others are
+	// all relative to their successors
+	while (deltaBytes_ > memoryBudgetBytes_ && !deltas_.empty())
+	{
+		deltaBytes_ -= deltas_.front().size();
+		deltas_.pop_front();
+	}
+}
+
+bool RewindBuffer::stepBack(System& system)
+{
+	if (deltas_.empty())
+	{
+		return false;
+	}
+
+	applyDelta(deltas_.back(), reinterpret_cast<byte*>(newestState_.get()), sizeof(MachineState));
+	deltaBytes_ -= deltas_.back().size();
+	deltas_.pop_back();
+
+	system.restore(*newestState_);
+	return true;
+}
+
+void RewindBuffer::clear()
+{
+	deltas_.clear();
+	deltaBytes_ = 0;
+	hasNewestState_ = false;
+}
+
+// Encodes newer ^ older as alternating (equal byte count, differing byte count, XORed
+// bytes) runs. Equal stretches are found a word at a time and a differing run only ends
+// at a whole equal word, which keeps the run count (and so the varint overhead) low.
+std::size_t RewindBuffer::encodeDelta(const byte* newer, const byte* older, const std::size_t size)
+{
+	byte* out = encodeBuffer_.data();
+	std::size_t position = 0;
+
+	while (position < size)
+	{
+		const std::size_t equalStart = position;
+		while (position + 8 <= size && read64(newer + position) == read64(older + position))
+		{
+			position += 8;
+		}
+		while (position < size && newer[position] == older[position])
+		{
+			position++;
+		}
+
+		const std::size_t differingStart = position;
+		while (position < size && (position + 8 > size || read64(newer + position) != read64(older + position)))
+		{
+			position++;
+		}
+
+		out = writeVarint(out, differingStart - equalStart);
+		out = writeVarint(out, position - differingStart);
+		for (std::size_t i = differingStart; i < position; ++i)
+		{
+			*out++ = newer[i] ^ older[i];
+		}
+	}
+
+	return static_cast<std::size_t>(out - encodeBuffer_.data());
+}
+
+void RewindBuffer::applyDelta(const std::vector<byte>& delta, byte* state, const std::size_t size)
+{
+	const byte* in = delta.data();
+	const byte* end = in + delta.size();
+	std::size_t position = 0;
+
+	while (in < end && position < size)
+	{
+		std::size_t equalCount;
+		std::size_t differingCount;
+		in = readVarint(in, equalCount);
+		in = readVarint(in, differingCount);
+		position += equalCount;
+
+		for (std::size_t i = 0; i < differingCount; ++i)
+		{
+			state[position + i] ^= in[i];
+		}
+		in += differingCount;
+		position += differingCount;
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef REWIND_BUFFER_H
+#define REWIND_BUFFER_H
+
+#include "system.h"
+#include "types.h"
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// History of machine states for rewinding. Only the newest state is kept in full; every
+// older one is stored as the XOR of it and its successor, run-length encoded. Between two
+// frames almost all of memory and VRAM is unchanged, so the XOR is mostly zeroes and a
+// delta is typically a few hundred bytes. Stepping back applies a single delta to the
+// newest state. Once the deltas exceed the memory budget the oldest ones are dropped.
+class RewindBuffer final
+{
+public:
+	explicit RewindBuffer(const std::size_t memoryBudgetBytes);
+
+	// Records the system's current state as the newest one in the history
+	void push(const System& system);
+
+	// Restores the system to the state recorded before the newest one and makes that the
+	// newest. Returns false once the history is exhausted.
+	bool stepBack(System& system);
+
+	// Forgets the whole history, e.g. when another cartridge is loaded
+	void clear();
+
+	std::size_t getStepCount() const { return deltas_.size(); }
+	std::size_t getMemoryUsage() const { return deltaBytes_; }
+
+private:
+	std::size_t encodeDelta(const byte* newer, const byte* older, const std::size_t size);
+	static void applyDelta(const std::vector<byte>& delta, byte* state, const std::size_t size);
+
+private:
+	std::unique_ptr<MachineState> newestState_;
+	std::unique_ptr<MachineState> scratchState_;
+	std::deque<std::vector<byte>> deltas_;
+	std::vector<byte> encodeBuffer_;
+	std::size_t memoryBudgetBytes_;
+	std::size_t deltaBytes_;
+	bool hasNewestState_;
+};
+
+#endif /* REWIND_BUFFER_H */
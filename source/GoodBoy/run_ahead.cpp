@@ -0,0 +1,36 @@
+#include "run_ahead.h"
+
+RunAhead::RunAhead(const unsigned int runAheadFrames)
+	: savedState_(std::make_unique<MachineState>())
+	, runAheadFrames_(runAheadFrames)
+{
+}
+
+void RunAhead::runFrame(System& system, VideoSink* videoSink, AudioSink* audioSink)
+{
+	if (runAheadFrames_ == 0)
+	{
+		system.setVideoSink(videoSink);
+		system.setAudioSink(audioSink);
+		system.runFrame();
+		return;
+	}
+
+	// The real frame, heard but not seen
+	system.setVideoSink(nullptr);
+	system.setAudioSink(audioSink);
+	system.runFrame();
+	system.snapshot(*savedState_);
+
+	// The speculative frames, only the last of which is seen
+	system.setAudioSink(nullptr);
+	for (unsigned int i = 1; i < runAheadFrames_; ++i)
+	{
+		system.runFrame();
+	}
+	system.setVideoSink(videoSink);
+	system.runFrame();
+
+	system.restore(*savedState_);
+	system.setAudioSink(audioSink);
+}
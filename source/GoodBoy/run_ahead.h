@@ -0,0 +1,31 @@
+#ifndef RUN_AHEAD_H
+#define RUN_AHEAD_H
+
+#include "sinks.h"
+#include "system.h"
+
+#include <memory>
+
+// Hides the game's own input lag by presenting a frame from the future. Each host frame
+// runs one real frame with the current input (producing audio), snapshots, runs ahead
+// the configured number of frames with that same input presenting only the last one,
+// and then restores the snapshot. The speculative frames produce neither audio nor
+// intermediate video, and cost one snapshot and one restore on top of the emulation.
+class RunAhead final
+{
+public:
+	explicit RunAhead(const unsigned int runAheadFrames);
+
+	unsigned int getRunAheadFrames() const { return runAheadFrames_; }
+	void setRunAheadFrames(const unsigned int runAheadFrames) { runAheadFrames_ = runAheadFrames; }
+
+	// Advances the system by exactly one frame. Output goes to the given sinks, which are
+	// left attached afterwards.
+	void runFrame(System& system, VideoSink* videoSink, AudioSink* audioSink);
+
+private:
+	std::unique_ptr<MachineState> savedState_;
+	unsigned int runAheadFrames_;
+};
+
+#endif /* RUN_AHEAD_H */
@@ -0,0 +1,305 @@
+#include "save_state.h"
+#include "little_endian.h"
+#include "logging.h"
+#include "lz_compression.h"
+
+#include <cstdio>
+#include <cstring>
+
+static constexpr char SAVE_STATE_MAGIC[8] = { 'G', 'B', 'S', 'T', 'A', 'T', 'E', '\0' };
+static constexpr std::size_t HEADER_SIZE = sizeof(SAVE_STATE_MAGIC) + 4 + 4 + 8;
+static constexpr std::size_t SECTION_HEADER_SIZE = 4 + 4 + 4;
+static constexpr int SECTION_COUNT = 9;
+static constexpr int MAX_PIECES_PER_SECTION = 2;
+
+namespace
+{
+	struct SectionPiece
+	{
+		byte* data;
+		std::size_t size;
+	};
+
+	// Maps a file section onto the parts of a MachineState it is made of
+	struct SectionLayout
+	{
+		char tag[4];
+		SectionPiece pieces[MAX_PIECES_PER_SECTION];
+
+		std::size_t getRawSize() const { return pieces[0].size + pieces[1].size; }
+	};
+}
+
+static void getSectionLayouts(MachineState& state, const int externalRamSize, SectionLayout (&layouts)[SECTION_COUNT])
+{
+	const SectionLayout sectionLayouts[SECTION_COUNT] =
+	{
+		{ { 'C', 'P', 'U', ' ' }, { { reinterpret_cast<byte*>(&state.cpu), sizeof(state.cpu) }, { nullptr, 0 } } },
+		{ { 'M', 'E', 'M', ' ' }, { { reinterpret_cast<byte*>(&state.memory), sizeof(state.memory) }, { nullptr, 0 } } },
+		{ { 'D', 'I', 'S', 'P' }, { { reinterpret_cast<byte*>(&state.display), sizeof(state.display) }, { nullptr, 0 } } },
+		{ { 'T', 'I', 'M', 'R' }, { { reinterpret_cast<byte*>(&state.timer), sizeof(state.timer) }, { nullptr, 0 } } },
+		{ { 'A', 'P', 'U', ' ' }, { { reinterpret_cast<byte*>(&state.apu), sizeof(state.apu) }, { nullptr, 0 } } },
+		{ { 'C', 'A', 'R', 'T' }, { { reinterpret_cast<byte*>(&state.cartridge), sizeof(state.cartridge) }, { state.cartridgeExternalRam, static_cast<std::size_t>(externalRamSize) } } },
+		{ { 'J', 'O', 'Y', 'P' }, { { reinterpret_cast<byte*>(&state.joypad), sizeof(state.joypad) }, { nullptr, 0 } } },
+		{ { 'I', 'N', 'T', 'R' }, { { reinterpret_cast<byte*>(&state.interrupts), sizeof(state.interrupts) }, { nullptr, 0 } } },
+		{ { 'S', 'Y', 'S', ' ' }, { { reinterpret_cast<byte*>(&state.scheduler), sizeof(state.scheduler) }, { reinterpret_cast<byte*>(&state.overshootCycles), sizeof(state.overshootCycles) } } },
+	};
+	memcpy(layouts, sectionLayouts, sizeof(sectionLayouts));
+}
+
+bool loadStateFromFile(System& system, const std::string& path)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+	{
+		log(LogType::ERROR, "Could not open save state %s", path.c_str());
+		return false;
+	}
+
+	fseek(file, 0, SEEK_END);
+	const long fileSize = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	std::vector<byte> contents(fileSize > 0 ? static_cast<std::size_t>(fileSize) : 0);
+	const std::size_t readSize = fread(contents.data(), sizeof(byte), contents.size(), file);
+	fclose(file);
+
+	if (readSize != contents.size() || contents.size() < HEADER_SIZE || memcmp(contents.data(), SAVE_STATE_MAGIC, sizeof(SAVE_STATE_MAGIC)) != 0)
+	{
+		log(LogType::ERROR, "%s is not a save state", path.c_str());
+		return false;
+	}
+
+	const byte* in = contents.data() + sizeof(SAVE_STATE_MAGIC);
+	const uint32_t version = readLE32(in);
+	const uint32_t sectionCount = readLE32(in + 4);
+	const uint64_t romHash = readLE64(in + 8);
+	in += 16;
+
+	if (version != SAVE_STATE_VERSION)
+	{
+		log(LogType::ERROR, "Save state %s has version %u, expected %u", path.c_str(), version, SAVE_STATE_VERSION);
+		return false;
+	}
+
+	if (romHash != system.getRomHash())
+	{
+		log(LogType::ERROR, "Save state %s was made with a different ROM", path.c_str());
+		return false;
+	}
+
+	// Decode into a scratch state first so a damaged file leaves the system as it was
+	auto state = std::make_unique<MachineState>();
+	SectionLayout layouts[SECTION_COUNT];
+	getSectionLayouts(*state, system.getCartridgeExternalRamSize(), layouts);
+	bool loadedSections[SECTION_COUNT] = {};
+	std::vector<byte> sectionBuffer;
+
+	const byte* end = contents.data() + contents.size();
+	for (uint32_t i = 0; i < sectionCount; ++i)
+	{
+		if (static_cast<std::size_t>(end - in) < SECTION_HEADER_SIZE)
+		{
+			log(LogType::ERROR, "Save state %s is truncated", path.c_str());
+			return false;
+		}
+
+		const char* tag = reinterpret_cast<const char*>(in);
+		const uint32_t rawSize = readLE32(in + 4);
+		const uint32_t compressedSize = readLE32(in + 8);
+		in += SECTION_HEADER_SIZE;
+
+		if (static_cast<std::size_t>(end - in) < compressedSize)
+		{
+			log(LogType::ERROR, "Save state %s is truncated", path.c_str());
+			return false;
+		}
+
+		int layoutIndex = 0;
+		while (layoutIndex < SECTION_COUNT && memcmp(layouts[layoutIndex].tag, tag, sizeof(layouts[layoutIndex].tag)) != 0)
+		{
+			layoutIndex++;
+		}
+
+		if (layoutIndex == SECTION_COUNT)
+		{
+			log(LogType::WARNING, "Skipping unknown save state section %.4s", tag);
+			in += compressedSize;
+			continue;
+		}
+
+		const SectionLayout& layout = layouts[layoutIndex];
+		sectionBuffer.resize(layout.getRawSize());
+		if (rawSize != layout.getRawSize() || !lzDecompress(in, compressedSize, sectionBuffer.data(), sectionBuffer.size()))
+		{
+			log(LogType::ERROR, "Save state section %.4s in %s is corrupt", tag, path.c_str());
+			return false;
+		}
+
+		const byte* sectionData = sectionBuffer.data();
+		for (const auto& piece : layout.pieces)
+		{
+			if (piece.size > 0)
+			{
+				memcpy(piece.data, sectionData, piece.size);
+				sectionData += piece.size;
+			}
+		}
+
+		loadedSections[layoutIndex] = true;
+		in += compressedSize;
+	}
+
+	for (int i = 0; i < SECTION_COUNT; ++i)
+	{
+		if (!loadedSections[i])
+		{
+			log(LogType::ERROR, "Save state %s is missing section %.4s", path.c_str(), layouts[i].tag);
+			return false;
+		}
+	}
+
+	system.restore(*state);
+	return true;
+}
+
+SaveStateWriter::SaveStateWriter()
+	: writing_(false)
+	, stopping_(false)
+{
+	for (int i = 0; i < MAX_PENDING_SAVES; ++i)
+	{
+		freeStates_.push_back(std::make_unique<MachineState>());
+	}
+
+	thread_ = std::thread([this]() { writerLoop(); });
+}
+
+SaveStateWriter::~SaveStateWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	workCondition_.notify_one();
+	thread_.join();
+}
+
+bool SaveStateWriter::saveAsync(const System& system, const std::string& path)
+{
+	std::unique_ptr<MachineState> state;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (freeStates_.empty())
+		{
+			log(LogType::WARNING, "Dropping save state %s, previous saves are still being written", path.c_str());
+			return false;
+		}
+		state = std::move(freeStates_.back());
+		freeStates_.pop_back();
+	}
+
+	system.snapshot(*state);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		pendingSaves_.push_back({ std::move(state), path, system.getRomHash(), system.getCartridgeExternalRamSize() });
+	}
+	workCondition_.notify_one();
+	return true;
+}
+
+void SaveStateWriter::waitIdle()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	idleCondition_.wait(lock, [this]() { return pendingSaves_.empty() && !writing_; });
+}
+
+void SaveStateWriter::writerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		// Drain the queue before honouring a stop request so no save is lost on shutdown
+		workCondition_.wait(lock, [this]() { return stopping_ || !pendingSaves_.empty(); });
+		if (pendingSaves_.empty())
+		{
+			return;
+		}
+
+		PendingSave save = std::move(pendingSaves_.front());
+		pendingSaves_.pop_front();
+		writing_ = true;
+		lock.unlock();
+
+		writeSaveState(save);
+
+		lock.lock();
+		freeStates_.push_back(std::move(save.state));
+		writing_ = false;
+		idleCondition_.notify_all();
+	}
+}
+
+bool SaveStateWriter::writeSaveState(const PendingSave& save)
+{
+	const std::string temporaryPath = save.path + ".tmp";
+	FILE* file = fopen(temporaryPath.c_str(), "wb");
+	if (file == nullptr)
+	{
+		log(LogType::ERROR, "Could not create save state %s", temporaryPath.c_str());
+		return false;
+	}
+
+	byte header[HEADER_SIZE];
+	memcpy(header, SAVE_STATE_MAGIC, sizeof(SAVE_STATE_MAGIC));
+	writeLE32(header + 8, SAVE_STATE_VERSION);
+	writeLE32(header + 12, SECTION_COUNT);
+	writeLE64(header + 16, save.romHash);
+	bool success = fwrite(header, sizeof(byte), sizeof(header), file) == sizeof(header);
+
+	SectionLayout layouts[SECTION_COUNT];
+	getSectionLayouts(*save.state, save.externalRamSize, layouts);
+	for (const auto& layout : layouts)
+	{
+		sectionBuffer_.resize(layout.getRawSize());
+		byte* sectionData = sectionBuffer_.data();
+		for (const auto& piece : layout.pieces)
+		{
+			if (piece.size > 0)
+			{
+				memcpy(sectionData, piece.data, piece.size);
+				sectionData += piece.size;
+			}
+		}
+
+		compressedBuffer_.resize(lzCompressBound(sectionBuffer_.size()));
+		const std::size_t compressedSize = lzCompress(sectionBuffer_.data(), sectionBuffer_.size(), compressedBuffer_.data());
+
+		byte sectionHeader[SECTION_HEADER_SIZE];
+		memcpy(sectionHeader, layout.tag, sizeof(layout.tag));
+		writeLE32(sectionHeader + 4, static_cast<uint32_t>(sectionBuffer_.size()));
+		writeLE32(sectionHeader + 8, static_cast<uint32_t>(compressedSize));
+		success = success && fwrite(sectionHeader, sizeof(byte), sizeof(sectionHeader), file) == sizeof(sectionHeader);
+		success = success && fwrite(compressedBuffer_.data(), sizeof(byte), compressedSize, file) == compressedSize;
+	}
+
+	success = fclose(file) == 0 && success;
+	if (!success)
+	{
+		log(LogType::ERROR, "Could not write save state %s", temporaryPath.c_str());
+		remove(temporaryPath.c_str());
+		return false;
+	}
+
+#if defined(_WIN32)
+	// rename() does not replace an existing file on Windows
+	remove(save.path.c_str());
+#endif
+	if (rename(temporaryPath.c_str(), save.path.c_str()) != 0)
+	{
+		log(LogType::ERROR, "Could not move save state into place at %s", save.path.c_str());
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,77 @@
+#ifndef SAVE_STATE_H
+#define SAVE_STATE_H
+
+#include "system.h"
+#include "types.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Save state files are laid out as
+//   header:   "GBSTATE\0", format version, section count, ROM hash
+//   sections: 4 character tag, raw size, compressed size, LZ compressed payload
+// with the header and section fields stored little-endian. The section payloads are the
+// components' raw state blocks (CPU, MEM, DISP, TIMR, APU, CART, JOYP, INTR, SYS), so any change
+// to one of the *State structs must bump SAVE_STATE_VERSION. Loading rejects files written
+// by another version or for another ROM.
+static constexpr uint32_t SAVE_STATE_VERSION = 2;
+
+// Restores the system from a save state file. The system is left untouched on failure.
+bool loadStateFromFile(System& system, const std::string& path);
+
+// Writes save states from a background thread. The calling thread only pays for the
+// snapshot; compression and disk I/O happen on the writer thread. Files are written to a
+// temporary name and renamed into place, so a crash mid-write never clobbers the last
+// good save.
+class SaveStateWriter final
+{
+public:
+	// Snapshot buffers preallocated for saves that have not hit the disk yet
+	static constexpr int MAX_PENDING_SAVES = 2;
+
+public:
+	SaveStateWriter();
+	~SaveStateWriter();
+
+	SaveStateWriter(const SaveStateWriter&) = delete;
+	SaveStateWriter& operator=(const SaveStateWriter&) = delete;
+
+	// Snapshots the system and queues it for writing. Returns false, dropping this save,
+	// if MAX_PENDING_SAVES saves are still in flight rather than blocking the caller.
+	bool saveAsync(const System& system, const std::string& path);
+
+	// Blocks until every queued save has been written
+	void waitIdle();
+
+private:
+	struct PendingSave
+	{
+		std::unique_ptr<MachineState> state;
+		std::string path;
+		uint64_t romHash;
+		int externalRamSize;
+	};
+
+private:
+	void writerLoop();
+	bool writeSaveState(const PendingSave& save);
+
+private:
+	std::vector<std::unique_ptr<MachineState>> freeStates_;
+	std::deque<PendingSave> pendingSaves_;
+	std::vector<byte> sectionBuffer_;
+	std::vector<byte> compressedBuffer_;
+	std::mutex mutex_;
+	std::condition_variable workCondition_;
+	std::condition_variable idleCondition_;
+	bool writing_;
+	bool stopping_;
+	std::thread thread_;
+};
+
+#endif /* SAVE_STATE_H */
@@ -0,0 +1,26 @@
+#include "scheduler.h"
+
+Scheduler::Scheduler()
+	: currentCycle_(0)
+	, stepStartCycle_(0)
+	, nextEventCycle_(NEVER)
+{
+	for (auto& eventCycle : eventCycles_)
+	{
+		eventCycle = NEVER;
+	}
+}
+
+void Scheduler::schedule(const EventType eventType, const uint64_t cycle)
+{
+	eventCycles_[static_cast<int>(eventType)] = cycle;
+
+	nextEventCycle_ = NEVER;
+	for (const auto eventCycle : eventCycles_)
+	{
+		if (eventCycle < nextEventCycle_)
+		{
+			nextEventCycle_ = eventCycle;
+		}
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "types.h"
+
+// Owns the global machine clock and the deadline of the next interesting event of each
+// timed component (PPU mode change/DMA completion, timer overflow, APU sample flush).
+// Components are caught up ("synced") to the current cycle only when their deadline
+// passes or when the CPU touches one of their registers, so the CPU can run
+// uninterrupted in between instead of ticking every component after every instruction.
+class Scheduler final
+{
+public:
+	enum class EventType
+	{
+		PPU, TIMER, APU, COUNT
+	};
+
+	static constexpr uint64_t NEVER = UINT64_MAX;
+
+	// Upper bound between two syncs of the same component, even when it has nothing
+	// scheduled, so that catch-up spans always fit the components' cycle counters.
+	static constexpr uint64_t MAX_SYNC_INTERVAL_CYCLES = 70224;
+
+public:
+	Scheduler();
+
+	uint64_t getCurrentCycle() const { return currentCycle_; }
+	uint64_t getStepStartCycle() const { return stepStartCycle_; }
+	uint64_t getNextEventCycle() const { return nextEventCycle_; }
+	bool hasDueEvents() const { return currentCycle_ >= nextEventCycle_; }
+	bool isEventDue(const EventType eventType) const { return currentCycle_ >= eventCycles_[static_cast<int>(eventType)]; }
+
+	void advance(const unsigned int cycles) { stepStartCycle_ = currentCycle_; currentCycle_ += cycles; }
+	void schedule(const EventType eventType, const uint64_t cycle);
+
+private:
+	// With only a handful of event sources a fixed slot per source and a cached minimum
+	// beats a heap; rescheduling is a store plus a scan of COUNT entries.
+	uint64_t eventCycles_[static_cast<int>(EventType::COUNT)];
+	uint64_t currentCycle_;
+	uint64_t stepStartCycle_;
+	uint64_t nextEventCycle_;
+};
+
+#endif /* SCHEDULER_H */
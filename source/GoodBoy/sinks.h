@@ -0,0 +1,71 @@
+#ifndef SINKS_H
+#define SINKS_H
+
+#include "types.h"
+
+// Output interfaces between the emulation core and whatever is presenting it.
+// The core never talks to a window or an audio device directly; a frontend
+// implements these and hands them to System. A detached (nullptr) sink means
+// the corresponding output is not produced at all.
+class VideoSink
+{
+public:
+	static constexpr int SCREEN_WIDTH = 160;
+	static constexpr int SCREEN_HEIGHT = 144;
+	static constexpr int BYTES_PER_PIXEL = 4;
+
+	virtual ~VideoSink() = default;
+
+	// Called once per frame on VBlank with the finished frame in RGBA8888 (ABGR byte order),
+	// SCREEN_WIDTH * SCREEN_HEIGHT * BYTES_PER_PIXEL bytes
+	virtual void onVBlank(const byte* pixels) = 0;
+};
+
+class AudioSink
+{
+public:
+	static constexpr int SAMPLE_RATE = 48000;
+	static constexpr int CHANNEL_COUNT = 2;
+
+	virtual ~AudioSink() = default;
+
+	// Called for every synthesized stereo frame at SAMPLE_RATE
+	virtual void onAudioFrame(const float left, const float right) = 0;
+};
+
+// A guest access to an address System::addWatchpoint watches
+struct WatchpointHit
+{
+	static constexpr byte READ    = 0x1;
+	static constexpr byte WRITE   = 0x2;
+	static constexpr byte EXECUTE = 0x4;
+
+	byte type;    // one of the above
+	word address;
+	byte value;   // the byte read, about to be written or the opcode about to run
+	word pc;      // the instruction's own address for EXECUTE, otherwise the CPU's PC, already past its operands
+};
+
+class WatchpointSink
+{
+public:
+	virtual ~WatchpointSink() = default;
+
+	// Called from inside the access, before a write lands or a fetched instruction runs.
+	// The emulation carries on afterwards.
+	virtual void onWatchpointHit(const WatchpointHit& hit) = 0;
+};
+
+class NullVideoSink final : public VideoSink
+{
+public:
+	void onVBlank(const byte*) override {}
+};
+
+class NullAudioSink final : public AudioSink
+{
+public:
+	void onAudioFrame(const float, const float) override {}
+};
+
+#endif /* SINKS_H */
@@ -1,37 +1,89 @@
 #include "system.h"
 
+#include <algorithm>
+#include <limits>
+
 System::System()
-	: display_()
+	: scheduler_()
+	, display_()
 	, cartridge_()
 	, joypad_()
 	, timer_()
 	, apu_()
-	, mem_(display_, cartridge_, joypad_, timer_, apu_)
-	, cpu_(mem_, display_)
+	, interruptController_()
+	, mem_(display_, cartridge_, joypad_, timer_, apu_, interruptController_)
+	, cpu_(mem_, display_, interruptController_)
+	, overshootCycles_(0)
+	, subsystemTimes_()
+	, subsystemTimingEnabled_(false)
+#ifdef GOODBOY_GUEST_PROFILER
+	, guestProfiler_(nullptr)
+#endif
 {
 	display_.setMemory(&mem_);
 	display_.setMainMemoryBlock(mem_.mem_);
 	joypad_.setMemory(mem_.mem_);
 	timer_.setMemory(mem_.mem_);
 
+	mem_.setCPU(&cpu_);
 	display_.setCPU(&cpu_);
 	joypad_.setCPU(&cpu_);
 	timer_.setCPU(&cpu_);
+
+	display_.setScheduler(&scheduler_);
+	timer_.setScheduler(&scheduler_);
+	apu_.setScheduler(&scheduler_);
 }
 
 unsigned int System::emulateNextMachineStep()
 {
-	// Update CPU
-	unsigned int cpuClockCycles = cpu_.executeNextInstruction();
+	return stepMachine(std::numeric_limits<unsigned int>::max());
+}
+
+unsigned int System::runCycles(const unsigned int cycles)
+{
+	unsigned int spentCycles = overshootCycles_;
+	while (spentCycles < cycles)
+	{
+		spentCycles += stepMachine(cycles - spentCycles);
+	}
+	overshootCycles_ = spentCycles - cycles;
+	return spentCycles;
+}
+
+void System::runFrame()
+{
+	runCycles(CPU_CLOCK_CYCLES_PER_FRAME);
+}
 
-	// Update display based on spent clock cycles
-	display_.update(cpuClockCycles);
-	
-	// Update timer based on spent clock cycles
-	timer_.update(cpuClockCycles);
+inline unsigned int System::stepMachine(const unsigned int cycleBudget)
+{
+	// Update CPU
+	unsigned int cpuClockCycles;
+	if (cpu_.isHaltedUntilInterrupt())
+	{
+		cpuClockCycles = skipHaltedSteps(cycleBudget);
+	}
+	else if (cpu_.isInIdleLoop() && getStepCycleLimit(cycleBudget) >= 2 * cpu_.getIdleLoopClockCycles())
+	{
+		cpuClockCycles = skipIdleLoop(cycleBudget);
+	}
+	else if (cpu_.isAtBulkLoop())
+	{
+		cpuClockCycles = runBulkLoop(cycleBudget);
+	}
+	else
+	{
+		cpuClockCycles = stepInstructions(cycleBudget);
+	}
 
-	// Update apu based on spent clock cycles
-	apu_.update(cpuClockCycles);
+	// Components only need to catch up once their next event is due. Register
+	// accesses in between sync them on demand.
+	if (scheduler_.hasDueEvents())
+	{
+		processDueEvents();
+		cpu_.onSchedulerEvent();
+	}
 
 	// Handle interrupts
 	cpuClockCycles += cpu_.handleInterrupts();
@@ -39,22 +91,244 @@ unsigned int System::emulateNextMachineStep()
 	return cpuClockCycles;
 }
 
+inline unsigned int System::stepInstructions(const unsigned int cycleBudget)
+{
+	if (cpu_.getExecutionMode() != CPU::ExecutionMode::JIT)
+	{
+		const unsigned int cpuClockCycles = cpu_.executeNextInstruction();
+		scheduler_.advance(cpuClockCycles);
+		return cpuClockCycles;
+	}
+
+	return stepCompiledCode(cycleBudget);
+}
+
+unsigned int System::stepCompiledCode(const unsigned int cycleBudget)
+{
+	// Compiled code may run several instructions in one step. It stops where the step by
+	// step loop would have found an event due or the budget spent, and the scheduler
+	// advances in two parts so the components see its last instruction as the last step.
+	const unsigned int cpuClockCycles = cpu_.executeCompiledInstructions(getStepCycleLimit(cycleBudget));
+	const unsigned int lastInstructionClockCycles = cpu_.getLastInstructionClockCycles();
+	scheduler_.advance(cpuClockCycles - lastInstructionClockCycles);
+	scheduler_.advance(lastInstructionClockCycles);
+	return cpuClockCycles;
+}
+
+unsigned int System::skipHaltedSteps(const unsigned int cycleBudget)
+{
+	// Only a component event can end the halt, so the halted steps up to the next one, or
+	// to the end of the budget, are all alike and collapse into one. As with compiled
+	// code the last of them stays a step of its own for the components.
+	const unsigned int haltedSteps = std::max(1u, (getStepCycleLimit(cycleBudget) + CPU::HALTED_STEP_CLOCK_CYCLES - 1) / CPU::HALTED_STEP_CLOCK_CYCLES);
+	const unsigned int cpuClockCycles = haltedSteps * CPU::HALTED_STEP_CLOCK_CYCLES;
+	scheduler_.advance(cpuClockCycles - CPU::HALTED_STEP_CLOCK_CYCLES);
+	scheduler_.advance(CPU::HALTED_STEP_CLOCK_CYCLES);
+
+#ifdef GOODBOY_GUEST_PROFILER
+	if (guestProfiler_ != nullptr) guestProfiler_->recordHaltedCycles(cpuClockCycles);
+#endif
+	return cpuClockCycles;
+}
+
+unsigned int System::skipIdleLoop(const unsigned int cycleBudget)
+{
+	// Like halted steps, the iterations of a polling loop up to the next event are alike
+	const unsigned int cpuClockCycles = cpu_.skipIdleLoop(getStepCycleLimit(cycleBudget));
+	const unsigned int lastInstructionClockCycles = cpu_.getLastInstructionClockCycles();
+	scheduler_.advance(cpuClockCycles - lastInstructionClockCycles);
+	scheduler_.advance(lastInstructionClockCycles);
+	return cpuClockCycles;
+}
+
+unsigned int System::runBulkLoop(const unsigned int cycleBudget)
+{
+	// The iterations of a copy or fill loop up to the next event only touch plain memory,
+	// so they can run in one step, ending like compiled code does
+	const unsigned int cpuClockCycles = cpu_.runBulkLoop(getStepCycleLimit(cycleBudget));
+	if (cpuClockCycles == 0)
+	{
+		return stepInstructions(cycleBudget);
+	}
+
+	const unsigned int lastInstructionClockCycles = cpu_.getLastInstructionClockCycles();
+	scheduler_.advance(cpuClockCycles - lastInstructionClockCycles);
+	scheduler_.advance(lastInstructionClockCycles);
+	return cpuClockCycles;
+}
+
+// Cycles a multi-instruction step may cover: up to the next scheduler event and no
+// further than the step loop would have run
+unsigned int System::getStepCycleLimit(const unsigned int cycleBudget) const
+{
+	const uint64_t currentCycle = scheduler_.getCurrentCycle();
+	const uint64_t cyclesUntilNextEvent = scheduler_.getNextEventCycle() > currentCycle ? scheduler_.getNextEventCycle() - currentCycle : 0;
+	return static_cast<unsigned int>(std::min<uint64_t>(cyclesUntilNextEvent, cycleBudget));
+}
+
+void System::processDueEvents()
+{
+	if (subsystemTimingEnabled_)
+	{
+		processDueEventsTimed();
+		return;
+	}
+
+	// Same order the components used to be ticked in after every instruction
+	if (scheduler_.isEventDue(Scheduler::EventType::PPU))
+	{
+		display_.sync();
+	}
+
+	if (scheduler_.isEventDue(Scheduler::EventType::TIMER))
+	{
+		timer_.sync();
+	}
+
+	if (scheduler_.isEventDue(Scheduler::EventType::APU))
+	{
+		apu_.sync();
+	}
+}
+
+void System::processDueEventsTimed()
+{
+	using Clock = std::chrono::steady_clock;
+
+	if (scheduler_.isEventDue(Scheduler::EventType::PPU))
+	{
+		const auto start = Clock::now();
+		display_.sync();
+		subsystemTimes_.display += Clock::now() - start;
+	}
+
+	if (scheduler_.isEventDue(Scheduler::EventType::TIMER))
+	{
+		const auto start = Clock::now();
+		timer_.sync();
+		subsystemTimes_.timer += Clock::now() - start;
+	}
+
+	if (scheduler_.isEventDue(Scheduler::EventType::APU))
+	{
+		const auto start = Clock::now();
+		apu_.sync();
+		subsystemTimes_.apu += Clock::now() - start;
+	}
+}
+
 std::string System::loadCartridge(const char* filename)
 {
 	const auto& cartridgeName = cartridge_.loadCartridge(filename);
 	mem_.setCartridgeCgbType(cartridge_.getCgbType());
+	cpu_.clearCachedCode();
+	display_.setCartridgeCgbType(cartridge_.getCgbType());
+	return cartridgeName;
+}
+
+std::string System::loadCartridgeFromMemory(const byte* romData, const std::size_t romSize)
+{
+	const auto& cartridgeName = cartridge_.loadCartridgeFromMemory(romData, romSize);
+	mem_.setCartridgeCgbType(cartridge_.getCgbType());
+	cpu_.clearCachedCode();
 	display_.setCartridgeCgbType(cartridge_.getCgbType());
 	return cartridgeName;
 }
 
+std::unique_ptr<System> System::clone() const
+{
+	auto copy = std::make_unique<System>();
+	copy->cartridge_.shareCartridge(cartridge_);
+	copy->mem_.setCartridgeCgbType(cartridge_.getCgbType());
+	copy->display_.setCartridgeCgbType(cartridge_.getCgbType());
+	copy->apu_.setSoundDisabled(apu_.isSoundDisabled());
+	copy->cpu_.setExecutionMode(cpu_.getExecutionMode());
+
+	// Component to component, skipping the MachineState a snapshot would go through
+	copy->scheduler_ = scheduler_;
+	copy->cpu_.copyStateFrom(cpu_);
+	copy->mem_.copyStateFrom(mem_);
+	copy->display_.copyStateFrom(display_);
+	copy->timer_.copyStateFrom(timer_);
+	copy->joypad_.copyStateFrom(joypad_);
+	copy->interruptController_.copyStateFrom(interruptController_);
+	copy->cartridge_.copyStateFrom(cartridge_);
+	copy->apu_.copyStateFrom(apu_);
+	copy->overshootCycles_ = overshootCycles_;
+	copy->mem_.remapPages();
+	return copy;
+}
+
+void System::snapshot(MachineState& state) const
+{
+	// Components sync lazily, but each one's last sync cycle is part of its state and the
+	// scheduler holds the matching deadlines, so no catch-up is needed first
+	state.scheduler = scheduler_;
+	cpu_.saveState(state.cpu);
+	mem_.saveState(state.memory);
+	display_.saveState(state.display);
+	timer_.saveState(state.timer);
+	joypad_.saveState(state.joypad);
+	interruptController_.saveState(state.interrupts);
+	cartridge_.saveState(state.cartridge, state.cartridgeExternalRam);
+	apu_.saveState(state.apu);
+	state.overshootCycles = overshootCycles_;
+}
+
+void System::restore(const MachineState& state)
+{
+	scheduler_ = state.scheduler;
+	cpu_.loadState(state.cpu);
+	mem_.loadState(state.memory);
+	display_.loadState(state.display);
+	timer_.loadState(state.timer);
+	joypad_.loadState(state.joypad);
+	interruptController_.loadState(state.interrupts);
+	cartridge_.loadState(state.cartridge, state.cartridgeExternalRam);
+	apu_.loadState(state.apu);
+	overshootCycles_ = state.overshootCycles;
+
+	// Banks, the boot ROM and DMA all come from the state, the page tables follow them
+	mem_.remapPages();
+
+	// ROM blocks are keyed by bank and stay valid, RAM was overwritten wholesale
+	cpu_.invalidateCachedRamCode();
+}
+
 void System::setInputState(const byte actionButtons, const byte directionButtons)
 {
 	joypad_.setJoypadState(actionButtons, directionButtons);
 }
 
-void System::setVBlankCallback(Display::VBlankCallback cb)
+void System::setVideoSink(VideoSink* videoSink)
+{
+	display_.setVideoSink(videoSink);
+}
+
+void System::setAudioSink(AudioSink* audioSink)
+{
+	apu_.setAudioSink(audioSink);
+}
+
+void System::addWatchpoint(const byte types, const word startAddress, const word endAddress)
+{
+	mem_.addWatchpoint(types, startAddress, endAddress);
+
+	// Cached blocks run without fetching, the interpreter has to take over watched code
+	if (types & WatchpointHit::EXECUTE)
+	{
+		cpu_.clearCachedCode();
+	}
+}
+
+void System::clearWatchpoints()
+{
+	mem_.clearWatchpoints();
+}
+
+void System::setWatchpointSink(WatchpointSink* watchpointSink)
 {
-	display_.setVBlankCallback(cb);
+	mem_.setWatchpointSink(watchpointSink);
 }
 
 void System::toggleSoundDisabled()
@@ -5,10 +5,48 @@
 #include "cartridge.h"
 #include "cpu.h"
 #include "display.h"
+#include "guest_profiler.h"
+#include "interrupt_controller.h"
 #include "joypad.h"
 #include "memory.h"
+#include "scheduler.h"
+#include "sinks.h"
 #include "timer.h"
 
+#include <chrono>
+#include <memory>
+#include <type_traits>
+
+// The complete guest-visible machine state as a handful of flat blocks, large enough for
+// any supported cartridge. Allocate one up front and reuse it for every snapshot; taking
+// or restoring one is a few memcpys and never touches the heap. A state can only be
+// restored into a System running the same cartridge.
+struct MachineState
+{
+	Scheduler scheduler;
+	CPUState cpu;
+	MemoryState memory;
+	DisplayState display;
+	TimerState timer;
+	JoypadState joypad;
+	InterruptControllerState interrupts;
+	CartridgeState cartridge;
+	APUState apu;
+	unsigned int overshootCycles;
+	byte cartridgeExternalRam[Cartridge::MAX_EXTERNAL_RAM_SIZE];
+};
+
+static_assert(std::is_trivially_copyable<MachineState>::value, "MachineState must stay memcpy-able");
+
+// Host time spent in each component's scheduled catch-up. Syncs forced by register
+// accesses in between run inside the CPU's instruction and are not included.
+struct SubsystemTimes
+{
+	std::chrono::nanoseconds display{ 0 };
+	std::chrono::nanoseconds timer{ 0 };
+	std::chrono::nanoseconds apu{ 0 };
+};
+
 class System final
 {
 public:
@@ -22,27 +60,103 @@ public:
 	static constexpr byte DIRECTION_BUTTON_UP_MASK = 0x4;
 	static constexpr byte DIRECTION_BUTTON_DOWN_MASK = 0x8;
 
+	// The number of CPU clock cycles per frame and per second
+	static constexpr unsigned int CPU_CLOCK_CYCLES_PER_FRAME = 70224;
+	static constexpr unsigned int CPU_CLOCK_CYCLES_PER_SECOND = 4194304;
+
 public:
 	System();
+
+	// The components are wired to each other by reference at construction, so a
+	// memberwise copy would leave the copy driving the original's components
+	System(const System&) = delete;
+	System& operator=(const System&) = delete;
+
+	// Forks the machine into an independent copy that shares this one's ROM image. The
+	// copy starts with no sinks attached and never writes the battery save file.
+	std::unique_ptr<System> clone() const;
 	
+	// One instruction, or up to the next scheduler event in the JIT, while halted and in
+	// polling loops
 	unsigned int emulateNextMachineStep();
 
+	// Runs the machine for at least the given number of clock cycles and returns the
+	// number actually spent. Any overshoot past the target (instructions are not
+	// divisible) is carried over and deducted from the next call, so repeated calls
+	// stay aligned to the requested cycle boundaries.
+	unsigned int runCycles(const unsigned int cycles);
+	void runFrame();
+
 	std::string loadCartridge(const char* filename);
+	std::string loadCartridgeFromMemory(const byte* romData, const std::size_t romSize);
+
+	uint64_t getRomHash() const { return cartridge_.getRomHash(); }
+	int getCartridgeExternalRamSize() const { return cartridge_.getExternalRamSize(); }
+
+	const byte* getWorkRam() const { return mem_.getWorkRam(); }
+	std::size_t getWorkRamSize() const { return mem_.getWorkRamSize(); }
+
+	void snapshot(MachineState& state) const;
+	void restore(const MachineState& state);
+
+	// Timing costs a clock read around every scheduled sync, so it is off by default
+	void setSubsystemTimingEnabled(const bool enabled) { subsystemTimingEnabled_ = enabled; }
+	const SubsystemTimes& getSubsystemTimes() const { return subsystemTimes_; }
+	uint64_t getExecutedInstructionCount() const { return cpu_.getExecutedInstructionCount(); }
+	const CPUState& getCPUState() const { return cpu_.getState(); }
+
+	// Host-side and not part of the state; every mode emulates the same machine
+	void setExecutionMode(const CPU::ExecutionMode mode) { cpu_.setExecutionMode(mode); }
+	CPU::ExecutionMode getExecutionMode() const { return cpu_.getExecutionMode(); }
+
+#ifdef GOODBOY_GUEST_PROFILER
+	// Profiles the guest code run from now on, until set back to nullptr. Clones start
+	// without one.
+	void setGuestProfiler(GuestProfiler* guestProfiler) { guestProfiler_ = guestProfiler; cpu_.setGuestProfiler(guestProfiler); }
+#endif
 
 	void setInputState(const byte actionButtons, const byte directionButtons);
-	void setVBlankCallback(Display::VBlankCallback cb);
+	void setVideoSink(VideoSink* videoSink);
+	void setAudioSink(AudioSink* audioSink);
+
+	// Watches startAddress through endAddress for the WatchpointHit types ORed in types,
+	// reporting hits to the sink. Only the pages watched leave the page tables, so runs
+	// slow down by how often the guest touches those. Host-side and not part of the
+	// state; clones start without any.
+	void addWatchpoint(const byte types, const word startAddress, const word endAddress);
+	void clearWatchpoints();
+	void setWatchpointSink(WatchpointSink* watchpointSink);
     
     void toggleSoundDisabled();
     bool isSoundDisabled() const;
     
 private:
+	unsigned int stepMachine(const unsigned int cycleBudget);
+	unsigned int stepInstructions(const unsigned int cycleBudget);
+	unsigned int stepCompiledCode(const unsigned int cycleBudget);
+	unsigned int skipHaltedSteps(const unsigned int cycleBudget);
+	unsigned int skipIdleLoop(const unsigned int cycleBudget);
+	unsigned int runBulkLoop(const unsigned int cycleBudget);
+	unsigned int getStepCycleLimit(const unsigned int cycleBudget) const;
+	void processDueEvents();
+	void processDueEventsTimed();
+
+private:
+	Scheduler scheduler_;
 	Display display_;
 	Cartridge cartridge_;
 	Joypad joypad_;
 	Timer timer_;
 	APU apu_;
+	InterruptController interruptController_;
 	Memory mem_;
 	CPU cpu_;
+	unsigned int overshootCycles_;
+	SubsystemTimes subsystemTimes_;
+	bool subsystemTimingEnabled_;
+#ifdef GOODBOY_GUEST_PROFILER
+	GuestProfiler* guestProfiler_;
+#endif
 };
 
 #endif
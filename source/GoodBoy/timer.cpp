@@ -36,22 +36,32 @@ static constexpr word TIMER_CONTROL_ADDRESS = 0xFF07;
 #define IS_BIT_SET(bit, reg) (((reg >> bit) & 0x1) == 0x1)
 
 Timer::Timer()
-	: divRegisterCycleCounter_(0)
-	, timerAccumRegisterCycleCounter_(0)
+	: TimerState()
+	, cpu_(nullptr)
 	, mem_(nullptr)
-	, divRegister_(0)
-	, timerAccumRegister_(0)
-	, timerModRegister_(0)
-	, timerControlRegister_(0)
-	, nextTimerModValue_(0)
-	, timerModUdpatedThisCycle_(false)
+	, scheduler_(nullptr)
 {
 }
 
+void Timer::sync()
+{
+	const auto currentCycle = scheduler_->getCurrentCycle();
+	if (currentCycle == lastSyncCycle_)
+	{
+		return;
+	}
+
+	const auto spentCpuCycles = static_cast<unsigned int>(currentCycle - lastSyncCycle_);
+	lastSyncCycle_ = currentCycle;
+
+	update(spentCpuCycles);
+	scheduleNextEvent();
+}
+
 void Timer::update(const unsigned int spentCpuCycles)
 {
 	divRegisterCycleCounter_ += spentCpuCycles;
-	if (divRegisterCycleCounter_ >= DIV_REGISTER_CYCLE_FREQ)
+	while (divRegisterCycleCounter_ >= DIV_REGISTER_CYCLE_FREQ)
 	{
 		divRegisterCycleCounter_ -= DIV_REGISTER_CYCLE_FREQ;
 		divRegister_++;
@@ -61,14 +71,7 @@ void Timer::update(const unsigned int spentCpuCycles)
 	{
 		timerAccumRegisterCycleCounter_ += spentCpuCycles;
 
-		word timerAccumFreq = 1024;
-		switch (timerControlRegister_ & 0x03)
-		{
-			case 0x00: timerAccumFreq = 1024; break;
-			case 0x01: timerAccumFreq = 16; break;
-			case 0x02: timerAccumFreq = 64; break;
-			case 0x03: timerAccumFreq = 256; break;
-		}
+		const word timerAccumFreq = getTimerAccumFrequency();
 
 		while (timerAccumRegisterCycleCounter_ >= timerAccumFreq)
 		{
@@ -89,8 +92,43 @@ void Timer::update(const unsigned int spentCpuCycles)
 	}
 }
 
-byte Timer::readByteAt(const word address) const
+void Timer::scheduleNextEvent()
 {
+	uint64_t cyclesUntilNextEvent = Scheduler::MAX_SYNC_INTERVAL_CYCLES;
+
+	if (timerModUdpatedThisCycle_)
+	{
+		// The pending TMA value has to land right after the current instruction
+		cyclesUntilNextEvent = 0;
+	}
+	else if (IS_BIT_SET(2, timerControlRegister_))
+	{
+		const int cyclesUntilOverflow = (0x100 - timerAccumRegister_) * getTimerAccumFrequency() - timerAccumRegisterCycleCounter_;
+		if (cyclesUntilOverflow < static_cast<int>(cyclesUntilNextEvent))
+		{
+			cyclesUntilNextEvent = cyclesUntilOverflow > 0 ? cyclesUntilOverflow : 0;
+		}
+	}
+
+	scheduler_->schedule(Scheduler::EventType::TIMER, lastSyncCycle_ + cyclesUntilNextEvent);
+}
+
+word Timer::getTimerAccumFrequency() const
+{
+	switch (timerControlRegister_ & 0x03)
+	{
+		case 0x00: return 1024;
+		case 0x01: return 16;
+		case 0x02: return 64;
+		case 0x03: return 256;
+	}
+	return 1024;
+}
+
+byte Timer::readByteAt(const word address)
+{
+	sync();
+
 	switch (address)
 	{
 		case DIV_REGISTER_ADDRESS: return divRegister_;
@@ -105,6 +143,8 @@ byte Timer::readByteAt(const word address) const
 
 void Timer::writeByteAt(const word address, const byte b)
 {
+	sync();
+
 	switch (address)
 	{
 		case DIV_REGISTER_ADDRESS: divRegister_ = 0x00; break; // Writing anything to the divider register resets it to 0
@@ -114,4 +154,6 @@ void Timer::writeByteAt(const word address, const byte b)
 		default:
 			log(LogType::WARNING, "Unknown TIMER write %s at %s", getHexByte(b).c_str(), getHexWord(address).c_str());
 	}
+
+	scheduleNextEvent();
 }
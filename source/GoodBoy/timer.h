@@ -1,10 +1,27 @@
 #ifndef TIMER_H
 #define TIMER_H
 
+#include "scheduler.h"
 #include "types.h"
 
 class CPU;
-class Timer final
+
+// Guest-visible timer state, kept as one trivially copyable block for snapshots
+struct TimerState
+{
+	uint64_t lastSyncCycle_;
+	int divRegisterCycleCounter_;
+	int timerAccumRegisterCycleCounter_;
+	byte divRegister_;
+	byte timerAccumRegister_;
+	byte timerModRegister_;
+	byte timerControlRegister_;
+	byte nextTimerModValue_;
+	bool timerModUdpatedThisCycle_;
+	bool timerAccumulatorEnabled_;
+};
+
+class Timer final : private TimerState
 {
 	friend class System;
 public:
@@ -12,24 +29,27 @@ public:
 
 	void setMemory(byte* mem) { mem_ = mem; }
 	void setCPU(CPU* cpu) { cpu_ = cpu; }
+	void setScheduler(Scheduler* scheduler) { scheduler_ = scheduler; scheduleNextEvent(); }
 
-	void update(const unsigned int spentCpuCycles);
+	// Catches DIV/TIMA up to the scheduler's current cycle
+	void sync();
 
-	byte readByteAt(const word address) const;
+	byte readByteAt(const word address);
 	void writeByteAt(const word address, const byte b);
 
+	void saveState(TimerState& state) const { state = *this; }
+	void loadState(const TimerState& state) { static_cast<TimerState&>(*this) = state; }
+	void copyStateFrom(const Timer& other) { other.saveState(*this); }
+
+private:
+	void update(const unsigned int spentCpuCycles);
+	void scheduleNextEvent();
+	word getTimerAccumFrequency() const;
+
 private:
-	int divRegisterCycleCounter_;
-	int timerAccumRegisterCycleCounter_;
 	CPU* cpu_;
 	byte* mem_;
-	byte divRegister_;
-	byte timerAccumRegister_;
-	byte timerModRegister_;
-	byte timerControlRegister_;
-	byte nextTimerModValue_;
-	bool timerModUdpatedThisCycle_;
-	bool timerAccumulatorEnabled_;
+	Scheduler* scheduler_;
 };
 
 #endif
\ No newline at end of file
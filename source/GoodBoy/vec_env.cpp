@@ -0,0 +1,121 @@
+#include "vec_env.h"
+
+#include <cassert>
+#include <cstring>
+
+static constexpr std::size_t SCREEN_PIXEL_COUNT = VideoSink::SCREEN_WIDTH * VideoSink::SCREEN_HEIGHT;
+
+void VecEnv::ObservationSink::onVBlank(const byte* pixels)
+{
+	if (!grayscale_)
+	{
+		memcpy(slot_, pixels, SCREEN_PIXEL_COUNT * VideoSink::BYTES_PER_PIXEL);
+		return;
+	}
+
+	// Pixels are stored A, B, G, R; BT.601 luma weights in 8.8 fixed point
+	for (std::size_t i = 0; i < SCREEN_PIXEL_COUNT; ++i)
+	{
+		const byte* pixel = pixels + i * VideoSink::BYTES_PER_PIXEL;
+		slot_[i] = static_cast<byte>((pixel[3] * 77 + pixel[2] * 150 + pixel[1] * 29) >> 8);
+	}
+}
+
+VecEnv::VecEnv(std::vector<std::unique_ptr<System>> systems, const unsigned int threadCount, const bool pinThreadsToCores)
+	: pool_(threadCount, pinThreadsToCores)
+	, observationBuffer_(nullptr)
+	, workRamOffset_(0)
+	, workRamSize_(0)
+	, observationType_(ObservationType::NONE)
+{
+	for (auto& system : systems)
+	{
+		assert(system != nullptr);
+		system->setVideoSink(nullptr);
+		system->setAudioSink(nullptr);
+		instances_.push_back({ std::move(system), std::make_unique<ObservationSink>() });
+	}
+}
+
+void VecEnv::setScreenObservation(byte* buffer, const bool rgba)
+{
+	observationBuffer_ = buffer;
+	observationType_ = rgba ? ObservationType::SCREEN_RGBA : ObservationType::SCREEN_GRAYSCALE;
+	updateObservationSlots();
+}
+
+void VecEnv::setWorkRamObservation(byte* buffer, const std::size_t offset, const std::size_t size)
+{
+	observationBuffer_ = buffer;
+	workRamOffset_ = offset;
+	workRamSize_ = size;
+	observationType_ = ObservationType::WORK_RAM;
+	updateObservationSlots();
+}
+
+void VecEnv::clearObservation()
+{
+	observationBuffer_ = nullptr;
+	observationType_ = ObservationType::NONE;
+	updateObservationSlots();
+}
+
+std::size_t VecEnv::getObservationSize() const
+{
+	switch (observationType_)
+	{
+		case ObservationType::SCREEN_GRAYSCALE: return SCREEN_PIXEL_COUNT;
+		case ObservationType::SCREEN_RGBA: return SCREEN_PIXEL_COUNT * VideoSink::BYTES_PER_PIXEL;
+		case ObservationType::WORK_RAM: return workRamSize_;
+		default: return 0;
+	}
+}
+
+void VecEnv::step(const byte* inputs, const unsigned int frameCount)
+{
+	// instances_ is not resized while the pool is running, so workers can index it freely
+	const unsigned int workerCount = pool_.getWorkerCount();
+	for (std::size_t i = 0; i < instances_.size(); ++i)
+	{
+		const byte input = inputs[i];
+		pool_.submit([this, i, input, frameCount](const unsigned int)
+		{
+			stepInstance(i, input, frameCount);
+		}, static_cast<int>(i % workerCount));
+	}
+
+	pool_.waitIdle();
+}
+
+void VecEnv::stepInstance(const std::size_t instanceIndex, const byte input, const unsigned int frameCount)
+{
+	Instance& instance = instances_[instanceIndex];
+	System& system = *instance.system;
+	const bool observesScreen = observationType_ == ObservationType::SCREEN_GRAYSCALE || observationType_ == ObservationType::SCREEN_RGBA;
+
+	system.setInputState(input & 0x0F, input >> 4);
+	for (unsigned int i = 0; i < frameCount; ++i)
+	{
+		// Only the last frame is observed, the ones before it skip the frame upload
+		system.setVideoSink(observesScreen && i + 1 == frameCount ? instance.observationSink.get() : nullptr);
+		system.runFrame();
+	}
+	system.setVideoSink(nullptr);
+
+	if (observationType_ == ObservationType::WORK_RAM)
+	{
+		byte* slot = observationBuffer_ + instanceIndex * workRamSize_;
+		assert(workRamOffset_ + workRamSize_ <= system.getWorkRamSize());
+		memcpy(slot, system.getWorkRam() + workRamOffset_, workRamSize_);
+	}
+}
+
+void VecEnv::updateObservationSlots()
+{
+	const std::size_t observationSize = getObservationSize();
+	for (std::size_t i = 0; i < instances_.size(); ++i)
+	{
+		byte* slot = observationBuffer_ != nullptr ? observationBuffer_ + i * observationSize : nullptr;
+		instances_[i].observationSink->setSlot(slot, observationType_ == ObservationType::SCREEN_GRAYSCALE);
+	}
+}
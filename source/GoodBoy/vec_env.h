@@ -0,0 +1,87 @@
+#ifndef VEC_ENV_H
+#define VEC_ENV_H
+
+#include "sinks.h"
+#include "system.h"
+#include "work_stealing_pool.h"
+
+#include <memory>
+#include <vector>
+
+// Steps a batch of System instances in lock-step for training pipelines. Every step
+// applies one input per instance, runs all of them the same number of frames on a
+// work-stealing pool and returns once all are done. Observations are written straight
+// into one caller-owned buffer with a slot per instance, so a trainer reads the whole
+// batch in place:
+//   SCREEN_GRAYSCALE [N][144][160]     8-bit luma
+//   SCREEN_RGBA      [N][144][160][4]  as handed to VideoSink::onVBlank
+//   WORK_RAM         [N][size]         a slice of each instance's work RAM
+// Screens are written on the VBlank of the step's last frame and left untouched for an
+// instance with the LCD off.
+class VecEnv final
+{
+public:
+	enum class ObservationType
+	{
+		NONE,
+		SCREEN_GRAYSCALE,
+		SCREEN_RGBA,
+		WORK_RAM
+	};
+
+public:
+	// A thread count of 0 uses one thread per hardware thread
+	explicit VecEnv(std::vector<std::unique_ptr<System>> systems, const unsigned int threadCount = 0, const bool pinThreadsToCores = false);
+
+	std::size_t getInstanceCount() const { return instances_.size(); }
+	System& getInstance(const std::size_t instanceIndex) { return *instances_[instanceIndex].system; }
+
+	// The buffer must hold getObservationSize() bytes per instance and outlive its use
+	void setScreenObservation(byte* buffer, const bool rgba);
+	// Work RAM bytes [offset, offset + size) of each instance, see System::getWorkRam
+	void setWorkRamObservation(byte* buffer, const std::size_t offset, const std::size_t size);
+	void clearObservation();
+
+	ObservationType getObservationType() const { return observationType_; }
+	std::size_t getObservationSize() const;
+
+	// inputs holds one byte per instance, action buttons in the low nibble and direction
+	// buttons in the high nibble (see the System button masks). The input is held for
+	// all frameCount frames.
+	void step(const byte* inputs, const unsigned int frameCount = 1);
+
+private:
+	// Writes an instance's frame into its observation slot
+	class ObservationSink final : public VideoSink
+	{
+	public:
+		ObservationSink() : slot_(nullptr), grayscale_(false) {}
+
+		void setSlot(byte* slot, const bool grayscale) { slot_ = slot; grayscale_ = grayscale; }
+		void onVBlank(const byte* pixels) override;
+
+	private:
+		byte* slot_;
+		bool grayscale_;
+	};
+
+	struct Instance
+	{
+		std::unique_ptr<System> system;
+		std::unique_ptr<ObservationSink> observationSink;
+	};
+
+private:
+	void stepInstance(const std::size_t instanceIndex, const byte input, const unsigned int frameCount);
+	void updateObservationSlots();
+
+private:
+	std::vector<Instance> instances_;
+	WorkStealingPool pool_;
+	byte* observationBuffer_;
+	std::size_t workRamOffset_;
+	std::size_t workRamSize_;
+	ObservationType observationType_;
+};
+
+#endif /* VEC_ENV_H */
@@ -0,0 +1,185 @@
+#include "work_stealing_pool.h"
+#include "logging.h"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static void pinCurrentThreadToCore(const unsigned int core)
+{
+#if defined(_WIN32)
+	const auto coreBit = core % (sizeof(DWORD_PTR) * 8);
+	if (SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << coreBit) == 0)
+	{
+		log(LogType::WARNING, "Could not pin worker thread to core %u", core);
+	}
+#elif defined(__linux__)
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	CPU_SET(core, &cpuSet);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0)
+	{
+		log(LogType::WARNING, "Could not pin worker thread to core %u", core);
+	}
+#else
+	log(LogType::WARNING, "Thread pinning is not supported on this platform, core %u ignored", core);
+#endif
+}
+
+WorkStealingPool::WorkStealingPool(const unsigned int workerCount, const bool pinWorkersToCores)
+	: stealableTaskCount_(0)
+	, pendingTaskCount_(0)
+	, nextWorker_(0)
+	, stopping_(false)
+{
+	const unsigned int coreCount = std::max(std::thread::hardware_concurrency(), 1u);
+	const unsigned int actualWorkerCount = workerCount == 0 ? coreCount : workerCount;
+
+	for (unsigned int i = 0; i < actualWorkerCount; ++i)
+	{
+		auto worker = std::make_unique<Worker>();
+		worker->pinnedTaskCount = 0;
+		workers_.push_back(std::move(worker));
+	}
+
+	// Only start the threads once every deque exists, since workers steal from each other
+	for (unsigned int i = 0; i < actualWorkerCount; ++i)
+	{
+		workers_[i]->thread = std::thread([this, i, pinWorkersToCores, coreCount]()
+		{
+			if (pinWorkersToCores)
+			{
+				pinCurrentThreadToCore(i % coreCount);
+			}
+			workerLoop(i);
+		});
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex_);
+		stopping_ = true;
+	}
+	wakeCondition_.notify_all();
+
+	for (auto& worker : workers_)
+	{
+		worker->thread.join();
+	}
+}
+
+void WorkStealingPool::submit(Task task, const int workerIndex, const bool stealable)
+{
+	const unsigned int targetIndex = workerIndex == ANY_WORKER
+		? nextWorker_++ % getWorkerCount()
+		: static_cast<unsigned int>(workerIndex) % getWorkerCount();
+
+	pendingTaskCount_++;
+	{
+		std::lock_guard<std::mutex> sleepLock(sleepMutex_);
+		Worker& worker = *workers_[targetIndex];
+		std::lock_guard<std::mutex> workerLock(worker.mutex);
+		worker.tasks.push_back({ std::move(task), stealable });
+		if (stealable)
+		{
+			stealableTaskCount_++;
+		}
+		else
+		{
+			worker.pinnedTaskCount++;
+		}
+	}
+
+	// Bound tasks can only be picked up by their own worker, so wake everyone
+	wakeCondition_.notify_all();
+}
+
+void WorkStealingPool::waitIdle()
+{
+	std::unique_lock<std::mutex> lock(sleepMutex_);
+	idleCondition_.wait(lock, [this]() { return pendingTaskCount_ == 0; });
+}
+
+void WorkStealingPool::workerLoop(const unsigned int workerIndex)
+{
+	while (true)
+	{
+		Task task;
+		if (popOwnTask(workerIndex, task) || stealTask(workerIndex, task))
+		{
+			task(workerIndex);
+
+			if (--pendingTaskCount_ == 0)
+			{
+				std::lock_guard<std::mutex> lock(sleepMutex_);
+				idleCondition_.notify_all();
+			}
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex_);
+		wakeCondition_.wait(lock, [this, workerIndex]() { return stopping_ || hasWorkFor(workerIndex); });
+		if (stopping_ && !hasWorkFor(workerIndex))
+		{
+			return;
+		}
+	}
+}
+
+bool WorkStealingPool::popOwnTask(const unsigned int workerIndex, Task& task)
+{
+	Worker& worker = *workers_[workerIndex];
+	std::lock_guard<std::mutex> lock(worker.mutex);
+	if (worker.tasks.empty())
+	{
+		return false;
+	}
+
+	QueuedTask& queuedTask = worker.tasks.back();
+	if (queuedTask.stealable)
+	{
+		stealableTaskCount_--;
+	}
+	else
+	{
+		worker.pinnedTaskCount--;
+	}
+	task = std::move(queuedTask.task);
+	worker.tasks.pop_back();
+	return true;
+}
+
+bool WorkStealingPool::stealTask(const unsigned int thiefIndex, Task& task)
+{
+	const auto workerCount = getWorkerCount();
+	for (unsigned int i = 1; i < workerCount; ++i)
+	{
+		Worker& victim = *workers_[(thiefIndex + i) % workerCount];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		for (auto iter = victim.tasks.begin(); iter != victim.tasks.end(); ++iter)
+		{
+			if (iter->stealable)
+			{
+				stealableTaskCount_--;
+				task = std::move(iter->task);
+				victim.tasks.erase(iter);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool WorkStealingPool::hasWorkFor(const unsigned int workerIndex) const
+{
+	return stealableTaskCount_ > 0 || workers_[workerIndex]->pinnedTaskCount > 0;
+}
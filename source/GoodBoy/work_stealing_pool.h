@@ -0,0 +1,78 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, each with its own task deque. A worker pops its own
+// deque from the back (most recently queued, hottest in cache) and, once empty, steals
+// from the front of the other workers' deques. Tasks can be bound to a worker, in which
+// case they are never stolen; combined with pinned workers this keeps a task on one core.
+class WorkStealingPool final
+{
+public:
+	// Receives the index of the worker running it
+	using Task = std::function<void(const unsigned int workerIndex)>;
+
+	static constexpr int ANY_WORKER = -1;
+
+public:
+	// A worker count of 0 uses one worker per hardware thread. With pinWorkersToCores,
+	// worker i is restricted to CPU core i (modulo the number of cores).
+	explicit WorkStealingPool(const unsigned int workerCount = 0, const bool pinWorkersToCores = false);
+	~WorkStealingPool();
+
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+	unsigned int getWorkerCount() const { return static_cast<unsigned int>(workers_.size()); }
+
+	// Queues a task on the given worker (or round-robin for ANY_WORKER). Tasks may submit
+	// further tasks. Non-stealable tasks only ever run on the worker they were queued on.
+	void submit(Task task, const int workerIndex = ANY_WORKER, const bool stealable = true);
+
+	// Blocks until every submitted task, including ones submitted by tasks, has finished
+	void waitIdle();
+
+private:
+	struct QueuedTask
+	{
+		Task task;
+		bool stealable;
+	};
+
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<QueuedTask> tasks;
+		std::atomic<unsigned int> pinnedTaskCount;
+		std::thread thread;
+	};
+
+private:
+	void workerLoop(const unsigned int workerIndex);
+	bool popOwnTask(const unsigned int workerIndex, Task& task);
+	bool stealTask(const unsigned int thiefIndex, Task& task);
+	bool hasWorkFor(const unsigned int workerIndex) const;
+
+private:
+	std::vector<std::unique_ptr<Worker>> workers_;
+
+	// Guards sleeping/waking; queue counters are only incremented while holding it so a
+	// worker checking them before it sleeps cannot miss a wake-up
+	std::mutex sleepMutex_;
+	std::condition_variable wakeCondition_;
+	std::condition_variable idleCondition_;
+	std::atomic<unsigned int> stealableTaskCount_;
+	std::atomic<unsigned int> pendingTaskCount_;
+	std::atomic<unsigned int> nextWorker_;
+	bool stopping_;
+};
+
+#endif /* WORK_STEALING_POOL_H */
@@ -0,0 +1,437 @@
+#include "x64_emitter.h"
+#include "logging.h"
+
+#include <cassert>
+#include <cstring>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+static constexpr byte REX_PREFIX          = 0x40;
+static constexpr byte REX_W               = 0x08;
+static constexpr byte REX_R               = 0x04;
+static constexpr byte REX_B               = 0x01;
+static constexpr byte OPERAND_SIZE_PREFIX = 0x66;
+
+static byte getRegisterIndex(const X64Emitter::Register reg)
+{
+	return static_cast<byte>(reg);
+}
+
+static bool allocateExecutableMemory(byte*& code, const std::size_t capacity)
+{
+#if defined(_WIN32)
+	code = static_cast<byte*>(VirtualAlloc(nullptr, capacity, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READ));
+#else
+	void* memory = mmap(nullptr, capacity, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	code = memory != MAP_FAILED ? static_cast<byte*>(memory) : nullptr;
+#endif
+	return code != nullptr;
+}
+
+X64Emitter::X64Emitter(const std::size_t capacity)
+	: code_(nullptr)
+	, capacity_(capacity)
+	, size_(0)
+{
+	if (HOST_SUPPORTED && !allocateExecutableMemory(code_, capacity_))
+	{
+		log(LogType::WARNING, "Could not allocate %zu bytes of executable memory", capacity_);
+	}
+}
+
+X64Emitter::~X64Emitter()
+{
+	if (code_ == nullptr)
+	{
+		return;
+	}
+
+#if defined(_WIN32)
+	VirtualFree(code_, 0, MEM_RELEASE);
+#else
+	munmap(code_, capacity_);
+#endif
+}
+
+void X64Emitter::beginWrite()
+{
+	assert(code_ != nullptr);
+#if defined(_WIN32)
+	DWORD oldProtection;
+	const bool succeeded = VirtualProtect(code_, capacity_, PAGE_READWRITE, &oldProtection) != 0;
+#else
+	const bool succeeded = mprotect(code_, capacity_, PROT_READ | PROT_WRITE) == 0;
+#endif
+	assert(succeeded);
+	(void)succeeded;
+}
+
+void X64Emitter::endWrite()
+{
+	assert(code_ != nullptr);
+#if defined(_WIN32)
+	DWORD oldProtection;
+	const bool succeeded = VirtualProtect(code_, capacity_, PAGE_EXECUTE_READ, &oldProtection) != 0;
+	FlushInstructionCache(GetCurrentProcess(), code_, capacity_);
+#else
+	const bool succeeded = mprotect(code_, capacity_, PROT_READ | PROT_EXEC) == 0;
+#endif
+	assert(succeeded);
+	(void)succeeded;
+}
+
+void X64Emitter::rewind(const byte* position)
+{
+	assert(position >= code_ && position <= code_ + size_);
+	size_ = static_cast<std::size_t>(position - code_);
+}
+
+void X64Emitter::movzxByte(const Register dst, const Register base, const int32_t disp)
+{
+	emitRex(false, dst, base);
+	emitByte(0x0F);
+	emitByte(0xB6);
+	emitMemoryOperand(dst, base, disp);
+}
+
+void X64Emitter::movzxWord(const Register dst, const Register base, const int32_t disp)
+{
+	emitRex(false, dst, base);
+	emitByte(0x0F);
+	emitByte(0xB7);
+	emitMemoryOperand(dst, base, disp);
+}
+
+void X64Emitter::storeByte(const Register base, const int32_t disp, const Register src)
+{
+	assert(getRegisterIndex(src) < getRegisterIndex(Register::RSP));
+	emitRex(false, src, base);
+	emitByte(0x88);
+	emitMemoryOperand(src, base, disp);
+}
+
+void X64Emitter::storeWord(const Register base, const int32_t disp, const Register src)
+{
+	emitByte(OPERAND_SIZE_PREFIX);
+	emitRex(false, src, base);
+	emitByte(0x89);
+	emitMemoryOperand(src, base, disp);
+}
+
+void X64Emitter::storeDword(const Register base, const int32_t disp, const Register src)
+{
+	emitRex(false, src, base);
+	emitByte(0x89);
+	emitMemoryOperand(src, base, disp);
+}
+
+void X64Emitter::storeByteImmediate(const Register base, const int32_t disp, const byte imm)
+{
+	emitRex(false, Register::RAX, base);
+	emitByte(0xC6);
+	emitMemoryOperand(Register::RAX, base, disp);
+	emitByte(imm);
+}
+
+void X64Emitter::storeWordImmediate(const Register base, const int32_t disp, const word imm)
+{
+	emitByte(OPERAND_SIZE_PREFIX);
+	emitRex(false, Register::RAX, base);
+	emitByte(0xC7);
+	emitMemoryOperand(Register::RAX, base, disp);
+	emitWord(imm);
+}
+
+void X64Emitter::storeDwordImmediate(const Register base, const int32_t disp, const uint32_t imm)
+{
+	emitRex(false, Register::RAX, base);
+	emitByte(0xC7);
+	emitMemoryOperand(Register::RAX, base, disp);
+	emitDword(imm);
+}
+
+void X64Emitter::testByteImmediate(const Register base, const int32_t disp, const byte imm)
+{
+	emitRex(false, Register::RAX, base);
+	emitByte(0xF6);
+	emitMemoryOperand(Register::RAX, base, disp);
+	emitByte(imm);
+}
+
+void X64Emitter::aluByte(const AluOperation operation, const Register dst, const Register src)
+{
+	assert(getRegisterIndex(dst) < getRegisterIndex(Register::RSP) && getRegisterIndex(src) < getRegisterIndex(Register::RSP));
+	emitByte(static_cast<byte>(operation) << 3);
+	emitRegisterOperand(src, dst);
+}
+
+void X64Emitter::aluByteImmediate(const AluOperation operation, const Register dst, const byte imm)
+{
+	assert(getRegisterIndex(dst) < getRegisterIndex(Register::RSP));
+	if (dst == Register::RAX)
+	{
+		emitByte((static_cast<byte>(operation) << 3) | 0x04);
+	}
+	else
+	{
+		emitByte(0x80);
+		emitRegisterOperand(static_cast<byte>(operation), dst);
+	}
+	emitByte(imm);
+}
+
+void X64Emitter::aluDword(const AluOperation operation, const Register dst, const Register src)
+{
+	emitRex(false, src, dst);
+	emitByte((static_cast<byte>(operation) << 3) | 0x01);
+	emitRegisterOperand(src, dst);
+}
+
+void X64Emitter::aluDwordImmediate(const AluOperation operation, const Register dst, const int32_t imm)
+{
+	emitRex(false, Register::RAX, dst);
+	if (imm >= INT8_MIN && imm <= INT8_MAX)
+	{
+		emitByte(0x83);
+		emitRegisterOperand(static_cast<byte>(operation), dst);
+		emitByte(static_cast<byte>(imm));
+	}
+	else
+	{
+		emitByte(0x81);
+		emitRegisterOperand(static_cast<byte>(operation), dst);
+		emitDword(static_cast<uint32_t>(imm));
+	}
+}
+
+void X64Emitter::incByte(const Register reg)
+{
+	assert(getRegisterIndex(reg) < getRegisterIndex(Register::RSP));
+	emitByte(0xFE);
+	emitRegisterOperand(0, reg);
+}
+
+void X64Emitter::decByte(const Register reg)
+{
+	assert(getRegisterIndex(reg) < getRegisterIndex(Register::RSP));
+	emitByte(0xFE);
+	emitRegisterOperand(1, reg);
+}
+
+void X64Emitter::incWord(const Register reg)
+{
+	emitByte(OPERAND_SIZE_PREFIX);
+	emitRex(false, Register::RAX, reg);
+	emitByte(0xFF);
+	emitRegisterOperand(0, reg);
+}
+
+void X64Emitter::decWord(const Register reg)
+{
+	emitByte(OPERAND_SIZE_PREFIX);
+	emitRex(false, Register::RAX, reg);
+	emitByte(0xFF);
+	emitRegisterOperand(1, reg);
+}
+
+void X64Emitter::incDword(const Register reg)
+{
+	emitRex(false, Register::RAX, reg);
+	emitByte(0xFF);
+	emitRegisterOperand(0, reg);
+}
+
+void X64Emitter::rolWord(const Register reg, const byte count)
+{
+	emitByte(OPERAND_SIZE_PREFIX);
+	emitRex(false, Register::RAX, reg);
+	emitByte(0xC1);
+	emitRegisterOperand(0, reg);
+	emitByte(count);
+}
+
+void X64Emitter::shlDword(const Register reg, const byte count)
+{
+	emitRex(false, Register::RAX, reg);
+	emitByte(0xC1);
+	emitRegisterOperand(4, reg);
+	emitByte(count);
+}
+
+void X64Emitter::btDword(const Register reg, const byte bit)
+{
+	emitRex(false, Register::RAX, reg);
+	emitByte(0x0F);
+	emitByte(0xBA);
+	emitRegisterOperand(4, reg);
+	emitByte(bit);
+}
+
+void X64Emitter::movDword(const Register dst, const Register src)
+{
+	emitRex(false, src, dst);
+	emitByte(0x89);
+	emitRegisterOperand(src, dst);
+}
+
+void X64Emitter::movQword(const Register dst, const Register src)
+{
+	emitRex(true, src, dst);
+	emitByte(0x89);
+	emitRegisterOperand(src, dst);
+}
+
+void X64Emitter::movQwordImmediate(const Register dst, const uint64_t imm)
+{
+	emitRex(true, Register::RAX, dst);
+	emitByte(0xB8 | (getRegisterIndex(dst) & 0x07));
+	emitQword(imm);
+}
+
+void X64Emitter::subQwordImmediate(const Register reg, const byte imm)
+{
+	emitRex(true, Register::RAX, reg);
+	emitByte(0x83);
+	emitRegisterOperand(static_cast<byte>(AluOperation::SUB), reg);
+	emitByte(imm);
+}
+
+void X64Emitter::addQwordImmediate(const Register reg, const byte imm)
+{
+	emitRex(true, Register::RAX, reg);
+	emitByte(0x83);
+	emitRegisterOperand(static_cast<byte>(AluOperation::ADD), reg);
+	emitByte(imm);
+}
+
+void X64Emitter::push(const Register reg)
+{
+	emitRex(false, Register::RAX, reg);
+	emitByte(0x50 | (getRegisterIndex(reg) & 0x07));
+}
+
+void X64Emitter::pop(const Register reg)
+{
+	emitRex(false, Register::RAX, reg);
+	emitByte(0x58 | (getRegisterIndex(reg) & 0x07));
+}
+
+void X64Emitter::pushFlags()
+{
+	emitByte(0x9C);
+}
+
+void X64Emitter::call(const Register target)
+{
+	emitRex(false, Register::RAX, target);
+	emitByte(0xFF);
+	emitRegisterOperand(2, target);
+}
+
+void X64Emitter::jmp(const Register target)
+{
+	emitRex(false, Register::RAX, target);
+	emitByte(0xFF);
+	emitRegisterOperand(4, target);
+}
+
+void X64Emitter::jmp(const byte* target)
+{
+	bind(jmp(), target);
+}
+
+X64Emitter::Fixup X64Emitter::jmp()
+{
+	emitByte(0xE9);
+	const Fixup fixup = size_;
+	emitDword(0);
+	return fixup;
+}
+
+X64Emitter::Fixup X64Emitter::jcc(const Condition condition)
+{
+	emitByte(0x0F);
+	emitByte(0x80 | static_cast<byte>(condition));
+	const Fixup fixup = size_;
+	emitDword(0);
+	return fixup;
+}
+
+void X64Emitter::ret()
+{
+	emitByte(0xC3);
+}
+
+void X64Emitter::bind(const Fixup fixup, const byte* target)
+{
+	// rel32 counts from the end of the jump, which the field itself ends
+	const int64_t displacement = target - (code_ + fixup + sizeof(int32_t));
+	assert(displacement >= INT32_MIN && displacement <= INT32_MAX);
+
+	const int32_t rel32 = static_cast<int32_t>(displacement);
+	memcpy(code_ + fixup, &rel32, sizeof(rel32));
+}
+
+void X64Emitter::emitByte(const byte b)
+{
+	assert(size_ < capacity_);
+	code_[size_++] = b;
+}
+
+void X64Emitter::emitWord(const word w)
+{
+	emitByte(w & 0xFF);
+	emitByte(w >> 8);
+}
+
+void X64Emitter::emitDword(const uint32_t d)
+{
+	emitWord(d & 0xFFFF);
+	emitWord(d >> 16);
+}
+
+void X64Emitter::emitQword(const uint64_t q)
+{
+	emitDword(q & 0xFFFFFFFF);
+	emitDword(q >> 32);
+}
+
+void X64Emitter::emitRex(const bool wide, const Register reg, const Register rm)
+{
+	byte rex = REX_PREFIX;
+	if (wide) rex |= REX_W;
+	if (getRegisterIndex(reg) >= 8) rex |= REX_R;
+	if (getRegisterIndex(rm) >= 8) rex |= REX_B;
+
+	if (rex != REX_PREFIX)
+	{
+		emitByte(rex);
+	}
+}
+
+void X64Emitter::emitMemoryOperand(const Register reg, const Register base, const int32_t disp)
+{
+	// mod 10: [base + disp32]. RSP and R12 as base need a SIB byte.
+	emitByte(0x80 | ((getRegisterIndex(reg) & 0x07) << 3) | (getRegisterIndex(base) & 0x07));
+	if ((getRegisterIndex(base) & 0x07) == getRegisterIndex(Register::RSP))
+	{
+		emitByte(0x24);
+	}
+	emitDword(static_cast<uint32_t>(disp));
+}
+
+void X64Emitter::emitRegisterOperand(const Register reg, const Register rm)
+{
+	emitByte(0xC0 | ((getRegisterIndex(reg) & 0x07) << 3) | (getRegisterIndex(rm) & 0x07));
+}
+
+void X64Emitter::emitRegisterOperand(const byte digit, const Register rm)
+{
+	emitByte(0xC0 | (digit << 3) | (getRegisterIndex(rm) & 0x07));
+}
@@ -0,0 +1,125 @@
+#ifndef X64_EMITTER_H
+#define X64_EMITTER_H
+
+#include "types.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Executable memory plus a minimal x86-64 assembler for the CPU's JIT, covering just the
+// instruction forms it emits. Memory operands are always [base + disp32] and byte
+// registers are limited to AL, CL, DL and BL so no REX prefix changes their meaning.
+//
+// The buffer is only ever writable or executable, never both: code is emitted between
+// beginWrite and endWrite and nothing in it may run in between.
+class X64Emitter final
+{
+public:
+	enum class Register : byte
+	{
+		RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+	};
+
+	// Jcc condition codes
+	enum class Condition : byte
+	{
+		B = 0x2, AE = 0x3, E = 0x4, NE = 0x5
+	};
+
+	// ALU operations in the order of their /digit in the 0x80-0x83 opcodes
+	enum class AluOperation : byte
+	{
+		ADD, OR, ADC, SBB, AND, SUB, XOR, CMP
+	};
+
+	// Offset of a rel32 field to patch once its jump's target is emitted
+	using Fixup = std::size_t;
+
+	// Whether the host can run what this emits at all
+#if defined(__x86_64__) || defined(_M_X64)
+	static constexpr bool HOST_SUPPORTED = true;
+#else
+	static constexpr bool HOST_SUPPORTED = false;
+#endif
+
+public:
+	explicit X64Emitter(const std::size_t capacity);
+	~X64Emitter();
+
+	X64Emitter(const X64Emitter&) = delete;
+	X64Emitter& operator=(const X64Emitter&) = delete;
+
+	// False when executable memory could not be allocated, nothing may be emitted then
+	bool isAvailable() const { return code_ != nullptr; }
+
+	void beginWrite();
+	void endWrite();
+
+	const byte* getCursor() const { return code_ + size_; }
+	std::size_t getRemainingCapacity() const { return capacity_ - size_; }
+
+	// Drops everything emitted after position, which must come from getCursor
+	void rewind(const byte* position);
+
+	void movzxByte(const Register dst, const Register base, const int32_t disp);
+	void movzxWord(const Register dst, const Register base, const int32_t disp);
+	void storeByte(const Register base, const int32_t disp, const Register src);
+	void storeWord(const Register base, const int32_t disp, const Register src);
+	void storeDword(const Register base, const int32_t disp, const Register src);
+	void storeByteImmediate(const Register base, const int32_t disp, const byte imm);
+	void storeWordImmediate(const Register base, const int32_t disp, const word imm);
+	void storeDwordImmediate(const Register base, const int32_t disp, const uint32_t imm);
+	void testByteImmediate(const Register base, const int32_t disp, const byte imm);
+
+	void aluByte(const AluOperation operation, const Register dst, const Register src);
+	void aluByteImmediate(const AluOperation operation, const Register dst, const byte imm);
+	void aluDword(const AluOperation operation, const Register dst, const Register src);
+	void aluDwordImmediate(const AluOperation operation, const Register dst, const int32_t imm);
+	void incByte(const Register reg);
+	void decByte(const Register reg);
+	void incWord(const Register reg);
+	void decWord(const Register reg);
+	void incDword(const Register reg);
+	void rolWord(const Register reg, const byte count);
+	void shlDword(const Register reg, const byte count);
+	void btDword(const Register reg, const byte bit);
+
+	void movDword(const Register dst, const Register src);
+	void movQword(const Register dst, const Register src);
+	void movQwordImmediate(const Register dst, const uint64_t imm);
+	void subQwordImmediate(const Register reg, const byte imm);
+	void addQwordImmediate(const Register reg, const byte imm);
+
+	void push(const Register reg);
+	void pop(const Register reg);
+	void pushFlags();
+
+	void call(const Register target);
+	void jmp(const Register target);
+	void jmp(const byte* target);
+	Fixup jmp();
+	Fixup jcc(const Condition condition);
+	void ret();
+
+	// Points the jump emitted at fixup to target
+	void bind(const Fixup fixup, const byte* target);
+
+private:
+	void emitByte(const byte b);
+	void emitWord(const word w);
+	void emitDword(const uint32_t d);
+	void emitQword(const uint64_t q);
+
+	// REX prefix when needed. reg goes to ModRM.reg, rm to ModRM.rm or the base register.
+	void emitRex(const bool wide, const Register reg, const Register rm);
+	void emitMemoryOperand(const Register reg, const Register base, const int32_t disp);
+	void emitRegisterOperand(const Register reg, const Register rm);
+	void emitRegisterOperand(const byte digit, const Register rm);
+
+private:
+	byte* code_;
+	std::size_t capacity_;
+	std::size_t size_;
+};
+
+#endif /* X64_EMITTER_H */